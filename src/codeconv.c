@@ -39,6 +39,7 @@
 #include "base64.h"
 #include "quoted-printable.h"
 #include "utils.h"
+#include "textscan.h"
 #include "prefs_common.h"
 
 /* For unknown reasons the inconv.m4 macro undefs that macro if no
@@ -147,6 +148,9 @@ static gint conv_noconv(gchar *outbuf, gint outlen, const gchar *inbuf);
 
 static gboolean strict_mode = FALSE;
 
+/* the EUC-JP descriptors below are opened once and shared */
+G_LOCK_DEFINE_STATIC(conv_euc);
+
 void codeconv_set_strict(gboolean mode)
 {
 	strict_mode = mode;
@@ -458,8 +462,10 @@ static gint conv_euctoutf8(gchar *outbuf, gint outlen, const gchar *inbuf)
 	static gboolean iconv_ok = TRUE;
 	gchar *tmpstr;
 
+	G_LOCK(conv_euc);
 	if (cd == (iconv_t)-1) {
 		if (!iconv_ok) {
+			G_UNLOCK(conv_euc);
 			strncpy2(outbuf, inbuf, outlen);
 			return -1;
 		}
@@ -470,6 +476,7 @@ static gint conv_euctoutf8(gchar *outbuf, gint outlen, const gchar *inbuf)
 				g_warning("conv_euctoutf8(): %s\n",
 					  g_strerror(errno));
 				iconv_ok = FALSE;
+				G_UNLOCK(conv_euc);
 				strncpy2(outbuf, inbuf, outlen);
 				return -1;
 			}
@@ -477,6 +484,7 @@ static gint conv_euctoutf8(gchar *outbuf, gint outlen, const gchar *inbuf)
 	}
 
 	tmpstr = conv_iconv_strdup_with_cd(inbuf, cd);
+	G_UNLOCK(conv_euc);
 	if (tmpstr) {
 		strncpy2(outbuf, tmpstr, outlen);
 		g_free(tmpstr);
@@ -515,8 +523,10 @@ static gint conv_utf8toeuc(gchar *outbuf, gint outlen, const gchar *inbuf)
 	static gboolean iconv_ok = TRUE;
 	gchar *tmpstr;
 
+	G_LOCK(conv_euc);
 	if (cd == (iconv_t)-1) {
 		if (!iconv_ok) {
+			G_UNLOCK(conv_euc);
 			strncpy2(outbuf, inbuf, outlen);
 			return -1;
 		}
@@ -527,6 +537,7 @@ static gint conv_utf8toeuc(gchar *outbuf, gint outlen, const gchar *inbuf)
 				g_warning("conv_utf8toeuc(): %s\n",
 					  g_strerror(errno));
 				iconv_ok = FALSE;
+				G_UNLOCK(conv_euc);
 				strncpy2(outbuf, inbuf, outlen);
 				return -1;
 			}
@@ -534,6 +545,7 @@ static gint conv_utf8toeuc(gchar *outbuf, gint outlen, const gchar *inbuf)
 	}
 
 	tmpstr = conv_iconv_strdup_with_cd(inbuf, cd);
+	G_UNLOCK(conv_euc);
 	if (tmpstr) {
 		strncpy2(outbuf, tmpstr, outlen);
 		g_free(tmpstr);
@@ -630,7 +642,7 @@ static gint conv_euctodisp(gchar *outbuf, gint outlen, const gchar *inbuf)
 
 void conv_utf8todisp(gchar *outbuf, gint outlen, const gchar *inbuf)
 {
-	if (g_utf8_validate(inbuf, -1, NULL) == TRUE)
+	if (scan_utf8_validate(inbuf, -1, NULL) == TRUE)
 		strncpy2(outbuf, inbuf, outlen);
 	else
 		conv_ustodisp(outbuf, outlen, inbuf);
@@ -641,7 +653,7 @@ static gint conv_anytodisp(gchar *outbuf, gint outlen, const gchar *inbuf)
 	gint r = 0;
 	if (conv_anytoutf8(outbuf, outlen, inbuf) < 0)
 		r = -1;
-	if (g_utf8_validate(outbuf, -1, NULL) != TRUE)
+	if (scan_utf8_validate(outbuf, -1, NULL) != TRUE)
 		conv_unreadable_8bit(outbuf);
 	return r;
 }
@@ -662,11 +674,11 @@ void conv_localetodisp(gchar *outbuf, gint outlen, const gchar *inbuf)
 	tmpstr = conv_iconv_strdup(inbuf, conv_get_locale_charset_str(),
 				   CS_INTERNAL);
 	codeconv_set_strict(FALSE);
-	if (tmpstr && g_utf8_validate(tmpstr, -1, NULL)) {
+	if (tmpstr && scan_utf8_validate(tmpstr, -1, NULL)) {
 		strncpy2(outbuf, tmpstr, outlen);
 		g_free(tmpstr);
 		return;
-	} else if (tmpstr && !g_utf8_validate(tmpstr, -1, NULL)) {
+	} else if (tmpstr && !scan_utf8_validate(tmpstr, -1, NULL)) {
 		g_free(tmpstr);
 		codeconv_set_strict(TRUE);
 		tmpstr = conv_iconv_strdup(inbuf, 
@@ -674,7 +686,7 @@ void conv_localetodisp(gchar *outbuf, gint outlen, const gchar *inbuf)
 				CS_INTERNAL);
 		codeconv_set_strict(FALSE);
 	}
-	if (tmpstr && g_utf8_validate(tmpstr, -1, NULL)) {
+	if (tmpstr && scan_utf8_validate(tmpstr, -1, NULL)) {
 		strncpy2(outbuf, tmpstr, outlen);
 		g_free(tmpstr);
 		return;
@@ -858,14 +870,102 @@ static CodeConvFunc conv_get_code_conv_func(const gchar *src_charset_str,
 	return code_conv;
 }
 
+/* iconv_open() has to look up and load gconv modules, which costs far
+ * more than converting a header, so closed descriptors are kept for the
+ * next conversion between the same pair of charsets. A descriptor is
+ * taken out of the cache while it is in use, so threads never share one
+ * and may each hold their own for the same pair. */
+#define CONV_ICONV_CACHE_SIZE	16
+
+typedef struct _ConvIconvEntry	ConvIconvEntry;
+
+struct _ConvIconvEntry
+{
+	gchar *src_code;
+	gchar *dest_code;
+	iconv_t cd;
+};
+
+static GList *conv_iconv_cache = NULL;	/* most recently used first */
+static guint conv_iconv_cache_len = 0;
+static guint conv_iconv_cache_hits = 0;
+static guint conv_iconv_cache_misses = 0;
+G_LOCK_DEFINE_STATIC(conv_iconv_cache);
+
+static ConvIconvEntry *conv_iconv_cache_get(const gchar *src_code,
+					    const gchar *dest_code)
+{
+	ConvIconvEntry *entry;
+	GList *cur;
+	guint hits, misses;
+	iconv_t cd;
+
+	G_LOCK(conv_iconv_cache);
+	for (cur = conv_iconv_cache; cur != NULL; cur = cur->next) {
+		entry = (ConvIconvEntry *)cur->data;
+		if (!strcmp(entry->src_code, src_code) &&
+		    !strcmp(entry->dest_code, dest_code)) {
+			conv_iconv_cache =
+				g_list_delete_link(conv_iconv_cache, cur);
+			conv_iconv_cache_len--;
+			conv_iconv_cache_hits++;
+			G_UNLOCK(conv_iconv_cache);
+			return entry;
+		}
+	}
+	hits = conv_iconv_cache_hits;
+	misses = ++conv_iconv_cache_misses;
+	G_UNLOCK(conv_iconv_cache);
+
+	debug_print("iconv cache: opening %s -> %s (%u hits, %u misses)\n",
+		    src_code, dest_code, hits, misses);
+
+	cd = iconv_open(dest_code, src_code);
+	if (cd == (iconv_t)-1)
+		return NULL;
+
+	entry = g_new(ConvIconvEntry, 1);
+	entry->src_code = g_strdup(src_code);
+	entry->dest_code = g_strdup(dest_code);
+	entry->cd = cd;
+
+	return entry;
+}
+
+static void conv_iconv_cache_put(ConvIconvEntry *entry)
+{
+	ConvIconvEntry *old = NULL;
+	GList *last;
+
+	/* back to the initial shift state for the next user */
+	iconv(entry->cd, NULL, NULL, NULL, NULL);
+
+	G_LOCK(conv_iconv_cache);
+	conv_iconv_cache = g_list_prepend(conv_iconv_cache, entry);
+	if (++conv_iconv_cache_len > CONV_ICONV_CACHE_SIZE) {
+		last = g_list_last(conv_iconv_cache);
+		old = (ConvIconvEntry *)last->data;
+		conv_iconv_cache = g_list_delete_link(conv_iconv_cache, last);
+		conv_iconv_cache_len--;
+	}
+	G_UNLOCK(conv_iconv_cache);
+
+	if (old != NULL) {
+		iconv_close(old->cd);
+		g_free(old->src_code);
+		g_free(old->dest_code);
+		g_free(old);
+	}
+}
+
 static gchar *conv_iconv_strdup(const gchar *inbuf,
 			 const gchar *src_code, const gchar *dest_code)
 {
-	iconv_t cd;
+	ConvIconvEntry *entry;
 	gchar *outbuf;
 
 	if (!src_code && !dest_code && 
-	    g_utf8_validate(inbuf, -1, NULL))
+	    scan_utf8_validate(inbuf, -1, NULL))
 	    	return g_strdup(inbuf);
 
 	if (!src_code)
@@ -885,13 +985,13 @@ static gchar *conv_iconv_strdup(const gchar *inbuf,
 	if (!strcasecmp(dest_code, CS_US_ASCII))
 		return g_strdup(inbuf);
 
-	cd = iconv_open(dest_code, src_code);
-	if (cd == (iconv_t)-1)
+	entry = conv_iconv_cache_get(src_code, dest_code);
+	if (entry == NULL)
 		return NULL;
 
-	outbuf = conv_iconv_strdup_with_cd(inbuf, cd);
+	outbuf = conv_iconv_strdup_with_cd(inbuf, entry->cd);
 
-	iconv_close(cd);
+	conv_iconv_cache_put(entry);
 
 	return outbuf;
 }
@@ -1484,6 +1584,18 @@ const gchar *conv_get_current_locale(void)
 	return cur_locale;
 }
 
+/* Computes now what is otherwise set up on first use, so that headers
+ * can then be decoded on several threads at once */
+void conv_prepare_threads(void)
+{
+	conv_get_charset_to_str_table();
+	conv_get_charset_from_str_table();
+	conv_get_locale_charset_str();
+	conv_get_locale_charset_str_no_utf8();
+	conv_get_outgoing_charset_str();
+	conv_is_ja_locale();
+}
+
 static gboolean conv_is_ja_locale(void)
 {
 	static gint is_ja_locale = -1;
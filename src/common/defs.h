@@ -101,8 +101,9 @@
 #define OLD_MARK_FILE		".sylpheed_mark"
 #define MARK_FILE		".claws_mark"
 #define TAGS_FILE		".claws_tags"
+#define JOURNAL_SUFFIX		".journal"
 #define PRINTING_PAGE_SETUP_STORAGE_FILE "print_page_setup"
-#define CACHE_VERSION		24
+#define CACHE_VERSION		27
 #define MARK_VERSION		2
 #define TAGS_VERSION		1
 
@@ -34,6 +34,10 @@
 	if (0) debug_print
 #endif
 
+/* tables may be shared by threads parsing headers; G_LOCK can be used
+ * before the thread system is set up */
+G_LOCK_DEFINE_STATIC(stringtable);
+
 typedef struct StringEntry_ {
 	gint	ref_count;
 	gchar  *string;
@@ -71,42 +75,121 @@ StringTable *string_table_new(void)
 gchar *string_table_insert_string(StringTable *table, const gchar *str)
 {
 	StringEntry *entry;
+	gchar *string;
+
+	G_LOCK(stringtable);
 
 	entry = g_hash_table_lookup(table->hash_table, str);
 
 	if (entry) {
 		entry->ref_count++;
+		table->hits++;
+		table->bytes_saved += strlen(entry->string) + 1;
 		XXX_DEBUG ("ref++ for %s (%d)\n", entry->string,
 			   entry->ref_count);
 	} else {
 		entry = string_entry_new(str);
+		table->misses++;
+		table->bytes_used += strlen(entry->string) + 1;
 		XXX_DEBUG ("inserting %s\n", str);
 		/* insert entry->string instead of str, since it can be
 		 * invalid pointer after this. */
 		g_hash_table_insert(table->hash_table, entry->string, entry);
 	}
+	string = entry->string;
+
+	G_UNLOCK(stringtable);
 
-	return entry->string;
+	return string;
 }
 
-void string_table_free_string(StringTable *table, const gchar *str)
+/* Called with the lock held */
+static gboolean string_table_release(StringTable *table, const gchar *str)
 {
 	StringEntry *entry;
 
 	entry = g_hash_table_lookup(table->hash_table, str);
 
-	if (entry) {
-		entry->ref_count--;
-		if (entry->ref_count <= 0) {
-			XXX_DEBUG ("refcount of string %s dropped to zero\n",
-				   entry->string);
-			g_hash_table_remove(table->hash_table, str);
-			string_entry_free(entry);
-		} else {
-			XXX_DEBUG ("ref-- for %s (%d)\n", entry->string,
-				   entry->ref_count); 
+	if (entry == NULL || entry->string != str)
+		return FALSE;
+
+	entry->ref_count--;
+	if (entry->ref_count <= 0) {
+		XXX_DEBUG ("refcount of string %s dropped to zero\n",
+			   entry->string);
+		g_hash_table_remove(table->hash_table, str);
+		table->bytes_used -= strlen(entry->string) + 1;
+		string_entry_free(entry);
+	} else {
+		table->bytes_saved -= strlen(entry->string) + 1;
+		XXX_DEBUG ("ref-- for %s (%d)\n", entry->string,
+			   entry->ref_count); 
+	}
+
+	return TRUE;
+}
+
+/* Releases a string returned by string_table_insert_string(). Returns
+ * FALSE, doing nothing, if str is not that string: an equal string
+ * allocated elsewhere does not belong to the table. */
+gboolean string_table_free_string(StringTable *table, const gchar *str)
+{
+	gboolean released;
+
+	G_LOCK(stringtable);
+	released = string_table_release(table, str);
+	G_UNLOCK(stringtable);
+
+	return released;
+}
+
+/* Same for the n strings of strs, under a single lock: the slots of the
+ * strings released are set to NULL, the others are left alone. Returns
+ * the number of strings released. */
+guint string_table_free_strings(StringTable *table, gchar **strs, guint n)
+{
+	guint i, released = 0;
+
+	G_LOCK(stringtable);
+	for (i = 0; i < n; i++) {
+		if (strs[i] != NULL && string_table_release(table, strs[i])) {
+			strs[i] = NULL;
+			released++;
 		}
 	}
+	G_UNLOCK(stringtable);
+
+	return released;
+}
+
+/* Tells whether str is a string returned by string_table_insert_string()
+ * and not yet released */
+gboolean string_table_owns_string(StringTable *table, const gchar *str)
+{
+	StringEntry *entry;
+	gboolean owned;
+
+	G_LOCK(stringtable);
+	entry = g_hash_table_lookup(table->hash_table, str);
+	owned = entry != NULL && entry->string == str;
+	G_UNLOCK(stringtable);
+
+	return owned;
+}
+
+/* Heap bytes of the strings held by the table, each counted once */
+gsize string_table_get_memusage(StringTable *table)
+{
+	gsize memusage;
+
+	cm_return_val_if_fail(table != NULL, 0);
+
+	G_LOCK(stringtable);
+	memusage = table->bytes_used +
+		g_hash_table_size(table->hash_table) * sizeof(StringEntry);
+	G_UNLOCK(stringtable);
+
+	return memusage;
 }
 
 static gboolean string_table_remove_for_each_fn(gchar *key, StringEntry *entry,
@@ -132,19 +215,25 @@ void string_table_free(StringTable *table)
 	g_free(table);
 }
 
-static void string_table_stats_for_each_fn(gchar *key, StringEntry *entry,
-					   guint *totals)
+void string_table_get_stats(StringTable *table, StringTableStats *stats)
 {
-	if (entry->ref_count > 1) {
-		*totals += strlen(key) * (entry->ref_count - 1);
-	}
-}
+	StringTableStats tmp;
 
-void string_table_get_stats(StringTable *table)
-{
-	guint totals = 0;
+	cm_return_if_fail(table != NULL);
 
-	g_hash_table_foreach(table->hash_table,
-			     (GHFunc)string_table_stats_for_each_fn, &totals);
-	XXX_DEBUG ("TOTAL UNSPILLED %d (%dK)\n", totals, totals / 1024);
+	if (stats == NULL)
+		stats = &tmp;
+
+	G_LOCK(stringtable);
+	stats->strings = g_hash_table_size(table->hash_table);
+	stats->hits = table->hits;
+	stats->misses = table->misses;
+	stats->bytes_saved = table->bytes_saved;
+	stats->bytes_used = table->bytes_used;
+	G_UNLOCK(stringtable);
+
+	debug_print("string table: %u strings, %u hits, %u misses, "
+		    "%zd bytes shared (%zdK)\n",
+		    stats->strings, stats->hits, stats->misses,
+		    stats->bytes_saved, stats->bytes_saved / 1024);
 }
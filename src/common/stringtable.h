@@ -22,15 +22,33 @@
 #include <glib.h>
 
 typedef struct {
-	GHashTable *hash_table;
+	GHashTable	*hash_table;
+	guint		 hits;
+	guint		 misses;
+	gsize		 bytes_saved;
+	gsize		 bytes_used;
 } StringTable;
 
+typedef struct {
+	guint	strings;	/* distinct strings in the table */
+	guint	hits;		/* insertions of an existing string */
+	guint	misses;		/* insertions of a new string */
+	gsize	bytes_saved;	/* bytes currently shared, not duplicated */
+	gsize	bytes_used;	/* bytes of the distinct strings */
+} StringTableStats;
+
 StringTable *string_table_new     (void);
 void         string_table_free    (StringTable *table);
 
-gchar *string_table_insert_string (StringTable *table, const gchar *str);
-void   string_table_free_string   (StringTable *table, const gchar *str);
+gchar    *string_table_insert_string (StringTable *table, const gchar *str);
+gboolean  string_table_free_string   (StringTable *table, const gchar *str);
+guint     string_table_free_strings  (StringTable *table, gchar **strs,
+				      guint n);
+gboolean  string_table_owns_string   (StringTable *table, const gchar *str);
+
+gsize  string_table_get_memusage  (StringTable *table);
 
-void   string_table_get_stats     (StringTable *table);
+void   string_table_get_stats     (StringTable *table,
+				   StringTableStats *stats);
 
 #endif /* STRINGTABLE_H__ */
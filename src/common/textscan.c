@@ -0,0 +1,237 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+#  include <immintrin.h>
+#endif
+
+#include "textscan.h"
+
+/* Mail headers and bodies are nearly all ASCII, so the scans below look
+ * at 16 (SSE2) or 32 (AVX2, when the CPU has it) bytes per step and only
+ * drop to single bytes at the first one that does not belong to the
+ * span. On a NUL-terminated string the vector loads are aligned, so they
+ * never reach into the next page however short the string is; they may
+ * still read past the NUL, which memory checkers report. Builds for
+ * them measure the string first and stay within it: AddressSanitizer
+ * is detected, and configure --disable-scan-overread defines
+ * SCAN_NO_OVERREAD for valgrind. tools/textscan_check.c checks both
+ * kinds of build on guard pages. */
+
+#ifndef SCAN_NO_OVERREAD
+#  if defined(__SANITIZE_ADDRESS__)
+#    define SCAN_NO_OVERREAD
+#  elif defined(__has_feature)
+#    if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#      define SCAN_NO_OVERREAD
+#    endif
+#  endif
+#endif
+
+enum
+{
+	SCAN_ASCII,	/* any 7-bit byte but NUL */
+	SCAN_TEXT	/* what is_ascii_str() accepts */
+};
+
+static inline gboolean scan_byte_ok(guchar c, gint kind)
+{
+	if (kind == SCAN_ASCII)
+		return c != '\0' && c < 0x80;
+
+	return (c >= 32 && c < 127) || c == '\t' || c == '\r' || c == '\n';
+}
+
+#ifdef __SSE2__
+/* bit n is set when byte n of v ends the span */
+static inline guint scan_sse2_mask(__m128i v, gint kind)
+{
+	__m128i x, bad, ok;
+
+	if (kind == SCAN_ASCII)
+		return _mm_movemask_epi8(_mm_or_si128(v,
+				_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+
+	/* flipping the top bit turns unsigned order into signed order */
+	x = _mm_xor_si128(v, _mm_set1_epi8((gchar)0x80));
+	bad = _mm_or_si128(_mm_cmplt_epi8(x, _mm_set1_epi8((gchar)(32 ^ 0x80))),
+			   _mm_cmpgt_epi8(x, _mm_set1_epi8((gchar)(126 ^ 0x80))));
+	ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+				       _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),
+			  _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+	return _mm_movemask_epi8(_mm_andnot_si128(ok, bad));
+}
+
+static gsize scan_span_sse2(const guchar *str, gssize len, gint kind)
+{
+	const guchar *p = str, *end;
+	guint mask;
+
+	if (len < 0) {
+		for (; ((gsize)p & 15) != 0; p++) {
+			if (!scan_byte_ok(*p, kind))
+				return p - str;
+		}
+		for (;; p += 16) {
+			mask = scan_sse2_mask(_mm_load_si128((const __m128i *)p),
+					      kind);
+			if (mask != 0)
+				return p - str + __builtin_ctz(mask);
+		}
+	}
+
+	for (end = str + len; end - p >= 16; p += 16) {
+		mask = scan_sse2_mask(_mm_loadu_si128((const __m128i *)p),
+				      kind);
+		if (mask != 0)
+			return p - str + __builtin_ctz(mask);
+	}
+	while (p < end && scan_byte_ok(*p, kind))
+		p++;
+
+	return p - str;
+}
+#endif /* __SSE2__ */
+
+#ifdef HAVE_AVX2_DISPATCH
+static gint scan_have_avx2 = -1;
+
+__attribute__((target("avx2")))
+static inline guint scan_avx2_mask(__m256i v, gint kind)
+{
+	__m256i x, bad, ok;
+
+	if (kind == SCAN_ASCII)
+		return _mm256_movemask_epi8(_mm256_or_si256(v,
+				_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+
+	x = _mm256_xor_si256(v, _mm256_set1_epi8((gchar)0x80));
+	bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8((gchar)(32 ^ 0x80)), x),
+			      _mm256_cmpgt_epi8(x, _mm256_set1_epi8((gchar)(126 ^ 0x80))));
+	ok = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+					     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))),
+			     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+	return _mm256_movemask_epi8(_mm256_andnot_si256(ok, bad));
+}
+
+__attribute__((target("avx2")))
+static gsize scan_span_avx2(const guchar *str, gssize len, gint kind)
+{
+	const guchar *p = str, *end;
+	guint mask;
+
+	if (len < 0) {
+		for (; ((gsize)p & 31) != 0; p++) {
+			if (!scan_byte_ok(*p, kind))
+				return p - str;
+		}
+		for (;; p += 32) {
+			mask = scan_avx2_mask(_mm256_load_si256((const __m256i *)p),
+					      kind);
+			if (mask != 0)
+				return p - str + __builtin_ctz(mask);
+		}
+	}
+
+	for (end = str + len; end - p >= 32; p += 32) {
+		mask = scan_avx2_mask(_mm256_loadu_si256((const __m256i *)p),
+				      kind);
+		if (mask != 0)
+			return p - str + __builtin_ctz(mask);
+	}
+	while (p < end && scan_byte_ok(*p, kind))
+		p++;
+
+	return p - str;
+}
+#endif /* HAVE_AVX2_DISPATCH */
+
+#ifndef __SSE2__
+static gsize scan_span_scalar(const guchar *str, gssize len, gint kind)
+{
+	const guchar *p = str;
+
+	if (len < 0) {
+		while (scan_byte_ok(*p, kind))
+			p++;
+	} else {
+		while (p < str + len && scan_byte_ok(*p, kind))
+			p++;
+	}
+
+	return p - str;
+}
+#endif
+
+static gsize scan_span(const gchar *str, gssize len, gint kind)
+{
+#ifdef SCAN_NO_OVERREAD
+	if (len < 0)
+		len = strlen(str);
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+	/* racing threads all store the same answer */
+	if (scan_have_avx2 < 0)
+		scan_have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if (scan_have_avx2)
+		return scan_span_avx2((const guchar *)str, len, kind);
+#endif
+#ifdef __SSE2__
+	return scan_span_sse2((const guchar *)str, len, kind);
+#else
+	return scan_span_scalar((const guchar *)str, len, kind);
+#endif
+}
+
+gsize scan_ascii_span(const gchar *str, gssize len)
+{
+	return scan_span(str, len, SCAN_ASCII);
+}
+
+gsize scan_text_span(const gchar *str, gssize len)
+{
+	return scan_span(str, len, SCAN_TEXT);
+}
+
+gboolean scan_utf8_validate(const gchar *str, gssize len, const gchar **end)
+{
+	gsize n;
+
+	n = scan_span(str, len, SCAN_ASCII);
+	if (len < 0 ? str[n] == '\0' : n == (gsize)len) {
+		if (end)
+			*end = str + n;
+		return TRUE;
+	}
+
+	/* everything before str + n is ASCII, so a character starts there */
+	return g_utf8_validate(str + n, len < 0 ? -1 : len - n, end);
+}
@@ -0,0 +1,38 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __TEXTSCAN_H__
+#define __TEXTSCAN_H__
+
+#include <glib.h>
+
+/* length of the leading run of 7-bit bytes, NUL excluded; len < 0 means
+ * str is NUL-terminated */
+gsize scan_ascii_span		(const gchar	*str,
+				 gssize		 len);
+/* length of the leading run of printable ASCII, tab, CR and LF */
+gsize scan_text_span		(const gchar	*str,
+				 gssize		 len);
+/* same result as g_utf8_validate(), with the ASCII part checked a block
+ * at a time */
+gboolean scan_utf8_validate	(const gchar	*str,
+				 gssize		 len,
+				 const gchar   **end);
+
+#endif /* __TEXTSCAN_H__ */
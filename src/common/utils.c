@@ -21,6 +21,11 @@
 #  include "config.h"
 #endif
 
+#if defined(HAVE_COPY_FILE_RANGE) && !defined(_GNU_SOURCE)
+/* for copy_file_range() */
+#define _GNU_SOURCE
+#endif
+
 #include "defs.h"
 
 #include <glib.h>
@@ -54,6 +59,10 @@
 #endif
 
 #include <fcntl.h>
+#ifdef HAVE_LINUX_FS_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
 
 #ifdef G_OS_WIN32
 #  include <direct.h>
@@ -72,6 +81,7 @@
 
 #include "utils.h"
 #include "socket.h"
+#include "textscan.h"
 #include "../codeconv.h"
 
 #define BUFFSIZE	8192
@@ -1111,17 +1121,7 @@ void subst_for_shellsafe_filename(gchar *str)
 
 gboolean is_ascii_str(const gchar *str)
 {
-	const guchar *p = (const guchar *)str;
-
-	while (*p != '\0') {
-		if (*p != '\t' && *p != ' ' &&
-		    *p != '\r' && *p != '\n' &&
-		    (*p < 32 || *p >= 127))
-			return FALSE;
-		p++;
-	}
-
-	return TRUE;
+	return str[scan_text_span(str, -1)] == '\0';
 }
 
 static const gchar * line_has_quote_char_last(const gchar * str, const gchar *quote_chars)
@@ -1964,6 +1964,17 @@ const gchar *get_imap_cache_dir(void)
 	return imap_cache_dir;
 }
 
+const gchar *get_mbox_cache_dir(void)
+{
+	static gchar *mbox_cache_dir = NULL;
+
+	if (!mbox_cache_dir)
+		mbox_cache_dir = g_strconcat(get_rc_dir(), G_DIR_SEPARATOR_S,
+					     MBOX_CACHE_DIR, NULL);
+
+	return mbox_cache_dir;
+}
+
 const gchar *get_mime_tmp_dir(void)
 {
 	static gchar *mime_tmp_dir = NULL;
@@ -2568,12 +2579,60 @@ gint append_file(const gchar *src, const gchar *dest, gboolean keep_backup)
 	return 0;
 }
 
-gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
+#ifdef FICLONE
+/* Shares the blocks of src_fd with dest_fd, on the filesystems which
+ * support it (btrfs, XFS...) */
+static gboolean copy_file_clone(gint src_fd, gint dest_fd)
+{
+	return ioctl(dest_fd, FICLONE, src_fd) == 0;
+}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* Copies the data of src_fd to dest_fd in the kernel. On failure,
+ * dest_fd is emptied again so that the data can be copied another way */
+static gboolean copy_file_range_all(gint src_fd, gint dest_fd)
+{
+	struct stat s;
+	off64_t in_off = 0, out_off = 0;
+	ssize_t n;
+
+	if (fstat(src_fd, &s) < 0)
+		return FALSE;
+
+	while (in_off < s.st_size) {
+		n = copy_file_range(src_fd, &in_off, dest_fd, &out_off,
+				    s.st_size - in_off, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			if (out_off > 0 && ftruncate(dest_fd, 0) < 0)
+				FILE_OP_ERROR("copy_file_range", "ftruncate");
+			return FALSE;
+		}
+		if (n == 0)
+			break;
+	}
+
+	return TRUE;
+}
+#endif
+
+/**
+ * Copies src to dest, letting the kernel do the work when it can: the
+ * data is shared with a reflink, then, if allow_link is set because
+ * both names may refer to the same file, dest is made a hard link to
+ * src, then the data is copied with copy_file_range(). It is only read
+ * and written back here when none of these works.
+ */
+gint copy_file_full(const gchar *src, const gchar *dest, gboolean keep_backup,
+		    gboolean allow_link)
 {
 	FILE *src_fp, *dest_fp;
 	gint n_read;
 	gchar buf[BUFSIZ];
 	gchar *dest_bak = NULL;
+	const gchar *method = NULL;
 	gboolean err = FALSE;
 
 	if ((src_fp = g_fopen(src, "rb")) == NULL) {
@@ -2606,7 +2665,39 @@ gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
 		g_warning("can't change file mode\n");
 	}
 
-	while ((n_read = fread(buf, sizeof(gchar), sizeof(buf), src_fp)) > 0) {
+#ifdef FICLONE
+	if (copy_file_clone(fileno(src_fp), fileno(dest_fp)))
+		method = "reflink";
+#endif
+#ifdef G_OS_UNIX
+	if (method == NULL && allow_link) {
+		fclose(dest_fp);
+		dest_fp = NULL;
+		if (g_unlink(dest) == 0 && link(src, dest) == 0)
+			method = "link";
+		else if ((dest_fp = g_fopen(dest, "wb")) == NULL) {
+			FILE_OP_ERROR(dest, "g_fopen");
+			fclose(src_fp);
+			if (dest_bak) {
+				if (rename_force(dest_bak, dest) < 0)
+					FILE_OP_ERROR(dest_bak, "rename");
+				g_free(dest_bak);
+			}
+			return -1;
+		} else if (change_file_mode_rw(dest_fp, dest) < 0) {
+			FILE_OP_ERROR(dest, "chmod");
+			g_warning("can't change file mode\n");
+		}
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	if (method == NULL &&
+	    copy_file_range_all(fileno(src_fp), fileno(dest_fp)))
+		method = "copy_file_range";
+#endif
+
+	while (method == NULL &&
+	       (n_read = fread(buf, sizeof(gchar), sizeof(buf), src_fp)) > 0) {
 		if (n_read < sizeof(buf) && ferror(src_fp))
 			break;
 		if (fwrite(buf, 1, n_read, dest_fp) < n_read) {
@@ -2628,7 +2719,7 @@ gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
 		err = TRUE;
 	}
 	fclose(src_fp);
-	if (fclose(dest_fp) == EOF) {
+	if (dest_fp && fclose(dest_fp) == EOF) {
 		FILE_OP_ERROR(dest, "fclose");
 		err = TRUE;
 	}
@@ -2643,6 +2734,9 @@ gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
 		return -1;
 	}
 
+	debug_print("copied %s to %s (%s)\n", src, dest,
+		    method ? method : "read/write");
+
 	if (keep_backup == FALSE && dest_bak)
 		claws_unlink(dest_bak);
 
@@ -2651,6 +2745,11 @@ gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
 	return 0;
 }
 
+gint copy_file(const gchar *src, const gchar *dest, gboolean keep_backup)
+{
+	return copy_file_full(src, dest, keep_backup, FALSE);
+}
+
 gint move_file(const gchar *src, const gchar *dest, gboolean overwrite)
 {
 	if (overwrite == FALSE && is_file_exist(dest)) {
@@ -416,6 +416,7 @@ gboolean rc_dir_is_alt			(void);
 const gchar *get_mail_base_dir		(void);
 const gchar *get_news_cache_dir		(void);
 const gchar *get_imap_cache_dir		(void);
+const gchar *get_mbox_cache_dir		(void);
 const gchar *get_mime_tmp_dir		(void);
 const gchar *get_template_dir		(void);
 const gchar *get_plugin_dir             (void);
@@ -460,6 +461,10 @@ gint append_file		(const gchar	*src,
 				 gboolean	 keep_backup);
 gint rename_force		(const gchar	*oldpath,
 				 const gchar	*newpath);
+gint copy_file_full		(const gchar	*src,
+				 const gchar	*dest,
+				 gboolean	 keep_backup,
+				 gboolean	 allow_link);
 gint copy_file			(const gchar	*src,
 				 const gchar	*dest,
 				 gboolean	 keep_backup);
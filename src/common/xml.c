@@ -163,7 +163,7 @@ GNode *xml_parse_file(const gchar *path)
 
 #if defined(SPARSE_MEMORY)
 	if (debug_get_mode())
-		string_table_get_stats(xml_string_table);
+		string_table_get_stats(xml_string_table, NULL);
 #endif
 
 	return node;
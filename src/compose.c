@@ -88,6 +88,7 @@
 #include "manage_window.h"
 #include "gtkshruler.h"
 #include "folder.h"
+#include "msgcache.h"
 #include "addr_compl.h"
 #include "quote_fmt.h"
 #include "undo.h"
@@ -5895,7 +5896,10 @@ static gint compose_queue_sub(Compose *compose, gint *msgnum, FolderItem **item,
 		return -1;
 	}
 	folder_item_scan(queue);
-	if ((num = folder_item_add_msg(queue, tmp, NULL, FALSE)) < 0) {
+	folder_sync_batch_begin();
+	num = folder_item_add_msg(queue, tmp, NULL, FALSE);
+	folder_sync_batch_end();
+	if (num < 0) {
 		g_warning("can't queue the message\n");
 		claws_unlink(tmp);
 		g_free(tmp);
@@ -9483,7 +9487,10 @@ gboolean compose_draft (gpointer data, guint action)
 	flag.tmp_flags = MSG_DRAFT;
 
 	folder_item_scan(draft);
-	if ((msgnum = folder_item_add_msg(draft, tmp, &flag, TRUE)) < 0) {
+	folder_sync_batch_begin();
+	msgnum = folder_item_add_msg(draft, tmp, &flag, TRUE);
+	folder_sync_batch_end();
+	if (msgnum < 0) {
 		MsgInfo *tmpinfo = NULL;
 		debug_print("didn't get msgnum after adding draft [%s]\n", compose->msgid?compose->msgid:"no msgid");
 		if (compose->msgid) {
@@ -11124,6 +11131,9 @@ static void compose_reply_from_messageview_real(MessageView *msgview, GSList *ms
 				if (orig_msginfo->tags) {
 					tmp_msginfo->tags = g_slist_copy(orig_msginfo->tags);
 					tmp_msginfo->folder->tags_dirty = TRUE;
+					if (tmp_msginfo->folder->cache)
+						msgcache_journal_tags(tmp_msginfo->folder->cache,
+								      tmp_msginfo->msgnum);
 				}
 			}
 		}
@@ -11292,8 +11302,8 @@ static MsgInfo *compose_msginfo_new_from_compose(Compose *compose)
 				newmsginfo->to = g_strdup(entry);
 			} else if (entry && *entry) {
 				gchar *tmp = g_strconcat(newmsginfo->to, ", ", entry, NULL);
-				g_free(newmsginfo->to);
-				newmsginfo->to = tmp;
+				procmsg_msginfo_set_str(newmsginfo, &newmsginfo->to, tmp);
+				g_free(tmp);
 			}
 		} else
 		if ( strcasecmp(header, prefs_common_translated_header_name("Cc:")) == 0 ) {
@@ -11301,8 +11311,8 @@ static MsgInfo *compose_msginfo_new_from_compose(Compose *compose)
 				newmsginfo->cc = g_strdup(entry);
 			} else if (entry && *entry) {
 				gchar *tmp = g_strconcat(newmsginfo->cc, ", ", entry, NULL);
-				g_free(newmsginfo->cc);
-				newmsginfo->cc = tmp;
+				procmsg_msginfo_set_str(newmsginfo, &newmsginfo->cc, tmp);
+				g_free(tmp);
 			}
 		} else
 		if ( strcasecmp(header,
@@ -11311,8 +11321,8 @@ static MsgInfo *compose_msginfo_new_from_compose(Compose *compose)
 				newmsginfo->newsgroups = g_strdup(entry);
 			} else if (entry && *entry) {
 				gchar *tmp = g_strconcat(newmsginfo->newsgroups, ", ", entry, NULL);
-				g_free(newmsginfo->newsgroups);
-				newmsginfo->newsgroups = tmp;
+				procmsg_msginfo_set_str(newmsginfo, &newmsginfo->newsgroups, tmp);
+				g_free(tmp);
 			}
 		}
 
@@ -0,0 +1,335 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#if defined(HAVE_LIBURING) && !defined(_GNU_SOURCE)
+/* for struct statx */
+#define _GNU_SOURCE
+#endif
+
+#include "defs.h"
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "file_batch.h"
+#include "folder.h"
+#include "utils.h"
+
+/* Stats or opens a set of files of the same directory at once, so that
+ * the requests wait on the disk or the NFS server together instead of
+ * one after the other. With io_uring they are queued to the kernel from
+ * this thread; without it, or when the kernel lacks the operations,
+ * they are spread over the folder job threads. */
+
+/* smaller batches are done in place */
+#define FILE_BATCH_MIN		16
+/* threads waiting on the files without io_uring, whatever the number
+ * of CPUs: they hardly use any */
+#define FILE_BATCH_THREADS	8
+/* requests in flight with io_uring */
+#define FILE_BATCH_RING_SIZE	64
+
+typedef struct _FileBatch {
+	const gchar	*dir;
+	gsize		 len;
+} FileBatch;
+
+static void file_batch_stat_job(gpointer data, gpointer user_data)
+{
+	FileBatchEntry *entry = (FileBatchEntry *)data;
+	FileBatch *batch = (FileBatch *)user_data;
+	gchar *path;
+	struct stat s;
+
+	path = g_build_filename(batch->dir, entry->file, NULL);
+	if (g_stat(path, &s) < 0) {
+		entry->error = errno;
+	} else {
+		entry->error = 0;
+		entry->size = s.st_size;
+		entry->mtime = s.st_mtime;
+	}
+	g_free(path);
+}
+
+/* Starts reading the beginning of an open file, without waiting for it
+ * where the system allows */
+static void file_batch_readahead(gint fd, gsize len)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+#else
+	gchar *buf = g_malloc(len);
+
+	if (read(fd, buf, len) < 0)
+		debug_print("file_batch: read: %s\n", g_strerror(errno));
+	g_free(buf);
+#endif
+}
+
+static void file_batch_prefetch_job(gpointer data, gpointer user_data)
+{
+	FileBatchEntry *entry = (FileBatchEntry *)data;
+	FileBatch *batch = (FileBatch *)user_data;
+	gchar *path;
+	gint fd;
+
+	path = g_build_filename(batch->dir, entry->file, NULL);
+	if ((fd = g_open(path, O_RDONLY, 0)) < 0) {
+		entry->error = errno;
+	} else {
+		entry->error = 0;
+		file_batch_readahead(fd, batch->len);
+		close(fd);
+	}
+	g_free(path);
+}
+
+static void file_batch_run(const gchar *dir, FileBatchEntry *entries,
+			   guint n, gsize len, GFunc func)
+{
+	FileBatch batch;
+	GPtrArray *jobs;
+	guint i;
+
+	batch.dir = dir;
+	batch.len = len;
+
+	if (n < FILE_BATCH_MIN) {
+		for (i = 0; i < n; i++)
+			func(&entries[i], &batch);
+		return;
+	}
+
+	jobs = g_ptr_array_sized_new(n);
+	for (i = 0; i < n; i++)
+		g_ptr_array_add(jobs, &entries[i]);
+	folder_run_jobs_full(jobs, func, &batch, FILE_BATCH_THREADS);
+	g_ptr_array_free(jobs, TRUE);
+}
+
+#ifdef HAVE_LIBURING
+static gpointer file_batch_uring_probe(gpointer data)
+{
+	struct io_uring ring;
+	struct io_uring_probe *probe;
+	gboolean ok = FALSE;
+
+	if (io_uring_queue_init(1, &ring, 0) < 0) {
+		debug_print("file_batch: io_uring not available\n");
+		return GINT_TO_POINTER(FALSE);
+	}
+	if ((probe = io_uring_get_probe_ring(&ring)) != NULL) {
+		ok = io_uring_opcode_supported(probe, IORING_OP_STATX) &&
+		     io_uring_opcode_supported(probe, IORING_OP_OPENAT);
+		io_uring_free_probe(probe);
+	}
+	io_uring_queue_exit(&ring);
+	debug_print("file_batch: io_uring %s\n",
+		    ok ? "supported" : "lacks statx/openat");
+
+	return GINT_TO_POINTER(ok);
+}
+
+static GOnce file_batch_uring_once = G_ONCE_INIT;
+
+static gboolean file_batch_uring_supported(void)
+{
+	/* batches are run from several threads */
+	return GPOINTER_TO_INT(g_once(&file_batch_uring_once,
+				      file_batch_uring_probe, NULL));
+}
+
+static void file_batch_uring_done(struct io_uring *ring,
+				  struct io_uring_cqe *cqe,
+				  FileBatchEntry *entries, struct statx *stx,
+				  gsize len, gboolean open_files)
+{
+	guint i = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+
+	if (cqe->res < 0) {
+		entries[i].error = -cqe->res;
+	} else if (open_files) {
+		entries[i].error = 0;
+		file_batch_readahead(cqe->res, len);
+		close(cqe->res);
+	} else {
+		entries[i].error = 0;
+		entries[i].size = stx[i].stx_size;
+		entries[i].mtime = stx[i].stx_mtime.tv_sec;
+	}
+	io_uring_cqe_seen(ring, cqe);
+}
+
+/* Queues a statx or an openat per entry, keeping at most
+ * FILE_BATCH_RING_SIZE in flight. Entries left with EINPROGRESS could
+ * not be done and are handed to the threads. */
+static void file_batch_uring(const gchar *dir, FileBatchEntry *entries,
+			     guint n, gsize len, gboolean open_files)
+{
+	struct io_uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct statx *stx = NULL;
+	guint queued = 0, submitted = 0, done = 0, i;
+	gint dfd, ret;
+
+	for (i = 0; i < n; i++)
+		entries[i].error = EINPROGRESS;
+
+	if ((dfd = g_open(dir, O_RDONLY | O_DIRECTORY, 0)) < 0)
+		return;
+	if (io_uring_queue_init(FILE_BATCH_RING_SIZE, &ring, 0) < 0) {
+		close(dfd);
+		return;
+	}
+	if (!open_files)
+		stx = g_new(struct statx, n);
+
+	while (done < n) {
+		while (queued < n && queued - done < FILE_BATCH_RING_SIZE &&
+		       (sqe = io_uring_get_sqe(&ring)) != NULL) {
+			if (open_files)
+				io_uring_prep_openat(sqe, dfd, entries[queued].file,
+						     O_RDONLY | O_CLOEXEC, 0);
+			else
+				io_uring_prep_statx(sqe, dfd, entries[queued].file,
+						    0, STATX_SIZE | STATX_MTIME,
+						    &stx[queued]);
+			io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(queued));
+			queued++;
+		}
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			debug_print("file_batch: io_uring_submit: %s\n",
+				    g_strerror(-ret));
+			break;
+		}
+		submitted += ret;
+
+		while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+			file_batch_uring_done(&ring, cqe, entries, stx, len,
+					      open_files);
+			done++;
+		}
+	}
+
+	/* the kernel writes to stx until the submitted requests are
+	 * complete, so they are waited for before it is freed */
+	while (done < submitted) {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret < 0) {
+			/* only a broken ring fails here; stx is then kept
+			 * rather than freed under the kernel */
+			g_warning("file_batch: io_uring_wait_cqe: %s\n",
+				  g_strerror(-ret));
+			stx = NULL;
+			break;
+		}
+		file_batch_uring_done(&ring, cqe, entries, stx, len,
+				      open_files);
+		done++;
+	}
+
+	io_uring_queue_exit(&ring);
+	g_free(stx);
+	close(dfd);
+}
+
+static void file_batch_uring_finish(const gchar *dir, FileBatchEntry *entries,
+				    guint n, gsize len, GFunc func)
+{
+	FileBatch batch;
+	guint i, left = 0;
+
+	batch.dir = dir;
+	batch.len = len;
+
+	for (i = 0; i < n; i++) {
+		if (entries[i].error == EINPROGRESS) {
+			func(&entries[i], &batch);
+			left++;
+		}
+	}
+	if (left > 0)
+		debug_print("file_batch: %u of %u files done without io_uring\n",
+			    left, n);
+}
+#endif
+
+/**
+ * Gets the size and modification time of files of dir. The error of
+ * each entry tells whether its size and mtime were set.
+ */
+void file_batch_stat(const gchar *dir, FileBatchEntry *entries, guint n)
+{
+	cm_return_if_fail(dir != NULL);
+	cm_return_if_fail(entries != NULL || n == 0);
+
+#ifdef HAVE_LIBURING
+	if (n >= FILE_BATCH_MIN && file_batch_uring_supported()) {
+		file_batch_uring(dir, entries, n, 0, FALSE);
+		file_batch_uring_finish(dir, entries, n, 0, file_batch_stat_job);
+		return;
+	}
+#endif
+	file_batch_run(dir, entries, n, 0, file_batch_stat_job);
+}
+
+/**
+ * Opens files of dir and starts reading their first len bytes, so that
+ * they are in memory by the time they are parsed one after the other.
+ * The error of each entry is set if the file could not be opened.
+ * Small batches are left alone.
+ */
+void file_batch_prefetch(const gchar *dir, FileBatchEntry *entries, guint n,
+			 gsize len)
+{
+	cm_return_if_fail(dir != NULL);
+	cm_return_if_fail(entries != NULL || n == 0);
+
+	/* reading a few files right away is as fast */
+	if (n < FILE_BATCH_MIN)
+		return;
+
+#ifdef HAVE_LIBURING
+	if (file_batch_uring_supported()) {
+		file_batch_uring(dir, entries, n, len, TRUE);
+		file_batch_uring_finish(dir, entries, n, len,
+					file_batch_prefetch_job);
+		return;
+	}
+#endif
+	file_batch_run(dir, entries, n, len, file_batch_prefetch_job);
+}
@@ -0,0 +1,48 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __FILE_BATCH_H__
+#define __FILE_BATCH_H__
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib.h>
+#include <time.h>
+
+typedef struct _FileBatchEntry	FileBatchEntry;
+
+struct _FileBatchEntry
+{
+	gchar	*file;		/* relative to the directory of the batch */
+	gint	 error;		/* errno of the failed call, 0 on success */
+	goffset	 size;
+	time_t	 mtime;
+};
+
+void file_batch_stat		(const gchar	*dir,
+				 FileBatchEntry	*entries,
+				 guint		 n);
+void file_batch_prefetch	(const gchar	*dir,
+				 FileBatchEntry	*entries,
+				 guint		 n,
+				 gsize		 len);
+
+#endif /* __FILE_BATCH_H__ */
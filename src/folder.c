@@ -21,6 +21,11 @@
 #  include "config.h"
 #endif
 
+#if defined(HAVE_SYNCFS) && !defined(_GNU_SOURCE)
+/* for syncfs() */
+#define _GNU_SOURCE
+#endif
+
 #include "defs.h"
 
 #include <glib.h>
@@ -31,6 +36,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 #ifdef WIN32
 #include <w32lib.h>
 #endif
@@ -41,6 +50,8 @@
 #include "imap.h"
 #include "news.h"
 #include "mh.h"
+#include "maildir.h"
+#include "mboxfolder.h"
 #include "utils.h"
 #include "xml.h"
 #include "codeconv.h"
@@ -58,11 +69,16 @@
 #include "timing.h"
 #include "compose.h"
 #include "main.h"
+#include "claws.h"
 
 /* Dependecies to be removed ?! */
 #include "prefs_common.h"
 #include "prefs_account.h"
 
+#ifndef HAVE_FDATASYNC
+#define fdatasync(fd)	fsync(fd)
+#endif
+
 /* Define possible missing constants for Windows. */
 #ifdef G_OS_WIN32
 # ifndef S_IRGRP
@@ -95,7 +111,17 @@ static void folder_get_persist_prefs_recursive
 					(GNode *node, GHashTable *pptable);
 static gboolean persist_prefs_free	(gpointer key, gpointer val, gpointer data);
 static void folder_item_read_cache		(FolderItem *item);
+static glong folder_elapsed_usecs		(const GTimeVal *start);
+static void folder_item_write_cache_now	(FolderItem *item,
+					 gboolean compact);
+
+static gint folder_sync_batch_depth = 0;
+static GSList *folder_sync_pending_items = NULL;
+static GPtrArray *folder_sync_files = NULL;
+static GHashTable *folder_sync_dirs = NULL;
 gint folder_item_scan_full		(FolderItem *item, gboolean filtering);
+static gint folder_item_scan_real	(FolderItem *item, gboolean filtering,
+					 gboolean opening);
 static void folder_item_update_with_msg (FolderItem *item, FolderItemUpdateFlags update_flags,
                                          MsgInfo *msg);
 static GHashTable *folder_persist_prefs_new	(Folder *folder);
@@ -105,6 +131,8 @@ static void folder_item_restore_persist_prefs	(FolderItem *item, GHashTable *ppt
 void folder_system_init(void)
 {
 	folder_register_class(mh_get_class());
+	folder_register_class(maildir_get_class());
+	folder_register_class(mbox_folder_get_class());
 	folder_register_class(imap_get_class());
 	folder_register_class(news_get_class());
 }
@@ -426,8 +454,10 @@ void folder_item_remove(FolderItem *item)
 		item->cache = NULL;
 	}
 	tags_file = folder_item_get_tags_file(item);
-	if (tags_file)
+	if (tags_file) {
 		claws_unlink(tags_file);
+		msgcache_remove_journal(tags_file);
+	}
 	g_free(tags_file);
 
 	hookdata.folder = item->folder;
@@ -483,6 +513,8 @@ void folder_item_destroy(FolderItem *item)
 
 	if (item->cache)
 		folder_item_free_cache(item, TRUE);
+	folder_sync_pending_items = g_slist_remove(folder_sync_pending_items,
+						   item);
 	if (item->prefs)
 		folder_item_prefs_free(item->prefs);
 	g_free(item->name);
@@ -550,7 +582,8 @@ void folder_item_set_xml(Folder *folder, FolderItem *item, XMLTag *tag)
 			item->forwarded_msgs = atoi(attr->value);
 		else if (!strcmp(attr->name, "locked"))
 			item->locked_msgs = atoi(attr->value);
-		else if (!strcmp(attr->name, "ignored"))
+		else if (!strcmp(attr->name, "ignore") ||
+			 !strcmp(attr->name, "ignored"))
 			item->ignored_msgs = atoi(attr->value);
 		else if (!strcmp(attr->name, "watched"))
 			item->watched_msgs = atoi(attr->value);
@@ -558,6 +591,10 @@ void folder_item_set_xml(Folder *folder, FolderItem *item, XMLTag *tag)
 			item->order = atoi(attr->value);
 		else if (!strcmp(attr->name, "total"))
 			item->total_msgs = atoi(attr->value);
+		else if (!strcmp(attr->name, "num_sig"))
+			item->num_sig = strtoul(attr->value, NULL, 10);
+		else if (!strcmp(attr->name, "num_sig_mtime"))
+			item->num_sig_mtime = strtoul(attr->value, NULL, 10);
 		else if (!strcmp(attr->name, "no_sub"))
 			item->no_sub = *attr->value == '1' ? TRUE : FALSE;
 		else if (!strcmp(attr->name, "no_select"))
@@ -677,6 +714,14 @@ XMLTag *folder_item_get_xml(Folder *folder, FolderItem *item)
 	xml_tag_add_attr(tag, xml_attr_new_int("locked", item->locked_msgs));
 	xml_tag_add_attr(tag, xml_attr_new_int("ignore", item->ignored_msgs));
 	xml_tag_add_attr(tag, xml_attr_new_int("watched", item->watched_msgs));
+	if (item->num_sig != 0) {
+		value = g_strdup_printf("%u", item->num_sig);
+		xml_tag_add_attr(tag, xml_attr_new("num_sig", value));
+		g_free(value);
+		value = g_strdup_printf("%ld", (unsigned long int) item->num_sig_mtime);
+		xml_tag_add_attr(tag, xml_attr_new("num_sig_mtime", value));
+		g_free(value);
+	}
 	xml_tag_add_attr(tag, xml_attr_new_int("order", item->order));
 
 	if (item->account)
@@ -974,7 +1019,7 @@ FolderItem *folder_create_folder(FolderItem *parent, const gchar *name)
 	if (new_item) {
 		FolderUpdateData hookdata;
 
-		new_item->cache = msgcache_new();
+		new_item->cache = msgcache_new(new_item);
 		new_item->cache_dirty = TRUE;
 		new_item->mark_dirty = TRUE;
 		new_item->tags_dirty = TRUE;
@@ -1229,6 +1274,7 @@ Folder *folder_find_from_path(const gchar *path)
 	for (list = folder_list; list != NULL; list = list->next) {
 		folder = list->data;
 		if ((FOLDER_TYPE(folder) == F_MH || 
+		     FOLDER_TYPE(folder) == F_MAILDIR ||
 		     FOLDER_TYPE(folder) == F_MBOX) &&
 		    !path_cmp(LOCAL_FOLDER(folder)->rootpath, path))
 			return folder;
@@ -1865,20 +1911,20 @@ gchar *folder_item_get_path(FolderItem *item)
 	return folder->klass->item_get_path(folder, item);
 }
 
-static gint folder_sort_cache_list_by_msgnum(gconstpointer a, gconstpointer b)
+static gint folder_compare_nums(const void *a, const void *b)
 {
-	MsgInfo *msginfo_a = (MsgInfo *) a;
-	MsgInfo *msginfo_b = (MsgInfo *) b;
-
-	return (msginfo_a->msgnum - msginfo_b->msgnum);
+	guint32 num_a = *(const guint32 *)a;
+	guint32 num_b = *(const guint32 *)b;
+	
+	return (num_a < num_b) ? -1 : (num_a > num_b);
 }
 
-static gint folder_sort_folder_list(gconstpointer a, gconstpointer b)
+static gint folder_compare_stamps(const void *a, const void *b)
 {
-	guint gint_a = GPOINTER_TO_INT(a);
-	guint gint_b = GPOINTER_TO_INT(b);
-	
-	return (gint_a - gint_b);
+	guint32 num_a = ((const MsgCacheStamp *)a)->num;
+	guint32 num_b = ((const MsgCacheStamp *)b)->num;
+
+	return (num_a < num_b) ? -1 : (num_a > num_b);
 }
 
 static gint syncronize_flags(FolderItem *item, MsgInfoList *msglist)
@@ -1965,7 +2011,7 @@ static void folder_item_process_open (FolderItem *item,
 		return;
 	if((item->folder->klass->scan_required != NULL) &&
 	   (item->folder->klass->scan_required(item->folder, item))) {
-		folder_item_scan_full(item, TRUE);
+		folder_item_scan_real(item, TRUE, TRUE);
 	} else {
 		folder_item_syncronize_flags(item);
 	}
@@ -2087,21 +2133,351 @@ static MsgInfo *get_msginfo(FolderItem *item, guint num)
 	return msginfo;
 }
 
+/* Sums up the numbers of a GSList, whatever their order; 0 is left
+ * for unknown signatures */
+static guint32 folder_num_list_signature(GSList *num_list)
+{
+	guint32 sig = 0, num;
+	GSList *cur;
+
+	for (cur = num_list; cur != NULL; cur = cur->next) {
+		num = GPOINTER_TO_UINT(cur->data) * 2654435761U;
+		sig += (num ^ (num >> 15)) + 0x9e3779b9U;
+	}
+
+	return sig != 0 ? sig : 1;
+}
+
+/* Returns the numbers of a GSList as a sorted array and frees the list */
+static guint32 *folder_num_list_to_array(GSList *num_list, guint *n_nums)
+{
+	guint32 *nums;
+	GSList *cur;
+	guint i = 0;
+
+	*n_nums = g_slist_length(num_list);
+	nums = g_new(guint32, MAX(*n_nums, 1));
+	for (cur = num_list; cur != NULL; cur = cur->next)
+		nums[i++] = GPOINTER_TO_UINT(cur->data);
+	g_slist_free(num_list);
+
+	qsort(nums, *n_nums, sizeof(guint32), folder_compare_nums);
+
+	return nums;
+}
+
+static void folder_scan_remember_subject(GHashTable *subject_table,
+					 MsgInfo *msginfo)
+{
+	if(prefs_common.thread_by_subject &&
+		MSG_IS_IGNORE_THREAD(msginfo->flags) &&
+		!subject_table_lookup(subject_table, msginfo->subject)) {
+		subject_table_insert(subject_table, msginfo->subject, msginfo);
+	}
+}
+
+/* cached holds the stamps of the cached messages still in the folder.
+ * Drops those modified by someone else, and remembers their numbers in
+ * new_list so that they are parsed again.
+ * The folder classes only look at the number, size and mtime of the
+ * messages they check, so these are given without decoding the cache. */
+static void folder_scan_check_changed(FolderItem *item, GArray *cached,
+				      GSList **new_list)
+{
+	Folder *folder = item->folder;
+	GHashTable *changed = NULL;
+	GSList *check = NULL, *changed_list, *cur;
+	MsgCacheStamp *stamp;
+	MsgInfo **stubs;
+	gboolean is_changed;
+	guint i, n = 0;
+
+	if (cached->len == 0 ||
+	    (folder->klass->get_changed_msgs == NULL &&
+	     folder->klass->is_msg_changed == NULL))
+		return;
+
+	stubs = g_new(MsgInfo *, cached->len);
+	for (i = 0; i < cached->len; i++) {
+		stamp = &g_array_index(cached, MsgCacheStamp, i);
+		stubs[i] = procmsg_msginfo_new();
+		stubs[i]->msgnum = stamp->num;
+		stubs[i]->size = stamp->size;
+		stubs[i]->mtime = stamp->mtime;
+		stubs[i]->flags.perm_flags = stamp->perm_flags;
+		stubs[i]->folder = item;
+	}
+
+	if (folder->klass->get_changed_msgs != NULL) {
+		for (i = cached->len; i > 0; i--)
+			check = g_slist_prepend(check, stubs[i - 1]);
+		changed_list = folder->klass->get_changed_msgs(folder, item, check);
+		changed = g_hash_table_new(g_direct_hash, g_direct_equal);
+		for (cur = changed_list; cur != NULL; cur = cur->next)
+			g_hash_table_insert(changed, cur->data, cur->data);
+		g_slist_free(changed_list);
+		g_slist_free(check);
+	}
+
+	for (i = 0; i < cached->len; i++) {
+		if (changed != NULL)
+			is_changed = g_hash_table_lookup(changed, stubs[i]) != NULL;
+		else
+			is_changed = folder->klass->is_msg_changed(folder, item, stubs[i]);
+		if (is_changed) {
+			msgcache_remove_msg(item->cache, stubs[i]->msgnum);
+			*new_list = g_slist_prepend(*new_list,
+					GINT_TO_POINTER(stubs[i]->msgnum));
+			debug_print("Remembering message %d to update...\n",
+				    stubs[i]->msgnum);
+		} else {
+			g_array_index(cached, MsgCacheStamp, n++) =
+				g_array_index(cached, MsgCacheStamp, i);
+		}
+		procmsg_msginfo_free(stubs[i]);
+	}
+	g_array_set_size(cached, n);
+	g_free(stubs);
+
+	if (changed != NULL)
+		g_hash_table_destroy(changed);
+}
+
+/* Flags passed down threads or depending on them when counting */
+#define FOLDER_SCAN_THREAD_FLAGS \
+	(MSG_MARKED | MSG_IGNORE_THREAD | MSG_WATCH_THREAD)
+
+/* Whether a cached message with these flags is to be decoded when
+ * counting a scan. The flags of the others were passed down their
+ * threads when they were scanned or their thread was flagged. */
+static gboolean folder_scan_stamp_needs_msg(MsgPermFlags flags,
+					    gboolean any_marked,
+					    gboolean not_unread_folder,
+					    gboolean by_subject)
+{
+	/* its unread flags are to be cleared */
+	if ((flags & (MSG_NEW | MSG_UNREAD)) != 0 &&
+	    ((flags & MSG_IGNORE_THREAD) != 0 || not_unread_folder))
+		return TRUE;
+	/* it may be under a marked message */
+	if ((flags & MSG_UNREAD) != 0 && any_marked)
+		return TRUE;
+	/* the scanned messages may join its ignored thread by subject */
+	return by_subject && (flags & MSG_IGNORE_THREAD) != 0;
+}
+
+/* Decodes the messages of cached whose flags need processing to count
+ * a scan, and the messages replied to above them and above those of
+ * exists, which may pass their flags down. They are moved from cached
+ * to exists; the others are counted from their flags alone. */
+static void folder_scan_get_needed_msgs(FolderItem *item, GArray *cached,
+					GPtrArray *exists,
+					gboolean not_unread_folder)
+{
+	GHashTable *nums, *msgids;
+	MsgPermFlags flags = 0;
+	MsgCacheStamp *stamp;
+	MsgInfo *msginfo, *parent;
+	gboolean any_marked, by_subject;
+	guint i, n;
+
+	if (cached->len == 0 || item->cache == NULL)
+		return;
+
+	for (i = 0; i < cached->len; i++)
+		flags |= g_array_index(cached, MsgCacheStamp, i).perm_flags;
+	for (i = 0; i < exists->len; i++) {
+		msginfo = g_ptr_array_index(exists, i);
+		flags |= msginfo->flags.perm_flags;
+	}
+	if ((flags & FOLDER_SCAN_THREAD_FLAGS) == 0 &&
+	    !(not_unread_folder && (flags & (MSG_NEW | MSG_UNREAD)) != 0))
+		return;
+	any_marked = (flags & MSG_MARKED) != 0;
+	by_subject = prefs_common.thread_by_subject && exists->len > 0;
+
+	nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (i = 0; i < exists->len; i++) {
+		msginfo = g_ptr_array_index(exists, i);
+		g_hash_table_insert(nums, GUINT_TO_POINTER(msginfo->msgnum),
+				    msginfo);
+	}
+	for (i = 0; i < cached->len; i++) {
+		stamp = &g_array_index(cached, MsgCacheStamp, i);
+		if (!folder_scan_stamp_needs_msg(stamp->perm_flags, any_marked,
+						 not_unread_folder, by_subject))
+			continue;
+		msginfo = msgcache_get_msg(item->cache, stamp->num);
+		if (msginfo == NULL)
+			continue;
+		g_ptr_array_add(exists, msginfo);
+		g_hash_table_insert(nums, GUINT_TO_POINTER(msginfo->msgnum),
+				    msginfo);
+	}
+
+	/* up the threads; exists grows as parents are found */
+	if ((flags & FOLDER_SCAN_THREAD_FLAGS) != 0) {
+		msgids = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = 0; i < exists->len; i++) {
+			msginfo = g_ptr_array_index(exists, i);
+			if (msginfo->msgid && *msginfo->msgid)
+				g_hash_table_insert(msgids, msginfo->msgid,
+						    msginfo);
+		}
+		for (i = 0; i < exists->len; i++) {
+			msginfo = g_ptr_array_index(exists, i);
+			if (!msginfo->inreplyto || !*msginfo->inreplyto ||
+			    g_hash_table_lookup(msgids, msginfo->inreplyto))
+				continue;
+			parent = msgcache_get_msg_by_id(item->cache,
+							msginfo->inreplyto);
+			if (parent == NULL)
+				continue;
+			if (g_hash_table_lookup(nums,
+					GUINT_TO_POINTER(parent->msgnum))) {
+				procmsg_msginfo_free(parent);
+				continue;
+			}
+			g_ptr_array_add(exists, parent);
+			g_hash_table_insert(nums,
+					    GUINT_TO_POINTER(parent->msgnum),
+					    parent);
+			if (parent->msgid && *parent->msgid)
+				g_hash_table_insert(msgids, parent->msgid,
+						    parent);
+		}
+		g_hash_table_destroy(msgids);
+	}
+
+	for (i = 0, n = 0; i < cached->len; i++) {
+		stamp = &g_array_index(cached, MsgCacheStamp, i);
+		if (!g_hash_table_lookup(nums, GUINT_TO_POINTER(stamp->num)))
+			g_array_index(cached, MsgCacheStamp, n++) = *stamp;
+	}
+	g_array_set_size(cached, n);
+	g_hash_table_destroy(nums);
+}
+
+/* Returns the messages of cached, decoded, followed by those of exists,
+ * which is freed, and empties cached */
+static GPtrArray *folder_scan_get_msgs(FolderItem *item, GArray *cached,
+				       GPtrArray *exists)
+{
+	GPtrArray *msgs;
+	MsgInfo *msginfo;
+	guint i;
+
+	msgs = g_ptr_array_sized_new(cached->len + exists->len);
+	for (i = 0; i < cached->len; i++) {
+		msginfo = msgcache_get_msg(item->cache,
+				g_array_index(cached, MsgCacheStamp, i).num);
+		if (msginfo != NULL)
+			g_ptr_array_add(msgs, msginfo);
+	}
+	for (i = 0; i < exists->len; i++)
+		g_ptr_array_add(msgs, g_ptr_array_index(exists, i));
+
+	g_ptr_array_free(exists, TRUE);
+	g_array_set_size(cached, 0);
+
+	return msgs;
+}
+
+/* Orders the messages of a scan so that every message comes after the
+ * message it replies to, if that one is in msgs too. parents is set to
+ * the index of that message, or -1; a loop of replies is cut where it
+ * is found. */
+static guint *folder_scan_thread_order(GPtrArray *msgs, gint **parents)
+{
+	GHashTable *by_msgid;
+	guchar *state;
+	guint *order, *stack;
+	guint i, n_order = 0, n_stack;
+	gint j;
+
+	by_msgid = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < msgs->len; i++) {
+		MsgInfo *msginfo = g_ptr_array_index(msgs, i);
+
+		if (msginfo->msgid && *msginfo->msgid &&
+		    !g_hash_table_lookup(by_msgid, msginfo->msgid))
+			g_hash_table_insert(by_msgid, msginfo->msgid,
+					    GUINT_TO_POINTER(i + 1));
+	}
+
+	*parents = g_new(gint, MAX(msgs->len, 1));
+	for (i = 0; i < msgs->len; i++) {
+		MsgInfo *msginfo = g_ptr_array_index(msgs, i);
+		guint parent = 0;
+
+		if (msginfo->inreplyto)
+			parent = GPOINTER_TO_UINT(g_hash_table_lookup(by_msgid,
+							msginfo->inreplyto));
+		(*parents)[i] = (parent > 0 && parent - 1 != i) ? parent - 1 : -1;
+	}
+	g_hash_table_destroy(by_msgid);
+
+	/* 0: not seen yet, 1: waiting for its parent, 2: ordered */
+	state = g_new0(guchar, MAX(msgs->len, 1));
+	order = g_new(guint, MAX(msgs->len, 1));
+	stack = g_new(guint, MAX(msgs->len, 1));
+	for (i = 0; i < msgs->len; i++) {
+		n_stack = 0;
+		for (j = i; j >= 0 && state[j] == 0; j = (*parents)[j]) {
+			state[j] = 1;
+			stack[n_stack++] = j;
+		}
+		while (n_stack > 0) {
+			j = stack[--n_stack];
+			if ((*parents)[j] >= 0 && state[(*parents)[j]] != 2) {
+				debug_print("loop detected: %d\n",
+					((MsgInfo *)g_ptr_array_index(msgs, j))->msgnum);
+				(*parents)[j] = -1;
+			}
+			state[j] = 2;
+			order[n_order++] = j;
+		}
+	}
+	g_free(stack);
+	g_free(state);
+
+	return order;
+}
+
 gint folder_item_scan_full(FolderItem *item, gboolean filtering)
+{
+	return folder_item_scan_real(item, filtering, FALSE);
+}
+
+/* opening: the folder is being opened, its messages are always compared
+ * with its cache */
+static gint folder_item_scan_real(FolderItem *item, gboolean filtering,
+				  gboolean opening)
 {
 	Folder *folder;
-	GSList *folder_list = NULL, *cache_list = NULL;
-	GSList *folder_list_cur, *cache_list_cur, *new_list = NULL;
-	GSList *exists_list = NULL, *elem;
+	GSList *folder_list = NULL, *new_list = NULL;
 	GSList *newmsg_list = NULL;
+	GPtrArray *exists;
+	GArray *cached;
+	MsgCacheStamp *cache_stamps = NULL;
+	guint *order;
+	gint *parents;
+	gboolean *marked_above;
+	guint32 *folder_nums;
+	guint n_folder_nums, n_cache_nums = 0;
+	guint fi = 0, ci = 0, i;
 	guint newcnt = 0, unreadcnt = 0, totalcnt = 0;
 	guint markedcnt = 0, unreadmarkedcnt = 0;
 	guint repliedcnt = 0, forwardedcnt = 0;
 	guint lockedcnt = 0, ignoredcnt = 0, watchedcnt = 0;
 
 	guint cache_max_num, folder_max_num, cache_cur_num, folder_cur_num;
-	gboolean update_flags = 0, old_uids_valid = FALSE;
+	guint32 num_sig;
+	gboolean update_flags = 0, old_uids_valid = FALSE, unchanged;
+	gboolean not_unread_folder, is_news;
 	GHashTable *subject_table = NULL;
+	GTimeVal start;
+	glong list_usecs, merge_usecs, fetch_usecs, count_usecs;
 	
 	cm_return_val_if_fail(item != NULL, -1);
 	if (item->path == NULL) return -1;
@@ -2111,9 +2487,25 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	cm_return_val_if_fail(folder != NULL, -1);
 	cm_return_val_if_fail(folder->klass->get_num_list != NULL, -1);
 
+	/* Same folder mtime as when the counts saved in the folder list
+	 * were taken: the folder was not even changed by us since, they
+	 * are still right and it need not be listed. The cache is read
+	 * when the folder is opened. Folders with flags of their own are
+	 * always checked. */
+	unchanged = !opening && !item->opened &&
+		    folder->klass->scan_required != NULL &&
+		    !folder->klass->scan_required(folder, item);
+	if (unchanged && item->num_sig != 0 &&
+	    item->num_sig_mtime == item->mtime &&
+	    item->cache == NULL && folder->klass->get_flags == NULL) {
+		debug_print("Folder %s unchanged, counts kept.\n", item->path);
+		return 0;
+	}
+
 	item->scanning = ITEM_SCANNING_WITH_FLAGS;
 
 	debug_print("Scanning folder %s for cache changes.\n", item->path ? item->path : "(null)");
+	g_get_current_time(&start);
 	
 	/* Get list of messages for folder and cache */
 	if (folder->klass->get_num_list(item->folder, item, &folder_list, &old_uids_valid) < 0) {
@@ -2122,6 +2514,18 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 		return(-1);
 	}
 
+	/* the same messages as when the counts were taken, the folder
+	 * only had its mtime changed, by us */
+	num_sig = folder_num_list_signature(folder_list);
+	if (unchanged && old_uids_valid && num_sig == item->num_sig &&
+	    item->cache == NULL && folder->klass->get_flags == NULL) {
+		debug_print("Folder %s unchanged, counts kept.\n", item->path);
+		g_slist_free(folder_list);
+		item->num_sig_mtime = item->mtime;
+		item->scanning = ITEM_NOT_SCANNING;
+		return 0;
+	}
+
 	if(prefs_common.thread_by_subject) {
 		subject_table = g_hash_table_new(g_str_hash, g_str_equal);
 	}
@@ -2129,72 +2533,51 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	if (old_uids_valid) {
 		if (!item->cache)
 			folder_item_read_cache(item);
-		cache_list = msgcache_get_msg_list(item->cache);
+		/* records of indexed caches are only decoded if needed */
+		cache_stamps = msgcache_get_stamp_array(item->cache, &n_cache_nums);
 	} else {
 		if (item->cache)
 			msgcache_destroy(item->cache);
-		item->cache = msgcache_new();
+		item->cache = msgcache_new(item);
 		item->cache_dirty = TRUE;
 		item->mark_dirty = TRUE;
 		item->tags_dirty = TRUE;
-		cache_list = NULL;
 	}
 
 	/* Sort both lists */
-    	cache_list = g_slist_sort(cache_list, folder_sort_cache_list_by_msgnum);
-	folder_list = g_slist_sort(folder_list, folder_sort_folder_list);
-
-	cache_list_cur = cache_list;
-	folder_list_cur = folder_list;
-
-	if (cache_list_cur != NULL) {
-		GSList *cache_list_last;
-	
-		cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-		cache_list_last = g_slist_last(cache_list);
-		cache_max_num = ((MsgInfo *)cache_list_last->data)->msgnum;
-	} else {
-		cache_cur_num = G_MAXINT;
-		cache_max_num = 0;
-	}
-
-	if (folder_list_cur != NULL) {
-		GSList *folder_list_last;
-	
-		folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-		folder_list_last = g_slist_last(folder_list);
-		folder_max_num = GPOINTER_TO_INT(folder_list_last->data);
-	} else {
-		folder_cur_num = G_MAXINT;
-		folder_max_num = 0;
-	}
+	if (n_cache_nums > 0)
+		qsort(cache_stamps, n_cache_nums, sizeof(MsgCacheStamp),
+		      folder_compare_stamps);
+	folder_nums = folder_num_list_to_array(folder_list, &n_folder_nums);
+	list_usecs = folder_elapsed_usecs(&start);
+
+	cache_max_num = n_cache_nums > 0 ? cache_stamps[n_cache_nums - 1].num : 0;
+	folder_max_num = n_folder_nums > 0 ? folder_nums[n_folder_nums - 1] : 0;
+	is_news = (FOLDER_TYPE(folder) == F_NEWS);
+	cached = g_array_sized_new(FALSE, FALSE, sizeof(MsgCacheStamp),
+				      MIN(n_folder_nums, n_cache_nums));
+
+	while (fi < n_folder_nums || ci < n_cache_nums) {
+		folder_cur_num = fi < n_folder_nums ? folder_nums[fi] : G_MAXUINT;
+		cache_cur_num = ci < n_cache_nums ? cache_stamps[ci].num : G_MAXUINT;
 
-	while ((cache_cur_num != G_MAXINT) || (folder_cur_num != G_MAXINT)) {
 		/*
 		 *  Message only exists in the folder
 		 *  Remember message for fetching
 		 */
 		if (folder_cur_num < cache_cur_num) {
-			gboolean add = FALSE;
-
-			switch(FOLDER_TYPE(folder)) {
-				case F_NEWS:
-					if (folder_cur_num < cache_max_num)
-						break;
-					
-					if (folder->account->max_articles == 0) {
-						add = TRUE;
-					}
+			gboolean add = TRUE;
 
-					if (folder_max_num <= folder->account->max_articles) {
-						add = TRUE;
-					} else if (folder_cur_num > (folder_max_num - folder->account->max_articles)) {
-						add = TRUE;
-					}
-					break;
-				default:
+			if (is_news) {
+				add = FALSE;
+				if (folder_cur_num < cache_max_num)
+					;
+				else if (folder->account->max_articles == 0)
+					add = TRUE;
+				else if (folder_max_num <= folder->account->max_articles)
+					add = TRUE;
+				else if (folder_cur_num > (folder_max_num - folder->account->max_articles))
 					add = TRUE;
-					break;
 			}
 			
 			if (add) {
@@ -2203,14 +2586,7 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			}
 
 			/* Move to next folder number */
-			if (folder_list_cur)
-				folder_list_cur = folder_list_cur->next;
-
-			if (folder_list_cur != NULL)
-				folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-			else
-				folder_cur_num = G_MAXINT;
-
+			fi++;
 			continue;
 		}
 
@@ -2223,13 +2599,7 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			debug_print("Removed message %d from cache.\n", cache_cur_num);
 
 			/* Move to next cache number */
-			if (cache_list_cur)
-				cache_list_cur = cache_list_cur->next;
-
-			if (cache_list_cur != NULL)
-				cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-			else
-				cache_cur_num = G_MAXINT;
+			ci++;
 
 			update_flags |= F_ITEM_UPDATE_MSGCNT | F_ITEM_UPDATE_CONTENT;
 
@@ -2241,62 +2611,41 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 		 *  Check if the message has been modified
 		 */
 		if (cache_cur_num == folder_cur_num) {
-			MsgInfo *msginfo;
-
-			msginfo = msgcache_get_msg(item->cache, folder_cur_num);
-			if (msginfo && folder->klass->is_msg_changed && folder->klass->is_msg_changed(folder, item, msginfo)) {
-				msgcache_remove_msg(item->cache, msginfo->msgnum);
-				new_list = g_slist_prepend(new_list, GINT_TO_POINTER(msginfo->msgnum));
-				procmsg_msginfo_free(msginfo);
-
-				debug_print("Remembering message %d to update...\n", folder_cur_num);
-			} else if (msginfo) {
-				exists_list = g_slist_prepend(exists_list, msginfo);
-
-				if(prefs_common.thread_by_subject &&
-					MSG_IS_IGNORE_THREAD(msginfo->flags) &&
-					!subject_table_lookup(subject_table, msginfo->subject)) {
-					subject_table_insert(subject_table, msginfo->subject, msginfo);
-				}
-			}
+			/* checked for changes below, all at once */
+			g_array_append_val(cached, cache_stamps[ci]);
 			
 			/* Move to next folder and cache number */
-			if (cache_list_cur)
-				cache_list_cur = cache_list_cur->next;
-			
-			if (folder_list_cur)
-				folder_list_cur = folder_list_cur->next;
-
-			if (cache_list_cur != NULL)
-				cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-			else
-				cache_cur_num = G_MAXINT;
-
-			if (folder_list_cur != NULL)
-				folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-			else
-				folder_cur_num = G_MAXINT;
-
+			fi++;
+			ci++;
 			continue;
 		}
 	}
 	
-	for(cache_list_cur = cache_list; cache_list_cur != NULL; cache_list_cur = g_slist_next(cache_list_cur))
-		procmsg_msginfo_free((MsgInfo *) cache_list_cur->data);
+	g_free(cache_stamps);
+	g_free(folder_nums);
 
-	g_slist_free(cache_list);
-	g_slist_free(folder_list);
+	folder_scan_check_changed(item, cached, &new_list);
+	exists = g_ptr_array_new();
+	/* their flags are synchronised on all the messages */
+	if (folder->klass->get_flags != NULL)
+		exists = folder_scan_get_msgs(item, cached, exists);
+	merge_usecs = folder_elapsed_usecs(&start) - list_usecs;
 
-	if (new_list != NULL) {
-		GSList *tmp_list = NULL;
+	if (new_list != NULL)
 		newmsg_list = get_msginfos(item, new_list);
-		g_slist_free(new_list);
-		tmp_list = g_slist_concat(g_slist_copy(exists_list), g_slist_copy(newmsg_list));
+	g_slist_free(new_list);
+
+	/* only folders that keep flags on their side need the list */
+	if (folder->klass->get_flags != NULL) {
+		GSList *tmp_list = g_slist_copy(newmsg_list);
+
+		for (i = exists->len; i > 0; i--)
+			tmp_list = g_slist_prepend(tmp_list,
+					g_ptr_array_index(exists, i - 1));
 		syncronize_flags(item, tmp_list);
 		g_slist_free(tmp_list);
-	} else {
-		syncronize_flags(item, exists_list);
 	}
+	fetch_usecs = folder_elapsed_usecs(&start) - list_usecs - merge_usecs;
 
 	folder_item_update_freeze();
 	
@@ -2313,15 +2662,8 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			MsgInfo *msginfo = (MsgInfo *) elem->data;
 
 			msgcache_add_msg(item->cache, msginfo);
-			if (!do_filter) {
-				exists_list = g_slist_prepend(exists_list, msginfo);
-
-				if(prefs_common.thread_by_subject &&
-					MSG_IS_IGNORE_THREAD(msginfo->flags) &&
-					!subject_table_lookup(subject_table, msginfo->subject)) {
-					subject_table_insert(subject_table, msginfo->subject, msginfo);
-				}			
-			}
+			if (!do_filter)
+				g_ptr_array_add(exists, msginfo);
 		}
 
 		if (do_filter) {
@@ -2344,13 +2686,8 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			if (unfiltered != NULL) {
 				for (elem = unfiltered; elem; elem = g_slist_next(elem)) {
 					MsgInfo *msginfo = (MsgInfo *)elem->data;
-					exists_list = g_slist_prepend(exists_list, msginfo);
 
-					if(prefs_common.thread_by_subject &&
-						MSG_IS_IGNORE_THREAD(msginfo->flags) &&
-						!subject_table_lookup(subject_table, msginfo->subject)) {
-						subject_table_insert(subject_table, msginfo->subject, msginfo);
-					}
+					g_ptr_array_add(exists, msginfo);
 				}
 				g_slist_free(unfiltered);
 			}
@@ -2366,17 +2703,65 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 		update_flags |= F_ITEM_UPDATE_MSGCNT | F_ITEM_UPDATE_CONTENT;
 	}
 
-	folder_item_set_batch(item, TRUE);
-	for (elem = exists_list; elem != NULL; elem = g_slist_next(elem)) {
-		MsgInfo *msginfo, *parent_msginfo;
+	/* messages of these folders are never new or unread */
+	not_unread_folder = folder_has_parent_of_type(item, F_OUTBOX) ||
+			    folder_has_parent_of_type(item, F_QUEUE)  ||
+			    folder_has_parent_of_type(item, F_DRAFT)  ||
+			    folder_has_parent_of_type(item, F_TRASH);
+
+	/* the other cached messages are counted from their flags alone */
+	folder_scan_get_needed_msgs(item, cached, exists, not_unread_folder);
+	for (i = 0; i < cached->len; i++) {
+		MsgPermFlags flags = g_array_index(cached, MsgCacheStamp, i).perm_flags;
 
-		msginfo = elem->data;
+		if (flags & MSG_NEW)
+			newcnt++;
+		if (flags & MSG_UNREAD)
+			unreadcnt++;
+		if (flags & MSG_MARKED)
+			markedcnt++;
+		if (flags & MSG_REPLIED)
+			repliedcnt++;
+		if (flags & MSG_FORWARDED)
+			forwardedcnt++;
+		if (flags & MSG_LOCKED)
+			lockedcnt++;
+		if (flags & MSG_IGNORE_THREAD)
+			ignoredcnt++;
+		if (flags & MSG_WATCH_THREAD)
+			watchedcnt++;
+		totalcnt++;
+	}
+	g_array_free(cached, TRUE);
+
+	for (i = 0; i < exists->len; i++)
+		folder_scan_remember_subject(subject_table,
+					     g_ptr_array_index(exists, i));
+
+	/* thread flags are passed down from parents to replies, so that
+	 * each message is only looked at once */
+	order = folder_scan_thread_order(exists, &parents);
+	marked_above = g_new0(gboolean, MAX(exists->len, 1));
+
+	folder_item_set_batch(item, TRUE);
+	for (i = 0; i < exists->len; i++) {
+		MsgInfo *msginfo, *parent_msginfo, *thread_parent = NULL;
+		guint cur = order[i];
+
+		msginfo = g_ptr_array_index(exists, cur);
+		if (parents[cur] >= 0) {
+			thread_parent = g_ptr_array_index(exists, parents[cur]);
+			marked_above[cur] = MSG_IS_MARKED(thread_parent->flags) ||
+					    marked_above[parents[cur]];
+		}
 		if (MSG_IS_IGNORE_THREAD(msginfo->flags) && (MSG_IS_NEW(msginfo->flags) || MSG_IS_UNREAD(msginfo->flags)))
 			procmsg_msginfo_unset_flags(msginfo, MSG_NEW | MSG_UNREAD, 0);
-		if (!MSG_IS_IGNORE_THREAD(msginfo->flags) && procmsg_msg_has_flagged_parent(msginfo, MSG_IGNORE_THREAD)) {
+		if (!MSG_IS_IGNORE_THREAD(msginfo->flags) && thread_parent &&
+		    MSG_IS_IGNORE_THREAD(thread_parent->flags)) {
 			procmsg_msginfo_change_flags(msginfo, MSG_IGNORE_THREAD, 0, MSG_NEW | MSG_UNREAD, 0);
 		}
-		if (!MSG_IS_WATCH_THREAD(msginfo->flags) && procmsg_msg_has_flagged_parent(msginfo, MSG_WATCH_THREAD)) {
+		if (!MSG_IS_WATCH_THREAD(msginfo->flags) && thread_parent &&
+		    MSG_IS_WATCH_THREAD(thread_parent->flags)) {
 			procmsg_msginfo_set_flags(msginfo, MSG_WATCH_THREAD, 0);
 		}
 		if(prefs_common.thread_by_subject && !msginfo->inreplyto &&
@@ -2388,17 +2773,14 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 						MSG_NEW | MSG_UNREAD, 0);
 			}
 		}
-		if ((folder_has_parent_of_type(item, F_OUTBOX) ||
-		     folder_has_parent_of_type(item, F_QUEUE)  ||
-		     folder_has_parent_of_type(item, F_DRAFT)  ||
-		     folder_has_parent_of_type(item, F_TRASH)) &&
+		if (not_unread_folder &&
 		    (MSG_IS_NEW(msginfo->flags) || MSG_IS_UNREAD(msginfo->flags)))
 			procmsg_msginfo_unset_flags(msginfo, MSG_NEW | MSG_UNREAD, 0);
 		if (MSG_IS_NEW(msginfo->flags))
 			newcnt++;
 		if (MSG_IS_UNREAD(msginfo->flags))
 			unreadcnt++;
-		if (MSG_IS_UNREAD(msginfo->flags) && procmsg_msg_has_marked_parent(msginfo))
+		if (MSG_IS_UNREAD(msginfo->flags) && marked_above[cur])
 			unreadmarkedcnt++;
 		if (MSG_IS_MARKED(msginfo->flags))
 			markedcnt++;
@@ -2414,11 +2796,16 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			watchedcnt++;
 
 		totalcnt++;
-
-		procmsg_msginfo_free(msginfo);
 	}
 	folder_item_set_batch(item, FALSE);
-	g_slist_free(exists_list);
+	/* released only now, replies look at their parent after it */
+	for (i = 0; i < exists->len; i++)
+		procmsg_msginfo_free(g_ptr_array_index(exists, i));
+	g_ptr_array_free(exists, TRUE);
+	g_free(order);
+	g_free(parents);
+	g_free(marked_above);
+	count_usecs = folder_elapsed_usecs(&start) - list_usecs - merge_usecs - fetch_usecs;
 	
 	if(prefs_common.thread_by_subject) {
 		g_hash_table_destroy(subject_table);
@@ -2443,6 +2830,8 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	item->locked_msgs = lockedcnt;
 	item->ignored_msgs = ignoredcnt;
 	item->watched_msgs = watchedcnt;
+	item->num_sig = num_sig;
+	item->num_sig_mtime = item->mtime;
 
 	update_flags |= F_ITEM_UPDATE_MSGCNT;
 
@@ -2451,6 +2840,11 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	
 	item->scanning = ITEM_NOT_SCANNING;
 
+	debug_print("Scanned %s (%u messages): lists %ldms, merge %ldms, "
+		    "fetch %ldms, counts %ldms\n", item->path, totalcnt,
+		    list_usecs / 1000, merge_usecs / 1000,
+		    fetch_usecs / 1000, count_usecs / 1000);
+
 	return 0;
 }
 
@@ -2459,44 +2853,6 @@ gint folder_item_scan(FolderItem *item)
 	return folder_item_scan_full(item, TRUE);
 }
 
-static void folder_count_total_cache_memusage(FolderItem *item, gpointer data)
-{
-	gint *memusage = (gint *)data;
-
-	if (item->cache == NULL)
-		return;
-	
-	*memusage += msgcache_get_memory_usage(item->cache);
-}
-
-static gint folder_cache_time_compare_func(gconstpointer a, gconstpointer b)
-{
-	FolderItem *fa = (FolderItem *)a;
-	FolderItem *fb = (FolderItem *)b;
-	
-	return (gint) (msgcache_get_last_access_time(fa->cache) - msgcache_get_last_access_time(fb->cache));
-}
-
-static void folder_find_expired_caches(FolderItem *item, gpointer data)
-{
-	GSList **folder_item_list = (GSList **)data;
-	gint difftime, expiretime;
-	
-	if (item->cache == NULL)
-		return;
-
-	if (item->opened > 0)
-		return;
-
-	difftime = (gint) (time(NULL) - msgcache_get_last_access_time(item->cache));
-	expiretime = prefs_common.cache_min_keep_time * 60;
-	debug_print("Cache unused time: %d (Expire time: %d)\n", difftime, expiretime);
-
-	if (difftime > expiretime && !item->opened && !item->processing_pending) {
-		*folder_item_list = g_slist_insert_sorted(*folder_item_list, item, folder_cache_time_compare_func);
-	}
-}
-
 gboolean folder_item_free_cache(FolderItem *item, gboolean force)
 {
 	cm_return_val_if_fail(item != NULL, TRUE);
@@ -2507,7 +2863,10 @@ gboolean folder_item_free_cache(FolderItem *item, gboolean force)
 	if (item->opened > 0 && !force)
 		return FALSE;
 
-	folder_item_write_cache(item);
+	/* not delayed by a sync batch, the cache goes away */
+	folder_sync_pending_items = g_slist_remove(folder_sync_pending_items,
+						   item);
+	folder_item_write_cache_now(item, FALSE);
 	msgcache_destroy(item->cache);
 	item->cache = NULL;
 	return TRUE;
@@ -2527,36 +2886,59 @@ void folder_clean_cache_memory_force(void)
 	prefs_common.cache_min_keep_time = old_cache_min_keep_time;
 }
 
+/* Frees least recently used caches until the memory they use is below
+ * the limit. Caches used in the last cache_min_keep_time minutes are
+ * kept, as are those of opened folders. */
 void folder_clean_cache_memory(FolderItem *protected_item)
 {
-	gint memusage = 0;
+	gsize memusage, limit;
+	GSList *free_list = NULL, *cur;
+	MsgCache *cache;
+	FolderItem *item;
+	time_t expire;
 
-	folder_func_to_all_folders(folder_count_total_cache_memusage, &memusage);	
-	debug_print("Total cache memory usage: %d\n", memusage);
-	
-	if (memusage > (prefs_common.cache_max_mem_usage * 1024)) {
-		GSList *folder_item_list = NULL, *listitem;
-		
-		debug_print("Trying to free cache memory\n");
-
-		folder_func_to_all_folders(folder_find_expired_caches, &folder_item_list);	
-		listitem = folder_item_list;
-		while((listitem != NULL) && (memusage > (prefs_common.cache_max_mem_usage * 1024))) {
-			FolderItem *item = (FolderItem *)(listitem->data);
-			gint cache_size = 0;
-			if (item == protected_item) {
-				listitem = listitem->next;
-				continue;
-			}
-			debug_print("Freeing cache memory for %s\n", item->path ? item->path : item->name);
-			cache_size = msgcache_get_memory_usage(item->cache);
-		        if (folder_item_free_cache(item, FALSE))
-				memusage -= cache_size;
+	memusage = msgcache_get_total_memory_usage();
+	limit = (gsize) MAX(prefs_common.cache_max_mem_usage, 0) * 1024;
+	debug_print("Total cache memory usage: %zd, shared strings: %zd\n",
+		    memusage,
+		    string_table_get_memusage(procmsg_get_string_table()));
 
-			listitem = listitem->next;
-		}
-		g_slist_free(folder_item_list);
+	if (memusage <= limit)
+		return;
+
+	debug_print("Trying to free cache memory\n");
+	expire = time(NULL) - prefs_common.cache_min_keep_time * 60;
+
+	for (cache = msgcache_get_lru_older(NULL);
+	     cache != NULL && memusage > limit;
+	     cache = msgcache_get_lru_older(cache)) {
+		/* the remaining caches were all used later */
+		if (msgcache_get_last_access_time(cache) > expire)
+			break;
+
+		item = msgcache_get_folder_item(cache);
+		if (item == NULL || item->cache != cache ||
+		    item == protected_item || item->opened > 0 ||
+		    item->processing_pending)
+			continue;
+
+		free_list = g_slist_prepend(free_list, item);
+		memusage -= MIN(memusage, (gsize) msgcache_get_memory_usage(cache));
 	}
+
+	/* write them all at once before freeing them */
+	free_list = g_slist_reverse(free_list);
+	folder_write_caches(free_list, FALSE);
+	for (cur = free_list; cur != NULL; cur = cur->next) {
+		item = (FolderItem *)(cur->data);
+
+		debug_print("Freeing cache memory for %s\n", item->path ? item->path : item->name);
+		folder_item_free_cache(item, FALSE);
+	}
+	g_slist_free(free_list);
+
+	debug_print("Total cache memory usage after cleanup: %zd\n",
+		    msgcache_get_total_memory_usage());
 }
 
 static void folder_item_remove_cached_msg(FolderItem *item, MsgInfo *msginfo)
@@ -2614,7 +2996,7 @@ static void folder_item_read_cache(FolderItem *item)
 			guint watchedcnt = 0;
 			MsgInfo *msginfo;
 
-			item->cache = msgcache_new();
+			item->cache = msgcache_new(item);
 			item->cache_dirty = TRUE;
 			item->mark_dirty = TRUE;
 			item->tags_dirty = TRUE;
@@ -2665,7 +3047,7 @@ static void folder_item_read_cache(FolderItem *item)
 		g_free(mark_file);
 		g_free(tags_file);
 	} else {
-		item->cache = msgcache_new();
+		item->cache = msgcache_new(item);
 		item->cache_dirty = TRUE;
 		item->mark_dirty = TRUE;
 		item->tags_dirty = TRUE;
@@ -2675,60 +3057,647 @@ static void folder_item_read_cache(FolderItem *item)
 	folder_clean_cache_memory(item);
 }
 
-void folder_item_write_cache(FolderItem *item)
+/* Cache files of different folders are read and written on a few
+ * threads, while the main thread waits for all of them. */
+#define FOLDER_MAX_THREADS	8
+
+typedef struct _FolderJobPool {
+	GPtrArray	*jobs;
+	guint		 next;
+	GFunc		 func;
+	gpointer	 data;
+#ifdef USE_PTHREAD
+	pthread_mutex_t	 mutex;
+#endif
+} FolderJobPool;
+
+static gpointer folder_job_pool_next(FolderJobPool *pool)
 {
-	gchar *cache_file = NULL, *mark_file = NULL, *tags_file = NULL;
-	FolderItemPrefs *prefs;
-	gint filemode = 0;
+	gpointer job = NULL;
+
+#ifdef USE_PTHREAD
+	pthread_mutex_lock(&pool->mutex);
+#endif
+	if (pool->next < pool->jobs->len)
+		job = g_ptr_array_index(pool->jobs, pool->next++);
+#ifdef USE_PTHREAD
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+
+	return job;
+}
+
+static void *folder_job_thread(void *data)
+{
+	FolderJobPool *pool = (FolderJobPool *)data;
+	gpointer job;
+
+	while ((job = folder_job_pool_next(pool)) != NULL)
+		pool->func(job, pool->data);
+
+	return NULL;
+}
+
+static guint folder_job_num_threads(guint jobs)
+{
+	glong cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	cpus = CLAMP(cpus, 1, FOLDER_MAX_THREADS);
+
+	return MIN((guint)cpus, jobs);
+}
+
+/* Calls func on every job, on up to max_threads threads including the
+ * calling one, and returns the number of threads used once all jobs
+ * are done. */
+guint folder_run_jobs_full(GPtrArray *jobs, GFunc func, gpointer data,
+			   guint max_threads)
+{
+	FolderJobPool pool;
+	guint n_threads = 0;
+#ifdef USE_PTHREAD
+	pthread_t threads[FOLDER_MAX_THREADS];
+	guint i;
+#endif
+
+	pool.jobs = jobs;
+	pool.next = 0;
+	pool.func = func;
+	pool.data = data;
+
+	max_threads = CLAMP(max_threads, 1, FOLDER_MAX_THREADS);
+	max_threads = MIN(max_threads, MAX(jobs->len, 1));
+
+#ifdef USE_PTHREAD
+	pthread_mutex_init(&pool.mutex, NULL);
+	for (i = 1; i < max_threads; i++) {
+		if (pthread_create(&threads[n_threads], NULL,
+				   folder_job_thread, &pool) != 0)
+			break;
+		n_threads++;
+	}
+#endif
+	folder_job_thread(&pool);
+#ifdef USE_PTHREAD
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.mutex);
+#endif
+
+	return n_threads + 1;
+}
+
+/* Same, on up to one thread per CPU */
+guint folder_run_jobs(GPtrArray *jobs, GFunc func, gpointer data)
+{
+	return folder_run_jobs_full(jobs, func, data,
+				    folder_job_num_threads(jobs->len));
+}
+
+static glong folder_elapsed_usecs(const GTimeVal *start)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+
+	return (now.tv_sec - start->tv_sec) * G_USEC_PER_SEC +
+		(now.tv_usec - start->tv_usec);
+}
+
+/* Startup cache preloading: the cache, mark and tags files of local
+ * folders are read on worker threads while the main thread keeps the
+ * interface alive, then the caches are handed over to their folders
+ * by the main thread. */
+typedef struct _CachePreloadJob {
+	FolderItem	*item;
+	gchar		*cache_file;
+	gchar		*mark_file;
+	gchar		*tags_file;
+	MsgCache	*cache;
+} CachePreloadJob;
+
+typedef struct _CachePreload {
+	GPtrArray	*jobs;
+	gsize		 max_memusage;
+	guint		 n_threads;
+	volatile gboolean done;
+} CachePreload;
+
+static void folder_preload_collect(FolderItem *item, gpointer data)
+{
+	GPtrArray *jobs = (GPtrArray *)data;
+	CachePreloadJob *job;
+
+	if (item->cache != NULL || item->path == NULL || item->no_select ||
+	    !FOLDER_IS_LOCAL(item->folder))
+		return;
+
+	/* the saved counts are shown until the folder is opened, only
+	 * the folders processed at startup need their cache now */
+	if (item->num_sig != 0 &&
+	    (item->prefs == NULL || !item->prefs->enable_processing))
+		return;
+
+	/* paths are built here, they may create directories */
+	job = g_new0(CachePreloadJob, 1);
+	job->item = item;
+	job->cache_file = folder_item_get_cache_file(item);
+	job->mark_file = folder_item_get_mark_file(item);
+	job->tags_file = folder_item_get_tags_file(item);
+	g_ptr_array_add(jobs, job);
+}
+
+/* Only reads files into a cache private to the job; folder items are
+ * not modified until the caches are handed over. */
+static void folder_preload_job(gpointer data, gpointer user_data)
+{
+	CachePreloadJob *job = (CachePreloadJob *)data;
+	CachePreload *preload = (CachePreload *)user_data;
+
+	/* the caches read so far, on every thread, are in the total */
+	if (msgcache_get_total_memory_usage() > preload->max_memusage)
+		return;
+
+	job->cache = msgcache_read_cache(job->item, job->cache_file);
+	if (job->cache == NULL)
+		return;
+	msgcache_read_mark(job->cache, job->mark_file);
+	msgcache_read_tags(job->cache, job->tags_file);
+}
+
+static void *folder_preload_thread(void *data)
+{
+	CachePreload *preload = (CachePreload *)data;
+
+	preload->n_threads = folder_run_jobs(preload->jobs,
+					     folder_preload_job, preload);
+	preload->done = TRUE;
+
+	return NULL;
+}
+
+void folder_preload_caches(void)
+{
+	CachePreload preload;
+	GPtrArray *jobs;
+	CachePreloadJob *job;
+	guint i, loaded = 0;
+	gsize memusage;
+#ifdef USE_PTHREAD
+	pthread_t pt;
+#endif
+	START_TIMING("");
+
+	jobs = g_ptr_array_new();
+	folder_func_to_all_folders(folder_preload_collect, jobs);
+
+	preload.jobs = jobs;
+	preload.max_memusage = (gsize) prefs_common.cache_max_mem_usage * 1024;
+	preload.n_threads = 0;
+	preload.done = FALSE;
+
+	/* reading a cache may convert strings from another charset */
+	conv_prepare_threads();
+#ifdef USE_PTHREAD
+	if (jobs->len > 0 &&
+	    pthread_create(&pt, NULL, folder_preload_thread, &preload) == 0) {
+		/* don't let the interface freeze while waiting */
+		while (!preload.done)
+			claws_do_idle();
+		pthread_join(pt, NULL);
+	} else
+#endif
+		folder_preload_thread(&preload);
+
+	/* hand the caches over, within the cache memory limit; the
+	 * preloaded caches are already counted in the total */
+	memusage = msgcache_get_total_memory_usage();
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+		if (job->cache != NULL)
+			memusage -= msgcache_get_memory_usage(job->cache);
+	}
+	for (i = 0; i < jobs->len; i++) {
+		job = g_ptr_array_index(jobs, i);
+
+		if (job->cache != NULL && job->item->cache == NULL &&
+		    memusage <= preload.max_memusage) {
+			job->item->cache = job->cache;
+			job->item->cache_dirty = FALSE;
+			job->item->mark_dirty = FALSE;
+			job->item->tags_dirty = FALSE;
+			memusage += msgcache_get_memory_usage(job->cache);
+			loaded++;
+		} else if (job->cache != NULL) {
+			msgcache_destroy(job->cache);
+		}
+
+		g_free(job->cache_file);
+		g_free(job->mark_file);
+		g_free(job->tags_file);
+		g_free(job);
+	}
+
+	debug_print("Preloaded %u of %u folder caches on %u threads\n",
+		    loaded, jobs->len, preload.n_threads);
+	g_ptr_array_free(jobs, TRUE);
+	END_TIMING();
+}
+
+/* Writing a cache is split so that many caches can be serialized and
+ * synced on worker threads; only the preparation and the final switch
+ * to the new files happen on the main thread. */
+typedef struct _CacheFlushJob {
+	FolderItem	*item;
+	MsgCache	*cache;
+	gchar		*cache_file;
+	gchar		*mark_file;
+	gchar		*tags_file;
+	gboolean	 cache_dirty;
+	gboolean	 compact;
+	gboolean	 need_scan;
+	time_t		 last_mtime;
+	gboolean	 journaled;
+	gint		 result;
+	glong		 usecs;
+} CacheFlushJob;
+
+static CacheFlushJob *folder_item_flush_prepare(FolderItem *item, gboolean compact)
+{
+	CacheFlushJob *job;
 	gchar *id;
-	time_t last_mtime = (time_t)0;
-	gboolean need_scan = FALSE;
-	
+
 	if (!item || !item->path || !item->cache)
-		return;
+		return NULL;
 
-	last_mtime = item->mtime;
+	job = g_new0(CacheFlushJob, 1);
+	job->item = item;
+	job->cache = item->cache;
+	job->compact = compact;
+	job->last_mtime = item->mtime;
 	if (item->folder->klass->set_mtime) {
 		if (item->folder->klass->scan_required)
-			need_scan = item->folder->klass->scan_required(item->folder, item);
+			job->need_scan = item->folder->klass->scan_required(item->folder, item);
 		else
-			need_scan = TRUE;
+			job->need_scan = TRUE;
 	}
 
 	id = folder_item_get_identifier(item);
 	debug_print("Save cache for folder %s\n", id);
 	g_free(id);
 
+	if (compact && msgcache_has_journal(item->cache)) {
+		item->mark_dirty = TRUE;
+		item->tags_dirty = TRUE;
+	}
+
+	job->cache_dirty = item->cache_dirty;
 	if (item->cache_dirty)
-		cache_file = folder_item_get_cache_file(item);
+		job->cache_file = folder_item_get_cache_file(item);
 	if (item->cache_dirty || item->mark_dirty)
-		mark_file = folder_item_get_mark_file(item);
+		job->mark_file = folder_item_get_mark_file(item);
 	if (item->cache_dirty || item->tags_dirty)
-		tags_file = folder_item_get_tags_file(item);
-	if (msgcache_write(cache_file, mark_file, tags_file, item->cache) < 0) {
+		job->tags_file = folder_item_get_tags_file(item);
+
+	return job;
+}
+
+/* Flag and tag changes are appended to journals when the rest of the
+ * cache is clean; otherwise new files are written, not synced yet. */
+static void folder_item_flush_write(gpointer data, gpointer user_data)
+{
+	CacheFlushJob *job = (CacheFlushJob *)data;
+	GTimeVal start;
+
+	g_get_current_time(&start);
+
+	if (!job->cache_dirty && !job->compact &&
+	    (job->mark_file || job->tags_file) &&
+	    msgcache_write_journal(job->mark_file, job->tags_file, job->cache) == 0)
+		job->journaled = TRUE;
+	else
+		job->result = msgcache_write_begin(job->cache_file,
+				job->mark_file, job->tags_file, job->cache);
+
+	job->usecs += folder_elapsed_usecs(&start);
+}
+
+static void folder_item_flush_sync(gpointer data, gpointer user_data)
+{
+	CacheFlushJob *job = (CacheFlushJob *)data;
+	GTimeVal start;
+
+	if (job->journaled || job->result < 0)
+		return;
+
+	g_get_current_time(&start);
+
+	if (msgcache_write_sync(job->cache_file, job->mark_file,
+				job->tags_file) < 0)
+		job->result = -1;
+
+	job->usecs += folder_elapsed_usecs(&start);
+}
+
+/* queues the journal of base_file to be synced with the current batch */
+static void folder_item_flush_sync_journal(const gchar *base_file)
+{
+	gchar *journal_file;
+
+	if (base_file == NULL)
+		return;
+	journal_file = g_strconcat(base_file, JOURNAL_SUFFIX, NULL);
+	if (is_file_exist(journal_file))
+		folder_sync_file(journal_file);
+	g_free(journal_file);
+}
+
+static void folder_item_flush_finish(CacheFlushJob *job)
+{
+	FolderItem *item = job->item;
+	FolderItemPrefs *prefs;
+	gint filemode = 0;
+
+	if (job->journaled) {
+		folder_item_flush_sync_journal(job->mark_file);
+		folder_item_flush_sync_journal(job->tags_file);
+		item->mark_dirty = FALSE;
+		item->tags_dirty = FALSE;
+	} else if (job->result < 0) {
+		msgcache_write_abort(job->cache_file, job->mark_file,
+				     job->tags_file);
 		prefs = item->prefs;
-    		if (prefs && prefs->enable_folder_chmod && prefs->folder_chmod) {
+		if (prefs && prefs->enable_folder_chmod && prefs->folder_chmod) {
 			/* for cache file */
 			filemode = prefs->folder_chmod;
 			if (filemode & S_IRGRP) filemode |= S_IWGRP;
 			if (filemode & S_IROTH) filemode |= S_IWOTH;
-			chmod(cache_file, filemode);
+			chmod(job->cache_file, filemode);
 		}
-        } else {
+	} else {
+		msgcache_write_commit(job->cache_file, job->mark_file,
+				      job->tags_file, job->cache);
 		item->cache_dirty = FALSE;
 		item->mark_dirty = FALSE;
 		item->tags_dirty = FALSE;
 	}
 
-	if (!need_scan && item->folder->klass->set_mtime) {
-		if (item->mtime == last_mtime) {
+	if (!job->need_scan && item->folder->klass->set_mtime) {
+		if (item->mtime == job->last_mtime) {
 			item->folder->klass->set_mtime(item->folder, item);
 		}
 	}
 
-	g_free(cache_file);
-	g_free(mark_file);
-	g_free(tags_file);
+	debug_print("Flushed cache of %s in %ld.%03lds%s\n",
+		    item->path ? item->path : item->name,
+		    job->usecs / G_USEC_PER_SEC,
+		    (job->usecs / 1000) % 1000,
+		    job->result < 0 ? " (failed)" : "");
+
+	g_free(job->cache_file);
+	g_free(job->mark_file);
+	g_free(job->tags_file);
+	g_free(job);
+}
+
+/* Writes the caches of all items, serializing and syncing them on
+ * worker threads. compact is as for folder_item_write_cache_full().
+ * Appended journals are synced together once all are written. */
+void folder_write_caches(GSList *items, gboolean compact)
+{
+	GPtrArray *jobs;
+	CacheFlushJob *job;
+	GSList *cur;
+	guint i, n_threads;
+	GTimeVal start;
+
+	g_get_current_time(&start);
+	folder_sync_batch_begin();
+
+	jobs = g_ptr_array_new();
+	for (cur = items; cur != NULL; cur = cur->next) {
+		if ((job = folder_item_flush_prepare(cur->data, compact)) != NULL)
+			g_ptr_array_add(jobs, job);
+	}
+
+	/* every new file is written before any is synced, so that the
+	 * filesystem can commit them together */
+	n_threads = folder_run_jobs(jobs, folder_item_flush_write, NULL);
+	folder_run_jobs(jobs, folder_item_flush_sync, NULL);
+
+	for (i = 0; i < jobs->len; i++)
+		folder_item_flush_finish(g_ptr_array_index(jobs, i));
+	folder_sync_batch_end();
+
+	debug_print("Flushed %u folder caches on %u threads in %ldms\n",
+		    jobs->len, n_threads, folder_elapsed_usecs(&start) / 1000);
+	g_ptr_array_free(jobs, TRUE);
+}
+
+void folder_item_write_cache(FolderItem *item)
+{
+	folder_item_write_cache_full(item, FALSE);
+}
+
+static void folder_item_write_cache_now(FolderItem *item, gboolean compact)
+{
+	CacheFlushJob *job;
+
+	if ((job = folder_item_flush_prepare(item, compact)) == NULL)
+		return;
+
+	folder_sync_batch_begin();
+	folder_item_flush_write(job, NULL);
+	folder_item_flush_sync(job, NULL);
+	folder_item_flush_finish(job);
+	folder_sync_batch_end();
+}
+
+/* Flag and tag changes are appended to journals when the rest of the
+ * cache is clean; compact forces the mark and tags files to be
+ * rewritten so that their journals can be dropped. Within a sync
+ * batch, the cache is written with the others at its end. */
+void folder_item_write_cache_full(FolderItem *item, gboolean compact)
+{
+	if (folder_sync_batch_depth > 0 && prefs_common.flush_metadata &&
+	    !compact) {
+		if (!g_slist_find(folder_sync_pending_items, item))
+			folder_sync_pending_items = g_slist_prepend(
+					folder_sync_pending_items, item);
+		return;
+	}
+
+	folder_item_write_cache_now(item, compact);
+}
+
+/* Sync batches: while incorporating, importing or moving mail, the new
+ * message files and the caches are not synced one by one, but all
+ * together when the batch ends. Message files added outside a batch are
+ * not synced. Nothing is committed before being synced, as outside batches:
+ * caches are still written to new files, synced, then renamed. */
+
+#define FOLDER_SYNCFS_MIN	32
+
+/**
+ * Starts a sync batch. Batches can be nested; the outermost one is
+ * synced by its folder_sync_batch_end().
+ */
+void folder_sync_batch_begin(void)
+{
+	folder_sync_batch_depth++;
+}
+
+static void folder_sync_dir_func(gpointer key, gpointer value, gpointer data)
+{
+	const gchar *dir = (const gchar *)key;
+	gint fd;
+
+	if ((fd = g_open(dir, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(dir, "open");
+		return;
+	}
+	if (fsync(fd) < 0)
+		FILE_OP_ERROR(dir, "fsync");
+	close(fd);
+}
+
+#ifdef HAVE_SYNCFS
+static void folder_syncfs_func(gpointer key, gpointer value, gpointer data)
+{
+	const gchar *dir = (const gchar *)key;
+	GHashTable *devs = (GHashTable *)data;
+	struct stat s;
+	gint fd;
+
+	if ((fd = g_open(dir, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(dir, "open");
+		return;
+	}
+	/* once per filesystem */
+	if (fstat(fd, &s) == 0 &&
+	    !g_hash_table_lookup(devs, GUINT_TO_POINTER(s.st_dev))) {
+		g_hash_table_insert(devs, GUINT_TO_POINTER(s.st_dev),
+				    GINT_TO_POINTER(1));
+		if (syncfs(fd) < 0)
+			FILE_OP_ERROR(dir, "syncfs");
+	}
+	close(fd);
+}
+#endif
+
+static void folder_sync_pending_files(void)
+{
+	const gchar *file;
+	guint i;
+	gint fd;
+#ifdef HAVE_SYNCFS
+	GHashTable *devs;
+#endif
+
+	if (folder_sync_files == NULL)
+		return;
+
+#ifdef HAVE_SYNCFS
+	/* a sweep of the whole filesystem costs less than syncing many
+	 * files one by one, and covers their directories */
+	if (folder_sync_files->len >= FOLDER_SYNCFS_MIN) {
+		devs = g_hash_table_new(g_direct_hash, g_direct_equal);
+		g_hash_table_foreach(folder_sync_dirs, folder_syncfs_func,
+				     devs);
+		g_hash_table_destroy(devs);
+		debug_print("Synced %u files with syncfs()\n",
+			    folder_sync_files->len);
+		goto out;
+	}
+#endif
+
+	for (i = 0; i < folder_sync_files->len; i++) {
+		file = g_ptr_array_index(folder_sync_files, i);
+		if ((fd = g_open(file, O_RDONLY, 0)) < 0) {
+			FILE_OP_ERROR(file, "open");
+			continue;
+		}
+		if (fdatasync(fd) < 0)
+			FILE_OP_ERROR(file, "fdatasync");
+		close(fd);
+	}
+	g_hash_table_foreach(folder_sync_dirs, folder_sync_dir_func, NULL);
+	debug_print("Synced %u files and %u directories\n",
+		    folder_sync_files->len, g_hash_table_size(folder_sync_dirs));
+
+#ifdef HAVE_SYNCFS
+out:
+#endif
+	g_ptr_array_foreach(folder_sync_files, (GFunc)g_free, NULL);
+	g_ptr_array_free(folder_sync_files, TRUE);
+	folder_sync_files = NULL;
+	g_hash_table_destroy(folder_sync_dirs);
+	folder_sync_dirs = NULL;
+}
+
+/**
+ * Ends a sync batch: the message files added during the batch are made
+ * durable together, then the caches written during it.
+ */
+void folder_sync_batch_end(void)
+{
+	GSList *items;
+
+	cm_return_if_fail(folder_sync_batch_depth > 0);
+
+	if (--folder_sync_batch_depth > 0)
+		return;
+
+	folder_sync_pending_files();
+
+	items = g_slist_reverse(folder_sync_pending_items);
+	folder_sync_pending_items = NULL;
+	if (items != NULL)
+		folder_write_caches(items, FALSE);
+	g_slist_free(items);
+}
+
+/**
+ * Makes the message files added so far in the current sync batch
+ * durable now, for callers about to make their source forget them.
+ * The caches are still written when the batch ends.
+ */
+void folder_sync_batch_flush(void)
+{
+	folder_sync_pending_files();
+}
+
+/**
+ * Queues file, a message just added to a local folder or a cache
+ * journal just appended to, to be made durable at the end of the
+ * current sync batch if prefs_common.flush_metadata asks so. Outside
+ * batches, nothing is done: callers which need the file on disk open a
+ * batch around it.
+ */
+void folder_sync_file(const gchar *file)
+{
+	gchar *dir;
+
+	cm_return_if_fail(file != NULL);
+
+	if (!prefs_common.flush_metadata || folder_sync_batch_depth == 0)
+		return;
+
+	if (folder_sync_files == NULL) {
+		folder_sync_files = g_ptr_array_new();
+		folder_sync_dirs = g_hash_table_new_full(g_str_hash,
+				g_str_equal, g_free, NULL);
+	}
+	g_ptr_array_add(folder_sync_files, g_strdup(file));
+
+	dir = g_path_get_dirname(file);
+	if (!g_hash_table_lookup(folder_sync_dirs, dir))
+		g_hash_table_insert(folder_sync_dirs, dir, GINT_TO_POINTER(1));
+	else
+		g_free(dir);
 }
 
 MsgInfo *folder_item_get_msginfo(FolderItem *item, gint num)
@@ -3113,6 +4082,14 @@ gint folder_item_add_msg(FolderItem *dest, const gchar *file,
 
 gint folder_item_add_msgs(FolderItem *dest, GSList *file_list,
                           gboolean remove_source)
+{
+	return folder_item_add_msgs_full(dest, file_list, remove_source, NULL);
+}
+
+/* Like folder_item_add_msgs(), also storing the number given to each
+ * MsgFileInfo in nums, when not NULL */
+gint folder_item_add_msgs_full(FolderItem *dest, GSList *file_list,
+			       gboolean remove_source, GHashTable *nums)
 {
         Folder *folder;
         gint ret, num, lastnum = -1;
@@ -3174,6 +4151,9 @@ gint folder_item_add_msgs(FolderItem *dest, GSList *file_list,
 			if (num > lastnum)
 				lastnum = num;
 
+			if (num > 0 && nums != NULL)
+				g_hash_table_insert(nums, fileinfo, GINT_TO_POINTER(num));
+
 			if (num >= 0 && remove_source) {
 				if (claws_unlink(fileinfo->file) < 0)
 					FILE_OP_ERROR(fileinfo->file, "unlink");
@@ -3439,10 +4419,13 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 
 	/* 
 	 * Copy messages to destination folder and 
-	 * store new message numbers in newmsgnums
+	 * store new message numbers in newmsgnums.
+	 * The copies are synced before the sources are removed.
 	 */
+	folder_sync_batch_begin();
 	if (folder->klass->copy_msgs != NULL) {
 		if (folder->klass->copy_msgs(folder, dest, msglist, relation) < 0) {
+			folder_sync_batch_end();
 			g_hash_table_destroy(relation);
 			return -1;
 		}
@@ -3454,6 +4437,7 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 		if (l != NULL) {
 			msginfo = (MsgInfo *) l->data;
 			if (msginfo != NULL && msginfo->folder == dest) {
+				folder_sync_batch_end();
 				g_hash_table_destroy(relation);
 				return -1;
 			}
@@ -3469,6 +4453,7 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 				not_moved = g_slist_prepend(not_moved, msginfo);
 		}
 	}
+	folder_sync_batch_end();
 
 	if (remove_source) {
 		MsgInfo *msginfo = (MsgInfo *) msglist->data;
@@ -3797,7 +4782,7 @@ gint folder_item_remove_all_msg(FolderItem *item)
 
 		if (result == 0) {
 			folder_item_free_cache(item, TRUE);
-			item->cache = msgcache_new();
+			item->cache = msgcache_new(item);
 			item->cache_dirty = TRUE;
 			item->mark_dirty = TRUE;
 			item->tags_dirty = TRUE;
@@ -3834,6 +4819,8 @@ void folder_item_change_msg_flags(FolderItem *item, MsgInfo *msginfo, MsgPermFla
 	cm_return_if_fail(msginfo != NULL);
 	
 	item->mark_dirty = TRUE;
+	if (item->cache)
+		msgcache_journal_flags(item->cache, msginfo->msgnum);
 
 	if (item->no_select)
 		return;
@@ -3861,6 +4848,8 @@ void folder_item_commit_tags(FolderItem *item, MsgInfo *msginfo, GSList *tags_se
 		return;
 	
 	item->tags_dirty = TRUE;
+	if (item->cache)
+		msgcache_journal_tags(item->cache, msginfo->msgnum);
 
 	if (folder->klass->commit_tags == NULL)
 		return;
@@ -543,6 +543,21 @@ struct _FolderClass
 	gboolean	(*is_msg_changed)	(Folder		*folder,
 						 FolderItem	*item,
 						 MsgInfo	*msginfo);
+	/**
+	 * Check which messages of a list have been modified by someone
+	 * else, all at once. If NULL \c is_msg_changed is called for each
+	 * message.
+	 *
+	 * \param folder The \c Folder of the messages
+	 * \param item The \c FolderItem containing the messages
+	 * \param msglist The \c MsgInfos of the messages that should be
+	 *                checked
+	 * \return A list of the \c MsgInfos of \c msglist that were
+	 *         modified. The \c MsgInfos are not referenced.
+	 */
+	MsgInfoList	*(*get_changed_msgs)	(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfoList	*msglist);
 	/**
 	 * Update a message's flags in the folder data. If NULL only the
 	 * internal flag management will be used. The function has to set
@@ -652,6 +667,8 @@ struct _FolderItem
 	gint locked_msgs;
 	gint ignored_msgs;
 	gint watched_msgs;
+	guint32 num_sig; /* of the numbers the counts are for, 0 if unknown */
+	time_t num_sig_mtime; /* folder mtime when num_sig was taken */
 
 	gint order;
 
@@ -845,6 +862,10 @@ gint   folder_item_add_msg		(FolderItem	*dest,
 gint   folder_item_add_msgs             (FolderItem     *dest,
                                          GSList         *file_list,
                                          gboolean        remove_source);
+gint   folder_item_add_msgs_full	(FolderItem	*dest,
+					 GSList		*file_list,
+					 gboolean	 remove_source,
+					 GHashTable	*nums);
 gint   folder_item_move_to		(FolderItem	*src,
 					 FolderItem	*dest,
 					 FolderItem    **new_item,
@@ -872,6 +893,22 @@ gboolean folder_item_is_msg_changed	(FolderItem	*item,
 void folder_clean_cache_memory		(FolderItem *protected_item);
 void folder_clean_cache_memory_force	(void);
 void folder_item_write_cache		(FolderItem *item);
+void folder_item_write_cache_full	(FolderItem *item,
+					 gboolean compact);
+void folder_preload_caches		(void);
+void folder_write_caches		(GSList *items,
+					 gboolean compact);
+void folder_sync_batch_begin		(void);
+void folder_sync_batch_end		(void);
+void folder_sync_batch_flush		(void);
+void folder_sync_file			(const gchar *file);
+guint folder_run_jobs			(GPtrArray *jobs,
+					 GFunc func,
+					 gpointer data);
+guint folder_run_jobs_full		(GPtrArray *jobs,
+					 GFunc func,
+					 gpointer data,
+					 guint max_threads);
 
 void folder_item_apply_processing	(FolderItem *item);
 
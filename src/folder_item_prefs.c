@@ -94,6 +94,8 @@ static PrefParam param[] = {
 	 NULL, NULL, NULL},
 	{"remove_old_bodies", "FALSE", &tmp_prefs.remove_old_bodies, P_BOOL,
 	 NULL, NULL, NULL},
+	{"compress_cache", "FALSE", &tmp_prefs.compress_cache, P_BOOL,
+	 NULL, NULL, NULL},
 
 	{"compose_with_format", "FALSE", &tmp_prefs.compose_with_format, P_BOOL,
 	 NULL, NULL, NULL},
@@ -201,6 +203,7 @@ static FolderItemPrefs *folder_item_prefs_clear(FolderItemPrefs *prefs)
 	prefs->offlinesync = FALSE;
 	prefs->offlinesync_days = 0;
 	prefs->remove_old_bodies = FALSE;
+	prefs->compress_cache = FALSE;
 
 	prefs->compose_with_format = FALSE;
 	prefs->compose_subject_format = NULL;
@@ -260,6 +263,7 @@ void folder_item_prefs_copy_prefs(FolderItem * src, FolderItem * dest)
 	tmp_prefs.offlinesync                   = src->prefs->offlinesync;
 	tmp_prefs.offlinesync_days              = src->prefs->offlinesync_days;
 	tmp_prefs.remove_old_bodies             = src->prefs->remove_old_bodies;
+	tmp_prefs.compress_cache                = src->prefs->compress_cache;
 
 	prefs_matcher_read_config();
 
@@ -38,6 +38,7 @@ struct _FolderItemPrefs {
 	int offlinesync;
 	int offlinesync_days;
 	int remove_old_bodies;
+	gboolean compress_cache;
 
 	gboolean request_return_receipt;
 	gboolean enable_default_to;
@@ -609,6 +609,12 @@ static gint inc_start(IncProgressDialog *inc_dialog)
 
 		SET_PIXMAP_AND_TEXT(currentpix, _("Retrieving"));
 
+		/* the new messages and caches are synced together once
+		 * filtered, before the UIDL list says they were received.
+		 * Messages deleted from the server as soon as they are
+		 * received are synced before, in inc_drop_message(). */
+		folder_sync_batch_begin();
+
 		/* begin POP3 session */
 		inc_state = inc_pop3_session_do(session);
 
@@ -703,6 +709,8 @@ static gint inc_start(IncProgressDialog *inc_dialog)
 		g_slist_free(filtered);
 		g_slist_free(unfiltered);
 
+		folder_sync_batch_end();
+
 		statusbar_pop_all();
 
 		new_msgs += pop3_session->cur_total_num;
@@ -1119,6 +1127,13 @@ static gint inc_drop_message(Pop3Session *session, const gchar *file)
 		return -1;
 	}
 
+	/* pop3_session_recv_data_finished() deletes it from the server
+	 * right after: it must be on disk first */
+	if (session->ac_prefs->rmmail &&
+	    session->ac_prefs->msg_leave_time == 0 &&
+	    session->ac_prefs->msg_leave_hour == 0)
+		folder_sync_batch_flush();
+
 	return 0;
 }
 
@@ -1363,7 +1378,10 @@ static gint get_spool(FolderItem *dest, const gchar *mbox, PrefsAccount *account
 	debug_print("Getting new messages from %s into %s...\n",
 		    mbox, dest->path);
 
+	/* the messages must be on disk before the mailbox is emptied */
+	folder_sync_batch_begin();
 	msgs = proc_mbox(dest, tmp_mbox, account->filter_on_recv, account);
+	folder_sync_batch_end();
 
 	claws_unlink(tmp_mbox);
 	if (msgs >= 0) empty_mbox(mbox);
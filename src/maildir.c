@@ -0,0 +1,1646 @@
+/*
+ * Sylpheed -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 1999-2009 Hiroyuki Yamamoto and the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "defs.h"
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "folder.h"
+#include "maildir.h"
+#include "procmsg.h"
+#include "procheader.h"
+#include "utils.h"
+#include "folder_item_prefs.h"
+
+/* Maildir++ layout: the mailbox directory is the inbox, and the folder
+ * sub/folder lives in the .sub.folder directory next to it. Each has
+ * the cur, new and tmp directories of a maildir.
+ *
+ * Messages are known by the unique part of their file name, before the
+ * ":2," info suffix which holds their flags. The number given to each
+ * unique name is kept in MAILDIR_UIDS_FILE, next to the cache, so that
+ * it does not change from one session to the next. */
+
+#define MAILDIR_UIDS_FILE	".claws_uids"
+#define MAILDIR_UIDS_VERSION	1
+
+/* flags kept in the file names, the others are in the cache only */
+#define MAILDIR_FLAGS	(MSG_NEW | MSG_UNREAD | MSG_MARKED | MSG_REPLIED | \
+			 MSG_FORWARDED | MSG_DELETED)
+
+typedef struct _MaildirFolderItem	MaildirFolderItem;
+typedef struct _MaildirMsg		MaildirMsg;
+
+#define MAILDIR_ITEM(obj)	((MaildirFolderItem *)obj)
+
+struct _MaildirMsg
+{
+	gint	 num;
+	gchar	*uniq;
+	gchar	*file;		/* relative to the folder: new/<uniq> or
+				 * cur/<uniq>:2,<info>, NULL until seen */
+	gboolean found;
+};
+
+struct _MaildirFolderItem
+{
+	FolderItem item;
+
+	GHashTable *msgs;	/* number -> MaildirMsg */
+	GHashTable *uniqs;	/* unique name -> MaildirMsg */
+	gint next_num;
+	gboolean uids_dirty;
+};
+
+static void	maildir_folder_init		(Folder		*folder,
+						 const gchar	*name,
+						 const gchar	*path);
+
+static Folder	*maildir_folder_new		(const gchar	*name,
+						 const gchar	*path);
+static void     maildir_folder_destroy		(Folder		*folder);
+static gint     maildir_scan_tree		(Folder		*folder);
+static gint     maildir_create_tree		(Folder		*folder);
+
+static FolderItem *maildir_item_new		(Folder		*folder);
+static void	maildir_item_destroy		(Folder		*folder,
+						 FolderItem	*item);
+static gchar   *maildir_item_get_path		(Folder		*folder,
+						 FolderItem	*item);
+static FolderItem *maildir_create_folder	(Folder		*folder,
+						 FolderItem	*parent,
+						 const gchar	*name);
+static gint     maildir_rename_folder		(Folder		*folder,
+						 FolderItem	*item,
+						 const gchar	*name);
+static gint     maildir_remove_folder		(Folder		*folder,
+						 FolderItem	*item);
+static gint	maildir_item_close		(Folder		*folder,
+						 FolderItem	*item);
+static gint	maildir_get_num_list		(Folder		*folder,
+						 FolderItem	*item,
+						 GSList		**list,
+						 gboolean	*old_uids_valid);
+static gboolean	maildir_scan_required		(Folder		*folder,
+						 FolderItem	*item);
+static void	maildir_set_mtime		(Folder		*folder,
+						 FolderItem	*item);
+
+static MsgInfo *maildir_get_msginfo		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gchar   *maildir_fetch_msg		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gint     maildir_add_msg			(Folder		*folder,
+						 FolderItem	*dest,
+						 const gchar	*file,
+						 MsgFlags	*flags);
+static gint     maildir_add_msgs		(Folder		*folder,
+						 FolderItem	*dest,
+						 GSList		*file_list,
+						 GHashTable	*relation);
+static gint     maildir_copy_msg		(Folder		*folder,
+						 FolderItem	*dest,
+						 MsgInfo	*msginfo);
+static gint     maildir_copy_msgs		(Folder		*folder,
+						 FolderItem	*dest,
+						 MsgInfoList	*msglist,
+						 GHashTable	*relation);
+static gint     maildir_remove_msg		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gint     maildir_remove_msgs		(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfoList	*msglist,
+						 GHashTable	*relation);
+static gint     maildir_remove_all_msg		(Folder		*folder,
+						 FolderItem	*item);
+static gboolean maildir_is_msg_changed		(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfo	*msginfo);
+static void	maildir_change_flags		(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfo	*msginfo,
+						 MsgPermFlags	 newflags);
+static gint	maildir_get_flags		(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfoList	*msglist,
+						 GHashTable	*msgflags);
+
+static gchar	*maildir_filename_from_utf8	(const gchar	*path);
+static gchar	*maildir_filename_to_utf8	(const gchar	*path);
+
+static FolderClass maildir_class;
+
+FolderClass *maildir_get_class(void)
+{
+	if (maildir_class.idstr == NULL) {
+		maildir_class.type = F_MAILDIR;
+		maildir_class.idstr = "maildir";
+		maildir_class.uistr = "Maildir";
+
+		/* Folder functions */
+		maildir_class.new_folder = maildir_folder_new;
+		maildir_class.destroy_folder = maildir_folder_destroy;
+		maildir_class.set_xml = folder_local_set_xml;
+		maildir_class.get_xml = folder_local_get_xml;
+		maildir_class.scan_tree = maildir_scan_tree;
+		maildir_class.create_tree = maildir_create_tree;
+
+		/* FolderItem functions */
+		maildir_class.item_new = maildir_item_new;
+		maildir_class.item_destroy = maildir_item_destroy;
+		maildir_class.item_get_path = maildir_item_get_path;
+		maildir_class.create_folder = maildir_create_folder;
+		maildir_class.rename_folder = maildir_rename_folder;
+		maildir_class.remove_folder = maildir_remove_folder;
+		maildir_class.close = maildir_item_close;
+		maildir_class.get_num_list = maildir_get_num_list;
+		maildir_class.scan_required = maildir_scan_required;
+		maildir_class.set_mtime = maildir_set_mtime;
+
+		/* Message functions */
+		maildir_class.get_msginfo = maildir_get_msginfo;
+		maildir_class.fetch_msg = maildir_fetch_msg;
+		maildir_class.add_msg = maildir_add_msg;
+		maildir_class.add_msgs = maildir_add_msgs;
+		maildir_class.copy_msg = maildir_copy_msg;
+		maildir_class.copy_msgs = maildir_copy_msgs;
+		maildir_class.remove_msg = maildir_remove_msg;
+		maildir_class.remove_msgs = maildir_remove_msgs;
+		maildir_class.remove_all_msg = maildir_remove_all_msg;
+		maildir_class.is_msg_changed = maildir_is_msg_changed;
+		maildir_class.change_flags = maildir_change_flags;
+		maildir_class.get_flags = maildir_get_flags;
+	}
+
+	return &maildir_class;
+}
+
+/**
+ * Tells whether path, absolute or relative to the home directory, is a
+ * maildir.
+ */
+gboolean maildir_is_maildir(const gchar *path)
+{
+	gchar *cur;
+	gboolean ret;
+
+	cm_return_val_if_fail(path != NULL, FALSE);
+
+	if (is_relative_filename(path))
+		cur = g_strconcat(get_home_dir(), G_DIR_SEPARATOR_S, path,
+				  G_DIR_SEPARATOR_S, "cur", NULL);
+	else
+		cur = g_strconcat(path, G_DIR_SEPARATOR_S, "cur", NULL);
+	ret = is_dir_exist(cur);
+	g_free(cur);
+
+	return ret;
+}
+
+static Folder *maildir_folder_new(const gchar *name, const gchar *path)
+{
+	Folder *folder;
+
+	folder = (Folder *)g_new0(MaildirFolder, 1);
+	folder->klass = &maildir_class;
+	maildir_folder_init(folder, name, path);
+
+	return folder;
+}
+
+static void maildir_folder_destroy(Folder *folder)
+{
+	folder_local_folder_destroy(LOCAL_FOLDER(folder));
+}
+
+static void maildir_folder_init(Folder *folder, const gchar *name,
+				const gchar *path)
+{
+	folder_local_folder_init(folder, name, path);
+}
+
+/* Folder paths */
+
+static gchar *maildir_get_root_path(Folder *folder)
+{
+	const gchar *rootpath = LOCAL_FOLDER(folder)->rootpath;
+
+	if (is_relative_filename(rootpath))
+		return g_strconcat(get_home_dir(), G_DIR_SEPARATOR_S,
+				   rootpath, NULL);
+
+	return g_strdup(rootpath);
+}
+
+/* Directory of the folder sub/folder: .sub.folder, or the mailbox
+ * directory itself for the inbox */
+static gchar *maildir_get_path(Folder *folder, const gchar *item_path)
+{
+	gchar *rootpath, *dir, *real_dir, *path;
+
+	rootpath = maildir_get_root_path(folder);
+	if (item_path == NULL || !strcmp(item_path, INBOX_DIR))
+		return rootpath;
+
+	dir = g_strconcat(".", item_path, NULL);
+	subst_char(dir, G_DIR_SEPARATOR, '.');
+	real_dir = maildir_filename_from_utf8(dir);
+	path = g_strconcat(rootpath, G_DIR_SEPARATOR_S, real_dir, NULL);
+	g_free(real_dir);
+	g_free(dir);
+	g_free(rootpath);
+
+	return path;
+}
+
+static gchar *maildir_item_get_path(Folder *folder, FolderItem *item)
+{
+	cm_return_val_if_fail(folder != NULL, NULL);
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	return maildir_get_path(folder, item->path);
+}
+
+static gint maildir_create_dirs(const gchar *path)
+{
+	const gchar *subdirs[] = { "cur", "new", "tmp" };
+	gchar *subdir;
+	gint i;
+
+	if (!is_dir_exist(path) && make_dir_hier(path) < 0)
+		return -1;
+
+	for (i = 0; i < G_N_ELEMENTS(subdirs); i++) {
+		subdir = g_strconcat(path, G_DIR_SEPARATOR_S, subdirs[i], NULL);
+		if (!is_dir_exist(subdir) && make_dir(subdir) < 0) {
+			g_free(subdir);
+			return -1;
+		}
+		g_free(subdir);
+	}
+
+	return 0;
+}
+
+/* Messages */
+
+static void maildir_msg_free(MaildirMsg *msg)
+{
+	g_free(msg->uniq);
+	g_free(msg->file);
+	g_free(msg);
+}
+
+static MaildirMsg *maildir_msg_add(MaildirFolderItem *item, gint num,
+				   const gchar *uniq, const gchar *file)
+{
+	MaildirMsg *msg;
+
+	/* a damaged uids file may give a number twice; replacing the
+	 * entry would free a message still in the uniqs table */
+	if (g_hash_table_lookup(item->msgs, GINT_TO_POINTER(num)) != NULL) {
+		g_warning("maildir: message number %d used twice, "
+			  "renumbering %s\n", num, uniq);
+		num = item->next_num;
+	}
+
+	msg = g_new0(MaildirMsg, 1);
+	msg->num = num;
+	msg->uniq = g_strdup(uniq);
+	msg->file = g_strdup(file);
+	g_hash_table_insert(item->msgs, GINT_TO_POINTER(num), msg);
+	g_hash_table_insert(item->uniqs, msg->uniq, msg);
+	if (item->next_num <= num)
+		item->next_num = num + 1;
+	item->uids_dirty = TRUE;
+
+	return msg;
+}
+
+static void maildir_msg_remove(MaildirFolderItem *item, MaildirMsg *msg)
+{
+	g_hash_table_remove(item->uniqs, msg->uniq);
+	g_hash_table_remove(item->msgs, GINT_TO_POINTER(msg->num));
+	item->uids_dirty = TRUE;
+}
+
+static gchar *maildir_msg_get_path(FolderItem *item, MaildirMsg *msg)
+{
+	gchar *path, *file;
+
+	path = folder_item_get_path(item);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, msg->file, NULL);
+	g_free(path);
+
+	return file;
+}
+
+static MsgPermFlags maildir_msg_get_flags(MaildirMsg *msg)
+{
+	MsgPermFlags flags = MSG_UNREAD;
+	const gchar *info;
+
+	if (!strncmp(msg->file, "new" G_DIR_SEPARATOR_S, 4))
+		return MSG_NEW | MSG_UNREAD;
+
+	if ((info = strstr(msg->file, ":2,")) == NULL)
+		return MSG_UNREAD;
+
+	for (info += 3; *info != '\0'; info++) {
+		switch (*info) {
+		case 'F': flags |= MSG_MARKED; break;
+		case 'P': flags |= MSG_FORWARDED; break;
+		case 'R': flags |= MSG_REPLIED; break;
+		case 'S': flags &= ~MSG_UNREAD; break;
+		case 'T': flags |= MSG_DELETED; break;
+		}
+	}
+
+	return flags;
+}
+
+/* Name of a message with these flags, keeping the info letters of
+ * old_file that have no flag here (draft, keywords of other clients) */
+static gchar *maildir_msg_get_file_name(const gchar *uniq, MsgPermFlags flags,
+					const gchar *old_file)
+{
+	gchar info[64];
+	const gchar *old_info = NULL, *p;
+	gint len = 0;
+	gchar c;
+
+	if ((flags & MAILDIR_FLAGS) == (MSG_NEW | MSG_UNREAD) &&
+	    (old_file == NULL || strstr(old_file, ":2,") == NULL))
+		return g_strconcat("new", G_DIR_SEPARATOR_S, uniq, NULL);
+
+	if (old_file != NULL && (old_info = strstr(old_file, ":2,")) != NULL)
+		old_info += 3;
+
+	/* info letters are kept in ASCII order */
+	for (c = 'A'; c <= 'z' && len < sizeof(info) - 1; c++) {
+		gboolean set;
+
+		switch (c) {
+		case 'F': set = (flags & MSG_MARKED) != 0; break;
+		case 'P': set = (flags & MSG_FORWARDED) != 0; break;
+		case 'R': set = (flags & MSG_REPLIED) != 0; break;
+		case 'S': set = (flags & MSG_UNREAD) == 0; break;
+		case 'T': set = (flags & MSG_DELETED) != 0; break;
+		default:
+			set = FALSE;
+			for (p = old_info; p != NULL && *p != '\0'; p++)
+				if (*p == c)
+					set = TRUE;
+			break;
+		}
+		if (set)
+			info[len++] = c;
+	}
+	info[len] = '\0';
+
+	return g_strconcat("cur", G_DIR_SEPARATOR_S, uniq, ":2,", info, NULL);
+}
+
+/* A unique name as described in maildir(5) */
+static gchar *maildir_get_new_uniq(void)
+{
+	static guint count = 0;
+	GTimeVal now;
+	gchar *host, *uniq;
+
+	host = g_strdup(get_domain_name());
+	subst_char(host, '/', '_');
+	subst_char(host, ':', '_');
+	g_get_current_time(&now);
+	uniq = g_strdup_printf("%ld.M%ldP%dQ%u.%s", (long)now.tv_sec,
+			       (long)now.tv_usec, (gint)getpid(), ++count, host);
+	g_free(host);
+
+	return uniq;
+}
+
+/* Numbers of the unique names */
+
+static void maildir_read_uids(MaildirFolderItem *item)
+{
+	gchar buf[BUFFSIZE];
+	gchar *path, *file, *p;
+	gint version, next_num, num;
+	FILE *fp;
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, MAILDIR_UIDS_FILE, NULL);
+	g_free(path);
+
+	if ((fp = g_fopen(file, "rb")) == NULL) {
+		g_free(file);
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), fp) == NULL ||
+	    sscanf(buf, "claws-maildir-uids %d %d", &version, &next_num) != 2 ||
+	    version != MAILDIR_UIDS_VERSION) {
+		g_warning("%s: unknown format, messages will be renumbered\n",
+			  file);
+		fclose(fp);
+		g_free(file);
+		return;
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		strretchomp(buf);
+		num = strtol(buf, &p, 10);
+		if (num <= 0 || *p != ' ' || *(p + 1) == '\0')
+			continue;
+		if (g_hash_table_lookup(item->uniqs, p + 1) == NULL)
+			maildir_msg_add(item, num, p + 1, NULL);
+	}
+	fclose(fp);
+	g_free(file);
+
+	if (item->next_num < next_num)
+		item->next_num = next_num;
+	item->uids_dirty = FALSE;
+}
+
+typedef struct _MaildirWriteData {
+	FILE *fp;
+	gboolean error;
+} MaildirWriteData;
+
+static void maildir_write_uids_func(gpointer key, gpointer value,
+				    gpointer data)
+{
+	MaildirMsg *msg = (MaildirMsg *)value;
+	MaildirWriteData *wdata = (MaildirWriteData *)data;
+
+	if (!wdata->error &&
+	    fprintf(wdata->fp, "%d %s\n", msg->num, msg->uniq) < 0)
+		wdata->error = TRUE;
+}
+
+static void maildir_write_uids(MaildirFolderItem *item)
+{
+	MaildirWriteData wdata;
+	gchar *path, *file, *tmp;
+
+	if (!item->uids_dirty || item->msgs == NULL)
+		return;
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, MAILDIR_UIDS_FILE, NULL);
+	tmp = g_strconcat(file, ".tmp", NULL);
+	g_free(path);
+
+	if ((wdata.fp = g_fopen(tmp, "wb")) == NULL) {
+		FILE_OP_ERROR(tmp, "fopen");
+		goto out;
+	}
+	wdata.error = fprintf(wdata.fp, "claws-maildir-uids %d %d\n",
+			      MAILDIR_UIDS_VERSION, item->next_num) < 0;
+	g_hash_table_foreach(item->msgs, maildir_write_uids_func, &wdata);
+	if (fclose(wdata.fp) == EOF)
+		wdata.error = TRUE;
+
+	if (wdata.error) {
+		FILE_OP_ERROR(tmp, "fwrite");
+		claws_unlink(tmp);
+	} else if (rename_force(tmp, file) < 0) {
+		FILE_OP_ERROR(tmp, "rename");
+	} else {
+		item->uids_dirty = FALSE;
+	}
+out:
+	g_free(tmp);
+	g_free(file);
+}
+
+static void maildir_load_uids(MaildirFolderItem *item)
+{
+	if (item->msgs != NULL)
+		return;
+
+	item->msgs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					   NULL,
+					   (GDestroyNotify)maildir_msg_free);
+	item->uniqs = g_hash_table_new(g_str_hash, g_str_equal);
+	item->next_num = 1;
+	maildir_read_uids(item);
+}
+
+static void maildir_unmark_found_func(gpointer key, gpointer value,
+				      gpointer data)
+{
+	((MaildirMsg *)value)->found = FALSE;
+}
+
+static gboolean maildir_remove_missing_func(gpointer key, gpointer value,
+					    gpointer data)
+{
+	MaildirMsg *msg = (MaildirMsg *)value;
+	MaildirFolderItem *item = (MaildirFolderItem *)data;
+
+	if (msg->found)
+		return FALSE;
+
+	g_hash_table_remove(item->uniqs, msg->uniq);
+	item->uids_dirty = TRUE;
+	return TRUE;
+}
+
+/* Of two files of the same message, left by a move or a flag change
+ * cut short, the one kept: cur/ over new/, then the first name, so that
+ * the order readdir() gives them in does not matter */
+static gboolean maildir_file_preferred(const gchar *file, const gchar *other)
+{
+	gboolean cur = g_str_has_prefix(file, "cur" G_DIR_SEPARATOR_S);
+	gboolean other_cur = g_str_has_prefix(other, "cur" G_DIR_SEPARATOR_S);
+
+	if (cur != other_cur)
+		return cur;
+
+	return strcmp(file, other) < 0;
+}
+
+/* Reads the new and cur directories, numbering the messages not seen
+ * before and forgetting those that are gone */
+static gint maildir_update(MaildirFolderItem *item)
+{
+	const gchar *subdirs[] = { "new", "cur" };
+	gchar *path, *dir, *file, *uniq, *tmp;
+	const gchar *name;
+	MaildirMsg *msg;
+	DIR *dp;
+	struct dirent *d;
+	gint i, found = 0;
+
+	maildir_load_uids(item);
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	cm_return_val_if_fail(path != NULL, -1);
+
+	g_hash_table_foreach(item->msgs, maildir_unmark_found_func, NULL);
+
+	for (i = 0; i < G_N_ELEMENTS(subdirs); i++) {
+		dir = g_strconcat(path, G_DIR_SEPARATOR_S, subdirs[i], NULL);
+		if ((dp = opendir(dir)) == NULL) {
+			FILE_OP_ERROR(dir, "opendir");
+			g_free(dir);
+			g_free(path);
+			return -1;
+		}
+		g_free(dir);
+
+		while ((d = readdir(dp)) != NULL) {
+			name = d->d_name;
+			if (name[0] == '.')
+				continue;
+
+			uniq = g_strndup(name, strcspn(name, ":"));
+			file = g_strconcat(subdirs[i], G_DIR_SEPARATOR_S,
+					   name, NULL);
+			if ((msg = g_hash_table_lookup(item->uniqs, uniq)) == NULL) {
+				msg = maildir_msg_add(item, item->next_num,
+						      uniq, NULL);
+			}
+			if (msg->found) {
+				if (maildir_file_preferred(file, msg->file)) {
+					tmp = msg->file;
+					msg->file = file;
+					file = tmp;
+				}
+				g_warning("maildir: %s in %s is the same message "
+					  "as %s, ignoring it\n", file, path,
+					  msg->file);
+				g_free(file);
+				g_free(uniq);
+				continue;
+			}
+			g_free(msg->file);
+			msg->file = file;
+			msg->found = TRUE;
+			found++;
+			g_free(uniq);
+		}
+		closedir(dp);
+	}
+	g_free(path);
+
+	g_hash_table_foreach_remove(item->msgs, maildir_remove_missing_func,
+				    item);
+	maildir_write_uids(item);
+
+	debug_print("maildir_update(): %d messages in %s\n", found,
+		    FOLDER_ITEM(item)->path ? FOLDER_ITEM(item)->path : "(null)");
+
+	return found;
+}
+
+/* Finds a message, reading the folder again if its file has moved */
+static MaildirMsg *maildir_get_msg(MaildirFolderItem *item, gint num)
+{
+	MaildirMsg *msg;
+	gchar *file;
+
+	maildir_load_uids(item);
+
+	msg = g_hash_table_lookup(item->msgs, GINT_TO_POINTER(num));
+	if (msg != NULL && msg->file != NULL) {
+		file = maildir_msg_get_path(FOLDER_ITEM(item), msg);
+		if (is_file_exist(file)) {
+			g_free(file);
+			return msg;
+		}
+		g_free(file);
+	}
+
+	if (maildir_update(item) < 0)
+		return NULL;
+
+	msg = g_hash_table_lookup(item->msgs, GINT_TO_POINTER(num));
+	return msg != NULL && msg->file != NULL ? msg : NULL;
+}
+
+/* Renames src to dest, failing rather than replacing an existing dest */
+static gint maildir_rename_new(const gchar *src, const gchar *dest)
+{
+#ifdef G_OS_UNIX
+	if (link(src, dest) < 0)
+		return -1;
+	if (claws_unlink(src) < 0) {
+		FILE_OP_ERROR(src, "unlink");
+		claws_unlink(dest);
+		return -1;
+	}
+	return 0;
+#else
+	if (is_file_entry_exist(dest)) {
+		errno = EEXIST;
+		return -1;
+	}
+	return g_rename(src, dest);
+#endif
+}
+
+/* Delivers src to dest, through tmp so that other readers never see a
+ * partial message, unless it can be moved there directly. Returns the
+ * number of the new message. */
+static gint maildir_deliver(MaildirFolderItem *dest, const gchar *src,
+			    const gchar *uniq, MsgPermFlags flags,
+			    gboolean move, gboolean *moved)
+{
+	FolderItemPrefs *prefs = FOLDER_ITEM(dest)->prefs;
+	gchar *path, *file, *destfile, *tmpfile, *new_uniq = NULL;
+	MaildirMsg *msg;
+
+	if (moved)
+		*moved = FALSE;
+
+	maildir_load_uids(dest);
+	if (uniq == NULL || g_hash_table_lookup(dest->uniqs, uniq) != NULL)
+		uniq = new_uniq = maildir_get_new_uniq();
+
+	path = folder_item_get_path(FOLDER_ITEM(dest));
+	file = maildir_msg_get_file_name(uniq, flags, NULL);
+	destfile = g_strconcat(path, G_DIR_SEPARATOR_S, file, NULL);
+
+	/* another client may have delivered it since the last update */
+	if (new_uniq == NULL && is_file_entry_exist(destfile)) {
+		g_free(destfile);
+		g_free(file);
+		uniq = new_uniq = maildir_get_new_uniq();
+		file = maildir_msg_get_file_name(uniq, flags, NULL);
+		destfile = g_strconcat(path, G_DIR_SEPARATOR_S, file, NULL);
+	}
+
+	if (move && maildir_rename_new(src, destfile) == 0) {
+		if (moved)
+			*moved = TRUE;
+	} else {
+		tmpfile = g_strconcat(path, G_DIR_SEPARATOR_S, "tmp",
+				      G_DIR_SEPARATOR_S, uniq, NULL);
+#ifdef G_OS_UNIX
+		if (link(src, tmpfile) < 0) {
+#endif
+			if (copy_file(src, tmpfile, FALSE) < 0) {
+				g_warning(_("can't copy message %s to %s\n"),
+					  src, tmpfile);
+				g_free(tmpfile);
+				goto err;
+			}
+#ifdef G_OS_UNIX
+		}
+#endif
+		if (maildir_rename_new(tmpfile, destfile) < 0) {
+			FILE_OP_ERROR(tmpfile, "rename");
+			claws_unlink(tmpfile);
+			g_free(tmpfile);
+			goto err;
+		}
+		g_free(tmpfile);
+	}
+
+	if (prefs && prefs->enable_folder_chmod && prefs->folder_chmod) {
+		if (chmod(destfile, prefs->folder_chmod) < 0)
+			FILE_OP_ERROR(destfile, "chmod");
+	}
+
+	msg = maildir_msg_add(dest, dest->next_num, uniq, file);
+
+	g_free(destfile);
+	g_free(file);
+	g_free(path);
+	g_free(new_uniq);
+	return msg->num;
+
+err:
+	g_free(destfile);
+	g_free(file);
+	g_free(path);
+	g_free(new_uniq);
+	return -1;
+}
+
+/* FolderItem functions */
+
+static FolderItem *maildir_item_new(Folder *folder)
+{
+	MaildirFolderItem *item;
+
+	item = g_new0(MaildirFolderItem, 1);
+	item->next_num = 1;
+
+	return (FolderItem *)item;
+}
+
+static void maildir_item_destroy(Folder *folder, FolderItem *_item)
+{
+	MaildirFolderItem *item = MAILDIR_ITEM(_item);
+
+	cm_return_if_fail(item != NULL);
+
+	if (item->msgs != NULL) {
+		g_hash_table_destroy(item->uniqs);
+		g_hash_table_destroy(item->msgs);
+	}
+	g_free(_item);
+}
+
+static gint maildir_item_close(Folder *folder, FolderItem *item)
+{
+	maildir_write_uids(MAILDIR_ITEM(item));
+	return 0;
+}
+
+static void maildir_get_num_list_func(gpointer key, gpointer value,
+				      gpointer data)
+{
+	GSList **list = (GSList **)data;
+
+	*list = g_slist_prepend(*list, key);
+}
+
+static gint maildir_get_num_list(Folder *folder, FolderItem *item,
+				 GSList **list, gboolean *old_uids_valid)
+{
+	gint nummsgs;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	*old_uids_valid = TRUE;
+
+	if ((nummsgs = maildir_update(MAILDIR_ITEM(item))) < 0)
+		return -1;
+
+	g_hash_table_foreach(MAILDIR_ITEM(item)->msgs,
+			     maildir_get_num_list_func, list);
+	maildir_set_mtime(folder, item);
+
+	return nummsgs;
+}
+
+/* New messages change new, flags and moves change cur */
+static time_t maildir_get_mtime(FolderItem *item)
+{
+	const gchar *subdirs[] = { "new", "cur" };
+	gchar *path, *dir;
+	struct stat s;
+	time_t mtime = 0;
+	gint i;
+
+	path = folder_item_get_path(item);
+	cm_return_val_if_fail(path != NULL, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(subdirs); i++) {
+		dir = g_strconcat(path, G_DIR_SEPARATOR_S, subdirs[i], NULL);
+		if (g_stat(dir, &s) < 0) {
+			FILE_OP_ERROR(dir, "stat");
+		} else if (s.st_mtime > mtime)
+			mtime = s.st_mtime;
+		g_free(dir);
+	}
+	g_free(path);
+
+	return mtime;
+}
+
+static gboolean maildir_scan_required(Folder *folder, FolderItem *item)
+{
+	time_t mtime;
+
+	mtime = maildir_get_mtime(item);
+	if (mtime > item->mtime && mtime - 3600 != item->mtime) {
+		debug_print("Maildir scan required, folder updated: %s (%ld > %ld)\n",
+			    item->path ? item->path : "(null)",
+			    (long int) mtime, (long int) item->mtime);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void maildir_set_mtime(Folder *folder, FolderItem *item)
+{
+	item->mtime = maildir_get_mtime(item);
+}
+
+/* Message functions */
+
+static MsgInfo *maildir_get_msginfo(Folder *folder, FolderItem *item, gint num)
+{
+	MaildirMsg *msg;
+	MsgInfo *msginfo;
+	MsgFlags flags;
+	gchar *file;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	if ((msg = maildir_get_msg(MAILDIR_ITEM(item), num)) == NULL)
+		return NULL;
+
+	flags.perm_flags = maildir_msg_get_flags(msg);
+	flags.tmp_flags = 0;
+	if (folder_has_parent_of_type(item, F_QUEUE)) {
+		MSG_SET_TMP_FLAGS(flags, MSG_QUEUED);
+	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
+		MSG_SET_TMP_FLAGS(flags, MSG_DRAFT);
+	}
+
+	file = maildir_msg_get_path(item, msg);
+	msginfo = procheader_parse_file(file, flags, FALSE, FALSE);
+	g_free(file);
+	if (msginfo == NULL)
+		return NULL;
+
+	/* read messages have no flag, that the parser takes as new */
+	msginfo->flags.perm_flags = flags.perm_flags;
+	msginfo->msgnum = num;
+	msginfo->folder = item;
+
+	return msginfo;
+}
+
+static gchar *maildir_fetch_msg(Folder *folder, FolderItem *item, gint num)
+{
+	MaildirMsg *msg;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+	cm_return_val_if_fail(num > 0, NULL);
+
+	if ((msg = maildir_get_msg(MAILDIR_ITEM(item), num)) == NULL)
+		return NULL;
+
+	return maildir_msg_get_path(item, msg);
+}
+
+static gint maildir_add_msg(Folder *folder, FolderItem *dest,
+			    const gchar *file, MsgFlags *flags)
+{
+	GSList file_list;
+	MsgFileInfo fileinfo;
+
+	cm_return_val_if_fail(file != NULL, -1);
+
+	fileinfo.msginfo = NULL;
+	fileinfo.file = (gchar *)file;
+	fileinfo.flags = flags;
+	file_list.data = &fileinfo;
+	file_list.next = NULL;
+
+	return maildir_add_msgs(folder, dest, &file_list, NULL);
+}
+
+/* Makes a newly delivered message durable, see folder_sync_file() */
+static void maildir_sync_msg(MaildirFolderItem *item, gint num)
+{
+	MaildirMsg *msg;
+	gchar *file;
+
+	msg = g_hash_table_lookup(item->msgs, GINT_TO_POINTER(num));
+	if (msg == NULL || msg->file == NULL)
+		return;
+
+	file = maildir_msg_get_path(FOLDER_ITEM(item), msg);
+	folder_sync_file(file);
+	g_free(file);
+}
+
+static gint maildir_add_msgs(Folder *folder, FolderItem *dest,
+			     GSList *file_list, GHashTable *relation)
+{
+	MsgFileInfo *fileinfo;
+	MsgPermFlags flags;
+	GSList *cur;
+	gint num = -1;
+
+	cm_return_val_if_fail(dest != NULL, -1);
+	cm_return_val_if_fail(file_list != NULL, -1);
+
+	for (cur = file_list; cur != NULL; cur = cur->next) {
+		fileinfo = (MsgFileInfo *)cur->data;
+
+		flags = fileinfo->flags ? fileinfo->flags->perm_flags
+					: MSG_NEW | MSG_UNREAD;
+		num = maildir_deliver(MAILDIR_ITEM(dest), fileinfo->file,
+				      NULL, flags, FALSE, NULL);
+		if (num < 0)
+			break;
+		maildir_sync_msg(MAILDIR_ITEM(dest), num);
+
+		if (relation != NULL)
+			g_hash_table_insert(relation, fileinfo,
+					    GINT_TO_POINTER(num));
+	}
+	maildir_write_uids(MAILDIR_ITEM(dest));
+
+	return num;
+}
+
+static gint maildir_copy_msg(Folder *folder, FolderItem *dest, MsgInfo *msginfo)
+{
+	GSList msglist;
+
+	cm_return_val_if_fail(msginfo != NULL, -1);
+
+	msglist.data = msginfo;
+	msglist.next = NULL;
+
+	return maildir_copy_msgs(folder, dest, &msglist, NULL);
+}
+
+static gint maildir_copy_msgs(Folder *folder, FolderItem *dest,
+			      MsgInfoList *msglist, GHashTable *relation)
+{
+	MaildirFolderItem *src = NULL;
+	MaildirMsg *srcmsg = NULL;
+	MsgInfo *msginfo;
+	MsgInfoList *cur;
+	gchar *srcfile;
+	gboolean moved;
+	gint num = -1;
+
+	cm_return_val_if_fail(dest != NULL, -1);
+	cm_return_val_if_fail(msglist != NULL, -1);
+
+	msginfo = (MsgInfo *)msglist->data;
+	cm_return_val_if_fail(msginfo != NULL, -1);
+
+	if (msginfo->folder == dest) {
+		g_warning("the src folder is identical to the dest.\n");
+		return -1;
+	}
+
+	if (FOLDER_TYPE(msginfo->folder->folder) == F_MAILDIR)
+		src = MAILDIR_ITEM(msginfo->folder);
+
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		if (msginfo == NULL)
+			break;
+
+		if (src != NULL) {
+			if ((srcmsg = maildir_get_msg(src, msginfo->msgnum)) == NULL)
+				break;
+			srcfile = maildir_msg_get_path(msginfo->folder, srcmsg);
+		} else {
+			srcfile = procmsg_get_message_file(msginfo);
+		}
+		if (srcfile == NULL)
+			break;
+
+		debug_print("Copying message %s%c%d to %s ...\n",
+			    msginfo->folder->path, G_DIR_SEPARATOR,
+			    msginfo->msgnum, dest->path);
+
+		/* moves between maildirs are renames, keeping the name */
+		msginfo->flags.tmp_flags &= ~MSG_MOVE_DONE;
+		num = maildir_deliver(MAILDIR_ITEM(dest), srcfile,
+				      srcmsg ? srcmsg->uniq : NULL,
+				      msginfo->flags.perm_flags,
+				      MSG_IS_MOVE(msginfo->flags), &moved);
+		g_free(srcfile);
+		if (num < 0)
+			break;
+
+		if (moved) {
+			/* say unlinking's not necessary */
+			msginfo->flags.tmp_flags |= MSG_MOVE_DONE;
+			if (src != NULL)
+				maildir_msg_remove(src, srcmsg);
+		} else
+			maildir_sync_msg(MAILDIR_ITEM(dest), num);
+		srcmsg = NULL;
+
+		if (relation != NULL) {
+			if (g_hash_table_lookup(relation, msginfo) != NULL)
+				g_warning("already in : %p", msginfo);
+			g_hash_table_insert(relation, msginfo,
+					    GINT_TO_POINTER(num));
+		}
+	}
+
+	maildir_write_uids(MAILDIR_ITEM(dest));
+	if (src != NULL)
+		maildir_write_uids(src);
+
+	return cur == NULL ? num : -1;
+}
+
+static gint maildir_remove_msg(Folder *folder, FolderItem *item, gint num)
+{
+	MaildirMsg *msg;
+	gchar *file;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	msg = maildir_get_msg(MAILDIR_ITEM(item), num);
+	cm_return_val_if_fail(msg != NULL, -1);
+
+	file = maildir_msg_get_path(item, msg);
+	if (claws_unlink(file) < 0) {
+		FILE_OP_ERROR(file, "unlink");
+		g_free(file);
+		return -1;
+	}
+	g_free(file);
+
+	maildir_msg_remove(MAILDIR_ITEM(item), msg);
+	maildir_write_uids(MAILDIR_ITEM(item));
+
+	return 0;
+}
+
+static gint maildir_remove_msgs(Folder *folder, FolderItem *item,
+				MsgInfoList *msglist, GHashTable *relation)
+{
+	MaildirMsg *msg;
+	MsgInfoList *cur;
+	MsgInfo *msginfo;
+	gchar *file;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		if (msginfo == NULL)
+			continue;
+		if (MSG_IS_MOVE(msginfo->flags) && MSG_IS_MOVE_DONE(msginfo->flags)) {
+			msginfo->flags.tmp_flags &= ~MSG_MOVE_DONE;
+			continue;
+		}
+
+		msg = maildir_get_msg(MAILDIR_ITEM(item), msginfo->msgnum);
+		if (msg == NULL)
+			continue;
+
+		file = maildir_msg_get_path(item, msg);
+		if (claws_unlink(file) < 0) {
+			FILE_OP_ERROR(file, "unlink");
+		} else
+			maildir_msg_remove(MAILDIR_ITEM(item), msg);
+		g_free(file);
+	}
+	maildir_write_uids(MAILDIR_ITEM(item));
+
+	return 0;
+}
+
+static gboolean maildir_remove_all_func(gpointer key, gpointer value,
+					gpointer data)
+{
+	MaildirMsg *msg = (MaildirMsg *)value;
+	MaildirFolderItem *item = (MaildirFolderItem *)data;
+	gchar *file;
+
+	if (msg->file == NULL)
+		return TRUE;
+
+	file = maildir_msg_get_path(FOLDER_ITEM(item), msg);
+	if (claws_unlink(file) < 0 && errno != ENOENT) {
+		FILE_OP_ERROR(file, "unlink");
+		g_free(file);
+		return FALSE;
+	}
+	g_free(file);
+
+	g_hash_table_remove(item->uniqs, msg->uniq);
+	return TRUE;
+}
+
+static gint maildir_remove_all_msg(Folder *folder, FolderItem *item)
+{
+	MaildirFolderItem *mitem = MAILDIR_ITEM(item);
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	if (maildir_update(mitem) < 0)
+		return -1;
+
+	g_hash_table_foreach_remove(mitem->msgs, maildir_remove_all_func, mitem);
+	mitem->uids_dirty = TRUE;
+	maildir_write_uids(mitem);
+
+	return g_hash_table_size(mitem->msgs) == 0 ? 0 : -1;
+}
+
+static gboolean maildir_is_msg_changed(Folder *folder, FolderItem *item,
+				       MsgInfo *msginfo)
+{
+	MaildirMsg *msg;
+	struct stat s;
+	gchar *file;
+	gint ret;
+
+	if ((msg = maildir_get_msg(MAILDIR_ITEM(item), msginfo->msgnum)) == NULL)
+		return TRUE;
+
+	file = maildir_msg_get_path(item, msg);
+	ret = g_stat(file, &s);
+	g_free(file);
+
+	if (ret < 0 || msginfo->size != s.st_size || (
+		(msginfo->mtime - s.st_mtime != 0) &&
+		(msginfo->mtime - s.st_mtime != 3600) &&
+		(msginfo->mtime - s.st_mtime != -3600)))
+		return TRUE;
+
+	return FALSE;
+}
+
+static void maildir_change_flags(Folder *folder, FolderItem *item,
+				 MsgInfo *msginfo, MsgPermFlags newflags)
+{
+	MaildirMsg *msg;
+	gchar *path, *file, *oldfile, *newfile;
+	gboolean need_scan;
+	time_t last_mtime;
+
+	msg = maildir_get_msg(MAILDIR_ITEM(item), msginfo->msgnum);
+	if (msg != NULL) {
+		file = maildir_msg_get_file_name(msg->uniq, newflags, msg->file);
+		if (strcmp(file, msg->file) != 0) {
+			need_scan = maildir_scan_required(folder, item);
+			last_mtime = item->mtime;
+
+			path = folder_item_get_path(item);
+			oldfile = g_strconcat(path, G_DIR_SEPARATOR_S,
+					      msg->file, NULL);
+			newfile = g_strconcat(path, G_DIR_SEPARATOR_S,
+					      file, NULL);
+			if (g_rename(oldfile, newfile) < 0) {
+				FILE_OP_ERROR(oldfile, "rename");
+			} else {
+				g_free(msg->file);
+				msg->file = file;
+				file = NULL;
+			}
+			g_free(newfile);
+			g_free(oldfile);
+			g_free(path);
+
+			if (item->mtime == last_mtime && !need_scan)
+				maildir_set_mtime(folder, item);
+		}
+		g_free(file);
+	}
+
+	msginfo->flags.perm_flags = newflags;
+}
+
+static gint maildir_get_flags(Folder *folder, FolderItem *item,
+			      MsgInfoList *msglist, GHashTable *msgflags)
+{
+	MaildirFolderItem *mitem = MAILDIR_ITEM(item);
+	MaildirMsg *msg;
+	MsgInfoList *cur;
+	MsgInfo *msginfo;
+	MsgPermFlags flags;
+
+	maildir_load_uids(mitem);
+
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		msg = g_hash_table_lookup(mitem->msgs,
+					  GINT_TO_POINTER(msginfo->msgnum));
+		if (msg == NULL || msg->file == NULL)
+			continue;
+
+		flags = maildir_msg_get_flags(msg);
+		/* unread messages moved to cur stay new until read */
+		if ((flags & MSG_UNREAD) && MSG_IS_NEW(msginfo->flags))
+			flags |= MSG_NEW;
+		flags |= msginfo->flags.perm_flags & ~MAILDIR_FLAGS;
+
+		g_hash_table_insert(msgflags, msginfo, GINT_TO_POINTER(flags));
+	}
+
+	return 0;
+}
+
+/* Folder tree */
+
+#define MAKE_DIR_IF_NOT_EXIST(dir) \
+{ \
+	if (maildir_create_dirs(dir) < 0) { \
+		g_warning("can't create maildir %s\n", dir); \
+		g_free(dir); \
+		return -1; \
+	} \
+	g_free(dir); \
+}
+
+static gint maildir_create_tree(Folder *folder)
+{
+	gchar *path;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+
+	path = maildir_get_path(folder, INBOX_DIR);
+	MAKE_DIR_IF_NOT_EXIST(path);
+	path = maildir_get_path(folder, OUTBOX_DIR);
+	MAKE_DIR_IF_NOT_EXIST(path);
+	path = maildir_get_path(folder, QUEUE_DIR);
+	MAKE_DIR_IF_NOT_EXIST(path);
+	path = maildir_get_path(folder, DRAFT_DIR);
+	MAKE_DIR_IF_NOT_EXIST(path);
+	path = maildir_get_path(folder, TRASH_DIR);
+	MAKE_DIR_IF_NOT_EXIST(path);
+
+	return 0;
+}
+
+#undef MAKE_DIR_IF_NOT_EXIST
+
+static gboolean maildir_item_exists(FolderItem *item)
+{
+	gchar *path, *cur;
+	gboolean ret;
+
+	path = folder_item_get_path(item);
+	cur = g_strconcat(path, G_DIR_SEPARATOR_S, "cur", NULL);
+	ret = is_dir_exist(cur);
+	g_free(cur);
+	g_free(path);
+
+	return ret;
+}
+
+static gboolean maildir_remove_missing_folder_items_func(GNode *node,
+							 gpointer data)
+{
+	FolderItem *item;
+
+	cm_return_val_if_fail(node->data != NULL, FALSE);
+
+	if (G_NODE_IS_ROOT(node))
+		return FALSE;
+
+	item = FOLDER_ITEM(node->data);
+	if (maildir_item_exists(item)) {
+		item->no_select = FALSE;
+	} else if (G_NODE_IS_LEAF(node)) {
+		debug_print("folder '%s' not found. removing...\n", item->path);
+		folder_item_remove(item);
+	} else {
+		/* .a.b may exist without .a */
+		item->no_select = TRUE;
+	}
+
+	return FALSE;
+}
+
+static FolderItem *maildir_get_child(FolderItem *parent, const gchar *name,
+				     const gchar *path)
+{
+	Folder *folder = parent->folder;
+	FolderItem *item;
+	GNode *node;
+
+	for (node = parent->node->children; node != NULL; node = node->next) {
+		item = FOLDER_ITEM(node->data);
+		if (!strcmp2(item->path, path))
+			return item;
+	}
+
+	debug_print("new folder '%s' found.\n", path);
+	item = folder_item_new(folder, name, path);
+	folder_item_append(parent, item);
+	item->no_select = !maildir_item_exists(item);
+	if (folder->ui_func)
+		folder->ui_func(folder, item, folder->ui_func_data);
+
+	if (folder_item_parent(parent) == NULL) {
+		if (!folder->inbox && !strcmp(path, INBOX_DIR)) {
+			item->stype = F_INBOX;
+			folder->inbox = item;
+		} else if (!folder->outbox && !strcmp(path, OUTBOX_DIR)) {
+			item->stype = F_OUTBOX;
+			folder->outbox = item;
+		} else if (!folder->draft && !strcmp(path, DRAFT_DIR)) {
+			item->stype = F_DRAFT;
+			folder->draft = item;
+		} else if (!folder->queue && !strcmp(path, QUEUE_DIR)) {
+			item->stype = F_QUEUE;
+			folder->queue = item;
+		} else if (!folder->trash && !strcmp(path, TRASH_DIR)) {
+			item->stype = F_TRASH;
+			folder->trash = item;
+		}
+	}
+
+	return item;
+}
+
+/* Adds the items of a .sub.folder directory and of its parents */
+static void maildir_add_folder_items(FolderItem *root, const gchar *dir_name)
+{
+	FolderItem *item = root;
+	gchar *utf8name, *path = NULL, *tmp;
+	gchar **names;
+	gint i;
+
+	utf8name = maildir_filename_to_utf8(dir_name + 1);
+	names = g_strsplit(utf8name, ".", -1);
+	for (i = 0; names[i] != NULL; i++) {
+		if (names[i][0] == '\0')
+			break;
+		tmp = path ? g_strconcat(path, G_DIR_SEPARATOR_S, names[i], NULL)
+			   : g_strdup(names[i]);
+		g_free(path);
+		path = tmp;
+		item = maildir_get_child(item, names[i], path);
+	}
+	g_free(path);
+	g_strfreev(names);
+	g_free(utf8name);
+}
+
+static gint maildir_scan_tree(Folder *folder)
+{
+	FolderItem *item;
+	gchar *rootpath, *cur;
+	const gchar *dir_name;
+	DIR *dp;
+	struct dirent *d;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+
+	if (!folder->node) {
+		item = folder_item_new(folder, folder->name, NULL);
+		item->folder = folder;
+		item->no_select = TRUE;
+		folder->node = item->node = g_node_new(item);
+	} else
+		item = FOLDER_ITEM(folder->node->data);
+
+	if (maildir_create_tree(folder) < 0)
+		return -1;
+
+	debug_print("searching missing folders...\n");
+	g_node_traverse(folder->node, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+			maildir_remove_missing_folder_items_func, folder);
+
+	/* the mailbox directory itself */
+	maildir_get_child(item, INBOX_DIR, INBOX_DIR);
+
+	rootpath = maildir_get_root_path(folder);
+	if ((dp = opendir(rootpath)) == NULL) {
+		FILE_OP_ERROR(rootpath, "opendir");
+		g_free(rootpath);
+		return -1;
+	}
+
+	debug_print("scanning %s ...\n", rootpath);
+	while ((d = readdir(dp)) != NULL) {
+		dir_name = d->d_name;
+		if (dir_name[0] != '.' || dir_name[1] == '\0' ||
+		    dir_name[1] == '.')
+			continue;
+
+		cur = g_strconcat(rootpath, G_DIR_SEPARATOR_S, dir_name,
+				  G_DIR_SEPARATOR_S, "cur", NULL);
+		if (is_dir_exist(cur))
+			maildir_add_folder_items(item, dir_name);
+		g_free(cur);
+	}
+	closedir(dp);
+	g_free(rootpath);
+
+	return 0;
+}
+
+static FolderItem *maildir_create_folder(Folder *folder, FolderItem *parent,
+					 const gchar *name)
+{
+	FolderItem *new_item;
+	gchar *path, *fullpath;
+
+	cm_return_val_if_fail(folder != NULL, NULL);
+	cm_return_val_if_fail(parent != NULL, NULL);
+	cm_return_val_if_fail(name != NULL, NULL);
+
+	/* the separator of Maildir++ folder names */
+	if (strchr(name, '.') != NULL) {
+		g_warning("'.' can't be included in maildir folder names\n");
+		return NULL;
+	}
+
+	if (parent->path)
+		path = g_strconcat(parent->path, G_DIR_SEPARATOR_S, name,
+				   NULL);
+	else
+		path = g_strdup(name);
+
+	fullpath = maildir_get_path(folder, path);
+	if (maildir_create_dirs(fullpath) < 0) {
+		g_free(fullpath);
+		g_free(path);
+		return NULL;
+	}
+	g_free(fullpath);
+
+	new_item = folder_item_new(folder, name, path);
+	folder_item_append(parent, new_item);
+	g_free(path);
+
+	return new_item;
+}
+
+static gboolean maildir_collect_items_func(GNode *node, gpointer data)
+{
+	GSList **items = (GSList **)data;
+
+	*items = g_slist_prepend(*items, node->data);
+
+	return FALSE;
+}
+
+/* Items of the subtree of item: each has its own directory */
+static GSList *maildir_get_subtree(FolderItem *item)
+{
+	GSList *items = NULL;
+
+	g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			maildir_collect_items_func, &items);
+
+	return g_slist_reverse(items);
+}
+
+static gint maildir_rename_folder(Folder *folder, FolderItem *item,
+				  const gchar *name)
+{
+	GSList *items, *cur;
+	FolderItem *sub;
+	gchar *dirname, *newpath, *sub_newpath;
+	gchar *olddir, *newdir;
+	gint oldpathlen;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+	cm_return_val_if_fail(item != NULL, -1);
+	cm_return_val_if_fail(item->path != NULL, -1);
+	cm_return_val_if_fail(name != NULL, -1);
+
+	if (strchr(name, '.') != NULL)
+		return -1;
+
+	if (strchr(item->path, G_DIR_SEPARATOR) != NULL) {
+		dirname = g_path_get_dirname(item->path);
+		newpath = g_strconcat(dirname, G_DIR_SEPARATOR_S, name, NULL);
+		g_free(dirname);
+	} else
+		newpath = g_strdup(name);
+
+	oldpathlen = strlen(item->path);
+	items = maildir_get_subtree(item);
+
+	for (cur = items; cur != NULL; cur = cur->next) {
+		sub = FOLDER_ITEM(cur->data);
+		sub_newpath = g_strconcat(newpath, sub->path + oldpathlen, NULL);
+		olddir = maildir_get_path(folder, sub->path);
+		newdir = maildir_get_path(folder, sub_newpath);
+		if (is_dir_exist(olddir) && g_rename(olddir, newdir) < 0) {
+			FILE_OP_ERROR(olddir, "rename");
+			g_free(olddir);
+			g_free(newdir);
+			g_free(sub_newpath);
+			g_free(newpath);
+			g_slist_free(items);
+			return -1;
+		}
+		g_free(olddir);
+		g_free(newdir);
+
+		g_free(sub->path);
+		sub->path = sub_newpath;
+	}
+	g_slist_free(items);
+
+	g_free(item->name);
+	item->name = g_strdup(name);
+	g_free(newpath);
+
+	return 0;
+}
+
+static gint maildir_remove_folder(Folder *folder, FolderItem *item)
+{
+	GSList *items, *cur;
+	gchar *path;
+	gint ret = 0;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+	cm_return_val_if_fail(item != NULL, -1);
+	cm_return_val_if_fail(item->path != NULL, -1);
+
+	items = maildir_get_subtree(item);
+	for (cur = items; cur != NULL; cur = cur->next) {
+		path = folder_item_get_path(FOLDER_ITEM(cur->data));
+		if (is_dir_exist(path) && remove_dir_recursive(path) < 0) {
+			g_warning("can't remove directory `%s'\n", path);
+			ret = -1;
+		}
+		g_free(path);
+	}
+	g_slist_free(items);
+
+	if (ret < 0)
+		return ret;
+
+	folder_item_remove(item);
+	return 0;
+}
+
+static gchar *maildir_filename_from_utf8(const gchar *path)
+{
+	gchar *real_path = g_filename_from_utf8(path, -1, NULL, NULL, NULL);
+
+	if (!real_path) {
+		g_warning("maildir_filename_from_utf8: failed to convert character set\n");
+		real_path = g_strdup(path);
+	}
+
+	return real_path;
+}
+
+static gchar *maildir_filename_to_utf8(const gchar *path)
+{
+	gchar *utf8path = g_filename_to_utf8(path, -1, NULL, NULL, NULL);
+
+	if (!utf8path) {
+		g_warning("maildir_filename_to_utf8: failed to convert character set\n");
+		utf8path = g_strdup(path);
+	}
+
+	return utf8path;
+}
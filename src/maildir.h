@@ -0,0 +1,40 @@
+/*
+ * Sylpheed -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 1999-2009 Hiroyuki Yamamoto and the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __MAILDIR_H__
+#define __MAILDIR_H__
+
+#include <glib.h>
+
+#include "folder.h"
+#include "localfolder.h"
+
+typedef struct _MaildirFolder	MaildirFolder;
+
+#define MAILDIR_FOLDER(obj)	((MaildirFolder *)obj)
+
+struct _MaildirFolder
+{
+	LocalFolder lfolder;
+};
+
+FolderClass *maildir_get_class	(void);
+gboolean maildir_is_maildir	(const gchar	*path);
+
+#endif /* __MAILDIR_H__ */
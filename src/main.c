@@ -93,6 +93,7 @@
 #include "addressbook.h"
 #include "compose.h"
 #include "folder.h"
+#include "mh.h"
 #include "setup.h"
 #include "utils.h"
 #include "gtkutils.h"
@@ -1462,6 +1463,13 @@ int main(int argc, char *argv[])
 
 	/* make one all-folder processing before using claws */
 	main_window_cursor_wait(mainwin);
+	/* read the caches of local folders in parallel rather than one
+	 * at a time as folders get processed and scanned; the interface
+	 * is kept alive meanwhile, but locked */
+	claws_register_idle_function(claws_gtk_idle);
+	main_window_lock(mainwin);
+	folder_preload_caches();
+	main_window_unlock(mainwin);
 	folder_func_to_all_folders(initial_processing, (gpointer *)mainwin);
 
 	/* if claws crashed, rebuild caches */
@@ -1498,8 +1506,6 @@ int main(int argc, char *argv[])
 		cmd.status_full_folders = NULL;
 	}
 
-	claws_register_idle_function(claws_gtk_idle);
-
 	prefs_toolbar_init();
 
 	num_folder_class = g_list_length(folder_get_list());
@@ -1691,6 +1697,8 @@ int main(int argc, char *argv[])
 
 static void save_all_caches(FolderItem *item, gpointer data)
 {
+	GSList **items = (GSList **)data;
+
 	if (!item->cache) {
 		return;
 	}
@@ -1699,13 +1707,14 @@ static void save_all_caches(FolderItem *item, gpointer data)
 		folder_item_close(item);
 	}
 
-	folder_item_free_cache(item, TRUE);
+	*items = g_slist_prepend(*items, item);
 }
 
 static void exit_claws(MainWindow *mainwin)
 {
 	gchar *filename;
 	gboolean have_connectivity;
+	GSList *items = NULL, *cur;
 
 	sc_exiting = TRUE;
 
@@ -1727,7 +1736,12 @@ static void exit_claws(MainWindow *mainwin)
 	}
 
 	/* save all state before exiting */
-	folder_func_to_all_folders(save_all_caches, NULL);
+	folder_func_to_all_folders(save_all_caches, &items);
+	folder_write_caches(items, TRUE);
+	mh_write_pending_sequences();
+	for (cur = items; cur != NULL; cur = cur->next)
+		folder_item_free_cache((FolderItem *)cur->data, TRUE);
+	g_slist_free(items);
 	folder_write_list();
 
 	main_window_get_size(mainwin);
@@ -79,6 +79,8 @@
 #include "tags.h"
 #include "textview.h"
 #include "imap.h"
+#include "maildir.h"
+#include "mboxfolder.h"
 #include "socket.h"
 #include "printing.h"
 #ifdef G_OS_WIN32
@@ -3010,7 +3012,9 @@ static void main_window_add_mailbox(MainWindow *mainwin)
 		g_free(path);
 		return;
 	}
-	folder = folder_new(folder_get_class_from_string("mh"), 
+	folder = folder_new(folder_get_class_from_string(
+				maildir_is_maildir(path) ? "maildir" :
+				mbox_folder_is_mbox_dir(path) ? "mbox" : "mh"),
 			    !strcmp(path, "Mail") ? _("Mailbox") : 
 			    g_path_get_basename(path), path);
 	g_free(path);
@@ -64,73 +64,267 @@
 #define SC_FPUTC fputc
 #endif
 
-#define FPUTS_TO_TMP_ABORT_IF_FAIL(s) \
+/* Messages added to the destination folder at once */
+#define MBOX_IMPORT_BATCH	500
+#define MBOX_READ_SIZE		(1024 * 1024)
+
+/* Reads an mbox line by line, in large blocks */
+struct _MboxReader {
+	gint	 fd;
+	gchar	*buf;
+	gsize	 size;
+	gsize	 start;		/* first byte not returned yet */
+	gsize	 end;		/* end of the data read */
+	goffset	 pos;		/* offset of buf in the file */
+	goffset	 limit;		/* offset to stop reading at, or -1 */
+	gboolean eof;
+	gboolean error;
+};
+
+static gssize mbox_pread(gint fd, gchar *buf, gsize count, goffset offset)
+{
+#ifdef G_OS_UNIX
+	return pread(fd, buf, count, offset);
+#else
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return read(fd, buf, count);
+#endif
+}
+
+/**
+ * Reads the lines of fd from offset up to limit, or to the end of the
+ * file if limit is -1, without moving its file offset.
+ */
+MboxReader *mbox_reader_new(gint fd, goffset offset, goffset limit)
+{
+	MboxReader *reader;
+
+	reader = g_new0(MboxReader, 1);
+	reader->fd = fd;
+	reader->pos = offset;
+	reader->limit = limit;
+	reader->size = MBOX_READ_SIZE;
+	/* small ranges are read at once */
+	if (limit >= 0 && limit - offset < MBOX_READ_SIZE)
+		reader->size = MAX(limit - offset, 256);
+	reader->buf = g_malloc(reader->size);
+
+	return reader;
+}
+
+void mbox_reader_free(MboxReader *reader)
+{
+	if (reader == NULL)
+		return;
+	g_free(reader->buf);
+	g_free(reader);
+}
+
+/**
+ * Returns the next line, with its newline, valid until the next call,
+ * or NULL at the end. Its offset in the file is stored in offset.
+ */
+const gchar *mbox_reader_get_line(MboxReader *reader, gsize *len,
+				  goffset *offset)
+{
+	const gchar *nl;
+	gssize n_read;
+	gsize count;
+
+	for (;;) {
+		nl = memchr(reader->buf + reader->start, '\n',
+			    reader->end - reader->start);
+		if (nl != NULL || reader->eof)
+			break;
+
+		/* keep the incomplete line, and make room after it */
+		if (reader->start > 0) {
+			memmove(reader->buf, reader->buf + reader->start,
+				reader->end - reader->start);
+			reader->end -= reader->start;
+			reader->pos += reader->start;
+			reader->start = 0;
+		}
+		if (reader->end == reader->size) {
+			reader->size *= 2;
+			reader->buf = g_realloc(reader->buf, reader->size);
+		}
+		count = reader->size - reader->end;
+		if (reader->limit >= 0 &&
+		    reader->limit - (reader->pos + reader->end) < count)
+			count = reader->limit - (reader->pos + reader->end);
+		if (count == 0) {
+			reader->eof = TRUE;
+			break;
+		}
+		n_read = mbox_pread(reader->fd, reader->buf + reader->end,
+				    count, reader->pos + reader->end);
+		if (n_read < 0 && errno == EINTR)
+			continue;
+		if (n_read <= 0) {
+			reader->eof = TRUE;
+			reader->error = n_read < 0;
+		} else
+			reader->end += n_read;
+	}
+
+	if (nl != NULL)
+		*len = nl + 1 - (reader->buf + reader->start);
+	else if ((*len = reader->end - reader->start) == 0)
+		return NULL;
+
+	if (offset != NULL)
+		*offset = reader->pos + reader->start;
+	nl = reader->buf + reader->start;
+	reader->start += *len;
+
+	return nl;
+}
+
+gboolean mbox_reader_at_eof(MboxReader *reader)
+{
+	return reader->eof && reader->start == reader->end;
+}
+
+gboolean mbox_reader_get_error(MboxReader *reader)
+{
+	return reader->error;
+}
+
+/* Where the messages are written before being added to dest, so that
+ * adding them needs no copy: the tmp directory of a Maildir, which
+ * readers leave alone, or the directory of other local folders, where
+ * a dot name is not taken as a message */
+static gchar *mbox_get_import_dir(FolderItem *dest)
+{
+	gchar *path, *dir;
+
+	if (FOLDER_IS_LOCAL(dest->folder) &&
+	    (path = folder_item_get_path(dest)) != NULL) {
+		if (FOLDER_TYPE(dest->folder) == F_MAILDIR) {
+			dir = g_strconcat(path, G_DIR_SEPARATOR_S, "tmp", NULL);
+			g_free(path);
+			path = dir;
+		}
+		if (is_dir_exist(path))
+			return path;
+		g_free(path);
+	}
+
+	return g_strdup(get_tmp_dir());
+}
+
+/* Adds the messages written so far; with to_filter, their MsgInfos are
+ * prepended to it */
+static gint mbox_import_add_msgs(FolderItem *dest, GSList **to_add,
+				 GSList **to_filter)
+{
+	GHashTable *nums = NULL;
+	MsgFileInfo *finfo;
+	MsgInfo *msginfo;
+	GSList *cur;
+	gint ret, num;
+
+	if (*to_add == NULL)
+		return 0;
+
+	*to_add = g_slist_reverse(*to_add);
+	if (to_filter != NULL)
+		nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	ret = folder_item_add_msgs_full(dest, *to_add, TRUE, nums);
+
+	if (to_filter != NULL) {
+		for (cur = *to_add; ret >= 0 && cur != NULL; cur = cur->next) {
+			num = GPOINTER_TO_INT(g_hash_table_lookup(nums,
+								  cur->data));
+			if (num > 0 &&
+			    (msginfo = folder_item_get_msginfo(dest, num)) != NULL)
+				*to_filter = g_slist_prepend(*to_filter, msginfo);
+		}
+		g_hash_table_destroy(nums);
+	}
+
+	/* the files which were not added are left */
+	for (cur = *to_add; ret < 0 && cur != NULL; cur = cur->next) {
+		finfo = (MsgFileInfo *)cur->data;
+		if (is_file_exist(finfo->file))
+			claws_unlink(finfo->file);
+	}
+	procmsg_message_file_list_free(*to_add);
+	*to_add = NULL;
+
+	return ret;
+}
+
+#define MBOX_WRITE(s, len) \
 { \
 	lines++; \
-	if (fputs(s, tmp_fp) == EOF) { \
-		g_warning("can't write to temporary file\n"); \
-		fclose(tmp_fp); \
-		fclose(mbox_fp); \
-		claws_unlink(tmp_file); \
-		g_free(tmp_file); \
-		return -1; \
-	} \
+	if (fwrite(s, 1, len, tmp_fp) < (len)) \
+		goto write_err; \
 }
 
+/* Splits mbox into messages, in one pass over it. Quoted From lines are
+ * unquoted, and the blank line which ends each message is dropped. */
 gint proc_mbox(FolderItem *dest, const gchar *mbox, gboolean apply_filter,
 	       PrefsAccount *account)
 /* return values: -1 error, >=0 number of msgs added */
 {
-	FILE *mbox_fp;
-	gchar buf[MSGBUFSIZE];
-	gchar *tmp_file;
+	MboxReader *reader;
+	const gchar *line;
+	gsize len;
+	gchar *import_dir, *tmp_file = NULL;
+	FILE *tmp_fp = NULL;
 	gint msgs = 0;
 	gint lines;
-	MsgInfo *msginfo;
-	gboolean more;
+	gint ret = -1;
 	GSList *to_filter = NULL, *filtered = NULL, *unfiltered = NULL, *cur, *to_add = NULL;
 	gboolean printed = FALSE;
 	FolderItem *dropfolder;
+	GTimeVal start, now;
+	glong msecs;
+	gint fd;
 
 	cm_return_val_if_fail(dest != NULL, -1);
 	cm_return_val_if_fail(mbox != NULL, -1);
 
 	debug_print("Getting messages from %s into %s...\n", mbox, dest->path);
 
-	if ((mbox_fp = g_fopen(mbox, "rb")) == NULL) {
-		FILE_OP_ERROR(mbox, "fopen");
+	if ((fd = g_open(mbox, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(mbox, "open");
 		alertpanel_error(_("Could not open mbox file:\n%s\n"), mbox);
 		return -1;
 	}
+	reader = mbox_reader_new(fd, 0, -1);
 
 	/* ignore empty lines on the head */
 	do {
-		if (fgets(buf, sizeof(buf), mbox_fp) == NULL) {
+		if ((line = mbox_reader_get_line(reader, &len, NULL)) == NULL) {
 			g_warning("can't read mbox file.\n");
-			fclose(mbox_fp);
-			return -1;
+			goto out;
 		}
-	} while (buf[0] == '\n' || buf[0] == '\r');
+	} while (line[0] == '\n' || line[0] == '\r');
 
-	if (strncmp(buf, "From ", 5) != 0) {
+	if (len < 5 || strncmp(line, "From ", 5) != 0) {
 		g_warning("invalid mbox format: %s\n", mbox);
-		fclose(mbox_fp);
-		return -1;
+		goto out;
 	}
 
-	tmp_file = get_tmp_file();
-
+	g_get_current_time(&start);
 	folder_item_update_freeze();
+	/* the imported messages are synced together at the end */
+	folder_sync_batch_begin();
 
 	if (apply_filter)
 		dropfolder = folder_get_default_processing();
 	else
 		dropfolder = dest;
+	import_dir = mbox_get_import_dir(dropfolder);
 	
 	do {
-		FILE *tmp_fp;
 		gint empty_lines;
-		gint msgnum;
+		gint offset;
 		
 		if (msgs > 0 && msgs%500 == 0) {
 			if (printed)
@@ -140,12 +334,12 @@ gint proc_mbox(FolderItem *dest, const gchar *mbox, gboolean apply_filter,
 			GTK_EVENTS_FLUSH();
 		}
 	
+		tmp_file = g_strdup_printf("%s%c.mbox-import.%d.%d", import_dir,
+					   G_DIR_SEPARATOR, (gint)getpid(), msgs);
 		if ((tmp_fp = g_fopen(tmp_file, "wb")) == NULL) {
 			FILE_OP_ERROR(tmp_file, "fopen");
 			g_warning("can't open temporary file\n");
-			fclose(mbox_fp);
-			g_free(tmp_file);
-			return -1;
+			goto err;
 		}
 		if (change_file_mode_rw(tmp_fp, tmp_file) < 0) {
 			FILE_OP_ERROR(tmp_file, "chmod");
@@ -153,119 +347,86 @@ gint proc_mbox(FolderItem *dest, const gchar *mbox, gboolean apply_filter,
 
 		empty_lines = 0;
 		lines = 0;
-		more = FALSE;
-
-		/* process all lines from mboxrc file */
-		while (fgets(buf, sizeof(buf), mbox_fp) != NULL) {
-			int offset;
-
-			/* eof not reached, expect more lines */
-			more = TRUE;
 
+		while ((line = mbox_reader_get_line(reader, &len, NULL)) != NULL) {
 			/* eat empty lines */
-			if (buf[0] == '\n' || buf[0] == '\r') {
+			if (line[0] == '\n' || line[0] == '\r') {
 				empty_lines++;
 				continue;
 			}
 
 			/* From separator or quoted From */
-			offset = 0;
-			/* detect leading '>' char(s) */
-			while ((buf[offset] == '>')) {
-				offset++;
-			}
-			if (!strncmp(buf+offset, "From ", 5)) {
-				/* From separator: */
-				if (offset == 0) {
-					/* expect next mbox item */
+			for (offset = 0; offset < len && line[offset] == '>'; offset++)
+				;
+			if (len - offset >= 5 && !strncmp(line + offset, "From ", 5)) {
+				/* From separator: expect next mbox item */
+				if (offset == 0)
 					break;
-				}
-
-				/* quoted From: */
-				/* flush any eaten empty line */
-				if (empty_lines > 0) {
-					while (empty_lines-- > 0) {
-						FPUTS_TO_TMP_ABORT_IF_FAIL("\n");
-				}
-					empty_lines = 0;
-				}
-				/* store the unquoted line */
-				FPUTS_TO_TMP_ABORT_IF_FAIL(buf + 1);
-				continue;
+				/* quoted From: store it unquoted */
+				line++;
+				len--;
 			}
 
-			/* other line */
 			/* flush any eaten empty line */
-			if (empty_lines > 0) {			
-				while (empty_lines-- > 0) {
-					FPUTS_TO_TMP_ABORT_IF_FAIL("\n");
-			}
-				empty_lines = 0;
-			}
-			/* store the line itself */
-					FPUTS_TO_TMP_ABORT_IF_FAIL(buf);
+			for (; empty_lines > 0; empty_lines--)
+				MBOX_WRITE("\n", 1);
+			MBOX_WRITE(line, len);
 		}
 		/* end of mbox item or end of mbox */
 
 		/* flush any eaten empty line (but the last one) */
-		if (empty_lines > 0) {
-			while (--empty_lines > 0) {
-				FPUTS_TO_TMP_ABORT_IF_FAIL("\n");
-			}
-		}
+		while (--empty_lines > 0)
+			MBOX_WRITE("\n", 1);
 
-		/* more emails to expect? */
-		more = !feof(mbox_fp);
+		if (mbox_reader_get_error(reader)) {
+			FILE_OP_ERROR(mbox, "read");
+			goto err;
+		}
 
 		/* warn if email part is empty (it's the minimum check 
 		   we can do */
 		if (lines == 0) {
 			g_warning("malformed mbox: %s: message %d is empty\n", mbox, msgs);
-			fclose(tmp_fp);
-			fclose(mbox_fp);
-			claws_unlink(tmp_file);
-			return -1;
+			goto err;
 		}
 
 		if (fclose(tmp_fp) == EOF) {
+			tmp_fp = NULL;
 			FILE_OP_ERROR(tmp_file, "fclose");
-			g_warning("can't write to temporary file\n");
-			fclose(mbox_fp);
-			claws_unlink(tmp_file);
-			g_free(tmp_file);
-			return -1;
+			goto write_err;
 		}
+		tmp_fp = NULL;
 
-		if (apply_filter) {
-			if ((msgnum = folder_item_add_msg(dropfolder, tmp_file, NULL, TRUE)) < 0) {
-				fclose(mbox_fp);
-				claws_unlink(tmp_file);
-				g_free(tmp_file);
-				return -1;
-			}
-			msginfo = folder_item_get_msginfo(dropfolder, msgnum);
-			to_filter = g_slist_prepend(to_filter, msginfo);
-		} else {
+		{
 			MsgFileInfo *finfo = g_new0(MsgFileInfo, 1);
 			finfo->file = tmp_file;
-			
 			to_add = g_slist_prepend(to_add, finfo);
-			tmp_file = get_tmp_file();
-			
-			/* flush every 500 */
-			if (msgs > 0 && msgs % 500 == 0) {
-				folder_item_add_msgs(dropfolder, to_add, TRUE);
-				procmsg_message_file_list_free(to_add);
-				to_add = NULL;
-			}
+			tmp_file = NULL;
 		}
 		msgs++;
-	} while (more);
+
+		if (msgs % MBOX_IMPORT_BATCH == 0 &&
+		    mbox_import_add_msgs(dropfolder, &to_add,
+				apply_filter ? &to_filter : NULL) < 0)
+			goto err;
+	} while (!mbox_reader_at_eof(reader));
+
+	if (mbox_import_add_msgs(dropfolder, &to_add,
+			apply_filter ? &to_filter : NULL) < 0)
+		goto err;
 
 	if (printed)
 		statusbar_pop_all();
 
+	g_get_current_time(&now);
+	msecs = (now.tv_sec - start.tv_sec) * 1000 +
+		(now.tv_usec - start.tv_usec) / 1000;
+	debug_print("Imported %d messages from %s in %ld.%03lds (%ld messages/s)\n",
+		    msgs, mbox, msecs / 1000, msecs % 1000,
+		    msecs > 0 ? (glong)msgs * 1000 / msecs : (glong)msgs);
+
 	if (apply_filter) {
+		to_filter = g_slist_reverse(to_filter);
 
 		folder_item_set_batch(dropfolder, FALSE);
 		procmsg_msglist_filter(to_filter, account, 
@@ -290,21 +451,41 @@ gint proc_mbox(FolderItem *dest, const gchar *mbox, gboolean apply_filter,
 		g_slist_free(unfiltered);
 		g_slist_free(filtered);
 		g_slist_free(to_filter);
-	} else if (to_add) {
-		folder_item_add_msgs(dropfolder, to_add, TRUE);
-		procmsg_message_file_list_free(to_add);
-		to_add = NULL;
 	}
 
+	ret = msgs;
+	debug_print("%d messages found.\n", msgs);
+	goto done;
+
+write_err:
+	g_warning("can't write to temporary file\n");
+err:
+	if (printed)
+		statusbar_pop_all();
+	if (tmp_fp != NULL)
+		fclose(tmp_fp);
+	if (tmp_file != NULL)
+		claws_unlink(tmp_file);
+	for (cur = to_add; cur != NULL; cur = cur->next)
+		claws_unlink(((MsgFileInfo *)cur->data)->file);
+	procmsg_message_file_list_free(to_add);
+	for (cur = to_filter; cur != NULL; cur = cur->next)
+		procmsg_msginfo_free((MsgInfo *)cur->data);
+	g_slist_free(to_filter);
+done:
+	folder_sync_batch_end();
 	folder_item_update_thaw();
-	
+	g_free(import_dir);
 	g_free(tmp_file);
-	fclose(mbox_fp);
-	debug_print("%d messages found.\n", msgs);
+out:
+	mbox_reader_free(reader);
+	close(fd);
 
-	return msgs;
+	return ret;
 }
 
+#undef MBOX_WRITE
+
 gint lock_mbox(const gchar *base, LockType type)
 {
 #ifdef G_OS_UNIX
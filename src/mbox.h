@@ -29,6 +29,8 @@ typedef enum {
 	LOCK_FLOCK
 } LockType;
 
+typedef struct _MboxReader	MboxReader;
+
 
 gint proc_mbox		(FolderItem	*dest,
 			 const gchar	*mbox,
@@ -48,4 +50,14 @@ gint export_to_mbox	(FolderItem	*src,
 gint export_list_to_mbox(GSList 	*mlist, 
 			 const gchar 	*mbox);
 
+MboxReader *mbox_reader_new		(gint		 fd,
+					 goffset	 offset,
+					 goffset	 limit);
+void mbox_reader_free			(MboxReader	*reader);
+const gchar *mbox_reader_get_line	(MboxReader	*reader,
+					 gsize		*len,
+					 goffset	*offset);
+gboolean mbox_reader_at_eof		(MboxReader	*reader);
+gboolean mbox_reader_get_error		(MboxReader	*reader);
+
 #endif /* __MBOX_H__ */
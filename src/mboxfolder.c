@@ -0,0 +1,1793 @@
+/*
+ * Sylpheed -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 1999-2009 Hiroyuki Yamamoto and the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "defs.h"
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "folder.h"
+#include "mboxfolder.h"
+#include "mbox.h"
+#include "procmsg.h"
+#include "procheader.h"
+#include "utils.h"
+
+/* The mailbox directory holds one mbox file per folder; its
+ * subdirectories are folders holding more of them.
+ *
+ * The mbox files are read in place. Where each message starts, and the
+ * lengths of its header and body, are kept in MBOX_INDEX_FILE next to
+ * the cache, with the size and the mtime of the mbox they describe.
+ * When the mbox only grew, only the new part of it is read. Messages
+ * are copied into the cache directory when they are opened.
+ *
+ * Messages are appended to, and removed from, the mbox under the lock
+ * of lock_mbox(). Flags are kept in the cache only. */
+
+#define MBOX_INDEX_FILE		".claws_mbox_index"
+#define MBOX_INDEX_VERSION	1
+
+typedef struct _MboxFolderItem	MboxFolderItem;
+typedef struct _MboxMsg		MboxMsg;
+
+#define MBOX_ITEM(obj)	((MboxFolderItem *)obj)
+
+struct _MboxMsg
+{
+	gint	num;
+	goffset	offset;		/* of its From_ line */
+	goffset	header_len;	/* From_ line and header, blank line included */
+	goffset	body_len;	/* without the blank line ending it */
+};
+
+struct _MboxFolderItem
+{
+	FolderItem item;
+
+	GArray *msgs;		/* MboxMsgs, by offset and number */
+	gint next_num;
+	goffset index_size;	/* size of the mbox when indexed */
+	time_t index_mtime;
+	gboolean index_valid;
+	gboolean index_dirty;
+	gboolean renumbered;	/* not told to get_num_list() yet */
+};
+
+static void	mbox_folder_init		(Folder		*folder,
+						 const gchar	*name,
+						 const gchar	*path);
+
+static Folder	*mbox_folder_new		(const gchar	*name,
+						 const gchar	*path);
+static void     mbox_folder_destroy		(Folder		*folder);
+static gint     mbox_folder_scan_tree		(Folder		*folder);
+static gint     mbox_folder_create_tree		(Folder		*folder);
+
+static FolderItem *mbox_folder_item_new		(Folder		*folder);
+static void	mbox_folder_item_destroy	(Folder		*folder,
+						 FolderItem	*item);
+static gchar   *mbox_folder_item_get_path	(Folder		*folder,
+						 FolderItem	*item);
+static FolderItem *mbox_folder_create_folder	(Folder		*folder,
+						 FolderItem	*parent,
+						 const gchar	*name);
+static gint     mbox_folder_rename_folder	(Folder		*folder,
+						 FolderItem	*item,
+						 const gchar	*name);
+static gint     mbox_folder_remove_folder	(Folder		*folder,
+						 FolderItem	*item);
+static gint	mbox_folder_item_close		(Folder		*folder,
+						 FolderItem	*item);
+static gint	mbox_folder_get_num_list	(Folder		*folder,
+						 FolderItem	*item,
+						 GSList		**list,
+						 gboolean	*old_uids_valid);
+static gboolean	mbox_folder_scan_required	(Folder		*folder,
+						 FolderItem	*item);
+static void	mbox_folder_set_mtime		(Folder		*folder,
+						 FolderItem	*item);
+
+static MsgInfo *mbox_folder_get_msginfo		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gchar   *mbox_folder_fetch_msg		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gint     mbox_folder_add_msg		(Folder		*folder,
+						 FolderItem	*dest,
+						 const gchar	*file,
+						 MsgFlags	*flags);
+static gint     mbox_folder_add_msgs		(Folder		*folder,
+						 FolderItem	*dest,
+						 GSList		*file_list,
+						 GHashTable	*relation);
+static gint     mbox_folder_copy_msg		(Folder		*folder,
+						 FolderItem	*dest,
+						 MsgInfo	*msginfo);
+static gint     mbox_folder_copy_msgs		(Folder		*folder,
+						 FolderItem	*dest,
+						 MsgInfoList	*msglist,
+						 GHashTable	*relation);
+static gint     mbox_folder_remove_msg		(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+static gint     mbox_folder_remove_msgs		(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfoList	*msglist,
+						 GHashTable	*relation);
+static gint     mbox_folder_remove_all_msg	(Folder		*folder,
+						 FolderItem	*item);
+static gboolean mbox_folder_is_msg_changed	(Folder		*folder,
+						 FolderItem	*item,
+						 MsgInfo	*msginfo);
+
+static gchar	*mbox_folder_filename_from_utf8	(const gchar	*path);
+static gchar	*mbox_folder_filename_to_utf8	(const gchar	*path);
+
+static FolderClass mbox_folder_class;
+
+FolderClass *mbox_folder_get_class(void)
+{
+	if (mbox_folder_class.idstr == NULL) {
+		mbox_folder_class.type = F_MBOX;
+		mbox_folder_class.idstr = "mbox";
+		mbox_folder_class.uistr = "mbox";
+
+		/* Folder functions */
+		mbox_folder_class.new_folder = mbox_folder_new;
+		mbox_folder_class.destroy_folder = mbox_folder_destroy;
+		mbox_folder_class.set_xml = folder_local_set_xml;
+		mbox_folder_class.get_xml = folder_local_get_xml;
+		mbox_folder_class.scan_tree = mbox_folder_scan_tree;
+		mbox_folder_class.create_tree = mbox_folder_create_tree;
+
+		/* FolderItem functions */
+		mbox_folder_class.item_new = mbox_folder_item_new;
+		mbox_folder_class.item_destroy = mbox_folder_item_destroy;
+		mbox_folder_class.item_get_path = mbox_folder_item_get_path;
+		mbox_folder_class.create_folder = mbox_folder_create_folder;
+		mbox_folder_class.rename_folder = mbox_folder_rename_folder;
+		mbox_folder_class.remove_folder = mbox_folder_remove_folder;
+		mbox_folder_class.close = mbox_folder_item_close;
+		mbox_folder_class.get_num_list = mbox_folder_get_num_list;
+		mbox_folder_class.scan_required = mbox_folder_scan_required;
+		mbox_folder_class.set_mtime = mbox_folder_set_mtime;
+
+		/* Message functions */
+		mbox_folder_class.get_msginfo = mbox_folder_get_msginfo;
+		mbox_folder_class.fetch_msg = mbox_folder_fetch_msg;
+		mbox_folder_class.add_msg = mbox_folder_add_msg;
+		mbox_folder_class.add_msgs = mbox_folder_add_msgs;
+		mbox_folder_class.copy_msg = mbox_folder_copy_msg;
+		mbox_folder_class.copy_msgs = mbox_folder_copy_msgs;
+		mbox_folder_class.remove_msg = mbox_folder_remove_msg;
+		mbox_folder_class.remove_msgs = mbox_folder_remove_msgs;
+		mbox_folder_class.remove_all_msg = mbox_folder_remove_all_msg;
+		mbox_folder_class.is_msg_changed = mbox_folder_is_msg_changed;
+	}
+
+	return &mbox_folder_class;
+}
+
+static gboolean mbox_folder_is_mbox_file(const gchar *file)
+{
+	gchar buf[5];
+	FILE *fp;
+	gboolean ret;
+
+	if ((fp = g_fopen(file, "rb")) == NULL)
+		return FALSE;
+	ret = fread(buf, 1, sizeof(buf), fp) == sizeof(buf) &&
+	      !strncmp(buf, "From ", sizeof(buf));
+	fclose(fp);
+
+	return ret;
+}
+
+/**
+ * Tells whether path, absolute or relative to the home directory, is a
+ * directory of mbox files: it holds at least one, and no MH message.
+ */
+gboolean mbox_folder_is_mbox_dir(const gchar *path)
+{
+	gchar *dir, *file;
+	const gchar *name;
+	gboolean found = FALSE;
+	DIR *dp;
+	struct dirent *d;
+
+	cm_return_val_if_fail(path != NULL, FALSE);
+
+	if (is_relative_filename(path))
+		dir = g_strconcat(get_home_dir(), G_DIR_SEPARATOR_S, path, NULL);
+	else
+		dir = g_strdup(path);
+
+	if ((dp = opendir(dir)) == NULL) {
+		g_free(dir);
+		return FALSE;
+	}
+
+	while ((d = readdir(dp)) != NULL) {
+		name = d->d_name;
+		if (name[0] == '.')
+			continue;
+		if (to_number(name) > 0) {
+			found = FALSE;
+			break;
+		}
+		if (found)
+			continue;
+
+		file = g_strconcat(dir, G_DIR_SEPARATOR_S, name, NULL);
+		found = mbox_folder_is_mbox_file(file);
+		g_free(file);
+	}
+	closedir(dp);
+	g_free(dir);
+
+	return found;
+}
+
+static Folder *mbox_folder_new(const gchar *name, const gchar *path)
+{
+	Folder *folder;
+
+	folder = (Folder *)g_new0(MboxFolder, 1);
+	folder->klass = &mbox_folder_class;
+	mbox_folder_init(folder, name, path);
+
+	return folder;
+}
+
+static void mbox_folder_destroy(Folder *folder)
+{
+	folder_local_folder_destroy(LOCAL_FOLDER(folder));
+}
+
+static void mbox_folder_init(Folder *folder, const gchar *name,
+			     const gchar *path)
+{
+	folder_local_folder_init(folder, name, path);
+}
+
+/* Folder paths */
+
+static gchar *mbox_folder_get_root_path(Folder *folder)
+{
+	const gchar *rootpath = LOCAL_FOLDER(folder)->rootpath;
+
+	if (is_relative_filename(rootpath))
+		return g_strconcat(get_home_dir(), G_DIR_SEPARATOR_S,
+				   rootpath, NULL);
+
+	return g_strdup(rootpath);
+}
+
+/* The mbox file, or the directory, of the folder item_path */
+static gchar *mbox_folder_get_file(Folder *folder, const gchar *item_path)
+{
+	gchar *rootpath, *real_path, *file;
+
+	rootpath = mbox_folder_get_root_path(folder);
+	if (item_path == NULL)
+		return rootpath;
+
+	real_path = mbox_folder_filename_from_utf8(item_path);
+	file = g_strconcat(rootpath, G_DIR_SEPARATOR_S, real_path, NULL);
+	g_free(real_path);
+	g_free(rootpath);
+
+	return file;
+}
+
+static gchar *mbox_folder_item_get_file(FolderItem *item)
+{
+	return mbox_folder_get_file(item->folder, item->path);
+}
+
+/* The directory of the cache, the index and the opened messages */
+static gchar *mbox_folder_get_cache_path(Folder *folder,
+					 const gchar *item_path)
+{
+	gchar *folder_path, *real_path, *path;
+
+	folder_path = g_strconcat(get_mbox_cache_dir(), G_DIR_SEPARATOR_S,
+				  folder->name, NULL);
+	if (item_path == NULL)
+		return folder_path;
+
+	real_path = mbox_folder_filename_from_utf8(item_path);
+	path = g_strconcat(folder_path, G_DIR_SEPARATOR_S, real_path, NULL);
+	g_free(real_path);
+	g_free(folder_path);
+
+	return path;
+}
+
+static gchar *mbox_folder_item_get_path(Folder *folder, FolderItem *item)
+{
+	cm_return_val_if_fail(folder != NULL, NULL);
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	return mbox_folder_get_cache_path(folder, item->path);
+}
+
+static gchar *mbox_folder_get_msg_cache_file(FolderItem *item, gint num)
+{
+	gchar *path, *file;
+
+	path = folder_item_get_path(item);
+	if (!is_dir_exist(path))
+		make_dir_hier(path);
+	file = g_strdup_printf("%s%c%d", path, G_DIR_SEPARATOR, num);
+	g_free(path);
+
+	return file;
+}
+
+/* Offset index */
+
+static MboxMsg *mbox_folder_get_msg(MboxFolderItem *item, gint num)
+{
+	MboxMsg *msgs;
+	guint lo, hi, mid;
+
+	if (item->msgs == NULL)
+		return NULL;
+
+	/* numbers grow with the offsets */
+	msgs = (MboxMsg *)item->msgs->data;
+	lo = 0;
+	hi = item->msgs->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (msgs[mid].num == num)
+			return &msgs[mid];
+		if (msgs[mid].num < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+static void mbox_folder_read_index(MboxFolderItem *item)
+{
+	gchar buf[BUFFSIZE];
+	gchar *path, *file;
+	gint version, next_num;
+	gint64 size;
+	glong mtime;
+	MboxMsg msg, *last = NULL;
+	FILE *fp;
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, MBOX_INDEX_FILE, NULL);
+	g_free(path);
+
+	if ((fp = g_fopen(file, "rb")) == NULL) {
+		g_free(file);
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), fp) == NULL ||
+	    sscanf(buf, "claws-mbox-index %d %d %" G_GINT64_FORMAT " %ld",
+		   &version, &next_num, &size, &mtime) != 4 ||
+	    version != MBOX_INDEX_VERSION) {
+		g_warning("%s: unknown format, the mbox will be indexed again\n",
+			  file);
+		goto bad;
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (sscanf(buf, "%d %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+			   " %" G_GINT64_FORMAT, &msg.num, &msg.offset,
+			   &msg.header_len, &msg.body_len) != 4 ||
+		    msg.num <= 0 || msg.num >= next_num ||
+		    msg.header_len <= 0 || msg.body_len < 0 ||
+		    msg.offset + msg.header_len + msg.body_len > size ||
+		    (last != NULL && (msg.num <= last->num ||
+		     msg.offset < last->offset + last->header_len +
+				  last->body_len))) {
+			g_warning("%s: broken, the mbox will be indexed again\n",
+				  file);
+			g_array_set_size(item->msgs, 0);
+			goto bad;
+		}
+		g_array_append_val(item->msgs, msg);
+		last = &g_array_index(item->msgs, MboxMsg, item->msgs->len - 1);
+	}
+
+	item->next_num = next_num;
+	item->index_size = size;
+	item->index_mtime = mtime;
+	item->index_valid = TRUE;
+	item->index_dirty = FALSE;
+bad:
+	fclose(fp);
+	g_free(file);
+}
+
+static void mbox_folder_write_index(MboxFolderItem *item)
+{
+	gchar *path, *file, *tmp;
+	MboxMsg *msg;
+	gboolean error;
+	FILE *fp;
+	guint i;
+
+	if (!item->index_dirty || !item->index_valid)
+		return;
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	if (!is_dir_exist(path))
+		make_dir_hier(path);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, MBOX_INDEX_FILE, NULL);
+	tmp = g_strconcat(file, ".tmp", NULL);
+	g_free(path);
+
+	if ((fp = g_fopen(tmp, "wb")) == NULL) {
+		FILE_OP_ERROR(tmp, "fopen");
+		goto out;
+	}
+	error = fprintf(fp, "claws-mbox-index %d %d %" G_GINT64_FORMAT " %ld\n",
+			MBOX_INDEX_VERSION, item->next_num,
+			(gint64)item->index_size,
+			(glong)item->index_mtime) < 0;
+	for (i = 0; i < item->msgs->len && !error; i++) {
+		msg = &g_array_index(item->msgs, MboxMsg, i);
+		error = fprintf(fp, "%d %" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+				" %" G_GINT64_FORMAT "\n", msg->num,
+				(gint64)msg->offset, (gint64)msg->header_len,
+				(gint64)msg->body_len) < 0;
+	}
+	if (fclose(fp) == EOF)
+		error = TRUE;
+
+	if (error) {
+		FILE_OP_ERROR(tmp, "fwrite");
+		claws_unlink(tmp);
+	} else if (rename_force(tmp, file) < 0) {
+		FILE_OP_ERROR(tmp, "rename");
+	} else {
+		item->index_dirty = FALSE;
+	}
+out:
+	g_free(tmp);
+	g_free(file);
+}
+
+static void mbox_folder_load_index(MboxFolderItem *item)
+{
+	if (item->msgs != NULL)
+		return;
+
+	item->msgs = g_array_new(FALSE, FALSE, sizeof(MboxMsg));
+	item->next_num = 1;
+	mbox_folder_read_index(item);
+}
+
+/* Forgets the index, and the messages opened with its numbers */
+static void mbox_folder_clear_index(MboxFolderItem *item)
+{
+	gchar *path;
+
+	g_array_set_size(item->msgs, 0);
+	item->next_num = 1;
+
+	path = folder_item_get_path(FOLDER_ITEM(item));
+	if (is_dir_exist(path))
+		remove_all_numbered_files(path);
+	g_free(path);
+}
+
+static void mbox_folder_end_msg(MboxFolderItem *item, MboxMsg *msg,
+				gboolean in_header, goffset end)
+{
+	if (!in_header)
+		msg->body_len = end - msg->offset - msg->header_len;
+	msg->num = item->next_num++;
+	g_array_append_val(item->msgs, *msg);
+}
+
+/* Indexes the messages of fd from offset on */
+static gint mbox_folder_index_msgs(MboxFolderItem *item, gint fd,
+				   goffset offset, goffset size)
+{
+	MboxReader *reader;
+	MboxMsg msg;
+	const gchar *line;
+	gsize len;
+	goffset line_offset, blank = -1, end = offset;
+	gboolean in_msg = FALSE, in_header = FALSE, error;
+	guint old_len = item->msgs->len;
+
+	reader = mbox_reader_new(fd, offset, size);
+	while ((line = mbox_reader_get_line(reader, &len, &line_offset)) != NULL) {
+		end = line_offset + len;
+
+		/* the same separators as proc_mbox() */
+		if (len >= 5 && !strncmp(line, "From ", 5)) {
+			if (in_msg)
+				mbox_folder_end_msg(item, &msg, in_header,
+						    blank >= 0 ? blank : line_offset);
+			msg.offset = line_offset;
+			msg.header_len = len;
+			msg.body_len = 0;
+			in_msg = in_header = TRUE;
+			blank = -1;
+			continue;
+		}
+		if (!in_msg)
+			continue;
+
+		if (in_header) {
+			msg.header_len += len;
+			if (line[0] == '\n' || line[0] == '\r')
+				in_header = FALSE;
+			continue;
+		}
+
+		/* the last blank line is not part of the message */
+		blank = line[0] == '\n' || line[0] == '\r' ? line_offset : -1;
+	}
+	if (in_msg)
+		mbox_folder_end_msg(item, &msg, in_header,
+				    blank >= 0 ? blank : end);
+
+	error = mbox_reader_get_error(reader);
+	mbox_reader_free(reader);
+
+	return error ? -1 : item->msgs->len - old_len;
+}
+
+/* Whether the indexed part of fd is unchanged, and what follows it
+ * starts a message */
+static gboolean mbox_folder_is_appended(MboxFolderItem *item, gint fd,
+					goffset size)
+{
+	MboxReader *reader;
+	MboxMsg *last;
+	const gchar *line;
+	gsize len;
+	goffset line_offset;
+	gboolean ret = FALSE;
+
+	if (size < item->index_size)
+		return FALSE;
+
+	if (item->msgs->len > 0) {
+		last = &g_array_index(item->msgs, MboxMsg,
+				      item->msgs->len - 1);
+		reader = mbox_reader_new(fd, last->offset, last->offset + 5);
+		line = mbox_reader_get_line(reader, &len, NULL);
+		ret = line != NULL && len == 5 && !strncmp(line, "From ", 5);
+		mbox_reader_free(reader);
+		if (!ret)
+			return FALSE;
+	}
+
+	reader = mbox_reader_new(fd, item->index_size, size);
+	while ((line = mbox_reader_get_line(reader, &len, &line_offset)) != NULL) {
+		if (line[0] == '\n' || line[0] == '\r')
+			continue;
+		ret = len >= 5 && !strncmp(line, "From ", 5);
+		break;
+	}
+	mbox_reader_free(reader);
+
+	return ret;
+}
+
+/* Brings the index up to date with the mbox, renumbered is set when
+ * the numbers of its messages changed */
+static gint mbox_folder_update(MboxFolderItem *item, gboolean *renumbered)
+{
+	gchar *file;
+	struct stat s;
+	goffset offset = 0;
+	gint fd, n;
+
+	if (renumbered != NULL)
+		*renumbered = FALSE;
+
+	mbox_folder_load_index(item);
+
+	file = mbox_folder_item_get_file(FOLDER_ITEM(item));
+	if (g_stat(file, &s) < 0) {
+		FILE_OP_ERROR(file, "stat");
+		g_free(file);
+		return -1;
+	}
+	if (item->index_valid && s.st_size == item->index_size &&
+	    s.st_mtime == item->index_mtime) {
+		g_free(file);
+		return item->msgs->len;
+	}
+
+	if ((fd = g_open(file, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(file, "open");
+		g_free(file);
+		return -1;
+	}
+
+	if (item->index_valid && mbox_folder_is_appended(item, fd, s.st_size)) {
+		offset = item->index_size;
+		debug_print("indexing %s from %" G_GINT64_FORMAT "\n",
+			    file, (gint64)offset);
+	} else {
+		debug_print("indexing %s\n", file);
+		if (renumbered != NULL)
+			*renumbered = TRUE;
+		item->renumbered = TRUE;
+		mbox_folder_clear_index(item);
+	}
+
+	n = mbox_folder_index_msgs(item, fd, offset, s.st_size);
+	close(fd);
+	if (n < 0) {
+		FILE_OP_ERROR(file, "read");
+		g_free(file);
+		item->index_valid = FALSE;
+		return -1;
+	}
+	debug_print("%d new messages in %s\n", n, file);
+	g_free(file);
+
+	item->index_size = s.st_size;
+	item->index_mtime = s.st_mtime;
+	item->index_valid = TRUE;
+	item->index_dirty = TRUE;
+	mbox_folder_write_index(item);
+
+	return item->msgs->len;
+}
+
+/* Takes the index as describing fd, after it was written to */
+static void mbox_folder_index_written(MboxFolderItem *item, gint fd)
+{
+	struct stat s;
+
+	if (fstat(fd, &s) < 0) {
+		FILE_OP_ERROR(FOLDER_ITEM(item)->path, "fstat");
+		item->index_valid = FALSE;
+		return;
+	}
+	item->index_size = s.st_size;
+	item->index_mtime = s.st_mtime;
+	item->index_dirty = TRUE;
+	mbox_folder_write_index(item);
+}
+
+/* FolderItem functions */
+
+static FolderItem *mbox_folder_item_new(Folder *folder)
+{
+	MboxFolderItem *item;
+
+	item = g_new0(MboxFolderItem, 1);
+	item->next_num = 1;
+
+	return (FolderItem *)item;
+}
+
+static void mbox_folder_item_destroy(Folder *folder, FolderItem *_item)
+{
+	MboxFolderItem *item = MBOX_ITEM(_item);
+
+	cm_return_if_fail(item != NULL);
+
+	if (item->msgs != NULL)
+		g_array_free(item->msgs, TRUE);
+	g_free(_item);
+}
+
+static gint mbox_folder_item_close(Folder *folder, FolderItem *item)
+{
+	if (MBOX_ITEM(item)->msgs != NULL)
+		mbox_folder_write_index(MBOX_ITEM(item));
+	return 0;
+}
+
+static gint mbox_folder_get_num_list(Folder *folder, FolderItem *item,
+				     GSList **list, gboolean *old_uids_valid)
+{
+	MboxFolderItem *mitem = MBOX_ITEM(item);
+	gint nummsgs, i;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	if ((nummsgs = mbox_folder_update(mitem, NULL)) < 0)
+		return -1;
+	/* the update may have been done when adding messages */
+	*old_uids_valid = !mitem->renumbered;
+	mitem->renumbered = FALSE;
+
+	for (i = nummsgs - 1; i >= 0; i--)
+		*list = g_slist_prepend(*list, GINT_TO_POINTER(
+				g_array_index(mitem->msgs, MboxMsg, i).num));
+	mbox_folder_set_mtime(folder, item);
+
+	return nummsgs;
+}
+
+static time_t mbox_folder_get_mtime(FolderItem *item)
+{
+	gchar *file;
+	struct stat s;
+	time_t mtime = 0;
+
+	file = mbox_folder_item_get_file(item);
+	if (g_stat(file, &s) < 0) {
+		FILE_OP_ERROR(file, "stat");
+	} else
+		mtime = s.st_mtime;
+	g_free(file);
+
+	return mtime;
+}
+
+static gboolean mbox_folder_scan_required(Folder *folder, FolderItem *item)
+{
+	time_t mtime;
+
+	cm_return_val_if_fail(item != NULL, FALSE);
+
+	if (item->path == NULL || item->no_select)
+		return FALSE;
+
+	mtime = mbox_folder_get_mtime(item);
+	if (mtime > item->mtime && mtime - 3600 != item->mtime) {
+		debug_print("mbox scan required, folder updated: %s (%ld > %ld)\n",
+			    item->path, (long int) mtime, (long int) item->mtime);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void mbox_folder_set_mtime(Folder *folder, FolderItem *item)
+{
+	item->mtime = mbox_folder_get_mtime(item);
+}
+
+/* Message functions */
+
+/* Flags of the Status: and X-Status: headers other mailers write */
+static MsgPermFlags mbox_folder_get_status_flags(const gchar *header)
+{
+	MsgPermFlags flags = MSG_NEW | MSG_UNREAD;
+	const gchar *p, *eol;
+
+	for (p = header; *p != '\0' && *p != '\n' && *p != '\r'; p = eol + 1) {
+		if ((eol = strchr(p, '\n')) == NULL)
+			eol = p + strlen(p);
+
+		if (!g_ascii_strncasecmp(p, "Status:", 7)) {
+			for (p += 7; p < eol; p++) {
+				if (*p == 'R')
+					flags &= ~(MSG_NEW | MSG_UNREAD);
+				else if (*p == 'O')
+					flags &= ~MSG_NEW;
+			}
+		} else if (!g_ascii_strncasecmp(p, "X-Status:", 9)) {
+			for (p += 9; p < eol; p++) {
+				if (*p == 'A')
+					flags |= MSG_REPLIED;
+				else if (*p == 'F')
+					flags |= MSG_MARKED;
+			}
+		}
+		if (*eol == '\0')
+			break;
+	}
+
+	return flags;
+}
+
+static MsgInfo *mbox_folder_get_msginfo(Folder *folder, FolderItem *item,
+					gint num)
+{
+	MboxMsg *msg;
+	MsgInfo *msginfo;
+	MsgFlags flags;
+	MboxReader *reader;
+	GString *header;
+	const gchar *line;
+	gchar *file;
+	gsize len;
+	gint fd;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	mbox_folder_load_index(MBOX_ITEM(item));
+	if ((msg = mbox_folder_get_msg(MBOX_ITEM(item), num)) == NULL)
+		return NULL;
+
+	file = mbox_folder_item_get_file(item);
+	if ((fd = g_open(file, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(file, "open");
+		g_free(file);
+		return NULL;
+	}
+	g_free(file);
+
+	/* the header, without the From_ line */
+	header = g_string_sized_new(msg->header_len);
+	reader = mbox_reader_new(fd, msg->offset,
+				 msg->offset + msg->header_len);
+	if (mbox_reader_get_line(reader, &len, NULL) != NULL) {
+		while ((line = mbox_reader_get_line(reader, &len, NULL)) != NULL)
+			g_string_append_len(header, line, len);
+	}
+	mbox_reader_free(reader);
+	close(fd);
+
+	flags.perm_flags = mbox_folder_get_status_flags(header->str);
+	flags.tmp_flags = 0;
+	if (folder_has_parent_of_type(item, F_QUEUE)) {
+		MSG_SET_TMP_FLAGS(flags, MSG_QUEUED);
+	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
+		MSG_SET_TMP_FLAGS(flags, MSG_DRAFT);
+	}
+
+	msginfo = procheader_parse_str(header->str, flags, FALSE, FALSE);
+	g_string_free(header, TRUE);
+	if (msginfo == NULL)
+		return NULL;
+
+	msginfo->msgnum = num;
+	msginfo->folder = item;
+	/* what the message takes in the mbox */
+	msginfo->size = msg->header_len + msg->body_len;
+
+	return msginfo;
+}
+
+/* Writes the message msg of the mbox open as fd to file, as it was
+ * before being quoted into the mbox */
+static gint mbox_folder_extract_msg(gint fd, MboxMsg *msg, const gchar *file)
+{
+	MboxReader *reader;
+	const gchar *line;
+	gsize len, i;
+	gint ret = 0;
+	FILE *fp;
+
+	if ((fp = g_fopen(file, "wb")) == NULL) {
+		FILE_OP_ERROR(file, "fopen");
+		return -1;
+	}
+
+	reader = mbox_reader_new(fd, msg->offset, msg->offset +
+				 msg->header_len + msg->body_len);
+	/* skip the From_ line */
+	if (mbox_reader_get_line(reader, &len, NULL) != NULL) {
+		while ((line = mbox_reader_get_line(reader, &len, NULL)) != NULL) {
+			for (i = 0; i < len && line[i] == '>'; i++)
+				;
+			if (i > 0 && len - i >= 5 && !strncmp(line + i, "From ", 5)) {
+				line++;
+				len--;
+			}
+			if (fwrite(line, 1, len, fp) < len) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	if (mbox_reader_get_error(reader)) {
+		FILE_OP_ERROR(file, "read");
+		ret = -1;
+	}
+	mbox_reader_free(reader);
+
+	if (fclose(fp) == EOF || ret < 0) {
+		FILE_OP_ERROR(file, "fwrite");
+		claws_unlink(file);
+		return -1;
+	}
+
+	return 0;
+}
+
+static gchar *mbox_folder_fetch_msg(Folder *folder, FolderItem *item, gint num)
+{
+	MboxMsg *msg;
+	gchar *file, *mbox_file, *tmp;
+	gboolean renumbered;
+	gint lockfd;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+	cm_return_val_if_fail(num > 0, NULL);
+
+	file = mbox_folder_get_msg_cache_file(item, num);
+	if (is_file_exist(file))
+		return file;
+
+	/* messages are moved within the mbox when others are removed, so
+	 * it is read under the lock, at offsets checked while holding it */
+	mbox_file = mbox_folder_item_get_file(item);
+	if ((lockfd = lock_mbox(mbox_file, LOCK_FLOCK)) < 0) {
+		g_free(mbox_file);
+		g_free(file);
+		return NULL;
+	}
+	if (mbox_folder_update(MBOX_ITEM(item), &renumbered) < 0 || renumbered ||
+	    (msg = mbox_folder_get_msg(MBOX_ITEM(item), num)) == NULL) {
+		unlock_mbox(mbox_file, lockfd, LOCK_FLOCK);
+		g_free(mbox_file);
+		g_free(file);
+		return NULL;
+	}
+
+	tmp = g_strconcat(file, ".tmp", NULL);
+	if (mbox_folder_extract_msg(lockfd, msg, tmp) < 0 ||
+	    rename_force(tmp, file) < 0) {
+		claws_unlink(tmp);
+		g_free(file);
+		file = NULL;
+	}
+	unlock_mbox(mbox_file, lockfd, LOCK_FLOCK);
+	g_free(mbox_file);
+	g_free(tmp);
+
+	return file;
+}
+
+/* Appends file to fp, at offset in the mbox, and indexes it */
+static gint mbox_folder_append_msg(MboxFolderItem *item, FILE *fp,
+				   goffset *offset, MsgFileInfo *fileinfo)
+{
+	MboxReader *reader;
+	MboxMsg msg;
+	const gchar *line;
+	gchar buf[BUFFSIZE], date[BUFFSIZE];
+	gsize len, i;
+	gint fd, from_len;
+	gboolean in_header = TRUE, error = FALSE;
+	time_t t;
+
+	if ((fd = g_open(fileinfo->file, O_RDONLY, 0)) < 0) {
+		FILE_OP_ERROR(fileinfo->file, "open");
+		return -1;
+	}
+
+	if (fileinfo->msginfo != NULL && fileinfo->msginfo->from != NULL) {
+		strncpy2(buf, fileinfo->msginfo->from, sizeof(buf));
+		extract_address(buf);
+		t = fileinfo->msginfo->date_t;
+	} else {
+		strncpy2(buf, "MAILER-DAEMON", sizeof(buf));
+		t = time(NULL);
+	}
+	if ((from_len = fprintf(fp, "From %s %s", buf, ctime_r(&t, date))) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	msg.offset = *offset;
+	msg.header_len = from_len;
+	msg.body_len = 0;
+
+	reader = mbox_reader_new(fd, 0, -1);
+	while (!error && (line = mbox_reader_get_line(reader, &len, NULL)) != NULL) {
+		for (i = 0; i < len && line[i] == '>'; i++)
+			;
+		if (len - i >= 5 && !strncmp(line + i, "From ", 5)) {
+			error = fputc('>', fp) == EOF;
+			if (in_header)
+				msg.header_len++;
+			else
+				msg.body_len++;
+		}
+		error = error || fwrite(line, 1, len, fp) < len;
+
+		if (in_header) {
+			msg.header_len += len;
+			if (line[0] == '\n' || line[0] == '\r')
+				in_header = FALSE;
+		} else
+			msg.body_len += len;
+
+		/* the message must end with a newline */
+		if (line[len - 1] != '\n' && mbox_reader_at_eof(reader)) {
+			error = error || fputc('\n', fp) == EOF;
+			if (in_header)
+				msg.header_len++;
+			else
+				msg.body_len++;
+		}
+	}
+	if (mbox_reader_get_error(reader)) {
+		FILE_OP_ERROR(fileinfo->file, "read");
+		error = TRUE;
+	}
+	mbox_reader_free(reader);
+	close(fd);
+
+	/* and be followed by a blank line */
+	if (error || fputc('\n', fp) == EOF)
+		return -1;
+
+	*offset += msg.header_len + msg.body_len + 1;
+	mbox_folder_end_msg(item, &msg, TRUE, 0);
+
+	return msg.num;
+}
+
+/* Blank line needed before a new From_ line, at the end of fd */
+static gint mbox_folder_end_with_blank_line(MboxFolderItem *item, gint fd,
+					    FILE *fp, goffset *offset)
+{
+	MboxMsg *last;
+	gchar tail[2] = { '\n', '\n' };
+	goffset size = *offset;
+
+	if (size == 0)
+		return 0;
+
+	if (lseek(fd, MAX(size - 2, 0), SEEK_SET) < 0 ||
+	    read(fd, tail + 2 - MIN(size, 2), MIN(size, 2)) != MIN(size, 2))
+		return -1;
+
+	if (tail[1] != '\n') {
+		/* the last line of the last message was not ended */
+		if (fputs("\n\n", fp) == EOF)
+			return -1;
+		*offset += 2;
+		if (item->msgs->len > 0) {
+			last = &g_array_index(item->msgs, MboxMsg,
+					      item->msgs->len - 1);
+			if (last->offset + last->header_len + last->body_len == size)
+				last->body_len++;
+		}
+	} else if (tail[0] != '\n') {
+		if (fputc('\n', fp) == EOF)
+			return -1;
+		*offset += 1;
+	}
+
+	return 0;
+}
+
+static gint mbox_folder_add_msg(Folder *folder, FolderItem *dest,
+				const gchar *file, MsgFlags *flags)
+{
+	GSList file_list;
+	MsgFileInfo fileinfo;
+
+	cm_return_val_if_fail(file != NULL, -1);
+
+	fileinfo.msginfo = NULL;
+	fileinfo.file = (gchar *)file;
+	fileinfo.flags = flags;
+	file_list.data = &fileinfo;
+	file_list.next = NULL;
+
+	return mbox_folder_add_msgs(folder, dest, &file_list, NULL);
+}
+
+static gint mbox_folder_add_msgs(Folder *folder, FolderItem *dest,
+				 GSList *file_list, GHashTable *relation)
+{
+	MboxFolderItem *item = MBOX_ITEM(dest);
+	MsgFileInfo *fileinfo;
+	GSList *cur;
+	gchar *file;
+	goffset size, offset;
+	guint old_len;
+	gint lockfd, num = -1;
+	struct stat s;
+	FILE *fp = NULL;
+
+	cm_return_val_if_fail(dest != NULL, -1);
+	cm_return_val_if_fail(file_list != NULL, -1);
+
+	file = mbox_folder_item_get_file(dest);
+	if ((lockfd = lock_mbox(file, LOCK_FLOCK)) < 0) {
+		g_free(file);
+		return -1;
+	}
+
+	if (mbox_folder_update(item, NULL) < 0)
+		goto out;
+	if (fstat(lockfd, &s) < 0) {
+		FILE_OP_ERROR(file, "fstat");
+		goto out;
+	}
+	size = offset = s.st_size;
+	old_len = item->msgs->len;
+
+	if ((fp = fdopen(dup(lockfd), "ab")) == NULL) {
+		FILE_OP_ERROR(file, "fdopen");
+		goto out;
+	}
+
+	if (mbox_folder_end_with_blank_line(item, lockfd, fp, &offset) < 0) {
+		num = -1;
+	} else {
+		for (cur = file_list; cur != NULL; cur = cur->next) {
+			fileinfo = (MsgFileInfo *)cur->data;
+
+			num = mbox_folder_append_msg(item, fp, &offset, fileinfo);
+			if (num < 0)
+				break;
+
+			if (relation != NULL)
+				g_hash_table_insert(relation, fileinfo,
+						    GINT_TO_POINTER(num));
+		}
+	}
+
+	if (fclose(fp) == EOF)
+		num = -1;
+
+	if (num < 0) {
+		FILE_OP_ERROR(file, "fwrite");
+		/* leave the mbox as it was */
+		if (ftruncate(lockfd, size) < 0)
+			FILE_OP_ERROR(file, "ftruncate");
+		g_array_set_size(item->msgs, old_len);
+		item->index_valid = FALSE;
+		goto out;
+	}
+
+	mbox_folder_index_written(item, lockfd);
+	folder_sync_file(file);
+out:
+	unlock_mbox(file, lockfd, LOCK_FLOCK);
+	g_free(file);
+
+	return num;
+}
+
+static gint mbox_folder_copy_msg(Folder *folder, FolderItem *dest,
+				 MsgInfo *msginfo)
+{
+	GSList msglist;
+
+	cm_return_val_if_fail(msginfo != NULL, -1);
+
+	msglist.data = msginfo;
+	msglist.next = NULL;
+
+	return mbox_folder_copy_msgs(folder, dest, &msglist, NULL);
+}
+
+static gint mbox_folder_copy_msgs(Folder *folder, FolderItem *dest,
+				  MsgInfoList *msglist, GHashTable *relation)
+{
+	MsgFileInfo *fileinfo;
+	GSList *file_list = NULL, *cur;
+	GHashTable *nums;
+	MsgInfo *msginfo;
+	gint ret = 0;
+
+	cm_return_val_if_fail(dest != NULL, -1);
+	cm_return_val_if_fail(msglist != NULL, -1);
+
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+
+		fileinfo = g_new0(MsgFileInfo, 1);
+		fileinfo->msginfo = msginfo;
+		fileinfo->flags = &msginfo->flags;
+		if ((fileinfo->file = procmsg_get_message_file(msginfo)) == NULL) {
+			g_warning("can't get the message %d\n", msginfo->msgnum);
+			g_free(fileinfo);
+			ret = -1;
+			break;
+		}
+		file_list = g_slist_prepend(file_list, fileinfo);
+	}
+	file_list = g_slist_reverse(file_list);
+
+	if (ret == 0 && file_list != NULL) {
+		nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+		ret = mbox_folder_add_msgs(folder, dest, file_list, nums);
+		for (cur = file_list; ret >= 0 && cur != NULL; cur = cur->next) {
+			fileinfo = (MsgFileInfo *)cur->data;
+			if (relation != NULL)
+				g_hash_table_insert(relation, fileinfo->msginfo,
+					g_hash_table_lookup(nums, fileinfo));
+		}
+		g_hash_table_destroy(nums);
+	}
+
+	for (cur = file_list; cur != NULL; cur = cur->next) {
+		fileinfo = (MsgFileInfo *)cur->data;
+		g_free(fileinfo->file);
+		g_free(fileinfo);
+	}
+	g_slist_free(file_list);
+
+	return ret;
+}
+
+/* Moves len bytes of fd from offset down to new_offset */
+static gint mbox_folder_move_range(gint fd, goffset offset, goffset new_offset,
+				   goffset len)
+{
+	gchar buf[65536];
+	gssize n_read, n_written, done;
+
+	while (len > 0) {
+		n_read = pread(fd, buf, MIN(len, sizeof(buf)), offset);
+		if (n_read < 0 && errno == EINTR)
+			continue;
+		if (n_read <= 0)
+			return -1;
+		for (done = 0; done < n_read; done += n_written) {
+			n_written = pwrite(fd, buf + done, n_read - done,
+					   new_offset + done);
+			if (n_written < 0 && errno == EINTR)
+				n_written = 0;
+			else if (n_written <= 0)
+				return -1;
+		}
+		offset += n_read;
+		new_offset += n_read;
+		len -= n_read;
+	}
+
+	return 0;
+}
+
+/* Removes the messages of nums from the mbox, in place: the kept
+ * messages are moved down while it is locked, then it is truncated.
+ * Writing a new file and renaming it would leave mail delivered to
+ * the locked old file behind. */
+static gint mbox_folder_remove_nums(MboxFolderItem *item, GHashTable *nums)
+{
+	FolderItem *_item = FOLDER_ITEM(item);
+	GArray *kept;
+	MboxMsg *msg, new_msg;
+	gchar *file, *cache_file;
+	gboolean renumbered;
+	goffset size, end, offset;
+	gint lockfd, ret = 0;
+	struct stat s;
+	guint i;
+
+	file = mbox_folder_item_get_file(_item);
+	if ((lockfd = lock_mbox(file, LOCK_FLOCK)) < 0) {
+		g_free(file);
+		return -1;
+	}
+
+	if (mbox_folder_update(item, &renumbered) < 0 || renumbered ||
+	    fstat(lockfd, &s) < 0) {
+		g_warning("%s changed, no message removed\n", file);
+		unlock_mbox(file, lockfd, LOCK_FLOCK);
+		g_free(file);
+		return -1;
+	}
+	size = s.st_size;
+
+	kept = g_array_sized_new(FALSE, FALSE, sizeof(MboxMsg),
+				 item->msgs->len);
+	/* what comes before the first message is kept */
+	offset = item->msgs->len > 0 ?
+		 g_array_index(item->msgs, MboxMsg, 0).offset : size;
+
+	for (i = 0; i < item->msgs->len && ret == 0; i++) {
+		msg = &g_array_index(item->msgs, MboxMsg, i);
+		end = i + 1 < item->msgs->len ?
+		      g_array_index(item->msgs, MboxMsg, i + 1).offset : size;
+
+		if (g_hash_table_lookup(nums, GINT_TO_POINTER(msg->num))) {
+			cache_file = mbox_folder_get_msg_cache_file(_item,
+								    msg->num);
+			if (is_file_exist(cache_file))
+				claws_unlink(cache_file);
+			g_free(cache_file);
+			continue;
+		}
+
+		new_msg = *msg;
+		new_msg.offset = offset;
+		g_array_append_val(kept, new_msg);
+		if (msg->offset != offset)
+			ret = mbox_folder_move_range(lockfd, msg->offset, offset,
+						     end - msg->offset);
+		offset += end - msg->offset;
+	}
+
+	if (ret == 0 && ftruncate(lockfd, offset) < 0)
+		ret = -1;
+	if (ret == 0 && fsync(lockfd) < 0)
+		ret = -1;
+
+	if (ret < 0) {
+		/* the mbox may be half moved, it is indexed again */
+		FILE_OP_ERROR(file, "write");
+		g_array_free(kept, TRUE);
+		item->index_valid = FALSE;
+		goto out;
+	}
+
+	g_array_free(item->msgs, TRUE);
+	item->msgs = kept;
+	mbox_folder_index_written(item, lockfd);
+	folder_sync_file(file);
+out:
+	unlock_mbox(file, lockfd, LOCK_FLOCK);
+	g_free(file);
+
+	return ret;
+}
+
+static gint mbox_folder_remove_msg(Folder *folder, FolderItem *item, gint num)
+{
+	GHashTable *nums;
+	gint ret;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(nums, GINT_TO_POINTER(num), GINT_TO_POINTER(1));
+	ret = mbox_folder_remove_nums(MBOX_ITEM(item), nums);
+	g_hash_table_destroy(nums);
+
+	return ret;
+}
+
+static gint mbox_folder_remove_msgs(Folder *folder, FolderItem *item,
+				    MsgInfoList *msglist, GHashTable *relation)
+{
+	GHashTable *nums;
+	MsgInfoList *cur;
+	MsgInfo *msginfo;
+	gint ret;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		msginfo = (MsgInfo *)cur->data;
+		if (msginfo == NULL)
+			continue;
+		if (MSG_IS_MOVE(msginfo->flags) && MSG_IS_MOVE_DONE(msginfo->flags)) {
+			msginfo->flags.tmp_flags &= ~MSG_MOVE_DONE;
+			continue;
+		}
+		g_hash_table_insert(nums, GINT_TO_POINTER(msginfo->msgnum),
+				    GINT_TO_POINTER(1));
+	}
+
+	/* one rewrite of the mbox for all of them */
+	ret = g_hash_table_size(nums) > 0 ?
+	      mbox_folder_remove_nums(MBOX_ITEM(item), nums) : 0;
+	g_hash_table_destroy(nums);
+
+	return ret;
+}
+
+static gint mbox_folder_remove_all_msg(Folder *folder, FolderItem *item)
+{
+	MboxFolderItem *mitem = MBOX_ITEM(item);
+	gchar *file;
+	gint lockfd, ret = 0;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	file = mbox_folder_item_get_file(item);
+	if ((lockfd = lock_mbox(file, LOCK_FLOCK)) < 0) {
+		g_free(file);
+		return -1;
+	}
+
+	mbox_folder_load_index(mitem);
+	if (ftruncate(lockfd, 0) < 0) {
+		FILE_OP_ERROR(file, "ftruncate");
+		ret = -1;
+	} else {
+		mbox_folder_clear_index(mitem);
+		mitem->index_valid = TRUE;
+		mbox_folder_index_written(mitem, lockfd);
+	}
+	unlock_mbox(file, lockfd, LOCK_FLOCK);
+	g_free(file);
+
+	return ret;
+}
+
+static gboolean mbox_folder_is_msg_changed(Folder *folder, FolderItem *item,
+					   MsgInfo *msginfo)
+{
+	MboxMsg *msg;
+
+	mbox_folder_load_index(MBOX_ITEM(item));
+	msg = mbox_folder_get_msg(MBOX_ITEM(item), msginfo->msgnum);
+
+	return msg == NULL || msginfo->size != msg->header_len + msg->body_len;
+}
+
+/* Folder tree */
+
+static gint mbox_folder_create_file(const gchar *file)
+{
+	FILE *fp;
+
+	if (is_file_exist(file))
+		return 0;
+
+	if ((fp = g_fopen(file, "ab")) == NULL) {
+		FILE_OP_ERROR(file, "fopen");
+		return -1;
+	}
+	if (change_file_mode_rw(fp, file) < 0)
+		FILE_OP_ERROR(file, "chmod");
+	fclose(fp);
+
+	return 0;
+}
+
+#define MAKE_MBOX_IF_NOT_EXIST(file) \
+{ \
+	if (mbox_folder_create_file(file) < 0) { \
+		g_warning("can't create mbox %s\n", file); \
+		g_free(file); \
+		return -1; \
+	} \
+	g_free(file); \
+}
+
+static gint mbox_folder_create_tree(Folder *folder)
+{
+	gchar *rootpath, *file;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+
+	rootpath = mbox_folder_get_root_path(folder);
+	if (!is_dir_exist(rootpath) && make_dir_hier(rootpath) < 0) {
+		g_free(rootpath);
+		return -1;
+	}
+	g_free(rootpath);
+
+	file = mbox_folder_get_file(folder, INBOX_DIR);
+	MAKE_MBOX_IF_NOT_EXIST(file);
+	file = mbox_folder_get_file(folder, OUTBOX_DIR);
+	MAKE_MBOX_IF_NOT_EXIST(file);
+	file = mbox_folder_get_file(folder, QUEUE_DIR);
+	MAKE_MBOX_IF_NOT_EXIST(file);
+	file = mbox_folder_get_file(folder, DRAFT_DIR);
+	MAKE_MBOX_IF_NOT_EXIST(file);
+	file = mbox_folder_get_file(folder, TRASH_DIR);
+	MAKE_MBOX_IF_NOT_EXIST(file);
+
+	return 0;
+}
+
+#undef MAKE_MBOX_IF_NOT_EXIST
+
+static gboolean mbox_folder_remove_missing_folder_items_func(GNode *node,
+							     gpointer data)
+{
+	FolderItem *item;
+	gchar *file;
+
+	cm_return_val_if_fail(node->data != NULL, FALSE);
+
+	if (G_NODE_IS_ROOT(node))
+		return FALSE;
+
+	item = FOLDER_ITEM(node->data);
+	file = mbox_folder_item_get_file(item);
+	if (is_dir_exist(file)) {
+		item->no_select = TRUE;
+	} else if (is_file_exist(file)) {
+		item->no_select = FALSE;
+	} else if (G_NODE_IS_LEAF(node)) {
+		debug_print("folder '%s' not found. removing...\n", item->path);
+		folder_item_remove(item);
+	}
+	g_free(file);
+
+	return FALSE;
+}
+
+static FolderItem *mbox_folder_get_child(FolderItem *parent, const gchar *name,
+					 const gchar *path, gboolean is_dir)
+{
+	Folder *folder = parent->folder;
+	FolderItem *item;
+	GNode *node;
+
+	for (node = parent->node->children; node != NULL; node = node->next) {
+		item = FOLDER_ITEM(node->data);
+		if (!strcmp2(item->path, path))
+			return item;
+	}
+
+	debug_print("new folder '%s' found.\n", path);
+	item = folder_item_new(folder, name, path);
+	folder_item_append(parent, item);
+	item->no_select = is_dir;
+	if (folder->ui_func)
+		folder->ui_func(folder, item, folder->ui_func_data);
+
+	if (folder_item_parent(parent) == NULL && !is_dir) {
+		if (!folder->inbox && !strcmp(path, INBOX_DIR)) {
+			item->stype = F_INBOX;
+			folder->inbox = item;
+		} else if (!folder->outbox && !strcmp(path, OUTBOX_DIR)) {
+			item->stype = F_OUTBOX;
+			folder->outbox = item;
+		} else if (!folder->draft && !strcmp(path, DRAFT_DIR)) {
+			item->stype = F_DRAFT;
+			folder->draft = item;
+		} else if (!folder->queue && !strcmp(path, QUEUE_DIR)) {
+			item->stype = F_QUEUE;
+			folder->queue = item;
+		} else if (!folder->trash && !strcmp(path, TRASH_DIR)) {
+			item->stype = F_TRASH;
+			folder->trash = item;
+		}
+	}
+
+	return item;
+}
+
+static void mbox_folder_scan_dir(FolderItem *parent, const gchar *dir)
+{
+	FolderItem *item;
+	gchar *file, *utf8name, *path;
+	const gchar *name;
+	DIR *dp;
+	struct dirent *d;
+
+	if ((dp = opendir(dir)) == NULL) {
+		FILE_OP_ERROR(dir, "opendir");
+		return;
+	}
+
+	debug_print("scanning %s ...\n", dir);
+	while ((d = readdir(dp)) != NULL) {
+		name = d->d_name;
+		/* temporary files and the locks of lock_mbox() */
+		if (name[0] == '.' || g_str_has_suffix(name, ".lock"))
+			continue;
+
+		file = g_strconcat(dir, G_DIR_SEPARATOR_S, name, NULL);
+		utf8name = mbox_folder_filename_to_utf8(name);
+		path = parent->path ? g_strconcat(parent->path, G_DIR_SEPARATOR_S,
+						  utf8name, NULL)
+				    : g_strdup(utf8name);
+
+		if (is_dir_exist(file)) {
+			item = mbox_folder_get_child(parent, utf8name, path, TRUE);
+			mbox_folder_scan_dir(item, file);
+		} else if (is_file_exist(file))
+			mbox_folder_get_child(parent, utf8name, path, FALSE);
+
+		g_free(path);
+		g_free(utf8name);
+		g_free(file);
+	}
+	closedir(dp);
+}
+
+static gint mbox_folder_scan_tree(Folder *folder)
+{
+	FolderItem *item;
+	gchar *rootpath;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+
+	if (!folder->node) {
+		item = folder_item_new(folder, folder->name, NULL);
+		item->folder = folder;
+		item->no_select = TRUE;
+		folder->node = item->node = g_node_new(item);
+	} else
+		item = FOLDER_ITEM(folder->node->data);
+
+	if (mbox_folder_create_tree(folder) < 0)
+		return -1;
+
+	debug_print("searching missing folders...\n");
+	g_node_traverse(folder->node, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+			mbox_folder_remove_missing_folder_items_func, folder);
+
+	rootpath = mbox_folder_get_root_path(folder);
+	mbox_folder_scan_dir(item, rootpath);
+	g_free(rootpath);
+
+	return 0;
+}
+
+static FolderItem *mbox_folder_create_folder(Folder *folder, FolderItem *parent,
+					     const gchar *name)
+{
+	FolderItem *new_item;
+	gchar *path, *file;
+
+	cm_return_val_if_fail(folder != NULL, NULL);
+	cm_return_val_if_fail(parent != NULL, NULL);
+	cm_return_val_if_fail(name != NULL, NULL);
+
+	/* only directories hold folders */
+	if (!parent->no_select) {
+		g_warning("mbox folders can't contain other folders\n");
+		return NULL;
+	}
+
+	if (parent->path)
+		path = g_strconcat(parent->path, G_DIR_SEPARATOR_S, name,
+				   NULL);
+	else
+		path = g_strdup(name);
+
+	file = mbox_folder_get_file(folder, path);
+	if (is_file_entry_exist(file) || mbox_folder_create_file(file) < 0) {
+		g_free(file);
+		g_free(path);
+		return NULL;
+	}
+	g_free(file);
+
+	new_item = folder_item_new(folder, name, path);
+	folder_item_append(parent, new_item);
+	g_free(path);
+
+	return new_item;
+}
+
+static gboolean mbox_folder_collect_items_func(GNode *node, gpointer data)
+{
+	GSList **items = (GSList **)data;
+
+	*items = g_slist_prepend(*items, node->data);
+
+	return FALSE;
+}
+
+static gint mbox_folder_rename_folder(Folder *folder, FolderItem *item,
+				      const gchar *name)
+{
+	GSList *items = NULL, *cur;
+	FolderItem *sub;
+	gchar *dirname, *newpath;
+	gchar *oldfile, *newfile, *oldcache, *newcache;
+	gint oldpathlen;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+	cm_return_val_if_fail(item != NULL, -1);
+	cm_return_val_if_fail(item->path != NULL, -1);
+	cm_return_val_if_fail(name != NULL, -1);
+
+	if (strchr(item->path, G_DIR_SEPARATOR) != NULL) {
+		dirname = g_path_get_dirname(item->path);
+		newpath = g_strconcat(dirname, G_DIR_SEPARATOR_S, name, NULL);
+		g_free(dirname);
+	} else
+		newpath = g_strdup(name);
+
+	/* the subfolders are in the renamed directory */
+	oldfile = mbox_folder_get_file(folder, item->path);
+	newfile = mbox_folder_get_file(folder, newpath);
+	if (g_rename(oldfile, newfile) < 0) {
+		FILE_OP_ERROR(oldfile, "rename");
+		g_free(oldfile);
+		g_free(newfile);
+		g_free(newpath);
+		return -1;
+	}
+	g_free(oldfile);
+	g_free(newfile);
+
+	oldcache = mbox_folder_get_cache_path(folder, item->path);
+	newcache = mbox_folder_get_cache_path(folder, newpath);
+	if (is_dir_exist(oldcache) && g_rename(oldcache, newcache) < 0) {
+		FILE_OP_ERROR(oldcache, "rename");
+		remove_dir_recursive(oldcache);
+	}
+	g_free(oldcache);
+	g_free(newcache);
+
+	oldpathlen = strlen(item->path);
+	g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			mbox_folder_collect_items_func, &items);
+	for (cur = items; cur != NULL; cur = cur->next) {
+		sub = FOLDER_ITEM(cur->data);
+		dirname = g_strconcat(newpath, sub->path + oldpathlen, NULL);
+		g_free(sub->path);
+		sub->path = dirname;
+	}
+	g_slist_free(items);
+
+	g_free(item->name);
+	item->name = g_strdup(name);
+	g_free(newpath);
+
+	return 0;
+}
+
+static gint mbox_folder_remove_folder(Folder *folder, FolderItem *item)
+{
+	gchar *file, *path;
+	gint ret;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+	cm_return_val_if_fail(item != NULL, -1);
+	cm_return_val_if_fail(item->path != NULL, -1);
+
+	file = mbox_folder_item_get_file(item);
+	if (is_dir_exist(file))
+		ret = remove_dir_recursive(file);
+	else if ((ret = claws_unlink(file)) < 0 && errno == ENOENT)
+		ret = 0;
+	if (ret < 0) {
+		g_warning("can't remove `%s'\n", file);
+		g_free(file);
+		return -1;
+	}
+	g_free(file);
+
+	path = folder_item_get_path(item);
+	if (is_dir_exist(path))
+		remove_dir_recursive(path);
+	g_free(path);
+
+	folder_item_remove(item);
+	return 0;
+}
+
+static gchar *mbox_folder_filename_from_utf8(const gchar *path)
+{
+	gchar *real_path = g_filename_from_utf8(path, -1, NULL, NULL, NULL);
+
+	if (!real_path) {
+		g_warning("mbox_folder_filename_from_utf8: failed to convert character set\n");
+		real_path = g_strdup(path);
+	}
+
+	return real_path;
+}
+
+static gchar *mbox_folder_filename_to_utf8(const gchar *path)
+{
+	gchar *utf8path = g_filename_to_utf8(path, -1, NULL, NULL, NULL);
+
+	if (!utf8path) {
+		g_warning("mbox_folder_filename_to_utf8: failed to convert character set\n");
+		utf8path = g_strdup(path);
+	}
+
+	return utf8path;
+}
@@ -31,6 +31,10 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <fcntl.h>
+#endif
 
 #include "folder.h"
 #include "mh.h"
@@ -41,6 +45,7 @@
 #include "statusbar.h"
 #include "gtkutils.h"
 #include "timing.h"
+#include "file_batch.h"
 
 /* Define possible missing constants for Windows. */
 #ifdef G_OS_WIN32
@@ -68,6 +73,9 @@ static gchar   *mh_fetch_msg		(Folder		*folder,
 static MsgInfo *mh_get_msginfo		(Folder		*folder,
 					 FolderItem	*item,
 					 gint		 num);
+static MsgInfoList *mh_get_msginfos	(Folder		*folder,
+					 FolderItem	*item,
+					 MsgNumberList	*numlist);
 static gint     mh_add_msg		(Folder		*folder,
 					 FolderItem	*dest,
 					 const gchar	*file,
@@ -95,6 +103,9 @@ static gint     mh_remove_all_msg	(Folder		*folder,
 static gboolean mh_is_msg_changed	(Folder		*folder,
 					 FolderItem	*item,
 					 MsgInfo	*msginfo);
+static MsgInfoList *mh_get_changed_msgs	(Folder		*folder,
+					 FolderItem	*item,
+					 MsgInfoList	*msglist);
 
 static gint 	mh_get_num_list		(Folder 	*folder,
 			    		 FolderItem 	*item, 
@@ -114,6 +125,8 @@ static gint    mh_remove_folder		(Folder		*folder,
 
 static gchar   *mh_get_new_msg_filename		(FolderItem	*dest);
 
+static void     mh_get_new_msg_flags		(FolderItem	*item,
+						 MsgFlags	*flags);
 static MsgInfo *mh_parse_msg			(const gchar	*file,
 						 FolderItem	*item);
 static void	mh_remove_missing_folder_items	(Folder		*folder);
@@ -137,9 +150,212 @@ static gint mh_get_flags		(Folder *folder, FolderItem *item,
                            		 MsgInfoList *msginfo_list, GHashTable *msgflags);
 #endif
 static void mh_write_sequences		(FolderItem 	*item, gboolean remove_unseen);
+static void mh_change_flags		(Folder		*folder,
+					 FolderItem	*item,
+					 MsgInfo	*msginfo,
+					 MsgPermFlags	 newflags);
+static void mh_item_destroy		(Folder		*folder,
+					 FolderItem	*item);
+static void mh_sequences_invalidate	(FolderItem	*item);
+static void mh_sequences_remove_msg	(FolderItem	*item,
+					 gint		 num);
+static void mh_sequences_check_nums	(FolderItem	*item,
+					 GSList		*nums,
+					 gint		 nummsgs);
 
 static FolderClass mh_class;
 
+#ifdef HAVE_SYS_INOTIFY_H
+/* Once an MH folder has been listed, creation, deletion and renaming of
+ * its message files are followed with inotify. Its numbers are then
+ * known without reading the directory again, and whether it changed
+ * without a stat. When the kernel loses events (queue overflow) or the
+ * directory goes away, watches are dropped and folders are read again
+ * the usual way. */
+typedef struct _MHWatch {
+	Folder		*folder;
+	FolderItem	*item;
+	gchar		*path;
+	gint		 wd;
+	GHashTable	*nums;
+	gboolean	 changed;
+} MHWatch;
+
+#define MH_WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+			 IN_MOVED_TO | IN_ONLYDIR)
+
+static gint mh_inotify_fd = -1;
+static GHashTable *mh_watches = NULL;		/* FolderItem -> MHWatch */
+static GHashTable *mh_watches_by_wd = NULL;	/* wd -> MHWatch */
+
+static void mh_watch_free(MHWatch *watch)
+{
+	g_hash_table_destroy(watch->nums);
+	g_free(watch->path);
+	g_free(watch);
+}
+
+/* Forgets a watch; the kernel already did if removed is set */
+static void mh_watch_remove(MHWatch *watch, gboolean removed)
+{
+	g_hash_table_remove(mh_watches, watch->item);
+	g_hash_table_remove(mh_watches_by_wd, GINT_TO_POINTER(watch->wd));
+	if (!removed)
+		inotify_rm_watch(mh_inotify_fd, watch->wd);
+	mh_watch_free(watch);
+}
+
+static gboolean mh_watch_remove_func(gpointer key, gpointer value,
+				     gpointer data)
+{
+	MHWatch *watch = (MHWatch *)value;
+	Folder *folder = (Folder *)data;
+
+	if (folder != NULL && watch->folder != folder)
+		return FALSE;
+
+	g_hash_table_remove(mh_watches_by_wd, GINT_TO_POINTER(watch->wd));
+	inotify_rm_watch(mh_inotify_fd, watch->wd);
+	mh_watch_free(watch);
+	return TRUE;
+}
+
+/* Drops the watches of folder, or all of them if folder is NULL */
+static void mh_watch_remove_all(Folder *folder)
+{
+	if (mh_watches != NULL)
+		g_hash_table_foreach_remove(mh_watches, mh_watch_remove_func,
+					    folder);
+}
+
+/* Applies the events queued since the last call */
+static void mh_watch_read_events(void)
+{
+	gchar buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	gboolean overflow = FALSE;
+	MHWatch *watch;
+	ssize_t len;
+	gchar *ptr;
+	gint num;
+
+	if (mh_inotify_fd < 0)
+		return;
+
+	while ((len = read(mh_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)ptr;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				overflow = TRUE;
+				continue;
+			}
+			watch = g_hash_table_lookup(mh_watches_by_wd,
+						    GINT_TO_POINTER(event->wd));
+			if (watch == NULL)
+				continue;
+			if (event->mask & IN_IGNORED) {
+				/* directory removed or unmounted */
+				mh_watch_remove(watch, TRUE);
+				continue;
+			}
+			if (event->len == 0 || (event->mask & IN_ISDIR) ||
+			    (num = to_number(event->name)) <= 0)
+				continue;
+
+			if (event->mask & (IN_CREATE | IN_MOVED_TO))
+				g_hash_table_insert(watch->nums,
+					GINT_TO_POINTER(num), GINT_TO_POINTER(num));
+			else
+				g_hash_table_remove(watch->nums,
+					GINT_TO_POINTER(num));
+			watch->changed = TRUE;
+		}
+	}
+
+	if (overflow) {
+		debug_print("MH: inotify queue overflow, dropping watches\n");
+		mh_watch_remove_all(NULL);
+	}
+}
+
+/* Returns the up to date watch of item, if there is one */
+static MHWatch *mh_watch_get(FolderItem *item, const gchar *path)
+{
+	MHWatch *watch;
+
+	if (mh_watches == NULL)
+		return NULL;
+
+	mh_watch_read_events();
+
+	watch = g_hash_table_lookup(mh_watches, item);
+	/* the item was moved, or freed and its address reused */
+	if (watch != NULL && strcmp(watch->path, path) != 0) {
+		mh_watch_remove(watch, FALSE);
+		watch = NULL;
+	}
+
+	return watch;
+}
+
+/* Starts watching the directory of item, before it is read so that no
+ * change can be missed */
+static MHWatch *mh_watch_add(FolderItem *item, const gchar *path)
+{
+	MHWatch *watch;
+	gint wd;
+
+	if (mh_inotify_fd < 0) {
+		if ((mh_inotify_fd = inotify_init()) < 0) {
+			FILE_OP_ERROR(path, "inotify_init");
+			return NULL;
+		}
+		fcntl(mh_inotify_fd, F_SETFL, O_NONBLOCK);
+		fcntl(mh_inotify_fd, F_SETFD, FD_CLOEXEC);
+		mh_watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+		mh_watches_by_wd = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	if ((watch = g_hash_table_lookup(mh_watches, item)) != NULL)
+		mh_watch_remove(watch, FALSE);
+
+	if ((wd = inotify_add_watch(mh_inotify_fd, path, MH_WATCH_EVENTS)) < 0) {
+		/* most likely out of watches, the folder is read each time */
+		debug_print("MH: can't watch %s: %s\n", path, g_strerror(errno));
+		return NULL;
+	}
+	/* the same directory through another item */
+	if ((watch = g_hash_table_lookup(mh_watches_by_wd,
+					 GINT_TO_POINTER(wd))) != NULL) {
+		g_hash_table_remove(mh_watches, watch->item);
+		g_hash_table_remove(mh_watches_by_wd, GINT_TO_POINTER(wd));
+		mh_watch_free(watch);
+	}
+
+	watch = g_new0(MHWatch, 1);
+	watch->folder = item->folder;
+	watch->item = item;
+	watch->path = g_strdup(path);
+	watch->wd = wd;
+	watch->nums = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(mh_watches, item, watch);
+	g_hash_table_insert(mh_watches_by_wd, GINT_TO_POINTER(wd), watch);
+
+	return watch;
+}
+
+static void mh_watch_get_num_list_func(gpointer key, gpointer value,
+				       gpointer data)
+{
+	GSList **list = (GSList **)data;
+
+	*list = g_slist_prepend(*list, key);
+}
+#endif
+
 FolderClass *mh_get_class(void)
 {
 	if (mh_class.idstr == NULL) {
@@ -164,10 +380,12 @@ FolderClass *mh_get_class(void)
 		mh_class.scan_required = mh_scan_required;
 		mh_class.set_mtime = mh_set_mtime;
 		mh_class.close = mh_item_close;
+		mh_class.item_destroy = mh_item_destroy;
 		mh_class.get_flags = NULL; /*mh_get_flags */;
 
 		/* Message functions */
 		mh_class.get_msginfo = mh_get_msginfo;
+		mh_class.get_msginfos = mh_get_msginfos;
 		mh_class.fetch_msg = mh_fetch_msg;
 		mh_class.add_msg = mh_add_msg;
 		mh_class.add_msgs = mh_add_msgs;
@@ -177,6 +395,8 @@ FolderClass *mh_get_class(void)
 		mh_class.remove_msgs = mh_remove_msgs;
 		mh_class.remove_all_msg = mh_remove_all_msg;
 		mh_class.is_msg_changed = mh_is_msg_changed;
+		mh_class.get_changed_msgs = mh_get_changed_msgs;
+		mh_class.change_flags = mh_change_flags;
 	}
 
 	return &mh_class;
@@ -195,6 +415,9 @@ static Folder *mh_folder_new(const gchar *name, const gchar *path)
 
 static void mh_folder_destroy(Folder *folder)
 {
+#ifdef HAVE_SYS_INOTIFY_H
+	mh_watch_remove_all(folder);
+#endif
 	folder_local_folder_destroy(LOCAL_FOLDER(folder));
 }
 
@@ -208,10 +431,22 @@ gboolean mh_scan_required(Folder *folder, FolderItem *item)
 {
 	gchar *path;
 	struct stat s;
+#ifdef HAVE_SYS_INOTIFY_H
+	MHWatch *watch;
+#endif
 
 	path = folder_item_get_path(item);
 	cm_return_val_if_fail(path != NULL, FALSE);
 
+#ifdef HAVE_SYS_INOTIFY_H
+	if ((watch = mh_watch_get(item, path)) != NULL) {
+		debug_print("MH scan %srequired, watched: %s\n",
+			    watch->changed ? "" : "not ", path);
+		g_free(path);
+		return watch->changed;
+	}
+#endif
+
 	if (g_stat(path, &s) < 0) {
 		FILE_OP_ERROR(path, "stat");
 		g_free(path);
@@ -283,16 +518,38 @@ gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *
 	DIR *dp;
 	struct dirent *d;
 	gint num, nummsgs = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+	MHWatch *watch;
+#endif
 
 	cm_return_val_if_fail(item != NULL, -1);
 
-	debug_print("mh_get_num_list(): Scanning %s ...\n", item->path?item->path:"(null)");
-
 	*old_uids_valid = TRUE;
 
 	path = folder_item_get_path(item);
 	cm_return_val_if_fail(path != NULL, -1);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if ((watch = mh_watch_get(item, path)) != NULL) {
+		g_hash_table_foreach(watch->nums, mh_watch_get_num_list_func, list);
+		nummsgs = g_hash_table_size(watch->nums);
+		debug_print("mh_get_num_list(): %d messages in %s, watched\n",
+			    nummsgs, item->path?item->path:"(null)");
+		g_free(path);
+		mh_sequences_check_nums(item, *list, nummsgs);
+		mh_set_mtime(folder, item);
+		return nummsgs;
+	}
+	watch = mh_watch_add(item, path);
+#endif
+
+	debug_print("mh_get_num_list(): Scanning %s ...\n", item->path?item->path:"(null)");
+
 	if (change_dir(path) < 0) {
+#ifdef HAVE_SYS_INOTIFY_H
+		if (watch != NULL)
+			mh_watch_remove(watch, FALSE);
+#endif
 		g_free(path);
 		return -1;
 	}
@@ -300,6 +557,10 @@ gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *
 
 	if ((dp = opendir(".")) == NULL) {
 		FILE_OP_ERROR(item->path, "opendir");
+#ifdef HAVE_SYS_INOTIFY_H
+		if (watch != NULL)
+			mh_watch_remove(watch, FALSE);
+#endif
 		return -1;
 	}
 
@@ -307,10 +568,16 @@ gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *
 		if ((num = to_number(d->d_name)) > 0) {
 			*list = g_slist_prepend(*list, GINT_TO_POINTER(num));
 		   	nummsgs++;
+#ifdef HAVE_SYS_INOTIFY_H
+			if (watch != NULL)
+				g_hash_table_insert(watch->nums,
+					GINT_TO_POINTER(num), GINT_TO_POINTER(num));
+#endif
 		}
 	}
 	closedir(dp);
 
+	mh_sequences_check_nums(item, *list, nummsgs);
 	mh_set_mtime(folder, item);
 	return nummsgs;
 }
@@ -356,6 +623,97 @@ static MsgInfo *mh_get_msginfo(Folder *folder, FolderItem *item, gint num)
 	return msginfo;
 }
 
+/* headers are usually much shorter */
+#define MH_PREFETCH_LEN		16384
+
+/* Headers of new messages are parsed on the folder job threads, into
+ * MsgInfos that nothing else knows about yet */
+typedef struct _MHParseJob {
+	gint		 num;
+	gchar		*file;
+	MsgInfo		*msginfo;
+} MHParseJob;
+
+static void mh_parse_job(gpointer data, gpointer user_data)
+{
+	MHParseJob *job = (MHParseJob *)data;
+	MsgFlags *flags = (MsgFlags *)user_data;
+
+	if (is_file_exist(job->file))
+		job->msginfo = procheader_parse_file(job->file, *flags,
+						     FALSE, FALSE);
+}
+
+static gint mh_parse_job_compare(gconstpointer a, gconstpointer b)
+{
+	const MHParseJob *job_a = *(const MHParseJob **)a;
+	const MHParseJob *job_b = *(const MHParseJob **)b;
+
+	return job_a->num - job_b->num;
+}
+
+static MsgInfoList *mh_get_msginfos(Folder *folder, FolderItem *item,
+				    MsgNumberList *numlist)
+{
+	MsgInfoList *ret = NULL;
+	MsgNumberList *cur;
+	MHParseJob *job;
+	GPtrArray *jobs;
+	FileBatchEntry *entries;
+	MsgFlags flags;
+	gchar *path;
+	guint n, i;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	path = folder_item_get_path(item);
+	cm_return_val_if_fail(path != NULL, NULL);
+
+	n = g_slist_length(numlist);
+	entries = g_new0(FileBatchEntry, n);
+	jobs = g_ptr_array_sized_new(n);
+	for (cur = numlist; cur != NULL; cur = cur->next) {
+		if (GPOINTER_TO_INT(cur->data) <= 0)
+			continue;
+		job = g_new0(MHParseJob, 1);
+		job->num = GPOINTER_TO_INT(cur->data);
+		job->file = g_strconcat(path, G_DIR_SEPARATOR_S,
+					itos(job->num), NULL);
+		entries[jobs->len].file = g_strdup(itos(job->num));
+		g_ptr_array_add(jobs, job);
+	}
+
+	/* the files are then parsed from memory */
+	file_batch_prefetch(path, entries, jobs->len, MH_PREFETCH_LEN);
+	for (i = 0; i < jobs->len; i++)
+		g_free(entries[i].file);
+	g_free(entries);
+	g_free(path);
+
+	mh_get_new_msg_flags(item, &flags);
+
+	conv_prepare_threads();
+	n = folder_run_jobs(jobs, mh_parse_job, &flags);
+	debug_print("mh_get_msginfos(): parsed %d messages on %u threads\n",
+		    jobs->len, n);
+
+	/* back on this thread, in number order */
+	g_ptr_array_sort(jobs, mh_parse_job_compare);
+	for (i = jobs->len; i > 0; i--) {
+		job = g_ptr_array_index(jobs, i - 1);
+		if (job->msginfo != NULL) {
+			job->msginfo->msgnum = job->num;
+			job->msginfo->folder = item;
+			ret = g_slist_prepend(ret, job->msginfo);
+		}
+		g_free(job->file);
+		g_free(job);
+	}
+	g_ptr_array_free(jobs, TRUE);
+
+	return ret;
+}
+
 static gchar *mh_get_new_msg_filename(FolderItem *dest)
 {
 	gchar *destfile;
@@ -433,12 +791,14 @@ static gint mh_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 #ifdef G_OS_UNIX
 		}
 #endif
+		folder_sync_file(destfile);
 
 		if (relation != NULL)
 			g_hash_table_insert(relation, fileinfo, GINT_TO_POINTER(dest->last_num + 1));
 		g_free(destfile);
 		dest->last_num++;
 	}
+	mh_sequences_invalidate(dest);
 	mh_write_sequences(dest, TRUE);
 	return dest->last_num;
 }
@@ -470,6 +830,7 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 	gint curnum = 0, total = 0;
 	gchar *srcpath = NULL;
 	gboolean full_fetch = FALSE;
+	gboolean allow_link;
 	time_t last_dest_mtime = (time_t)0;
 	time_t last_src_mtime = (time_t)0;
 
@@ -499,6 +860,14 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 
 	prefs = dest->prefs;
 
+	/* copies may share the file of the original, as MH messages are
+	 * never written again, except in the queue and drafts, or when a
+	 * chmod of the copy would change the original */
+	allow_link = src != NULL &&
+		     !folder_has_parent_of_type(dest, F_QUEUE) &&
+		     !folder_has_parent_of_type(dest, F_DRAFT) &&
+		     !(prefs && prefs->enable_folder_chmod && prefs->folder_chmod);
+
 	srcpath = folder_item_get_path(msginfo->folder);
 
 	dest_need_scan = mh_scan_required(dest->folder, dest);
@@ -553,7 +922,8 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 			msginfo->flags.tmp_flags &= ~MSG_MOVE_DONE;
 			if (move_file(srcfile, destfile, TRUE) < 0) {
 				FILE_OP_ERROR(srcfile, "move");
-				if (copy_file(srcfile, destfile, TRUE) < 0) {
+				if (copy_file_full(srcfile, destfile, TRUE,
+						   allow_link) < 0) {
 					FILE_OP_ERROR(srcfile, "copy");
 					g_free(srcfile);
 					g_free(destfile);
@@ -563,12 +933,16 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 				/* say unlinking's not necessary */
 				msginfo->flags.tmp_flags |= MSG_MOVE_DONE;
 			}
-		} else if (copy_file(srcfile, destfile, TRUE) < 0) {
+		} else if (copy_file_full(srcfile, destfile, TRUE,
+					  allow_link) < 0) {
 			FILE_OP_ERROR(srcfile, "copy");
 			g_free(srcfile);
 			g_free(destfile);
 			goto err_reset_status;
 		} 
+		/* a renamed file was already on disk */
+		if (!(msginfo->flags.tmp_flags & MSG_MOVE_DONE))
+			folder_sync_file(destfile);
 		if (prefs && prefs->enable_folder_chmod && prefs->folder_chmod) {
 			if (chmod(destfile, prefs->folder_chmod) < 0)
 				FILE_OP_ERROR(destfile, "chmod");
@@ -590,6 +964,7 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 	}
 
 	g_free(srcpath);
+	mh_sequences_invalidate(dest);
 	mh_write_sequences(dest, TRUE);
 
 	if (dest->mtime == last_dest_mtime && !dest_need_scan) {
@@ -607,6 +982,7 @@ static gint mh_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
 	return dest->last_num;
 err_reset_status:
 	g_free(srcpath);
+	mh_sequences_invalidate(dest);
 	mh_write_sequences(dest, TRUE);
 	if (total > 100) {
 		statusbar_progress_all(0,0,0);
@@ -635,6 +1011,7 @@ static gint mh_remove_msg(Folder *folder, FolderItem *item, gint num)
 		g_free(file);
 		return -1;
 	}
+	mh_sequences_remove_msg(item, num);
 
 	if (item->mtime == last_mtime && !need_scan) {
 		mh_set_mtime(folder, item);
@@ -668,6 +1045,7 @@ static gint mh_remove_msgs(Folder *folder, FolderItem *item,
 		MsgInfo *msginfo = (MsgInfo *)cur->data;
 		if (msginfo == NULL)
 			continue;
+		mh_sequences_remove_msg(item, msginfo->msgnum);
 		if (MSG_IS_MOVE(msginfo->flags) && MSG_IS_MOVE_DONE(msginfo->flags)) {
 			msginfo->flags.tmp_flags &= ~MSG_MOVE_DONE;
 			continue;
@@ -715,26 +1093,66 @@ static gint mh_remove_all_msg(Folder *folder, FolderItem *item)
 	val = remove_all_numbered_files(path);
 	g_free(path);
 
+	mh_sequences_invalidate(item);
 	mh_write_sequences(item, TRUE);
 
 	return val;
 }
 
+static gboolean mh_msg_differs(MsgInfo *msginfo, goffset size, time_t mtime)
+{
+	return msginfo->size != size || (
+		(msginfo->mtime - mtime != 0) &&
+		(msginfo->mtime - mtime != 3600) &&
+		(msginfo->mtime - mtime != -3600));
+}
+
 static gboolean mh_is_msg_changed(Folder *folder, FolderItem *item,
 				  MsgInfo *msginfo)
 {
 	struct stat s;
 
 	if (g_stat(itos(msginfo->msgnum), &s) < 0 ||
-	    msginfo->size  != s.st_size || (
-		(msginfo->mtime - s.st_mtime != 0) &&
-		(msginfo->mtime - s.st_mtime != 3600) &&
-		(msginfo->mtime - s.st_mtime != -3600)))
+	    mh_msg_differs(msginfo, s.st_size, s.st_mtime))
 		return TRUE;
 
 	return FALSE;
 }
 
+static MsgInfoList *mh_get_changed_msgs(Folder *folder, FolderItem *item,
+					MsgInfoList *msglist)
+{
+	MsgInfoList *ret = NULL, *cur;
+	MsgInfo *msginfo;
+	FileBatchEntry *entries;
+	gchar *path;
+	guint n, i;
+
+	path = folder_item_get_path(item);
+	cm_return_val_if_fail(path != NULL, NULL);
+
+	n = g_slist_length(msglist);
+	entries = g_new0(FileBatchEntry, n);
+	for (cur = msglist, i = 0; cur != NULL; cur = cur->next, i++) {
+		msginfo = (MsgInfo *)cur->data;
+		entries[i].file = g_strdup_printf("%d", msginfo->msgnum);
+	}
+
+	file_batch_stat(path, entries, n);
+
+	for (cur = msglist, i = 0; cur != NULL; cur = cur->next, i++) {
+		msginfo = (MsgInfo *)cur->data;
+		if (entries[i].error != 0 ||
+		    mh_msg_differs(msginfo, entries[i].size, entries[i].mtime))
+			ret = g_slist_prepend(ret, msginfo);
+		g_free(entries[i].file);
+	}
+	g_free(entries);
+	g_free(path);
+
+	return ret;
+}
+
 static gint mh_scan_tree(Folder *folder)
 {
 	FolderItem *item;
@@ -964,6 +1382,18 @@ static gint mh_remove_folder(Folder *folder, FolderItem *item)
 	return 0;
 }
 
+static void mh_get_new_msg_flags(FolderItem *item, MsgFlags *flags)
+{
+	flags->perm_flags = MSG_NEW|MSG_UNREAD;
+	flags->tmp_flags = 0;
+
+	if (folder_has_parent_of_type(item, F_QUEUE)) {
+		MSG_SET_TMP_FLAGS(*flags, MSG_QUEUED);
+	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
+		MSG_SET_TMP_FLAGS(*flags, MSG_DRAFT);
+	}
+}
+
 static MsgInfo *mh_parse_msg(const gchar *file, FolderItem *item)
 {
 	MsgInfo *msginfo;
@@ -972,14 +1402,7 @@ static MsgInfo *mh_parse_msg(const gchar *file, FolderItem *item)
 	cm_return_val_if_fail(item != NULL, NULL);
 	cm_return_val_if_fail(file != NULL, NULL);
 
-	flags.perm_flags = MSG_NEW|MSG_UNREAD;
-	flags.tmp_flags = 0;
-
-	if (folder_has_parent_of_type(item, F_QUEUE)) {
-		MSG_SET_TMP_FLAGS(flags, MSG_QUEUED);
-	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
-		MSG_SET_TMP_FLAGS(flags, MSG_DRAFT);
-	}
+	mh_get_new_msg_flags(item, &flags);
 
 	msginfo = procheader_parse_file(file, flags, FALSE, FALSE);
 	if (!msginfo) return NULL;
@@ -1243,8 +1666,208 @@ static gchar *get_unseen_seq_name(void)
 	return seq_name;	
 }
 
-static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
+/* The unseen sequence of each folder is kept from the flag changes, so
+ * that writing it needs neither the message list nor a sort. The runs
+ * of the sequence are broken by the seen messages only, not by missing
+ * numbers, so every message number is kept, in order. */
+
+#define MH_SEQUENCES_DELAY	1000
+
+typedef struct _MHSeqMsg {
+	gint	 num;
+	gboolean unseen;
+} MHSeqMsg;
+
+typedef struct _MHSequences {
+	FolderItem	*item;
+	GArray		*msgs;		/* MHSeqMsg, NULL until read again */
+	gboolean	 remove_unseen;
+	guint		 write_id;
+} MHSequences;
+
+static GHashTable *mh_sequences = NULL;		/* FolderItem -> MHSequences */
+
+#define MH_UNSEEN_FLAGS	(MSG_NEW | MSG_UNREAD)
+
+static MHSequences *mh_sequences_get(FolderItem *item, gboolean create)
+{
+	MHSequences *seq;
+
+	if (mh_sequences == NULL) {
+		if (!create)
+			return NULL;
+		mh_sequences = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	seq = g_hash_table_lookup(mh_sequences, item);
+	if (seq == NULL && create) {
+		seq = g_new0(MHSequences, 1);
+		seq->item = item;
+		g_hash_table_insert(mh_sequences, item, seq);
+	}
+
+	return seq;
+}
+
+static void mh_sequences_free(MHSequences *seq)
+{
+	if (seq->write_id > 0)
+		g_source_remove(seq->write_id);
+	if (seq->msgs != NULL)
+		g_array_free(seq->msgs, TRUE);
+	g_free(seq);
+}
+
+/* Forgets the messages of item, to read them from the cache again */
+static void mh_sequences_invalidate(FolderItem *item)
+{
+	MHSequences *seq = mh_sequences_get(item, FALSE);
+
+	if (seq != NULL && seq->msgs != NULL) {
+		g_array_free(seq->msgs, TRUE);
+		seq->msgs = NULL;
+	}
+}
+
+static void mh_sequences_load(MHSequences *seq)
+{
+	GSList *msglist, *cur;
+	MsgInfo *info;
+	MHSeqMsg msg;
+
+	if (seq->msgs != NULL)
+		return;
+
+	msglist = folder_item_get_msg_list(seq->item);
+	msglist = g_slist_sort(msglist, sort_cache_list_by_msgnum);
+
+	seq->msgs = g_array_sized_new(FALSE, FALSE, sizeof(MHSeqMsg),
+				      g_slist_length(msglist));
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		info = (MsgInfo *)cur->data;
+		msg.num = info->msgnum;
+		msg.unseen = (info->flags.perm_flags & MH_UNSEEN_FLAGS) != 0;
+		g_array_append_val(seq->msgs, msg);
+	}
+	procmsg_msg_list_free(msglist);
+}
+
+/* Index of num in seq->msgs, or -1 */
+static gint mh_sequences_find(MHSequences *seq, gint num)
+{
+	gint lo = 0, hi = (gint)seq->msgs->len - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (g_array_index(seq->msgs, MHSeqMsg, mid).num < num)
+			lo = mid + 1;
+		else if (g_array_index(seq->msgs, MHSeqMsg, mid).num > num)
+			hi = mid - 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+static void mh_sequences_remove_msg(FolderItem *item, gint num)
+{
+	MHSequences *seq = mh_sequences_get(item, FALSE);
+	gint i;
+
+	if (seq == NULL || seq->msgs == NULL)
+		return;
+
+	if ((i = mh_sequences_find(seq, num)) >= 0)
+		g_array_remove_index(seq->msgs, i);
+}
+
+/* Keeps the messages of item if nums, the numbers found when scanning
+ * it, are the ones already known */
+static void mh_sequences_check_nums(FolderItem *item, GSList *nums,
+				    gint nummsgs)
+{
+	MHSequences *seq = mh_sequences_get(item, FALSE);
+
+	if (seq == NULL || seq->msgs == NULL)
+		return;
+
+	if (seq->msgs->len == nummsgs) {
+		for (; nums != NULL; nums = nums->next)
+			if (mh_sequences_find(seq,
+					GPOINTER_TO_INT(nums->data)) < 0)
+				break;
+		if (nums == NULL)
+			return;
+	}
+
+	mh_sequences_invalidate(item);
+}
+
+static void mh_change_flags(Folder *folder, FolderItem *item,
+			    MsgInfo *msginfo, MsgPermFlags newflags)
 {
+	MHSequences *seq = mh_sequences_get(item, FALSE);
+	gint i;
+
+	msginfo->flags.perm_flags = newflags;
+
+	if (seq == NULL || seq->msgs == NULL)
+		return;
+
+	if ((i = mh_sequences_find(seq, msginfo->msgnum)) >= 0)
+		g_array_index(seq->msgs, MHSeqMsg, i).unseen =
+			(newflags & MH_UNSEEN_FLAGS) != 0;
+	else
+		mh_sequences_invalidate(item);
+}
+
+static void mh_item_destroy(Folder *folder, FolderItem *item)
+{
+	MHSequences *seq = mh_sequences_get(item, FALSE);
+
+	if (seq != NULL) {
+		g_hash_table_remove(mh_sequences, item);
+		mh_sequences_free(seq);
+	}
+	g_free(item);
+}
+
+/* " a-b c d-e", the runs of unseen messages */
+static gchar *mh_sequences_get_unseen(MHSequences *seq)
+{
+	GString *sequence;
+	MHSeqMsg *msg;
+	gint start = -1, end = -1;
+	guint i;
+
+	mh_sequences_load(seq);
+
+	sequence = g_string_new("");
+	for (i = 0; i <= seq->msgs->len; i++) {
+		msg = i < seq->msgs->len
+			? &g_array_index(seq->msgs, MHSeqMsg, i) : NULL;
+		if (msg && msg->unseen) {
+			if (start < 0)
+				start = end = msg->num;
+			else
+				end = msg->num;
+		} else if (start > 0 && end > 0) {
+			if (start != end)
+				g_string_append_printf(sequence, " %d-%d",
+						       start, end);
+			else
+				g_string_append_printf(sequence, " %d", start);
+			start = end = -1;
+		}
+	}
+
+	return g_string_free(sequence, FALSE);
+}
+
+static void mh_write_sequences_now(MHSequences *seq)
+{
+	FolderItem *item = seq->item;
 	gchar *mh_sequences_old, *mh_sequences_new;
 	FILE *mh_sequences_old_fp, *mh_sequences_new_fp;
 	gchar buf[BUFFSIZE];
@@ -1252,9 +1875,11 @@ static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
 	gboolean err = FALSE;
 	START_TIMING("");
 
-	if (!item)
-		return;
-	
+	if (seq->write_id > 0) {
+		g_source_remove(seq->write_id);
+		seq->write_id = 0;
+	}
+
 	path = folder_item_get_path(item);
 
 	mh_sequences_old = g_strconcat(path, G_DIR_SEPARATOR_S,
@@ -1262,42 +1887,11 @@ static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
 	mh_sequences_new = g_strconcat(path, G_DIR_SEPARATOR_S,
 					    ".mh_sequences.new", NULL);
 	if ((mh_sequences_new_fp = g_fopen(mh_sequences_new, "w+b")) != NULL) {
-		GSList *msglist = folder_item_get_msg_list(item);
-		GSList *cur;
-		MsgInfo *info = NULL;
-		gint start = -1, end = -1;
-		gchar *sequence = g_strdup("");
-		gint seq_len = 0;
-		msglist = g_slist_sort(msglist, sort_cache_list_by_msgnum);
-		cur = msglist;
-		
+		gchar *sequence = NULL;
+
 		/* write the unseen sequence if we don't have to scrap it */
-		if (!remove_unseen) do {
-			info = (MsgInfo *)(cur ? cur->data:NULL);
-			if (info && (MSG_IS_UNREAD(info->flags) || MSG_IS_NEW(info->flags))) {
-				if (start < 0)
-					start = end = info->msgnum;
-				else
-					end = info->msgnum;
-			} else {
-				if (start > 0 && end > 0) {
-					gchar tmp[32];
-					gint tmp_len = 0;
-					if (start != end)
-						snprintf(tmp, 31, " %d-%d", start, end);
-					else
-						snprintf(tmp, 31, " %d", start);
-					
-					tmp_len = strlen(tmp);
-					sequence = g_realloc(sequence, seq_len+tmp_len+1);
-					strcpy(sequence+seq_len, tmp);
-					seq_len += tmp_len;
-
-					start = end = -1;
-				}
-			}
-			cur = cur ? cur->next:NULL;
-		} while (cur || (start > 0 && end > 0));
+		if (!seq->remove_unseen)
+			sequence = mh_sequences_get_unseen(seq);
 		if (sequence && *sequence) {
 			if (fprintf(mh_sequences_new_fp, "%s%s\n", 
 					get_unseen_seq_name(), sequence) < 0)
@@ -1328,7 +1922,6 @@ static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
 		if (!err)
 			g_rename(mh_sequences_new, mh_sequences_old);
 		g_free(sequence);
-		procmsg_msg_list_free(msglist);
 	}
 	g_free(mh_sequences_old);
 	g_free(mh_sequences_new);
@@ -1337,6 +1930,71 @@ static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
 	END_TIMING();
 }
 
+/* Renaming the file changes the mtime of the folder, which must not make
+ * it look modified if it was known to be up to date */
+static void mh_write_delayed_sequences(MHSequences *seq)
+{
+	FolderItem *item = seq->item;
+	gboolean need_scan = mh_scan_required(item->folder, item);
+	time_t last_mtime = item->mtime;
+
+	mh_write_sequences_now(seq);
+
+	if (item->mtime == last_mtime && !need_scan)
+		mh_set_mtime(item->folder, item);
+}
+
+static gboolean mh_write_sequences_timeout(gpointer data)
+{
+	MHSequences *seq = (MHSequences *)data;
+
+	seq->write_id = 0;
+	mh_write_delayed_sequences(seq);
+
+	return FALSE;
+}
+
+/* The unseen sequence is dropped while messages are added, as their
+ * flags are not known yet, and written again when the folder is
+ * closed. Dropping it is delayed, so that a run of additions only
+ * rewrites the file once. */
+static void mh_write_sequences(FolderItem *item, gboolean remove_unseen)
+{
+	MHSequences *seq;
+
+	if (!item)
+		return;
+
+	seq = mh_sequences_get(item, TRUE);
+	seq->remove_unseen = remove_unseen;
+
+	if (!remove_unseen)
+		mh_write_sequences_now(seq);
+	else if (seq->write_id == 0)
+		seq->write_id = g_timeout_add(MH_SEQUENCES_DELAY,
+					      mh_write_sequences_timeout, seq);
+}
+
+static void mh_write_pending_sequences_func(gpointer key, gpointer value,
+					    gpointer data)
+{
+	MHSequences *seq = (MHSequences *)value;
+
+	if (seq->write_id > 0)
+		mh_write_delayed_sequences(seq);
+}
+
+/**
+ * Writes the .mh_sequences files whose update was delayed, before
+ * quitting.
+ */
+void mh_write_pending_sequences(void)
+{
+	if (mh_sequences != NULL)
+		g_hash_table_foreach(mh_sequences,
+				     mh_write_pending_sequences_func, NULL);
+}
+
 static int mh_item_close(Folder *folder, FolderItem *item)
 {
 	time_t last_mtime = (time_t)0;
@@ -1356,6 +2014,9 @@ static void mh_set_mtime(Folder *folder, FolderItem *item)
 {
 	struct stat s;
 	gchar *path = folder_item_get_path(item);
+#ifdef HAVE_SYS_INOTIFY_H
+	MHWatch *watch;
+#endif
 
 	cm_return_if_fail(path != NULL);
 
@@ -1367,5 +2028,10 @@ static void mh_set_mtime(Folder *folder, FolderItem *item)
 
 	item->mtime = s.st_mtime;
 	debug_print("MH: forced mtime of %s to %ld\n", item->name?item->name:"(null)", item->mtime);
+#ifdef HAVE_SYS_INOTIFY_H
+	/* as with the mtime, changes seen so far are taken as known */
+	if ((watch = mh_watch_get(item, path)) != NULL)
+		watch->changed = FALSE;
+#endif
 	g_free(path);
 }
@@ -35,5 +35,6 @@ struct _MHFolder
 };
 
 FolderClass *mh_get_class	(void);
+void mh_write_pending_sequences	(void);
 
 #endif /* __MH_H__ */
@@ -74,9 +74,36 @@ static FolderViewPopup mh_popup =
 	set_sensitivity
 };
 
+/* Maildir folders are handled the same way */
+static FolderViewPopup maildir_popup =
+{
+	"maildir",
+	"<MaildirFolder>",
+	mh_popup_entries,
+	G_N_ELEMENTS(mh_popup_entries),
+	NULL, 0,
+	NULL, 0, 0, NULL,
+	add_menuitems,
+	set_sensitivity
+};
+
+static FolderViewPopup mbox_popup =
+{
+	"mbox",
+	"<MboxFolder>",
+	mh_popup_entries,
+	G_N_ELEMENTS(mh_popup_entries),
+	NULL, 0,
+	NULL, 0, 0, NULL,
+	add_menuitems,
+	set_sensitivity
+};
+
 void mh_gtk_init(void)
 {
 	folderview_register_popup(&mh_popup);
+	folderview_register_popup(&maildir_popup);
+	folderview_register_popup(&mbox_popup);
 }
 
 static void add_menuitems(GtkUIManager *ui_manager, FolderItem *item)
@@ -295,7 +322,8 @@ static void move_folder_cb(GtkAction *action, gpointer data)
 	FolderItem *from_folder = NULL, *to_folder = NULL;
 
 	from_folder = folderview_get_selected_item(folderview);
-	if (!from_folder || from_folder->folder->klass != mh_get_class())
+	if (!from_folder || (FOLDER_TYPE(from_folder->folder) != F_MH &&
+			     FOLDER_TYPE(from_folder->folder) != F_MAILDIR))
 		return;
 
 	to_folder = foldersel_folder_sel(from_folder->folder, FOLDER_SEL_MOVE, NULL, TRUE);
@@ -311,7 +339,8 @@ static void copy_folder_cb(GtkAction *action, gpointer data)
 	FolderItem *from_folder = NULL, *to_folder = NULL;
 
 	from_folder = folderview_get_selected_item(folderview);
-	if (!from_folder || from_folder->folder->klass != mh_get_class())
+	if (!from_folder || (FOLDER_TYPE(from_folder->folder) != F_MH &&
+			     FOLDER_TYPE(from_folder->folder) != F_MAILDIR))
 		return;
 
 	to_folder = foldersel_folder_sel(from_folder->folder, FOLDER_SEL_MOVE, NULL, TRUE);
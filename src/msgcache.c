@@ -38,6 +38,9 @@
 #include <sys/stat.h>
 
 #include <time.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "msgcache.h"
 #include "utils.h"
@@ -90,8 +93,6 @@ static gboolean msgcache_use_mmap_read = TRUE;
 static gboolean msgcache_use_mmap_read = TRUE;
 #endif
 
-static gboolean swapping = TRUE;
-
 typedef enum
 {
 	DATA_READ,
@@ -99,19 +100,107 @@ typedef enum
 	DATA_APPEND
 } DataOpenMode;
 
+/* Version of the cache format whose strings are not NUL-terminated on
+ * disk. It is still read, through heap copies, so that upgrading does
+ * not force a rescan of every folder. */
+#define CACHE_VERSION_UNTERMINATED	24
+
+/* Version of the cache format without the trailing record index. Its
+ * records are identical to the current ones. */
+#define CACHE_VERSION_UNINDEXED		25
+
+/* Version of the cache format without the encoding word after the
+ * charset. Its files are laid out as plain current ones. */
+#define CACHE_VERSION_UNENCODED		26
+
+/* Encodings of the records of a cache file. Plain records are followed
+ * by their index; compressed records are stored in blocks of about
+ * CACHE_BLOCK_SIZE bytes, each holding whole records and preceded by
+ * its decompressed and compressed sizes, up to an empty block. There
+ * is no index for them, as records can not be reached in place. */
+#define CACHE_ENCODING_PLAIN		0
+#define CACHE_ENCODING_ZLIB		1
+
+#define CACHE_BLOCK_SIZE		(64 * 1024)
+#define CACHE_BLOCK_MAX_SIZE		(16 * 1024 * 1024)
+
+/* A flag or tag journal is compacted into its base file once it grows
+ * past the size of the base file, but never below this size. */
+#define JOURNAL_MIN_COMPACT_SIZE	(64 * 1024)
+
+/* The records of a cache file are followed by an index of (msgnum,
+ * offset) pairs sorted by msgnum, then by (msgid hash, index position)
+ * pairs sorted by hash, then by a trailer holding the offset of the
+ * index, the number of entries of both tables and this magic. Offsets
+ * are 32 bits: files whose records end past 4GB are written without
+ * an index, and read whole as older files are. */
+#define CACHE_INDEX_MAGIC		0x78646e49
+#define CACHE_TRAILER_SIZE		16
+
+/* A message of an indexed cache file whose record has not been decoded
+ * yet. Flags and tags read before it is decoded are kept here. */
+typedef struct _MsgCacheEntry {
+	guint32		 num;
+	guint32		 offset;
+	MsgPermFlags	 perm_flags;
+	GSList		*tags;
+	gboolean	 lazy;
+} MsgCacheEntry;
+
 struct _MsgCache {
 	GHashTable	*msgnum_table;
 	GHashTable	*msgid_table;
+	MsgCacheMap	*map;
 	guint		 memusage;
+	guint		 mapusage;
 	time_t		 last_access;
+	GList		 lru_link;
+
+	/* msgnums whose flags/tags changed since the last write */
+	GHashTable	*mark_pending;
+	GHashTable	*tags_pending;
+	/* bytes of records in the on-disk journals */
+	guint		 mark_journal_size;
+	guint		 tags_journal_size;
+
+	/* index of the mapped cache file, for records decoded on demand */
+	FolderItem	*item;
+	MsgTmpFlags	 tmp_flags;
+	MsgCacheEntry	*entries;
+	guint		 n_entries;
+	guint		 n_lazy;
+	gchar		*msgid_index;
+	guint		 n_msgids;
+};
+
+/* Read-only mapping of a cache file. MsgInfo string fields read from it
+ * point directly into the mapping, and each such MsgInfo holds a
+ * reference so that the mapping outlives the MsgCache if needed. */
+struct _MsgCacheMap {
+	gint		 refcnt;
+	gchar		*data;
+	gsize		 len;
 };
 
+/* Every cache, most recently used first, and the heap bytes used by
+ * all of them; caches may be read and written on worker threads. */
+static GQueue msgcache_lru = { NULL, NULL, 0 };
+static gsize msgcache_total_memusage = 0;
+G_LOCK_DEFINE_STATIC(msgcache_lru);
+
+/* Heap bytes of a hash table slot, counted once per table holding a
+ * MsgInfo */
+#define MSGCACHE_TABLE_SLOT_SIZE	(3 * sizeof(gpointer))
+
 typedef struct _StringConverter StringConverter;
 struct _StringConverter {
 	gchar *(*convert) (StringConverter *converter, gchar *srcstr);
 	void   (*free)    (StringConverter *converter);
 };
 
+static MsgInfo *msgcache_materialize_entry(MsgCache *cache,
+					   MsgCacheEntry *entry);
+
 typedef struct _StrdupConverter StrdupConverter;
 struct _StrdupConverter {
 	StringConverter converter;
@@ -125,47 +214,264 @@ struct _CharsetConverter {
 	gchar *dstcharset;
 };
 
-MsgCache *msgcache_new(void)
+static guint msgcache_msginfo_memusage(MsgInfo *msginfo)
+{
+	return procmsg_msginfo_memusage(msginfo) +
+		MSGCACHE_TABLE_SLOT_SIZE * (msginfo->msgid ? 2 : 1);
+}
+
+/* Adds delta bytes to the memory usage of the cache and of all caches */
+static void msgcache_charge(MsgCache *cache, gint delta)
+{
+	G_LOCK(msgcache_lru);
+	cache->memusage += delta;
+	msgcache_total_memusage += delta;
+	G_UNLOCK(msgcache_lru);
+}
+
+/* A msginfo may change while it is in the cache, so what it gives back
+ * when it leaves is what it was charged when it entered */
+static void msgcache_charge_msginfo(MsgCache *cache, MsgInfo *msginfo)
+{
+	msginfo->cache_memusage = msgcache_msginfo_memusage(msginfo);
+	msgcache_charge(cache, msginfo->cache_memusage);
+}
+
+static void msgcache_release_msginfo(MsgCache *cache, MsgInfo *msginfo)
+{
+	msgcache_charge(cache, -(gint) msginfo->cache_memusage);
+	msginfo->cache_memusage = 0;
+}
+
+/* Marks the cache as the most recently used one */
+static void msgcache_touch(MsgCache *cache)
+{
+	msgcache_touch(cache);
+
+	G_LOCK(msgcache_lru);
+	if (msgcache_lru.head != &cache->lru_link) {
+		g_queue_unlink(&msgcache_lru, &cache->lru_link);
+		g_queue_push_head_link(&msgcache_lru, &cache->lru_link);
+	}
+	G_UNLOCK(msgcache_lru);
+}
+
+MsgCache *msgcache_new(FolderItem *item)
 {
 	MsgCache *cache;
 	
 	cache = g_new0(MsgCache, 1),
 	cache->msgnum_table = g_hash_table_new(g_int_hash, g_int_equal);
 	cache->msgid_table = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->mark_pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cache->tags_pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cache->item = item;
 	cache->last_access = time(NULL);
+	cache->lru_link.data = cache;
+	cache->memusage = sizeof(MsgCache);
+
+	G_LOCK(msgcache_lru);
+	g_queue_push_head_link(&msgcache_lru, &cache->lru_link);
+	msgcache_total_memusage += cache->memusage;
+	G_UNLOCK(msgcache_lru);
 
 	return cache;
 }
 
-static gboolean msgcache_msginfo_free_func(gpointer num, gpointer msginfo, gpointer user_data)
+static MsgCacheMap *msgcache_map_new(gchar *data, gsize len)
 {
-	procmsg_msginfo_free((MsgInfo *)msginfo);
-	return TRUE;
-}											  
+	MsgCacheMap *map;
+
+	map = g_new0(MsgCacheMap, 1);
+	map->refcnt = 1;
+	map->data = data;
+	map->len = len;
+
+	return map;
+}
+
+MsgCacheMap *msgcache_map_ref(MsgCacheMap *map)
+{
+	cm_return_val_if_fail(map != NULL, NULL);
+
+	g_atomic_int_inc(&map->refcnt);
+
+	return map;
+}
+
+void msgcache_map_unref(MsgCacheMap *map)
+{
+	if (map == NULL)
+		return;
+
+	if (!g_atomic_int_dec_and_test(&map->refcnt))
+		return;
+
+	debug_print("Unmapping %zd bytes of message cache\n", map->len);
+#ifdef G_OS_WIN32
+	UnmapViewOfFile((void*) map->data);
+#else
+	munmap(map->data, map->len);
+#endif
+	g_free(map);
+}
+
+gboolean msgcache_map_owns(MsgCacheMap *map, gconstpointer ptr)
+{
+	if (map == NULL || ptr == NULL)
+		return FALSE;
+
+	return ((const gchar *)ptr >= map->data &&
+		(const gchar *)ptr < map->data + map->len);
+}
+
+static gint msgcache_entry_compare(gconstpointer key, gconstpointer elem)
+{
+	guint32 num = *(const guint32 *)key;
+	const MsgCacheEntry *entry = elem;
+
+	if (num < entry->num)
+		return -1;
+	return (num > entry->num) ? 1 : 0;
+}
+
+/* Returns the entry of a message whose record is not decoded yet */
+static MsgCacheEntry *msgcache_lookup_entry(MsgCache *cache, guint num)
+{
+	MsgCacheEntry *entry;
+	guint32 key = num;
+
+	if (cache->n_lazy == 0)
+		return NULL;
+
+	entry = bsearch(&key, cache->entries, cache->n_entries,
+			sizeof(MsgCacheEntry), msgcache_entry_compare);
+
+	return (entry != NULL && entry->lazy) ? entry : NULL;
+}
+
+static void msgcache_drop_entry(MsgCache *cache, MsgCacheEntry *entry)
+{
+	g_slist_free(entry->tags);
+	entry->tags = NULL;
+	entry->lazy = FALSE;
+	cache->n_lazy--;
+}
+
+static void msgcache_materialize_all(MsgCache *cache)
+{
+	guint i;
+
+	if (cache->n_lazy == 0)
+		return;
+
+	debug_print("Decoding %u remaining cache records\n", cache->n_lazy);
+	for (i = 0; i < cache->n_entries && cache->n_lazy > 0; i++) {
+		if (cache->entries[i].lazy)
+			msgcache_materialize_entry(cache, &cache->entries[i]);
+	}
+}
+
+static guint32 msgcache_get_uint32(const gchar *data, gboolean swapped)
+{
+	return swapped ? MMAP_TO_GUINT32_SWAPPED(data) : MMAP_TO_GUINT32(data);
+}
+
+/* Hash of a Message-ID as stored in the index of cache files, so it
+ * must not change between versions. */
+static guint32 msgcache_msgid_hash(const gchar *msgid)
+{
+	const guchar *p;
+	guint32 hash = 5381;
+
+	for (p = (const guchar *)msgid; *p != '\0'; p++)
+		hash = (hash << 5) + hash + *p;
+
+	return hash;
+}
+
+/* Decodes the records whose Message-ID has the same hash as msgid until
+ * one of them matches. */
+static MsgInfo *msgcache_materialize_msgid(MsgCache *cache, const gchar *msgid)
+{
+	MsgInfo *msginfo;
+	guint32 hash = msgcache_msgid_hash(msgid);
+	guint lo = 0, hi = cache->n_msgids, mid;
+	guint32 pos;
+
+	/* find the first entry with this hash */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (msgcache_get_uint32(cache->msgid_index + 8 * mid, TRUE) < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < cache->n_msgids &&
+	       msgcache_get_uint32(cache->msgid_index + 8 * lo, TRUE) == hash; lo++) {
+		pos = msgcache_get_uint32(cache->msgid_index + 8 * lo + 4, TRUE);
+		if (pos >= cache->n_entries || !cache->entries[pos].lazy)
+			continue;
+		msginfo = msgcache_materialize_entry(cache, &cache->entries[pos]);
+		if (msginfo && msginfo->msgid && !strcmp(msginfo->msgid, msgid))
+			return msginfo;
+	}
+
+	return NULL;
+}
+
+static void msgcache_msginfo_collect_func(gpointer num, gpointer msginfo, gpointer user_data)
+{
+	g_ptr_array_add((GPtrArray *)user_data, msginfo);
+}
 
 void msgcache_destroy(MsgCache *cache)
 {
+	GPtrArray *msginfos;
+	guint i;
+
 	cm_return_if_fail(cache != NULL);
 
-	g_hash_table_foreach_remove(cache->msgnum_table, msgcache_msginfo_free_func, NULL);
+	G_LOCK(msgcache_lru);
+	g_queue_unlink(&msgcache_lru, &cache->lru_link);
+	msgcache_total_memusage -= cache->memusage;
+	G_UNLOCK(msgcache_lru);
+
+	for (i = 0; i < cache->n_entries; i++)
+		g_slist_free(cache->entries[i].tags);
+	g_free(cache->entries);
+	/* the messages go together, releasing their addresses to the
+	 * string table under one lock */
+	msginfos = g_ptr_array_sized_new(g_hash_table_size(cache->msgnum_table));
+	g_hash_table_foreach(cache->msgnum_table, msgcache_msginfo_collect_func, msginfos);
 	g_hash_table_destroy(cache->msgid_table);
 	g_hash_table_destroy(cache->msgnum_table);
+	procmsg_msginfo_free_array(msginfos);
+	g_ptr_array_free(msginfos, TRUE);
+	g_hash_table_destroy(cache->mark_pending);
+	g_hash_table_destroy(cache->tags_pending);
+	msgcache_map_unref(cache->map);
 	g_free(cache);
 }
 
 void msgcache_add_msg(MsgCache *cache, MsgInfo *msginfo) 
 {
 	MsgInfo *newmsginfo;
+	MsgCacheEntry *entry;
 
 	cm_return_if_fail(cache != NULL);
 	cm_return_if_fail(msginfo != NULL);
 
+	if ((entry = msgcache_lookup_entry(cache, msginfo->msgnum)) != NULL)
+		msgcache_drop_entry(cache, entry);
+
 	newmsginfo = procmsg_msginfo_new_ref(msginfo);
 	g_hash_table_insert(cache->msgnum_table, &newmsginfo->msgnum, newmsginfo);
 	if(newmsginfo->msgid != NULL)
 		g_hash_table_insert(cache->msgid_table, newmsginfo->msgid, newmsginfo);
-	cache->memusage += procmsg_msginfo_memusage(msginfo);
-	cache->last_access = time(NULL);
+	msgcache_charge_msginfo(cache, newmsginfo);
+	msgcache_touch(cache);
 
 	msginfo->folder->cache_dirty = TRUE;
 
@@ -175,21 +481,32 @@ void msgcache_add_msg(MsgCache *cache, MsgInfo *msginfo)
 void msgcache_remove_msg(MsgCache *cache, guint msgnum)
 {
 	MsgInfo *msginfo;
+	MsgCacheEntry *entry;
+	FolderItem *item;
 
 	cm_return_if_fail(cache != NULL);
 
+	/* a record that was never decoded can just be forgotten */
+	if ((entry = msgcache_lookup_entry(cache, msgnum)) != NULL) {
+		msgcache_drop_entry(cache, entry);
+		msgcache_touch(cache);
+		cache->item->cache_dirty = TRUE;
+		return;
+	}
+
 	msginfo = (MsgInfo *) g_hash_table_lookup(cache->msgnum_table, &msgnum);
 	if(!msginfo)
 		return;
 
-	cache->memusage -= procmsg_msginfo_memusage(msginfo);
+	item = msginfo->folder;
+	msgcache_release_msginfo(cache, msginfo);
 	if(msginfo->msgid)
 		g_hash_table_remove(cache->msgid_table, msginfo->msgid);
 	g_hash_table_remove(cache->msgnum_table, &msginfo->msgnum);
 	procmsg_msginfo_free(msginfo);
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 
-	msginfo->folder->cache_dirty = TRUE;
+	item->cache_dirty = TRUE;
 
 	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
 }
@@ -197,16 +514,20 @@ void msgcache_remove_msg(MsgCache *cache, guint msgnum)
 void msgcache_update_msg(MsgCache *cache, MsgInfo *msginfo)
 {
 	MsgInfo *oldmsginfo, *newmsginfo;
+	MsgCacheEntry *entry;
 	
 	cm_return_if_fail(cache != NULL);
 	cm_return_if_fail(msginfo != NULL);
 
+	if ((entry = msgcache_lookup_entry(cache, msginfo->msgnum)) != NULL)
+		msgcache_drop_entry(cache, entry);
+
 	oldmsginfo = g_hash_table_lookup(cache->msgnum_table, &msginfo->msgnum);
 	if(oldmsginfo && oldmsginfo->msgid) 
 		g_hash_table_remove(cache->msgid_table, oldmsginfo->msgid);
 	if (oldmsginfo) {
 		g_hash_table_remove(cache->msgnum_table, &oldmsginfo->msgnum);
-		cache->memusage -= procmsg_msginfo_memusage(oldmsginfo);
+		msgcache_release_msginfo(cache, oldmsginfo);
 		procmsg_msginfo_free(oldmsginfo);
 	}
 
@@ -214,8 +535,8 @@ void msgcache_update_msg(MsgCache *cache, MsgInfo *msginfo)
 	g_hash_table_insert(cache->msgnum_table, &newmsginfo->msgnum, newmsginfo);
 	if(newmsginfo->msgid)
 		g_hash_table_insert(cache->msgid_table, newmsginfo->msgid, newmsginfo);
-	cache->memusage += procmsg_msginfo_memusage(newmsginfo);
-	cache->last_access = time(NULL);
+	msgcache_charge_msginfo(cache, newmsginfo);
+	msgcache_touch(cache);
 	
 	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
 
@@ -227,13 +548,16 @@ void msgcache_update_msg(MsgCache *cache, MsgInfo *msginfo)
 MsgInfo *msgcache_get_msg(MsgCache *cache, guint num)
 {
 	MsgInfo *msginfo;
+	MsgCacheEntry *entry;
 
 	cm_return_val_if_fail(cache != NULL, NULL);
 
 	msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
+	if (!msginfo && (entry = msgcache_lookup_entry(cache, num)) != NULL)
+		msginfo = msgcache_materialize_entry(cache, entry);
 	if(!msginfo)
 		return NULL;
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	return procmsg_msginfo_new_ref(msginfo);
 }
@@ -246,9 +570,11 @@ MsgInfo *msgcache_get_msg_by_id(MsgCache *cache, const gchar *msgid)
 	cm_return_val_if_fail(msgid != NULL, NULL);
 
 	msginfo = g_hash_table_lookup(cache->msgid_table, msgid);
+	if (!msginfo && cache->n_lazy > 0)
+		msginfo = msgcache_materialize_msgid(cache, msgid);
 	if(!msginfo)
 		return NULL;
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	return procmsg_msginfo_new_ref(msginfo);	
 }
@@ -267,14 +593,69 @@ MsgInfoList *msgcache_get_msg_list(MsgCache *cache)
 	START_TIMING("");
 	cm_return_val_if_fail(cache != NULL, NULL);
 
+	msgcache_materialize_all(cache);
 	g_hash_table_foreach((GHashTable *)cache->msgnum_table, msgcache_get_msg_list_func, (gpointer)&msg_list);	
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	msg_list = g_slist_reverse(msg_list);
 	END_TIMING();
 	return msg_list;
 }
 
+static void msgcache_get_stamp_array_func(gpointer key, gpointer value, gpointer user_data)
+{
+	GArray *stamps = user_data;
+	MsgInfo *msginfo = value;
+	MsgCacheStamp stamp;
+
+	stamp.num = msginfo->msgnum;
+	stamp.size = msginfo->size;
+	stamp.mtime = msginfo->mtime;
+	stamp.perm_flags = msginfo->flags.perm_flags;
+	g_array_append_val(stamps, stamp);
+}
+
+/* Returns the number, size, mtime and flags of all cached messages, in
+ * no particular order. Records of indexed caches are not decoded: size
+ * and mtime are read where they start. */
+MsgCacheStamp *msgcache_get_stamp_array(MsgCache *cache, guint *n_stamps)
+{
+	GArray *stamps;
+	MsgCacheEntry *entry;
+	MsgCacheStamp stamp;
+	const gchar *record;
+	guint i;
+
+	cm_return_val_if_fail(cache != NULL, NULL);
+	cm_return_val_if_fail(n_stamps != NULL, NULL);
+
+	stamps = g_array_sized_new(FALSE, FALSE, sizeof(MsgCacheStamp),
+			g_hash_table_size(cache->msgnum_table) + cache->n_lazy);
+	g_hash_table_foreach(cache->msgnum_table, msgcache_get_stamp_array_func, stamps);
+	for (i = 0; i < cache->n_entries; i++) {
+		entry = &cache->entries[i];
+		if (!entry->lazy)
+			continue;
+		/* msgnum, size and mtime lead every record */
+		if ((gsize) entry->offset + 12 > cache->map->len) {
+			g_warning("Cache record of message %u corrupted\n", entry->num);
+			msgcache_drop_entry(cache, entry);
+			cache->item->cache_dirty = TRUE;
+			continue;
+		}
+		record = cache->map->data + entry->offset;
+		stamp.num = entry->num;
+		stamp.size = msgcache_get_uint32(record + 4, TRUE);
+		stamp.mtime = msgcache_get_uint32(record + 8, TRUE);
+		stamp.perm_flags = entry->perm_flags;
+		g_array_append_val(stamps, stamp);
+	}
+	msgcache_touch(cache);
+
+	*n_stamps = stamps->len;
+	return (MsgCacheStamp *) g_array_free(stamps, FALSE);
+}
+
 time_t msgcache_get_last_access_time(MsgCache *cache)
 {
 	cm_return_val_if_fail(cache != NULL, 0);
@@ -289,18 +670,93 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 	return cache->memusage;
 }
 
+/* Heap bytes used by all caches; mapped cache files are not counted.
+ * Shared address strings are not either: they are only released once
+ * no cache uses them, so freeing a cache would not give them back. */
+gsize msgcache_get_total_memory_usage(void)
+{
+	gsize memusage;
+
+	G_LOCK(msgcache_lru);
+	memusage = msgcache_total_memusage;
+	G_UNLOCK(msgcache_lru);
+
+	return memusage;
+}
+
+/* Returns the cache used just before cache, or the least recently used
+ * cache if cache is NULL. */
+MsgCache *msgcache_get_lru_older(MsgCache *cache)
+{
+	GList *link;
+
+	G_LOCK(msgcache_lru);
+	link = (cache != NULL) ? cache->lru_link.prev : msgcache_lru.tail;
+	G_UNLOCK(msgcache_lru);
+
+	return (link != NULL) ? (MsgCache *) link->data : NULL;
+}
+
+FolderItem *msgcache_get_folder_item(MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, NULL);
+
+	return cache->item;
+}
+
+gint msgcache_get_mapped_memory_usage(MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, 0);
+
+	return cache->mapusage;
+}
+
+void msgcache_journal_flags(MsgCache *cache, guint num)
+{
+	cm_return_if_fail(cache != NULL);
+
+	g_hash_table_insert(cache->mark_pending, GUINT_TO_POINTER(num),
+			    GUINT_TO_POINTER(num));
+}
+
+void msgcache_journal_tags(MsgCache *cache, guint num)
+{
+	cm_return_if_fail(cache != NULL);
+
+	g_hash_table_insert(cache->tags_pending, GUINT_TO_POINTER(num),
+			    GUINT_TO_POINTER(num));
+}
+
+void msgcache_remove_journal(const gchar *file)
+{
+	gchar *journal_file;
+
+	cm_return_if_fail(file != NULL);
+
+	journal_file = g_strconcat(file, JOURNAL_SUFFIX, NULL);
+	if (is_file_exist(journal_file))
+		claws_unlink(journal_file);
+	g_free(journal_file);
+}
+
+gboolean msgcache_has_journal(MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, FALSE);
+
+	return cache->mark_journal_size > 0 || cache->tags_journal_size > 0;
+}
+
 /*
  *  Cache saving functions
  */
 
-#define READ_CACHE_DATA(data, fp, total_len) \
+#define READ_CACHE_DATA(data, fp) \
 { \
-	if ((tmp_len = msgcache_read_cache_data_str(fp, &data, conv)) < 0) { \
+	if ((tmp_len = msgcache_read_cache_data_str(fp, &data, conv, swapping, terminated)) < 0) { \
 		procmsg_msginfo_free(msginfo); \
 		error = TRUE; \
 		goto bail_err; \
 	} \
-	total_len += tmp_len; \
 }
 
 #define READ_CACHE_DATA_INT(n, fp) \
@@ -329,22 +785,28 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 	walk_data += 4;	rem_len -= 4;								\
 }
 
-#define GET_CACHE_DATA(data, total_len) \
+#define GET_CACHE_DATA(data) \
 { \
 	GET_CACHE_DATA_INT(tmp_len);	\
-	if (rem_len < tmp_len) {								\
+	if (tmp_len < 0 || rem_len < tmp_len + (terminated ? 1 : 0)) {			\
 		g_print("error at rem_len:%d (tmp_len %d)\n", rem_len, tmp_len);		\
 		error = TRUE;									\
 		goto bail_err;									\
 	}											\
-	if ((tmp_len = msgcache_get_cache_data_str(walk_data, &data, tmp_len, conv)) < 0) { \
+	if (terminated && walk_data[tmp_len] != '\0') {					\
+		g_print("error at rem_len:%d (unterminated)\n", rem_len);			\
+		error = TRUE; \
+		goto bail_err; \
+	}											\
+	if (map != NULL) {									\
+		data = (tmp_len > 0) ? walk_data : NULL;					\
+	} else if ((tmp_len = msgcache_get_cache_data_str(walk_data, &data, tmp_len, conv)) < 0) { \
 		g_print("error at rem_len:%d\n", rem_len);\
-		procmsg_msginfo_free(msginfo); \
 		error = TRUE; \
 		goto bail_err; \
 	} \
-	total_len += tmp_len; \
-	walk_data += tmp_len; rem_len -= tmp_len; \
+	walk_data += tmp_len + (terminated ? 1 : 0); \
+	rem_len -= tmp_len + (terminated ? 1 : 0); \
 }
 
 
@@ -381,6 +843,11 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 			w_err = 1;			\
 		wrote += len;				\
 	} \
+	if (w_err == 0) {				\
+		if (SC_FWRITE("", 1, 1, fp) != 1)	\
+			w_err = 1;			\
+		wrote += 1;				\
+	} \
 }
 
 #define PUT_CACHE_DATA(data)				\
@@ -396,6 +863,29 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 		walk_data += len;			\
 		wrote += len;				\
 	}						\
+	*walk_data++ = '\0';				\
+	wrote += 1;					\
+}
+
+#define APPEND_CACHE_DATA_INT(n, buf)			\
+{							\
+	guint32 idata;					\
+							\
+	idata = (guint32)bswap_32(n);			\
+	g_byte_array_append(buf, (guint8 *)&idata, sizeof(idata)); \
+	wrote += 4;					\
+}
+
+#define APPEND_CACHE_DATA(data, buf)			\
+{							\
+	size_t len;					\
+	if (data == NULL)				\
+		len = 0;				\
+	else						\
+		len = strlen(data);			\
+	APPEND_CACHE_DATA_INT(len, buf);		\
+	g_byte_array_append(buf, (guint8 *)(len > 0 ? data : ""), len + 1); \
+	wrote += len + 1;				\
 }
 
 static FILE *msgcache_open_data_file(const gchar *file, guint version,
@@ -460,7 +950,9 @@ static FILE *msgcache_open_data_file(const gchar *file, guint version,
 }
 
 static gint msgcache_read_cache_data_str(FILE *fp, gchar **str, 
-					 StringConverter *conv)
+					 StringConverter *conv,
+					 gboolean swapping,
+					 gboolean terminated)
 {
 	gchar *tmpstr = NULL;
 	size_t ni;
@@ -486,8 +978,14 @@ static gint msgcache_read_cache_data_str(FILE *fp, gchar **str,
 		len = bswap_32(len);
 	}
 
-	if (len == 0)
+	if (len == 0) {
+		if (terminated && fgetc(fp) != '\0') {
+			g_warning("read_data_str: Cache data (terminator) corrupted "
+				  "at offset %ld\n", ftell(fp));
+			return -1;
+		}
 		return 0;
+	}
 
 	tmpstr = g_try_malloc(len + 1);
 
@@ -495,7 +993,9 @@ static gint msgcache_read_cache_data_str(FILE *fp, gchar **str,
 		return -1;
 	}
 
-	if ((ni = fread(tmpstr, 1, len, fp)) != len) {
+	if ((ni = fread(tmpstr, 1, len + (terminated ? 1 : 0), fp)) 
+			!= len + (terminated ? 1 : 0)
+	    || (terminated && tmpstr[len] != '\0')) {
 		g_warning("read_data_str: Cache data corrupted, read %zd of %u "
 			  "bytes at offset %ld\n", 
 			  ni, len, ftell(fp));
@@ -561,10 +1061,264 @@ static void strconv_charset_free(StringConverter *conv)
 	g_free(charsetconv->dstcharset);
 }
 
+/* Decodes the cache record at *walk, moving *walk and *len past it.
+ * Returns NULL if the record is corrupted. */
+static MsgInfo *msgcache_decode_record(FolderItem *item, MsgCacheMap *map,
+				       StringConverter *conv,
+				       gboolean swapping, gboolean terminated,
+				       MsgTmpFlags tmp_flags, gchar **walk,
+				       gint *len, guint *memusage)
+{
+	MsgInfo *msginfo = NULL;
+	gchar *walk_data = *walk;
+	gint rem_len = *len;
+	gint tmp_len = 0;
+	guint32 num;
+	guint refnum;
+	gchar *ref;
+	gboolean error = FALSE;
+
+	GET_CACHE_DATA_INT(num);
+
+	msginfo = procmsg_msginfo_new();
+	msginfo->msgnum = num;
+	if (map != NULL)
+		msginfo->cache_map = msgcache_map_ref(map);
+
+	GET_CACHE_DATA_INT(msginfo->size);
+	GET_CACHE_DATA_INT(msginfo->mtime);
+	GET_CACHE_DATA_INT(msginfo->date_t);
+	GET_CACHE_DATA_INT(msginfo->flags.tmp_flags);
+
+	GET_CACHE_DATA(msginfo->fromname);
+
+	GET_CACHE_DATA(msginfo->date);
+	GET_CACHE_DATA(msginfo->from);
+	GET_CACHE_DATA(msginfo->to);
+	GET_CACHE_DATA(msginfo->cc);
+	GET_CACHE_DATA(msginfo->newsgroups);
+	GET_CACHE_DATA(msginfo->subject);
+	GET_CACHE_DATA(msginfo->msgid);
+	GET_CACHE_DATA(msginfo->inreplyto);
+	GET_CACHE_DATA(msginfo->xref);
+
+	GET_CACHE_DATA_INT(msginfo->planned_download);
+	GET_CACHE_DATA_INT(msginfo->total_size);
+	GET_CACHE_DATA_INT(refnum);
+
+	for (; refnum != 0; refnum--) {
+		ref = NULL;
+
+		GET_CACHE_DATA(ref);
+
+		if (ref && *ref)
+			msginfo->references =
+				g_slist_prepend(msginfo->references, ref);
+	}
+	if (msginfo->references)
+		msginfo->references =
+			g_slist_reverse(msginfo->references);
+
+	msginfo->folder = item;
+	msginfo->flags.tmp_flags |= tmp_flags;
+	/* mapped strings cost no heap, the others are shared */
+	if (map == NULL)
+		procmsg_msginfo_intern_strings(msginfo);
+	msginfo->cache_memusage = msgcache_msginfo_memusage(msginfo);
+	*memusage += msginfo->cache_memusage;
+
+	*walk = walk_data;
+	*len = rem_len;
+
+	return msginfo;
+
+bail_err:
+	if (error)
+		procmsg_msginfo_free(msginfo);
+	return NULL;
+}
+
+/* Checks the trailer of an indexed cache file of file_len bytes whose
+ * records start at records_start. Returns the offset of the index, or 0
+ * if the trailer is not valid. */
+static guint32 msgcache_parse_trailer(const gchar *trailer, gsize file_len,
+				      gsize records_start, gboolean swapping,
+				      guint32 *n_entries, guint32 *n_msgids)
+{
+	guint32 index_offset;
+	guint64 index_len;
+
+	if (msgcache_get_uint32(trailer + 12, swapping) != CACHE_INDEX_MAGIC)
+		return 0;
+
+	index_offset = msgcache_get_uint32(trailer, swapping);
+	*n_entries = msgcache_get_uint32(trailer + 4, swapping);
+	*n_msgids = msgcache_get_uint32(trailer + 8, swapping);
+
+	index_len = 8 * ((guint64) *n_entries + *n_msgids) + CACHE_TRAILER_SIZE;
+	if (index_offset < records_start || *n_msgids > *n_entries ||
+	    (guint64) index_offset + index_len != file_len)
+		return 0;
+
+	return index_offset;
+}
+
+/* Sets up the entries of a cache from the index of its mapping, so that
+ * records are only decoded when their message is asked for. */
+static gboolean msgcache_load_index(MsgCache *cache, FolderItem *item,
+				    MsgTmpFlags tmp_flags, gchar *data,
+				    guint32 records_start, guint32 index_offset,
+				    guint32 n_entries, guint32 n_msgids)
+{
+	gchar *index = data + index_offset;
+	MsgCacheEntry *entries;
+	guint32 i;
+
+	entries = g_new0(MsgCacheEntry, n_entries);
+	for (i = 0; i < n_entries; i++) {
+		entries[i].num = msgcache_get_uint32(index + 8 * i, TRUE);
+		entries[i].offset = msgcache_get_uint32(index + 8 * i + 4, TRUE);
+		entries[i].lazy = TRUE;
+		if (entries[i].offset < records_start ||
+		    entries[i].offset >= index_offset ||
+		    (i > 0 && entries[i].num <= entries[i - 1].num)) {
+			g_warning("Cache index corrupted at entry %u\n", i);
+			g_free(entries);
+			return FALSE;
+		}
+	}
+
+	cache->item = item;
+	cache->tmp_flags = tmp_flags;
+	cache->entries = entries;
+	cache->n_entries = n_entries;
+	cache->n_lazy = n_entries;
+	cache->msgid_index = index + 8 * n_entries;
+	cache->n_msgids = n_msgids;
+
+	return TRUE;
+}
+
+static MsgInfo *msgcache_materialize_entry(MsgCache *cache, MsgCacheEntry *entry)
+{
+	MsgInfo *msginfo;
+	gchar *walk_data = cache->map->data + entry->offset;
+	gint rem_len = cache->map->len - entry->offset;
+	guint memusage = 0;
+
+	msginfo = msgcache_decode_record(cache->item, cache->map, NULL,
+					 TRUE, TRUE, cache->tmp_flags,
+					 &walk_data, &rem_len, &memusage);
+	if (msginfo == NULL || msginfo->msgnum != entry->num) {
+		g_warning("Cache record of message %u corrupted\n", entry->num);
+		procmsg_msginfo_free(msginfo);
+		msgcache_drop_entry(cache, entry);
+		cache->item->cache_dirty = TRUE;
+		return NULL;
+	}
+
+	msginfo->flags.perm_flags = entry->perm_flags;
+	msginfo->tags = entry->tags;
+	entry->tags = NULL;
+	entry->lazy = FALSE;
+	cache->n_lazy--;
+
+	g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
+	if (msginfo->msgid)
+		g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
+	msgcache_charge(cache, memusage);
+
+	return msginfo;
+}
+
+#ifdef HAVE_LIBZ
+static gboolean msgcache_read_block_int(FILE *fp, gboolean swapping,
+					guint32 *n)
+{
+	guint32 idata;
+
+	if (fread(&idata, sizeof(idata), 1, fp) != 1)
+		return FALSE;
+	*n = swapping ? bswap_32(idata) : idata;
+
+	return TRUE;
+}
+
+/* Reads the records of a compressed cache file, decompressing one
+ * block at a time so that memory use stays bounded by the largest
+ * block. */
+static gboolean msgcache_read_blocks(MsgCache *cache, FolderItem *item,
+				     FILE *fp, StringConverter *conv,
+				     gboolean swapping, MsgTmpFlags tmp_flags,
+				     guint *memusage)
+{
+	GByteArray *raw, *comp;
+	guint32 raw_len, comp_len;
+	uLongf out_len;
+	MsgInfo *msginfo;
+	gchar *walk_data;
+	gint rem_len;
+	gboolean done = FALSE;
+
+	raw = g_byte_array_sized_new(CACHE_BLOCK_SIZE);
+	comp = g_byte_array_sized_new(CACHE_BLOCK_SIZE);
+
+	while (msgcache_read_block_int(fp, swapping, &raw_len) &&
+	       msgcache_read_block_int(fp, swapping, &comp_len)) {
+		if (raw_len == 0) {
+			done = (comp_len == 0);
+			break;
+		}
+		if (raw_len > CACHE_BLOCK_MAX_SIZE ||
+		    comp_len > compressBound(raw_len)) {
+			g_warning("Cache block corrupted (%u/%u bytes)\n",
+				  comp_len, raw_len);
+			break;
+		}
+
+		g_byte_array_set_size(comp, comp_len);
+		g_byte_array_set_size(raw, raw_len);
+		out_len = raw_len;
+		if (fread(comp->data, 1, comp_len, fp) != comp_len ||
+		    uncompress(raw->data, &out_len, comp->data,
+			       comp_len) != Z_OK ||
+		    out_len != raw_len) {
+			g_warning("Cache block corrupted\n");
+			break;
+		}
+
+		walk_data = (gchar *)raw->data;
+		rem_len = raw_len;
+		while (rem_len > 0) {
+			msginfo = msgcache_decode_record(item, NULL, conv,
+						swapping, TRUE, tmp_flags,
+						&walk_data, &rem_len, memusage);
+			if (msginfo == NULL)
+				goto out;
+
+			g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
+			if(msginfo->msgid)
+				g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
+		}
+	}
+out:
+	g_byte_array_free(raw, TRUE);
+	g_byte_array_free(comp, TRUE);
+
+	return done;
+}
+#endif
+
 MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 {
+	static const guint cache_versions[] = {
+		CACHE_VERSION,
+		CACHE_VERSION_UNENCODED,
+		CACHE_VERSION_UNINDEXED,
+		CACHE_VERSION_UNTERMINATED
+	};
 	MsgCache *cache;
-	FILE *fp;
+	FILE *fp = NULL;
 	MsgInfo *msginfo;
 	MsgTmpFlags tmp_flags = 0;
 	gchar file_buf[BUFFSIZE];
@@ -578,26 +1332,39 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 	guint memusage = 0;
 	gint tmp_len = 0, map_len = -1;
 	char *cache_data = NULL;
+	MsgCacheMap *map = NULL;
+	guint version = CACHE_VERSION;
+	gboolean swapping = TRUE;
+	gboolean terminated, indexed, compressed = FALSE;
+	guint32 records_start, index_offset = 0, encoding;
+	guint32 n_entries = 0, n_msgids = 0;
 	struct stat st;
+	guint i;
 
 	cm_return_val_if_fail(cache_file != NULL, NULL);
 	cm_return_val_if_fail(item != NULL, NULL);
 
-	swapping = TRUE;
-
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
 	 * it means it's the old version (not little-endian) on a big-endian machine. The code has
 	 * no effect on x86 as their file doesn't change. */
 
-	if ((fp = msgcache_open_data_file
-		(cache_file, CACHE_VERSION, DATA_READ, file_buf, sizeof(file_buf))) == NULL) {
+	/* Older versions are still read, so that upgrading does not force
+	 * a rescan of every folder. */
+	for (i = 0; fp == NULL && i < G_N_ELEMENTS(cache_versions); i++) {
+		version = cache_versions[i];
+		swapping = TRUE;
 		if ((fp = msgcache_open_data_file
-		(cache_file, bswap_32(CACHE_VERSION), DATA_READ, file_buf, sizeof(file_buf))) == NULL)
-			return NULL;
-		else
-			swapping = FALSE;
+			(cache_file, version, DATA_READ, file_buf, sizeof(file_buf))) == NULL) {
+			if ((fp = msgcache_open_data_file
+			(cache_file, bswap_32(version), DATA_READ, file_buf, sizeof(file_buf))) != NULL)
+				swapping = FALSE;
+		}
 	}
+	if (fp == NULL)
+		return NULL;
+	terminated = (version != CACHE_VERSION_UNTERMINATED);
+	indexed = (version == CACHE_VERSION || version == CACHE_VERSION_UNENCODED);
 
 	debug_print("\tReading %sswapped message cache from %s...\n", swapping?"":"un", cache_file);
 
@@ -607,10 +1374,29 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 		tmp_flags |= MSG_DRAFT;
 	}
 
-	if (msgcache_read_cache_data_str(fp, &srccharset, NULL) < 0) {
+	if (msgcache_read_cache_data_str(fp, &srccharset, NULL, swapping, terminated) < 0) {
 		fclose(fp);
 		return NULL;
 	}
+	if (version == CACHE_VERSION) {
+		if (fread(&encoding, sizeof(encoding), 1, fp) != 1)
+			encoding = G_MAXUINT32;
+		else if (swapping)
+			encoding = bswap_32(encoding);
+#ifdef HAVE_LIBZ
+		compressed = (encoding == CACHE_ENCODING_ZLIB);
+#endif
+		/* the folder gets rescanned if the file can't be read */
+		if (encoding != CACHE_ENCODING_PLAIN && !compressed) {
+			g_warning("%s: unsupported cache encoding %u\n",
+				  cache_file, encoding);
+			g_free(srccharset);
+			fclose(fp);
+			return NULL;
+		}
+		if (compressed)
+			indexed = FALSE;
+	}
 	dstcharset = CS_UTF_8;
 	if (srccharset == NULL || dstcharset == NULL) {
 		conv = NULL;
@@ -633,13 +1419,34 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 	}
 	g_free(srccharset);
 
-	cache = msgcache_new();
+	cache = msgcache_new(item);
+	records_start = ftell(fp);
+
+	/* files too large to be mapped are read through stdio, whole */
+	if (fstat(fileno(fp), &st) >= 0 && st.st_size <= G_MAXINT)
+		map_len = st.st_size;
+	else
+		map_len = -1;
+
+	/* find where the records end */
+	if (indexed && map_len >= (gint) (records_start + CACHE_TRAILER_SIZE)) {
+		gchar trailer[CACHE_TRAILER_SIZE];
+
+		if (fseek(fp, map_len - CACHE_TRAILER_SIZE, SEEK_SET) == 0 &&
+		    fread(trailer, 1, CACHE_TRAILER_SIZE, fp) == CACHE_TRAILER_SIZE)
+			index_offset = msgcache_parse_trailer(trailer, map_len,
+					records_start, swapping,
+					&n_entries, &n_msgids);
+		if (fseek(fp, records_start, SEEK_SET) != 0) {
+			FILE_OP_ERROR(cache_file, "fseek");
+			error = TRUE;
+			goto bail_err;
+		}
+		if (index_offset == 0)
+			g_warning("%s: cache index missing or corrupted\n", cache_file);
+	}
 
-	if (msgcache_use_mmap_read == TRUE) {
-		if (fstat(fileno(fp), &st) >= 0)
-			map_len = st.st_size;
-		else
-			map_len = -1;
+	if (msgcache_use_mmap_read == TRUE && !compressed) {
 		if (map_len > 0) {
 #ifdef G_OS_WIN32
 			cache_data = NULL;
@@ -662,88 +1469,79 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 		cache_data = NULL;
 	}
 	if (cache_data != NULL && cache_data != MAP_FAILED) {
-		int rem_len = map_len-ftell(fp);
-		char *walk_data = cache_data+ftell(fp);
+		int rem_len = map_len - records_start;
+		char *walk_data = cache_data + records_start;
+
+		if (index_offset > 0)
+			rem_len = index_offset - records_start;
+
+#ifndef G_OS_WIN32
+		/* Strings are NUL-terminated on disk and need no conversion:
+		 * point MsgInfo fields straight into the mapping instead of
+		 * duplicating each of them. */
+		if (terminated && conv == NULL)
+			map = msgcache_map_new(cache_data, map_len);
+#endif
+		/* With an index, records are decoded when first asked for */
+		if (map != NULL && index_offset > 0 && swapping &&
+		    msgcache_load_index(cache, item, tmp_flags, cache_data,
+					records_start, index_offset,
+					n_entries, n_msgids)) {
+			memusage += n_entries * sizeof(MsgCacheEntry);
+			rem_len = 0;
+		}
 
 		while(rem_len > 0) {
-			GET_CACHE_DATA_INT(num);
-			
-			msginfo = procmsg_msginfo_new();
-			msginfo->msgnum = num;
-			memusage += sizeof(MsgInfo);
-
-			GET_CACHE_DATA_INT(msginfo->size);
-			GET_CACHE_DATA_INT(msginfo->mtime);
-			GET_CACHE_DATA_INT(msginfo->date_t);
-			GET_CACHE_DATA_INT(msginfo->flags.tmp_flags);
-
-			GET_CACHE_DATA(msginfo->fromname, memusage);
-
-			GET_CACHE_DATA(msginfo->date, memusage);
-			GET_CACHE_DATA(msginfo->from, memusage);
-			GET_CACHE_DATA(msginfo->to, memusage);
-			GET_CACHE_DATA(msginfo->cc, memusage);
-			GET_CACHE_DATA(msginfo->newsgroups, memusage);
-			GET_CACHE_DATA(msginfo->subject, memusage);
-			GET_CACHE_DATA(msginfo->msgid, memusage);
-			GET_CACHE_DATA(msginfo->inreplyto, memusage);
-			GET_CACHE_DATA(msginfo->xref, memusage);
-
-			GET_CACHE_DATA_INT(msginfo->planned_download);
-			GET_CACHE_DATA_INT(msginfo->total_size);
-			GET_CACHE_DATA_INT(refnum);
-
-			for (; refnum != 0; refnum--) {
-				ref = NULL;
-
-				GET_CACHE_DATA(ref, memusage);
-
-				if (ref && *ref)
-					msginfo->references =
-						g_slist_prepend(msginfo->references, ref);
+			msginfo = msgcache_decode_record(item, map, conv,
+						swapping, terminated, tmp_flags,
+						&walk_data, &rem_len, &memusage);
+			if (msginfo == NULL) {
+				error = TRUE;
+				break;
 			}
-			if (msginfo->references)
-				msginfo->references =
-					g_slist_reverse(msginfo->references);
-
-			msginfo->folder = item;
-			msginfo->flags.tmp_flags |= tmp_flags;
 
 			g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
 			if(msginfo->msgid)
 				g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
 		}
 
+		if (map == NULL) {
 #ifdef G_OS_WIN32
-		UnmapViewOfFile((void*) cache_data);
+			UnmapViewOfFile((void*) cache_data);
 #else
-		munmap(cache_data, map_len);
+			munmap(cache_data, map_len);
+#endif
+		}
+#ifdef HAVE_LIBZ
+	} else if (compressed) {
+		error = !msgcache_read_blocks(cache, item, fp, conv, swapping,
+					      tmp_flags, &memusage);
 #endif
 	} else {
-		while (fread(&num, sizeof(num), 1, fp) == 1) {
+		while ((index_offset == 0 || ftell(fp) < (long) index_offset) &&
+		       fread(&num, sizeof(num), 1, fp) == 1) {
 			if (swapping)
 				num = bswap_32(num);
 
 			msginfo = procmsg_msginfo_new();
 			msginfo->msgnum = num;
-			memusage += sizeof(MsgInfo);
 
 			READ_CACHE_DATA_INT(msginfo->size, fp);
 			READ_CACHE_DATA_INT(msginfo->mtime, fp);
 			READ_CACHE_DATA_INT(msginfo->date_t, fp);
 			READ_CACHE_DATA_INT(msginfo->flags.tmp_flags, fp);
 
-			READ_CACHE_DATA(msginfo->fromname, fp, memusage);
+			READ_CACHE_DATA(msginfo->fromname, fp);
 
-			READ_CACHE_DATA(msginfo->date, fp, memusage);
-			READ_CACHE_DATA(msginfo->from, fp, memusage);
-			READ_CACHE_DATA(msginfo->to, fp, memusage);
-			READ_CACHE_DATA(msginfo->cc, fp, memusage);
-			READ_CACHE_DATA(msginfo->newsgroups, fp, memusage);
-			READ_CACHE_DATA(msginfo->subject, fp, memusage);
-			READ_CACHE_DATA(msginfo->msgid, fp, memusage);
-			READ_CACHE_DATA(msginfo->inreplyto, fp, memusage);
-			READ_CACHE_DATA(msginfo->xref, fp, memusage);
+			READ_CACHE_DATA(msginfo->date, fp);
+			READ_CACHE_DATA(msginfo->from, fp);
+			READ_CACHE_DATA(msginfo->to, fp);
+			READ_CACHE_DATA(msginfo->cc, fp);
+			READ_CACHE_DATA(msginfo->newsgroups, fp);
+			READ_CACHE_DATA(msginfo->subject, fp);
+			READ_CACHE_DATA(msginfo->msgid, fp);
+			READ_CACHE_DATA(msginfo->inreplyto, fp);
+			READ_CACHE_DATA(msginfo->xref, fp);
 
 			READ_CACHE_DATA_INT(msginfo->planned_download, fp);
 			READ_CACHE_DATA_INT(msginfo->total_size, fp);
@@ -752,7 +1550,7 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 			for (; refnum != 0; refnum--) {
 				ref = NULL;
 
-				READ_CACHE_DATA(ref, fp, memusage);
+				READ_CACHE_DATA(ref, fp);
 
 				if (ref && *ref)
 					msginfo->references =
@@ -764,6 +1562,9 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 
 			msginfo->folder = item;
 			msginfo->flags.tmp_flags |= tmp_flags;
+			procmsg_msginfo_intern_strings(msginfo);
+			msginfo->cache_memusage = msgcache_msginfo_memusage(msginfo);
+			memusage += msginfo->cache_memusage;
 
 			g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
 			if(msginfo->msgid)
@@ -781,30 +1582,67 @@ bail_err:
 
 	if(error) {
 		msgcache_destroy(cache);
+		msgcache_map_unref(map);
 		return NULL;
 	}
 
-	cache->last_access = time(NULL);
-	cache->memusage = memusage;
+	msgcache_touch(cache);
+	msgcache_charge(cache, memusage);
+	if (map != NULL) {
+		cache->map = map;
+		cache->mapusage = map_len;
+	}
 
-	debug_print("done. (%d items read)\n", g_hash_table_size(cache->msgnum_table));
-	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
+	debug_print("done. (%d items read, %u indexed)\n",
+		    g_hash_table_size(cache->msgnum_table), cache->n_lazy);
+	debug_print("Cache size: %d messages, %u heap bytes, %u mapped bytes\n",
+		    g_hash_table_size(cache->msgnum_table) + cache->n_lazy,
+		    cache->memusage, cache->mapusage);
+	if (debug_get_mode())
+		string_table_get_stats(procmsg_get_string_table(), NULL);
 
 	return cache;
 }
 
-void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
+/* Flags and tags files are read right after the cache file, so they
+ * also apply to messages whose record is not decoded yet. */
+static void msgcache_set_perm_flags(MsgCache *cache, guint num,
+				    MsgPermFlags perm_flags)
+{
+	MsgInfo *msginfo;
+	MsgCacheEntry *entry;
+
+	if ((msginfo = g_hash_table_lookup(cache->msgnum_table, &num)) != NULL)
+		msginfo->flags.perm_flags = perm_flags;
+	else if ((entry = msgcache_lookup_entry(cache, num)) != NULL)
+		entry->perm_flags = perm_flags;
+}
+
+static GSList **msgcache_lookup_tags(MsgCache *cache, guint num)
 {
-	FILE *fp;
 	MsgInfo *msginfo;
+	MsgCacheEntry *entry;
+
+	if ((msginfo = g_hash_table_lookup(cache->msgnum_table, &num)) != NULL)
+		return &msginfo->tags;
+	if ((entry = msgcache_lookup_entry(cache, num)) != NULL)
+		return &entry->tags;
+	return NULL;
+}
+
+/* Returns the number of record bytes read from mark_file, or -1 if it
+ * could not be opened. Flag journals use the same record format. */
+static gint msgcache_read_mark_file(MsgCache *cache, const gchar *mark_file)
+{
+	FILE *fp;
 	MsgPermFlags perm_flags;
 	guint32 num;
 	gint map_len = -1;
+	gint read_len = 0;
 	char *cache_data = NULL;
 	struct stat st;
 	gboolean error;
-
-	swapping = TRUE;
+	gboolean swapping = TRUE;
 
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
@@ -814,7 +1652,7 @@ void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
 	if ((fp = msgcache_open_data_file(mark_file, MARK_VERSION, DATA_READ, NULL, 0)) == NULL) {
 		/* see if it isn't swapped ? */
 		if ((fp = msgcache_open_data_file(mark_file, bswap_32(MARK_VERSION), DATA_READ, NULL, 0)) == NULL)
-			return;
+			return -1;
 		else
 			swapping = FALSE; /* yay */
 	}
@@ -853,10 +1691,8 @@ void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
 		while(rem_len > 0) {
 			GET_CACHE_DATA_INT(num);
 			GET_CACHE_DATA_INT(perm_flags);
-			msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
-			if(msginfo) {
-				msginfo->flags.perm_flags = perm_flags;
-			}
+			read_len += 8;
+			msgcache_set_perm_flags(cache, num, perm_flags);
 		}
 #ifdef G_OS_WIN32
 		UnmapViewOfFile((void*) cache_data);
@@ -870,27 +1706,45 @@ void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
 			if (fread(&perm_flags, sizeof(perm_flags), 1, fp) != 1) break;
 			if (swapping)
 				perm_flags = bswap_32(perm_flags);
-			msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
-			if(msginfo) {
-				msginfo->flags.perm_flags = perm_flags;
-			}
+			read_len += 8;
+			msgcache_set_perm_flags(cache, num, perm_flags);
 		}	
 	}
 bail_err:
 	fclose(fp);
+	return read_len;
 }
 
-void msgcache_read_tags(MsgCache *cache, const gchar *tags_file)
+void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
+{
+	gchar *journal_file;
+	gint journal_size;
+
+	cm_return_if_fail(cache != NULL);
+	cm_return_if_fail(mark_file != NULL);
+
+	msgcache_read_mark_file(cache, mark_file);
+
+	/* replay flag changes appended since the mark file was written */
+	journal_file = g_strconcat(mark_file, JOURNAL_SUFFIX, NULL);
+	journal_size = msgcache_read_mark_file(cache, journal_file);
+	cache->mark_journal_size = MAX(journal_size, 0);
+	if (journal_size > 0)
+		debug_print("replayed %d bytes of flag journal %s\n",
+			    journal_size, journal_file);
+	g_free(journal_file);
+}
+
+static void msgcache_read_tags_file(MsgCache *cache, const gchar *tags_file)
 {
 	FILE *fp;
-	MsgInfo *msginfo;
+	GSList **tags;
 	guint32 num;
 	gint map_len = -1;
 	char *cache_data = NULL;
 	struct stat st;
 	gboolean error = FALSE;
-
-	swapping = TRUE;
+	gboolean swapping = TRUE;
 
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
@@ -939,19 +1793,19 @@ void msgcache_read_tags(MsgCache *cache, const gchar *tags_file)
 		while(rem_len > 0) {
 			gint id = -1;
 			GET_CACHE_DATA_INT(num);
-			msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
-			if(msginfo) {
-				g_slist_free(msginfo->tags);
-				msginfo->tags = NULL;
+			tags = msgcache_lookup_tags(cache, num);
+			if(tags) {
+				g_slist_free(*tags);
+				*tags = NULL;
 				do {
 					GET_CACHE_DATA_INT(id);
 					if (id > 0) {
-						msginfo->tags = g_slist_prepend(
-							msginfo->tags, 
+						*tags = g_slist_prepend(
+							*tags, 
 							GINT_TO_POINTER(id));
 					}
 				} while (id > 0);
-				msginfo->tags = g_slist_reverse(msginfo->tags);
+				*tags = g_slist_reverse(*tags);
 			}
 		}
 #ifdef G_OS_WIN32
@@ -964,22 +1818,22 @@ void msgcache_read_tags(MsgCache *cache, const gchar *tags_file)
 			gint id = -1;
 			if (swapping)
 				num = bswap_32(num);
-			msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
-			if(msginfo) {
-				g_slist_free(msginfo->tags);
-				msginfo->tags = NULL;
+			tags = msgcache_lookup_tags(cache, num);
+			if(tags) {
+				g_slist_free(*tags);
+				*tags = NULL;
 				do {
 					if (fread(&id, sizeof(id), 1, fp) != 1) 
 						id = -1;
 					if (swapping)
 						id = bswap_32(id);
 					if (id > 0) {
-						msginfo->tags = g_slist_prepend(
-							msginfo->tags, 
+						*tags = g_slist_prepend(
+							*tags, 
 							GINT_TO_POINTER(id));
 					}
 				} while (id > 0);
-				msginfo->tags = g_slist_reverse(msginfo->tags);
+				*tags = g_slist_reverse(*tags);
 			}
 		}
 	}
@@ -987,38 +1841,93 @@ bail_err:
 	fclose(fp);
 }
 
-static int msgcache_write_cache(MsgInfo *msginfo, FILE *fp)
+/* Tag journal records are fixed-size (msgnum, id) pairs: id 0 clears
+ * the message's tags, a positive id adds that tag. */
+static gint msgcache_read_tags_journal(MsgCache *cache, const gchar *journal_file)
 {
-	MsgTmpFlags flags = msginfo->flags.tmp_flags & MSG_CACHED_FLAG_MASK;
-	GSList *cur;
-	int w_err = 0, wrote = 0;
+	FILE *fp;
+	GSList **tags;
+	guint32 num;
+	gint32 id;
+	gint read_len = 0;
 
-	WRITE_CACHE_DATA_INT(msginfo->msgnum, fp);
-	WRITE_CACHE_DATA_INT(msginfo->size, fp);
-	WRITE_CACHE_DATA_INT(msginfo->mtime, fp);
-	WRITE_CACHE_DATA_INT(msginfo->date_t, fp);
-	WRITE_CACHE_DATA_INT(flags, fp);
+	if ((fp = msgcache_open_data_file(journal_file, TAGS_VERSION, DATA_READ, NULL, 0)) == NULL)
+		return -1;
+
+	while (fread(&num, sizeof(num), 1, fp) == 1) {
+		if (fread(&id, sizeof(id), 1, fp) != 1)
+			break;
+		num = bswap_32(num);
+		id = bswap_32(id);
+		read_len += 8;
+
+		tags = msgcache_lookup_tags(cache, num);
+		if (!tags)
+			continue;
+		if (id == 0) {
+			g_slist_free(*tags);
+			*tags = NULL;
+		} else if (id > 0 && !g_slist_find(*tags, GINT_TO_POINTER(id))) {
+			*tags = g_slist_append(*tags, GINT_TO_POINTER(id));
+		}
+	}
+	fclose(fp);
 
-	WRITE_CACHE_DATA(msginfo->fromname, fp);
-
-	WRITE_CACHE_DATA(msginfo->date, fp);
-	WRITE_CACHE_DATA(msginfo->from, fp);
-	WRITE_CACHE_DATA(msginfo->to, fp);
-	WRITE_CACHE_DATA(msginfo->cc, fp);
-	WRITE_CACHE_DATA(msginfo->newsgroups, fp);
-	WRITE_CACHE_DATA(msginfo->subject, fp);
-	WRITE_CACHE_DATA(msginfo->msgid, fp);
-	WRITE_CACHE_DATA(msginfo->inreplyto, fp);
-	WRITE_CACHE_DATA(msginfo->xref, fp);
-	WRITE_CACHE_DATA_INT(msginfo->planned_download, fp);
-	WRITE_CACHE_DATA_INT(msginfo->total_size, fp);
+	return read_len;
+}
+
+void msgcache_read_tags(MsgCache *cache, const gchar *tags_file)
+{
+	gchar *journal_file;
+	gint journal_size;
+
+	cm_return_if_fail(cache != NULL);
+	cm_return_if_fail(tags_file != NULL);
+
+	msgcache_read_tags_file(cache, tags_file);
+
+	journal_file = g_strconcat(tags_file, JOURNAL_SUFFIX, NULL);
+	journal_size = msgcache_read_tags_journal(cache, journal_file);
+	cache->tags_journal_size = MAX(journal_size, 0);
+	if (journal_size > 0)
+		debug_print("replayed %d bytes of tags journal %s\n",
+			    journal_size, journal_file);
+	g_free(journal_file);
+}
+
+/* Appends the cache record of msginfo to buf */
+static int msgcache_encode_cache(MsgInfo *msginfo, GByteArray *buf)
+{
+	MsgTmpFlags flags = msginfo->flags.tmp_flags & MSG_CACHED_FLAG_MASK;
+	GSList *cur;
+	int wrote = 0;
+
+	APPEND_CACHE_DATA_INT(msginfo->msgnum, buf);
+	APPEND_CACHE_DATA_INT(msginfo->size, buf);
+	APPEND_CACHE_DATA_INT(msginfo->mtime, buf);
+	APPEND_CACHE_DATA_INT(msginfo->date_t, buf);
+	APPEND_CACHE_DATA_INT(flags, buf);
+
+	APPEND_CACHE_DATA(msginfo->fromname, buf);
+
+	APPEND_CACHE_DATA(msginfo->date, buf);
+	APPEND_CACHE_DATA(msginfo->from, buf);
+	APPEND_CACHE_DATA(msginfo->to, buf);
+	APPEND_CACHE_DATA(msginfo->cc, buf);
+	APPEND_CACHE_DATA(msginfo->newsgroups, buf);
+	APPEND_CACHE_DATA(msginfo->subject, buf);
+	APPEND_CACHE_DATA(msginfo->msgid, buf);
+	APPEND_CACHE_DATA(msginfo->inreplyto, buf);
+	APPEND_CACHE_DATA(msginfo->xref, buf);
+	APPEND_CACHE_DATA_INT(msginfo->planned_download, buf);
+	APPEND_CACHE_DATA_INT(msginfo->total_size, buf);
         
-	WRITE_CACHE_DATA_INT(g_slist_length(msginfo->references), fp);
+	APPEND_CACHE_DATA_INT(g_slist_length(msginfo->references), buf);
 
 	for (cur = msginfo->references; cur != NULL; cur = cur->next) {
-		WRITE_CACHE_DATA((gchar *)cur->data, fp);
+		APPEND_CACHE_DATA((gchar *)cur->data, buf);
 	}
-	return w_err ? -1 : wrote;
+	return wrote;
 }
 
 static int msgcache_write_flags(MsgInfo *msginfo, FILE *fp)
@@ -1047,17 +1956,256 @@ static int msgcache_write_tags(MsgInfo *msginfo, FILE *fp)
 	return w_err ? -1 : wrote;
 }
 
+static int msgcache_write_tags_journal(MsgInfo *msginfo, FILE *fp)
+{
+	GSList *cur = msginfo->tags;
+	int w_err = 0, wrote = 0;
+
+	WRITE_CACHE_DATA_INT(msginfo->msgnum, fp);
+	WRITE_CACHE_DATA_INT(0, fp);
+	for (; cur; cur = cur->next) {
+		gint id = GPOINTER_TO_INT(cur->data);
+		if (tags_get_tag(id) != NULL) {
+			WRITE_CACHE_DATA_INT(msginfo->msgnum, fp);
+			WRITE_CACHE_DATA_INT(id, fp);
+		}
+	}
+
+	return w_err ? -1 : wrote;
+}
+
+struct write_journal
+{
+	MsgCache *cache;
+	FILE *fp;
+	int (*write_func) (MsgInfo *msginfo, FILE *fp);
+	int error;
+	guint size;
+};
+
+static void msgcache_write_journal_func(gpointer key, gpointer value, gpointer user_data)
+{
+	struct write_journal *journal = user_data;
+	guint num = GPOINTER_TO_UINT(key);
+	MsgInfo *msginfo;
+	int tmp;
+
+	msginfo = g_hash_table_lookup(journal->cache->msgnum_table, &num);
+	if (msginfo == NULL)
+		return;
+
+	tmp = journal->write_func(msginfo, journal->fp);
+	if (tmp < 0)
+		journal->error = 1;
+	else
+		journal->size += tmp;
+}
+
+/* Appends the current state of every message in pending to the journal
+ * of base_file. Returns -1 on error, or if the journal has grown enough
+ * that the base file should be rewritten instead. */
+static gint msgcache_append_journal(MsgCache *cache, const gchar *base_file,
+				    guint version, GHashTable *pending,
+				    guint *journal_size,
+				    int (*write_func) (MsgInfo *msginfo, FILE *fp))
+{
+	struct write_journal journal;
+	gchar *journal_file;
+	struct stat st;
+	goffset base_size = 0;
+
+	if (g_hash_table_size(pending) == 0)
+		return 0;
+
+	if (g_stat(base_file, &st) == 0)
+		base_size = st.st_size;
+	if (*journal_size + 8 * g_hash_table_size(pending) >
+	    MAX(base_size, JOURNAL_MIN_COMPACT_SIZE)) {
+		debug_print("journal of %s is due for compaction\n", base_file);
+		return -1;
+	}
+
+	journal_file = g_strconcat(base_file, JOURNAL_SUFFIX, NULL);
+	journal.cache = cache;
+	journal.fp = msgcache_open_data_file(journal_file, version,
+					     DATA_APPEND, NULL, 0);
+	journal.write_func = write_func;
+	journal.error = 0;
+	journal.size = 0;
+	if (journal.fp == NULL) {
+		g_free(journal_file);
+		return -1;
+	}
+
+	g_hash_table_foreach(pending, msgcache_write_journal_func, &journal);
+
+	/* synced by the caller, with the journals of other caches */
+	journal.error |= (fflush(journal.fp) != 0);
+	journal.error |= (fclose(journal.fp) != 0);
+
+	if (journal.error != 0) {
+		g_warning("failed to append to journal %s\n", journal_file);
+		g_free(journal_file);
+		return -1;
+	}
+
+	debug_print("appended %u bytes to journal %s\n", journal.size, journal_file);
+	g_free(journal_file);
+
+	*journal_size += journal.size;
+	g_hash_table_remove_all(pending);
+
+	return 0;
+}
+
+gint msgcache_write_journal(const gchar *mark_file, const gchar *tags_file,
+			    MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, -1);
+
+	if (mark_file && msgcache_append_journal(cache, mark_file, MARK_VERSION,
+			cache->mark_pending, &cache->mark_journal_size,
+			msgcache_write_flags) < 0)
+		return -1;
+	if (tags_file && msgcache_append_journal(cache, tags_file, TAGS_VERSION,
+			cache->tags_pending, &cache->tags_journal_size,
+			msgcache_write_tags_journal) < 0)
+		return -1;
+
+	msgcache_touch(cache);
+
+	return 0;
+}
+
 struct write_fps
 {
 	FILE *cache_fp;
 	FILE *mark_fp;
 	FILE *tags_fp;
 	int error;
-	guint cache_size;
+	guint64 cache_size;
 	guint mark_size;
 	guint tags_size;
+	GArray *index;
+	GByteArray *record;
+	GByteArray *block;	/* NULL unless compressing */
 };
 
+typedef struct _MsgCacheIndexEntry {
+	guint32 num;
+	guint32 offset;
+	guint32 hash;
+	gboolean has_msgid;
+} MsgCacheIndexEntry;
+
+static gint msgcache_index_compare_num(gconstpointer a, gconstpointer b)
+{
+	const MsgCacheIndexEntry *ea = a, *eb = b;
+
+	if (ea->num != eb->num)
+		return (ea->num < eb->num) ? -1 : 1;
+	return 0;
+}
+
+static gint msgcache_index_compare_hash(gconstpointer a, gconstpointer b)
+{
+	const MsgCacheIndexEntry *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash)
+		return (ea->hash < eb->hash) ? -1 : 1;
+	if (ea->offset != eb->offset)
+		return (ea->offset < eb->offset) ? -1 : 1;
+	return 0;
+}
+
+/* Writes the index of the records written to fp and the trailer
+ * pointing to it. */
+static int msgcache_write_index(GArray *index, guint32 index_offset, FILE *fp)
+{
+	GArray *msgids;
+	MsgCacheIndexEntry *entry;
+	guint i;
+	int w_err = 0, wrote = 0;
+
+	g_array_sort(index, msgcache_index_compare_num);
+
+	msgids = g_array_sized_new(FALSE, FALSE, sizeof(MsgCacheIndexEntry),
+				   index->len);
+	for (i = 0; i < index->len; i++) {
+		entry = &g_array_index(index, MsgCacheIndexEntry, i);
+		WRITE_CACHE_DATA_INT(entry->num, fp);
+		WRITE_CACHE_DATA_INT(entry->offset, fp);
+		if (entry->has_msgid) {
+			MsgCacheIndexEntry msgid = *entry;
+
+			/* the msgid section points to index positions */
+			msgid.offset = i;
+			g_array_append_val(msgids, msgid);
+		}
+	}
+
+	g_array_sort(msgids, msgcache_index_compare_hash);
+	for (i = 0; i < msgids->len; i++) {
+		entry = &g_array_index(msgids, MsgCacheIndexEntry, i);
+		WRITE_CACHE_DATA_INT(entry->hash, fp);
+		WRITE_CACHE_DATA_INT(entry->offset, fp);
+	}
+
+	WRITE_CACHE_DATA_INT(index_offset, fp);
+	WRITE_CACHE_DATA_INT(index->len, fp);
+	WRITE_CACHE_DATA_INT(msgids->len, fp);
+	WRITE_CACHE_DATA_INT(CACHE_INDEX_MAGIC, fp);
+
+	g_array_free(msgids, TRUE);
+
+	return w_err ? -1 : wrote;
+}
+
+#ifdef HAVE_LIBZ
+/* Compresses the records gathered in block to fp and empties it. An
+ * empty block ends the records. */
+static int msgcache_write_block(GByteArray *block, FILE *fp)
+{
+	uLongf comp_len = compressBound(block->len);
+	Bytef *comp;
+	int w_err = 0, wrote = 0;
+
+	comp = g_malloc(comp_len);
+	if (compress2(comp, &comp_len, block->data, block->len,
+		      Z_BEST_SPEED) != Z_OK) {
+		g_warning("failed to compress cache block\n");
+		g_free(comp);
+		return -1;
+	}
+
+	WRITE_CACHE_DATA_INT(block->len, fp);
+	WRITE_CACHE_DATA_INT(block->len > 0 ? comp_len : 0, fp);
+	if (w_err == 0 && block->len > 0) {
+		if (SC_FWRITE(comp, 1, comp_len, fp) != comp_len)
+			w_err = 1;
+		wrote += comp_len;
+	}
+	g_free(comp);
+	g_byte_array_set_size(block, 0);
+
+	return w_err ? -1 : wrote;
+}
+#endif
+
+/* Whether the cache file of the folder is to be written compressed,
+ * as asked for all folders or for this one. */
+static gboolean msgcache_use_compression(MsgCache *cache)
+{
+#ifdef HAVE_LIBZ
+	if (prefs_common.compress_cache)
+		return TRUE;
+	return (cache->item != NULL && cache->item->prefs != NULL &&
+		cache->item->prefs->compress_cache);
+#else
+	return FALSE;
+#endif
+}
+
 static void msgcache_write_func(gpointer key, gpointer value, gpointer user_data)
 {
 	MsgInfo *msginfo;
@@ -1067,9 +2215,33 @@ static void msgcache_write_func(gpointer key, gpointer value, gpointer user_data
 	msginfo = (MsgInfo *)value;
 	write_fps = user_data;
 
-	if (write_fps->cache_fp) {
-		tmp = msgcache_write_cache(msginfo, write_fps->cache_fp);
-		if (tmp < 0)
+	if (write_fps->cache_fp && write_fps->block) {
+		GByteArray *block = write_fps->block;
+
+		msgcache_encode_cache(msginfo, block);
+#ifdef HAVE_LIBZ
+		if (block->len >= CACHE_BLOCK_SIZE) {
+			tmp = msgcache_write_block(block, write_fps->cache_fp);
+			if (tmp < 0)
+				write_fps->error = 1;
+			else
+				write_fps->cache_size += tmp;
+		}
+#endif
+	} else if (write_fps->cache_fp) {
+		GByteArray *record = write_fps->record;
+		MsgCacheIndexEntry entry;
+
+		entry.num = msginfo->msgnum;
+		entry.offset = write_fps->cache_size;
+		entry.has_msgid = (msginfo->msgid != NULL && *msginfo->msgid != '\0');
+		entry.hash = entry.has_msgid ? msgcache_msgid_hash(msginfo->msgid) : 0;
+		g_array_append_val(write_fps->index, entry);
+
+		g_byte_array_set_size(record, 0);
+		tmp = msgcache_encode_cache(msginfo, record);
+		if (SC_FWRITE(record->data, 1, record->len,
+			      write_fps->cache_fp) != record->len)
 			write_fps->error = 1;
 		else
 			write_fps->cache_size += tmp;
@@ -1090,14 +2262,20 @@ static void msgcache_write_func(gpointer key, gpointer value, gpointer user_data
 	}
 }
 
-gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar *tags_file, MsgCache *cache)
+/* Writes the new versions of the files next to them. They are synced
+ * right away if sync is set and prefs_common.flush_metadata asks so. */
+static gint msgcache_write_new_files(const gchar *cache_file, const gchar *mark_file,
+				     const gchar *tags_file, MsgCache *cache,
+				     gboolean sync)
 {
 	struct write_fps write_fps;
 	gchar *new_cache, *new_mark, *new_tags;
+	gboolean compress = msgcache_use_compression(cache);
 	int w_err = 0, wrote = 0;
 
-	START_TIMING("");
-	cm_return_val_if_fail(cache != NULL, -1);
+	/* every record is written out again */
+	if (cache_file || mark_file || tags_file)
+		msgcache_materialize_all(cache);
 
 	new_cache = g_strconcat(cache_file, ".new", NULL);
 	new_mark  = g_strconcat(mark_file, ".new", NULL);
@@ -1107,6 +2285,9 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 	write_fps.cache_size = 0;
 	write_fps.mark_size = 0;
 	write_fps.tags_size = 0;
+	write_fps.index = NULL;
+	write_fps.record = NULL;
+	write_fps.block = NULL;
 
 	/* open files and write headers */
 
@@ -1120,6 +2301,8 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 			return -1;
 		}
 		WRITE_CACHE_DATA(CS_UTF_8, write_fps.cache_fp);
+		WRITE_CACHE_DATA_INT(compress ? CACHE_ENCODING_ZLIB
+				     : CACHE_ENCODING_PLAIN, write_fps.cache_fp);
 	} else {
 		write_fps.cache_fp = NULL;
 	}
@@ -1189,7 +2372,37 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 		flockfile(write_fps.tags_fp);
 #endif
 	/* write data to the files */
+	if (write_fps.cache_fp && compress) {
+		write_fps.block = g_byte_array_sized_new(CACHE_BLOCK_SIZE);
+	} else if (write_fps.cache_fp) {
+		write_fps.index = g_array_sized_new(FALSE, FALSE,
+				sizeof(MsgCacheIndexEntry),
+				g_hash_table_size(cache->msgnum_table));
+		write_fps.record = g_byte_array_new();
+	}
 	g_hash_table_foreach(cache->msgnum_table, msgcache_write_func, (gpointer)&write_fps);
+	if (write_fps.block) {
+#ifdef HAVE_LIBZ
+		/* last records, then the empty block ending them */
+		if (write_fps.error == 0 && write_fps.block->len > 0 &&
+		    msgcache_write_block(write_fps.block, write_fps.cache_fp) < 0)
+			write_fps.error = 1;
+		if (write_fps.error == 0 &&
+		    msgcache_write_block(write_fps.block, write_fps.cache_fp) < 0)
+			write_fps.error = 1;
+#endif
+		g_byte_array_free(write_fps.block, TRUE);
+	} else if (write_fps.cache_fp) {
+		if (write_fps.cache_size > G_MAXUINT32) {
+			g_warning("%s: cache over 4GB, written without an index\n",
+				  new_cache);
+		} else if (write_fps.error == 0 &&
+		    msgcache_write_index(write_fps.index, write_fps.cache_size,
+					 write_fps.cache_fp) < 0)
+			write_fps.error = 1;
+		g_array_free(write_fps.index, TRUE);
+		g_byte_array_free(write_fps.record, TRUE);
+	}
 #ifdef HAVE_FWRITE_UNLOCKED
 	/* unlock files */
 	if (write_fps.cache_fp)
@@ -1208,11 +2421,11 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 		write_fps.error |= (fflush(write_fps.tags_fp) != 0);
 
 	/* sync to filesystem */
-	if (prefs_common.flush_metadata && write_fps.cache_fp)
+	if (sync && prefs_common.flush_metadata && write_fps.cache_fp)
 		write_fps.error |= (fsync(fileno(write_fps.cache_fp)) != 0);
-	if (prefs_common.flush_metadata && write_fps.mark_fp)
+	if (sync && prefs_common.flush_metadata && write_fps.mark_fp)
 		write_fps.error |= (fsync(fileno(write_fps.mark_fp)) != 0);
-	if (prefs_common.flush_metadata && write_fps.tags_fp)
+	if (sync && prefs_common.flush_metadata && write_fps.tags_fp)
 		write_fps.error |= (fsync(fileno(write_fps.tags_fp)) != 0);
 
 	/* close files */
@@ -1233,22 +2446,134 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 		g_free(new_mark);
 		g_free(new_tags);
 		return -1;
-	} else {
-		/* switch files */
-		if (cache_file)
-			move_file(new_cache, cache_file, TRUE);
-		if (mark_file)
-			move_file(new_mark, mark_file, TRUE);
-		if (tags_file)
-			move_file(new_tags, tags_file, TRUE);
-		cache->last_access = time(NULL);
 	}
 
 	g_free(new_cache);
 	g_free(new_mark);
 	g_free(new_tags);
+	return 0;
+}
+
+static gint msgcache_sync_new_file(const gchar *file)
+{
+	gchar *new_file;
+	FILE *fp;
+	gint ret = 0;
+
+	if (file == NULL)
+		return 0;
+
+	new_file = g_strconcat(file, ".new", NULL);
+	if ((fp = g_fopen(new_file, "r+b")) == NULL) {
+		FILE_OP_ERROR(new_file, "fopen");
+		ret = -1;
+	} else {
+		if (fsync(fileno(fp)) != 0) {
+			FILE_OP_ERROR(new_file, "fsync");
+			ret = -1;
+		}
+		fclose(fp);
+	}
+	g_free(new_file);
+
+	return ret;
+}
+
+static void msgcache_unlink_new_file(const gchar *file)
+{
+	gchar *new_file;
+
+	if (file == NULL)
+		return;
+
+	new_file = g_strconcat(file, ".new", NULL);
+	claws_unlink(new_file);
+	g_free(new_file);
+}
+
+/* Writing many caches at once is split in steps, so that all the new
+ * files can be written, then synced together, then switched:
+ * msgcache_write_begin() writes them without syncing, then either
+ * msgcache_write_sync() and msgcache_write_commit(), or
+ * msgcache_write_abort() must follow with the same file names. */
+gint msgcache_write_begin(const gchar *cache_file, const gchar *mark_file,
+			  const gchar *tags_file, MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, -1);
+
+	return msgcache_write_new_files(cache_file, mark_file, tags_file,
+					cache, FALSE);
+}
+
+gint msgcache_write_sync(const gchar *cache_file, const gchar *mark_file,
+			 const gchar *tags_file)
+{
+	gint ret = 0;
+
+	if (!prefs_common.flush_metadata)
+		return 0;
+
+	ret |= msgcache_sync_new_file(cache_file);
+	ret |= msgcache_sync_new_file(mark_file);
+	ret |= msgcache_sync_new_file(tags_file);
+
+	return ret;
+}
+
+void msgcache_write_abort(const gchar *cache_file, const gchar *mark_file,
+			  const gchar *tags_file)
+{
+	msgcache_unlink_new_file(cache_file);
+	msgcache_unlink_new_file(mark_file);
+	msgcache_unlink_new_file(tags_file);
+}
+
+void msgcache_write_commit(const gchar *cache_file, const gchar *mark_file,
+			   const gchar *tags_file, MsgCache *cache)
+{
+	gchar *new_file;
+
+	cm_return_if_fail(cache != NULL);
+
+	/* switch files, then drop the journals they include: after a
+	 * crash in between, replaying a journal over its new file can only
+	 * bring back a flag that was changed again since, while dropping
+	 * it first could lose every change it held */
+	if (cache_file) {
+		new_file = g_strconcat(cache_file, ".new", NULL);
+		move_file(new_file, cache_file, TRUE);
+		g_free(new_file);
+	}
+	if (mark_file) {
+		new_file = g_strconcat(mark_file, ".new", NULL);
+		if (move_file(new_file, mark_file, TRUE) == 0)
+			msgcache_remove_journal(mark_file);
+		g_free(new_file);
+		g_hash_table_remove_all(cache->mark_pending);
+		cache->mark_journal_size = 0;
+	}
+	if (tags_file) {
+		new_file = g_strconcat(tags_file, ".new", NULL);
+		if (move_file(new_file, tags_file, TRUE) == 0)
+			msgcache_remove_journal(tags_file);
+		g_free(new_file);
+		g_hash_table_remove_all(cache->tags_pending);
+		cache->tags_journal_size = 0;
+	}
+	msgcache_touch(cache);
+}
+
+gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar *tags_file, MsgCache *cache)
+{
+	START_TIMING("");
+	cm_return_val_if_fail(cache != NULL, -1);
+
+	if (msgcache_write_new_files(cache_file, mark_file, tags_file,
+				     cache, TRUE) < 0)
+		return -1;
+	msgcache_write_commit(cache_file, mark_file, tags_file, cache);
+
 	debug_print("done.\n");
 	END_TIMING();
 	return 0;
 }
-
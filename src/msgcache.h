@@ -27,11 +27,22 @@
 #include <glib.h>
 
 typedef struct _MsgCache MsgCache;
+typedef struct _MsgCacheMap MsgCacheMap;
+typedef struct _MsgCacheStamp MsgCacheStamp;
 
 #include "procmsg.h"
 #include "folder.h"
 
-MsgCache   	*msgcache_new				(void);
+/* What a folder scan needs of a cached message to tell whether it
+ * changed and to count it */
+struct _MsgCacheStamp {
+	guint32		 num;
+	goffset		 size;
+	time_t		 mtime;
+	MsgPermFlags	 perm_flags;
+};
+
+MsgCache   	*msgcache_new				(FolderItem *item);
 void	   	 msgcache_destroy			(MsgCache *cache);
 MsgCache   	*msgcache_read_cache			(FolderItem *item,
 							 const gchar *cache_file);
@@ -43,6 +54,29 @@ gint	   	 msgcache_write				(const gchar *cache_file,
 							 const gchar *mark_file,
 							 const gchar *tags_file,
 							 MsgCache *cache);
+gint	   	 msgcache_write_begin			(const gchar *cache_file,
+							 const gchar *mark_file,
+							 const gchar *tags_file,
+							 MsgCache *cache);
+gint	   	 msgcache_write_sync			(const gchar *cache_file,
+							 const gchar *mark_file,
+							 const gchar *tags_file);
+void	   	 msgcache_write_commit			(const gchar *cache_file,
+							 const gchar *mark_file,
+							 const gchar *tags_file,
+							 MsgCache *cache);
+void	   	 msgcache_write_abort			(const gchar *cache_file,
+							 const gchar *mark_file,
+							 const gchar *tags_file);
+gint	   	 msgcache_write_journal			(const gchar *mark_file,
+							 const gchar *tags_file,
+							 MsgCache *cache);
+void	   	 msgcache_journal_flags			(MsgCache *cache,
+							 guint num);
+void	   	 msgcache_journal_tags			(MsgCache *cache,
+							 guint num);
+gboolean   	 msgcache_has_journal			(MsgCache *cache);
+void	   	 msgcache_remove_journal		(const gchar *file);
 void 	   	 msgcache_add_msg			(MsgCache *cache,
 							 MsgInfo *msginfo);
 void 	   	 msgcache_remove_msg			(MsgCache *cache,
@@ -54,7 +88,18 @@ MsgInfo	   	*msgcache_get_msg			(MsgCache *cache,
 MsgInfo	   	*msgcache_get_msg_by_id			(MsgCache *cache,
 							 const gchar *msgid);
 MsgInfoList	*msgcache_get_msg_list			(MsgCache *cache);
+MsgCacheStamp	*msgcache_get_stamp_array		(MsgCache *cache,
+							 guint *n_stamps);
 time_t	   	 msgcache_get_last_access_time		(MsgCache *cache);
 gint	   	 msgcache_get_memory_usage		(MsgCache *cache);
+gint	   	 msgcache_get_mapped_memory_usage	(MsgCache *cache);
+gsize	   	 msgcache_get_total_memory_usage	(void);
+MsgCache   	*msgcache_get_lru_older			(MsgCache *cache);
+FolderItem 	*msgcache_get_folder_item		(MsgCache *cache);
+
+MsgCacheMap	*msgcache_map_ref			(MsgCacheMap *map);
+void	   	 msgcache_map_unref			(MsgCacheMap *map);
+gboolean   	 msgcache_map_owns			(MsgCacheMap *map,
+							 gconstpointer ptr);
 
 #endif
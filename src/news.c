@@ -1063,11 +1063,9 @@ static void news_get_extra_fields(NewsSession *session, FolderItem *item, GSList
 	for (hdr = clist_begin(hdrlist); hdr; hdr = clist_next(hdr)) {
 		struct newsnntp_xhdr_resp_item *hdrval = clist_content(hdr);
 		msginfo = g_hash_table_lookup(hash_table, GINT_TO_POINTER(hdrval->hdr_article));
-		if (msginfo) {
-			if (msginfo->newsgroups)
-				g_free(msginfo->newsgroups);
-			msginfo->newsgroups = g_strdup(hdrval->hdr_value);
-		}
+		if (msginfo)
+			procmsg_msginfo_set_str(msginfo, &msginfo->newsgroups,
+						hdrval->hdr_value);
 	}
 	newsnntp_xhdr_free(hdrlist);
 	
@@ -1087,11 +1085,9 @@ static void news_get_extra_fields(NewsSession *session, FolderItem *item, GSList
 	for (hdr = clist_begin(hdrlist); hdr; hdr = clist_next(hdr)) {
 		struct newsnntp_xhdr_resp_item *hdrval = clist_content(hdr);
 		msginfo = g_hash_table_lookup(hash_table, GINT_TO_POINTER(hdrval->hdr_article));
-		if (msginfo) {
-			if (msginfo->to)
-				g_free(msginfo->to);
-			msginfo->to = g_strdup(hdrval->hdr_value);
-		}
+		if (msginfo)
+			procmsg_msginfo_set_str(msginfo, &msginfo->to,
+						hdrval->hdr_value);
 	}
 	newsnntp_xhdr_free(hdrlist);
 	
@@ -1111,11 +1107,9 @@ static void news_get_extra_fields(NewsSession *session, FolderItem *item, GSList
 	for (hdr = clist_begin(hdrlist); hdr; hdr = clist_next(hdr)) {
 		struct newsnntp_xhdr_resp_item *hdrval = clist_content(hdr);
 		msginfo = g_hash_table_lookup(hash_table, GINT_TO_POINTER(hdrval->hdr_article));
-		if (msginfo) {
-			if (msginfo->cc)
-				g_free(msginfo->cc);
-			msginfo->cc = g_strdup(hdrval->hdr_value);
-		}
+		if (msginfo)
+			procmsg_msginfo_set_str(msginfo, &msginfo->cc,
+						hdrval->hdr_value);
 	}
 	newsnntp_xhdr_free(hdrlist);
 	
@@ -1156,6 +1156,8 @@ static PrefParam param[] = {
 
 	{"flush_metadata", "TRUE", &prefs_common.flush_metadata, P_BOOL,
 	 NULL, NULL, NULL},
+	{"compress_cache", "FALSE", &prefs_common.compress_cache, P_BOOL,
+	 NULL, NULL, NULL},
 
 	{NULL, NULL, NULL, P_OTHER, NULL, NULL, NULL}
 };
@@ -506,6 +506,7 @@ struct _PrefsCommon
 	gboolean two_line_vert;
 	gboolean inherit_folder_props;
 	gboolean flush_metadata;
+	gboolean compress_cache;
 
 };
 
@@ -27,7 +27,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifdef G_OS_WIN32
 #  include <w32lib.h>
@@ -38,29 +41,31 @@
 #include "codeconv.h"
 #include "prefs_common.h"
 #include "utils.h"
+#include "textscan.h"
 
 #define BUFFSIZE	8192
 
+#ifndef O_BINARY
+#  define O_BINARY	0
+#endif
+#ifndef O_NONBLOCK
+#  define O_NONBLOCK	0
+#endif
+
 static gchar monthstr[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
 
 typedef char *(*getlinefunc) (char *, size_t, void *);
 typedef int (*peekcharfunc) (void *);
 typedef int (*getcharfunc) (void *);
-typedef gint (*get_one_field_func) (gchar *, size_t, void *, HeaderEntry[]);
-
-static gint string_get_one_field(gchar *buf, size_t len, char **str,
-				 HeaderEntry hentry[]);
 
-static char *string_getline(char *buf, size_t len, char **str);
-static int string_peekchar(char **str);
 static int file_peekchar(FILE *fp);
 static gint generic_get_one_field(gchar *buf, size_t len, void *data,
 				  HeaderEntry hentry[],
 				  getlinefunc getline, 
 				  peekcharfunc peekchar,
 				  gboolean unfold);
-static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
-			     gboolean full, gboolean decrypted);
+static MsgInfo *parse_stream(FILE *fp, gint fd, const gchar *str,
+			     MsgFlags flags, gboolean full, gboolean decrypted);
 
 
 gint procheader_get_one_field(gchar *buf, size_t len, FILE *fp,
@@ -71,46 +76,6 @@ gint procheader_get_one_field(gchar *buf, size_t len, FILE *fp,
 				     TRUE);
 }
 
-static gint string_get_one_field(gchar *buf, size_t len, char **str,
-				 HeaderEntry hentry[])
-{
-	return generic_get_one_field(buf, len, str, hentry,
-				     (getlinefunc)string_getline,
-				     (peekcharfunc)string_peekchar,
-				     TRUE);
-}
-
-static char *string_getline(char *buf, size_t len, char **str)
-{
-	gboolean is_cr = FALSE;
-	gboolean last_was_cr = FALSE;
-
-	if (!*str || !**str)
-		return NULL;
-
-	for (; **str && len > 1; --len) {
-		is_cr = (**str == '\r');
-		if ((*buf++ = *(*str)++) == '\n') {
-		    break;
-		}
-		if (last_was_cr) {
-			*(--buf) = '\n';
-			buf++;
-		    break;
-		}
-		last_was_cr = is_cr;
-	}
-		
-	*buf = '\0';
-
-	return buf;
-}
-
-static int string_peekchar(char **str)
-{
-	return **str;
-}
-
 static int file_peekchar(FILE *fp)
 {
 	return ungetc(getc(fp), fp);
@@ -324,23 +289,35 @@ MsgInfo *procheader_parse_file(const gchar *file, MsgFlags flags,
 			       gboolean full, gboolean decrypted)
 {
 	struct stat s;
-	FILE *fp;
+	gint fd;
 	MsgInfo *msginfo;
 
-	if (g_stat(file, &s) < 0) {
-		FILE_OP_ERROR(file, "stat");
+	/* plain read()s into the parser's block: no stdio buffer, and
+	 * fstat() instead of a second lookup of the path. The open must
+	 * not block on a FIFO before it is found not to be a file. */
+	if ((fd = g_open(file, O_RDONLY | O_BINARY | O_NONBLOCK, 0)) < 0) {
+		FILE_OP_ERROR(file, "open");
 		return NULL;
 	}
-	if (!S_ISREG(s.st_mode))
+	if (fstat(fd, &s) < 0) {
+		FILE_OP_ERROR(file, "fstat");
+		close(fd);
 		return NULL;
-
-	if ((fp = g_fopen(file, "rb")) == NULL) {
-		FILE_OP_ERROR(file, "fopen");
+	}
+	if (!S_ISREG(s.st_mode)) {
+		close(fd);
 		return NULL;
 	}
+#if O_NONBLOCK
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+		FILE_OP_ERROR(file, "fcntl");
+		close(fd);
+		return NULL;
+	}
+#endif
 
-	msginfo = procheader_parse_stream(fp, flags, full, decrypted);
-	fclose(fp);
+	msginfo = parse_stream(NULL, fd, NULL, flags, full, decrypted);
+	close(fd);
 
 	if (msginfo) {
 		msginfo->size = s.st_size;
@@ -353,7 +330,7 @@ MsgInfo *procheader_parse_file(const gchar *file, MsgFlags flags,
 MsgInfo *procheader_parse_str(const gchar *str, MsgFlags flags, gboolean full,
 			      gboolean decrypted)
 {
-	return parse_stream(&str, TRUE, flags, full, decrypted);
+	return parse_stream(NULL, -1, str, flags, full, decrypted);
 }
 
 enum
@@ -438,6 +415,288 @@ static HeaderEntry hentry_short[] = {{"Date:",		NULL, FALSE},
 				    {"SC-Message-Size:",NULL, FALSE},
 				    {NULL,		NULL, FALSE}};
 
+/* Case-insensitive perfect hash over the hentry_full names, colon excluded.
+ * The multiplier and shift are searched for when the table is first
+ * needed, so that every name gets its own slot whatever hentry_full
+ * holds. "From " has no colon and is checked on its own. */
+#define HEADER_HASH_SIZE	64
+#define HEADER_HASH_MULT_MAX	1024
+#define HEADER_HASH_SHIFT_MAX	8
+#define HEADER_NAME_MAX		32
+
+static gint8 header_hash_table[HEADER_HASH_SIZE];
+static guint32 header_hash_mult;
+static guint header_hash_shift;
+
+static guint header_name_hash(const gchar *name, gsize len)
+{
+	guint32 h = len;
+	gsize i;
+
+	for (i = 0; i < len; i++)
+		h = h * header_hash_mult + ((guchar)name[i] | 0x20);
+
+	return (h >> header_hash_shift) & (HEADER_HASH_SIZE - 1);
+}
+
+/* Fills header_hash_table if the current multiplier and shift give
+ * every name its own slot */
+static gboolean header_hash_table_fill(void)
+{
+	const gchar *name;
+	gsize len;
+	guint slot;
+	gint i;
+
+	memset(header_hash_table, -1, sizeof(header_hash_table));
+	for (i = 0; hentry_full[i].name != NULL; i++) {
+		name = hentry_full[i].name;
+		len = strlen(name);
+		if (name[len - 1] != ':')
+			continue;
+		/* header_name_lookup() looks no further for the colon */
+		g_assert(len <= HEADER_NAME_MAX);
+		slot = header_name_hash(name, len - 1);
+		if (header_hash_table[slot] >= 0)
+			return FALSE;
+		header_hash_table[slot] = i;
+	}
+
+	return TRUE;
+}
+
+static gpointer header_hash_table_build(gpointer data)
+{
+	for (header_hash_shift = 0;
+	     header_hash_shift < HEADER_HASH_SHIFT_MAX; header_hash_shift++) {
+		for (header_hash_mult = 1;
+		     header_hash_mult < HEADER_HASH_MULT_MAX;
+		     header_hash_mult += 2) {
+			if (header_hash_table_fill()) {
+				debug_print("header hash: multiplier %u, shift %u\n",
+					    header_hash_mult, header_hash_shift);
+				return NULL;
+			}
+		}
+	}
+
+	/* HEADER_HASH_SIZE is too small for hentry_full */
+	g_assert_not_reached();
+	return NULL;
+}
+
+static GOnce header_hash_once = G_ONCE_INIT;
+
+/* returns the hentry_full index of the header starting at line, or -1 */
+static gint header_name_lookup(const gchar *line, gsize len)
+{
+	const gchar *colon;
+	gsize namelen;
+	gint hnum;
+
+	if (len >= 5 && !g_ascii_strncasecmp(line, "From ", 5))
+		return H_FROM_SPACE;
+
+	colon = memchr(line, ':', MIN(len, HEADER_NAME_MAX));
+	if (colon == NULL)
+		return -1;
+	namelen = colon - line;
+
+	g_once(&header_hash_once, header_hash_table_build, NULL);
+	hnum = header_hash_table[header_name_hash(line, namelen)];
+	if (hnum < 0 ||
+	    g_ascii_strncasecmp(hentry_full[hnum].name, line, namelen + 1) != 0)
+		return -1;
+
+	return hnum;
+}
+
+/* Block reader used by parse_stream(), over a string, a stdio stream or
+ * a file descriptor. Lines are located with memchr() inside the block, and
+ * only the fields that are looked up get copied out. Line ends follow
+ * fgets_crlf(): a lone CR also ends a line. */
+typedef struct _HeaderReader	HeaderReader;
+
+struct _HeaderReader
+{
+	FILE *fp;
+	gint fd;
+	const gchar *start;
+	const gchar *cur;
+	const gchar *end;
+	gboolean eof;
+	gboolean moved;		/* the block no longer starts the data */
+	gchar block[BUFFSIZE * 2];
+};
+
+static void header_reader_init(HeaderReader *reader, FILE *fp, gint fd,
+			       const gchar *str)
+{
+	reader->fp = fp;
+	reader->fd = fd;
+	reader->moved = FALSE;
+	if (str != NULL) {
+		reader->start = str;
+		reader->end = str + strlen(str);
+		reader->eof = TRUE;
+	} else {
+		reader->start = reader->end = reader->block;
+		reader->eof = FALSE;
+	}
+	reader->cur = reader->start;
+}
+
+static void header_reader_rewind(HeaderReader *reader)
+{
+	/* nothing to read again while the block still holds the start */
+	if (reader->moved) {
+		if (reader->fp != NULL)
+			rewind(reader->fp);
+		else
+			lseek(reader->fd, 0, SEEK_SET);
+		reader->end = reader->block;
+		reader->eof = FALSE;
+		reader->moved = FALSE;
+	}
+	reader->cur = reader->start;
+}
+
+/* moves the unread data to the front of the block and reads more;
+ * pointers into the block are invalid afterwards */
+static gboolean header_reader_fill(HeaderReader *reader)
+{
+	gsize left;
+	gssize n;
+
+	if (reader->eof)
+		return FALSE;
+
+	left = reader->end - reader->cur;
+	if (left == sizeof(reader->block))
+		return FALSE;
+	if (reader->cur != reader->block) {
+		memmove(reader->block, reader->cur, left);
+		reader->cur = reader->block;
+		reader->end = reader->block + left;
+		reader->moved = TRUE;
+	}
+
+	if (reader->fp != NULL)
+		n = fread(reader->block + left, 1,
+			  sizeof(reader->block) - left, reader->fp);
+	else
+		n = read(reader->fd, reader->block + left,
+			 sizeof(reader->block) - left);
+	if (n <= 0) {
+		reader->eof = TRUE;
+		return FALSE;
+	}
+	reader->end += n;
+
+	return TRUE;
+}
+
+/* returns the length of the line at reader->cur including its end, 0 at
+ * the end of the data; bare_cr is set when it ends with a lone CR */
+static gsize header_reader_line(HeaderReader *reader, gboolean *bare_cr)
+{
+	const gchar *nl, *cr;
+	gsize len;
+
+	*bare_cr = FALSE;
+
+	while (1) {
+		len = reader->end - reader->cur;
+		nl = memchr(reader->cur, '\n', len);
+		cr = memchr(reader->cur, '\r', nl ? nl - reader->cur : len);
+		if (cr != NULL && cr + 1 < reader->end && cr + 1 != nl) {
+			*bare_cr = TRUE;
+			return cr + 1 - reader->cur;
+		}
+		if (nl != NULL)
+			return nl + 1 - reader->cur;
+		if (!header_reader_fill(reader))
+			break;
+	}
+
+	/* a line longer than the block is returned in pieces; keep the last
+	 * character (or a trailing CR and the one before it) for the next
+	 * piece so that it cannot start with a line end */
+	len = reader->end - reader->cur;
+	if (len == sizeof(reader->block))
+		len -= (reader->end[-1] == '\r') ? 2 : 1;
+
+	return len;
+}
+
+static gint header_reader_peekchar(HeaderReader *reader)
+{
+	if (reader->cur == reader->end && !header_reader_fill(reader))
+		return EOF;
+
+	return (guchar)*reader->cur;
+}
+
+/* Same result as generic_get_one_field() with hentry_full truncated to
+ * nentries entries, or with a NULL hentry when nentries is negative. */
+static gint header_reader_get_field(HeaderReader *reader, gchar *buf,
+				    gsize len, gint nentries)
+{
+	gsize linelen, buflen, n;
+	gboolean bare_cr, unfold, cont = FALSE;
+	gint nexthead;
+	gint hnum = 0;
+
+	while (1) {
+		linelen = header_reader_line(reader, &bare_cr);
+		if (linelen == 0)
+			return -1;
+		if (reader->cur[0] == '\r' || reader->cur[0] == '\n')
+			return -1;
+		if (nentries < 0)
+			break;
+		if (reader->cur[0] != ' ' && reader->cur[0] != '\t') {
+			hnum = header_name_lookup(reader->cur, linelen);
+			if (hnum >= 0 && hnum < nentries)
+				break;
+		}
+		reader->cur += linelen;
+	}
+	unfold = nentries < 0 || hentry_full[hnum].unfold;
+
+	buflen = 0;
+	while (1) {
+		n = MIN(linelen, len - buflen - 1);
+		memcpy(buf + buflen, reader->cur, n);
+		reader->cur += n;
+		if (cont && buf[buflen] == '\t')
+			buf[buflen] = ' ';
+		buflen += n;
+		if (bare_cr && n == linelen && buflen < len - 1)
+			buf[buflen++] = '\n';
+		buf[buflen] = '\0';
+
+		nexthead = header_reader_peekchar(reader);
+		if (nexthead != ' ' && nexthead != '\t')
+			break;
+		if (unfold) {
+			while (buflen > 0 && (buf[buflen - 1] == '\n' ||
+					      buf[buflen - 1] == '\r'))
+				buf[--buflen] = '\0';
+		}
+		if (len - buflen <= 2)
+			break;
+		linelen = header_reader_line(reader, &bare_cr);
+		cont = TRUE;
+	}
+
+	while (buflen > 0 && (buf[buflen - 1] == '\n' ||
+			      buf[buflen - 1] == '\r'))
+		buf[--buflen] = '\0';
+
+	return hnum;
+}
+
 static HeaderEntry* procheader_get_headernames(gboolean full)
 {
 	return full ? hentry_full : hentry_short;
@@ -446,28 +705,29 @@ static HeaderEntry* procheader_get_headernames(gboolean full)
 MsgInfo *procheader_parse_stream(FILE *fp, MsgFlags flags, gboolean full,
 				 gboolean decrypted)
 {
-	return parse_stream(fp, FALSE, flags, full, decrypted);
+	return parse_stream(fp, -1, NULL, flags, full, decrypted);
 }
 
-static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
-			     gboolean full, gboolean decrypted)
+static MsgInfo *parse_stream(FILE *fp, gint fd, const gchar *str,
+			     MsgFlags flags, gboolean full, gboolean decrypted)
 {
 	MsgInfo *msginfo;
 	gchar buf[BUFFSIZE];
 	gchar *p, *tmp;
 	gchar *hp;
 	HeaderEntry *hentry;
-	gint hnum;
-	void *orig_data = data;
-
-	get_one_field_func get_one_field =
-		isstring ? (get_one_field_func)string_get_one_field
-			 : (get_one_field_func)procheader_get_one_field;
+	gint hnum, nentries;
+	HeaderReader reader;
 
 	hentry = procheader_get_headernames(full);
+	nentries = full ? G_N_ELEMENTS(hentry_full) - 1
+			: G_N_ELEMENTS(hentry_short) - 1;
+
+	header_reader_init(&reader, fp, fd, str);
 
 	if (MSG_IS_QUEUED(flags) || MSG_IS_DRAFT(flags)) {
-		while (get_one_field(buf, sizeof(buf), data, NULL) != -1) {
+		while (header_reader_get_field(&reader, buf, sizeof(buf), -1)
+		       != -1) {
 			if ((!strncmp(buf, "X-Claws-End-Special-Headers: 1",
 				strlen("X-Claws-End-Special-Headers:"))) ||
 			    (!strncmp(buf, "X-Sylpheed-End-Special-Headers: 1",
@@ -478,10 +738,7 @@ static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
 			||  !strncmp(buf, "To: ", 4)
 			||  !strncmp(buf, "From: ", 6)
 			||  !strncmp(buf, "Subject: ", 9)) {
-				if (isstring)
-					data = orig_data;
-				else 
-					rewind((FILE *)data);
+				header_reader_rewind(&reader);
 				break;
 			}
 		}
@@ -496,8 +753,8 @@ static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
 	
 	msginfo->inreplyto = NULL;
 
-	while ((hnum = get_one_field(buf, sizeof(buf), data, hentry))
-	       != -1) {
+	while ((hnum = header_reader_get_field(&reader, buf, sizeof(buf),
+					       nentries)) != -1) {
 		hp = buf + strlen(hentry[hnum].name);
 		while (*hp == ' ' || *hp == '\t') hp++;
 
@@ -506,7 +763,7 @@ static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
 			if (msginfo->date) break;
 			msginfo->date_t =
 				procheader_date_parse(NULL, hp, 0);
-			if (g_utf8_validate(hp, -1, NULL)) {
+			if (scan_utf8_validate(hp, -1, NULL)) {
 				msginfo->date = g_strdup(hp);
 			} else {
 				gchar *utf = conv_codeset_strdup(
@@ -728,6 +985,8 @@ static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
 		msginfo->inreplyto =
 			g_strdup((gchar *)msginfo->references->data);
 
+	procmsg_msginfo_intern_strings(msginfo);
+
 	return msginfo;
 }
 
@@ -761,6 +1020,176 @@ gchar *procheader_get_fromname(const gchar *str)
 	return name;
 }
 
+#define DATE_IS_SPACE(c) \
+	((c) == ' ' || (c) == '\t' || (c) == '\n' || \
+	 (c) == '\v' || (c) == '\f' || (c) == '\r')
+
+static const gchar *date_skip_space(const gchar *p)
+{
+	while (DATE_IS_SPACE(*p))
+		p++;
+	return p;
+}
+
+/* copies the word at p, failing if it is longer than max */
+static const gchar *date_get_word(const gchar *p, gchar *word, gint max)
+{
+	gint n = 0;
+
+	while (*p != '\0' && !DATE_IS_SPACE(*p)) {
+		if (n == max || (*p & 0x80))
+			return NULL;
+		word[n++] = *p++;
+	}
+	word[n] = '\0';
+
+	return p;
+}
+
+/* reads 1 to max digits */
+static const gchar *date_get_number(const gchar *p, gint *num, gint max)
+{
+	gint n, val = 0;
+
+	for (n = 0; g_ascii_isdigit(*p); n++) {
+		if (n == max)
+			return NULL;
+		val = val * 10 + (*p++ - '0');
+	}
+	if (n == 0)
+		return NULL;
+	*num = val;
+
+	return p;
+}
+
+/* hh:mm or hh:mm:ss */
+static const gchar *date_get_time(const gchar *p, gint *hh, gint *mm,
+				  gint *ss)
+{
+	if ((p = date_get_number(p, hh, 2)) == NULL || *p++ != ':')
+		return NULL;
+	if ((p = date_get_number(p, mm, 2)) == NULL)
+		return NULL;
+	if (*p == ':')
+		return date_get_number(p + 1, ss, 2);
+	*ss = 0;
+
+	return p;
+}
+
+/* the first 5 characters of the next word, as "%5s" would read them */
+static const gchar *date_get_zone(const gchar *p, gchar *zone)
+{
+	gint n;
+
+	p = date_skip_space(p);
+	for (n = 0; n < 5 && *p != '\0' && !DATE_IS_SPACE(*p); n++) {
+		if (*p & 0x80)
+			return NULL;
+		zone[n] = *p++;
+	}
+	zone[n] = '\0';
+
+	return p;
+}
+
+/* Single pass over "[weekday] day month year hh:mm[:ss] [zone]", the
+ * layout of nearly every Date: header. Anything else returns -1 and is
+ * left to the sscanf() patterns, so whatever this accepts must yield the
+ * same fields those patterns would. */
+static gint procheader_scan_date_fast(const gchar *str,
+				      gchar *weekday, gint *day,
+				      gchar *month, gint *year,
+				      gint *hh, gint *mm, gint *ss,
+				      gchar *zone)
+{
+	const gchar *p = date_skip_space(str);
+
+	*weekday = '\0';
+	if (g_ascii_isalpha(*p)) {
+		if ((p = date_get_word(p, weekday, 10)) == NULL)
+			return -1;
+		p = date_skip_space(p);
+	}
+	if ((p = date_get_number(p, day, 4)) == NULL || !DATE_IS_SPACE(*p))
+		return -1;
+	p = date_skip_space(p);
+	if (!g_ascii_isalpha(*p) || (p = date_get_word(p, month, 9)) == NULL)
+		return -1;
+	p = date_skip_space(p);
+	if ((p = date_get_number(p, year, 4)) == NULL || !DATE_IS_SPACE(*p))
+		return -1;
+	p = date_skip_space(p);
+	if ((p = date_get_time(p, hh, mm, ss)) == NULL)
+		return -1;
+	if (date_get_zone(p, zone) == NULL)
+		return -1;
+
+	return 0;
+}
+
+/* asctime() and RFC 850 dates, which none of the patterns match */
+static gint procheader_scan_date_other(const gchar *str,
+				       gchar *weekday, gint *day,
+				       gchar *month, gint *year,
+				       gint *hh, gint *mm, gint *ss,
+				       gchar *zone)
+{
+	const gchar *p = date_skip_space(str);
+	gint n;
+
+	if (!g_ascii_isalpha(*p) || (p = date_get_word(p, weekday, 10)) == NULL)
+		return -1;
+	p = date_skip_space(p);
+
+	*zone = '\0';
+	if (g_ascii_isalpha(*p)) {
+		/* "Sun Nov  6 08:49:37 1994", date(1) puts a zone before
+		 * the year */
+		if ((p = date_get_word(p, month, 9)) == NULL)
+			return -1;
+		p = date_skip_space(p);
+		if ((p = date_get_number(p, day, 2)) == NULL)
+			return -1;
+		p = date_skip_space(p);
+		if ((p = date_get_time(p, hh, mm, ss)) == NULL)
+			return -1;
+		p = date_skip_space(p);
+		if (g_ascii_isalpha(*p)) {
+			if ((p = date_get_zone(p, zone)) == NULL)
+				return -1;
+			p = date_skip_space(p);
+		}
+		if ((p = date_get_number(p, year, 4)) == NULL)
+			return -1;
+		if (*zone == '\0' && date_get_zone(p, zone) == NULL)
+			return -1;
+		return 0;
+	}
+
+	/* "Sunday, 06-Nov-94 08:49:37 GMT" */
+	if ((p = date_get_number(p, day, 2)) == NULL || *p++ != '-')
+		return -1;
+	for (n = 0; g_ascii_isalpha(*p); n++) {
+		if (n == 9)
+			return -1;
+		month[n] = *p++;
+	}
+	month[n] = '\0';
+	if (n == 0 || *p++ != '-')
+		return -1;
+	if ((p = date_get_number(p, year, 4)) == NULL)
+		return -1;
+	p = date_skip_space(p);
+	if ((p = date_get_time(p, hh, mm, ss)) == NULL)
+		return -1;
+	if (date_get_zone(p, zone) == NULL)
+		return -1;
+
+	return 0;
+}
+
 static gint procheader_scan_date_string(const gchar *str,
 					gchar *weekday, gint *day,
 					gchar *month, gint *year,
@@ -775,6 +1204,10 @@ static gint procheader_scan_date_string(const gchar *str,
 	if (str == NULL)
 		return -1;
 
+	if (procheader_scan_date_fast(str, weekday, day, month, year,
+				      hh, mm, ss, zone) == 0)
+		return 0;
+
 	result = sscanf(str, "%10s %d %9s %d %2d:%2d:%2d %5s",
 			weekday, day, month, year, hh, mm, ss, zone);
 	if (result == 8) return 0;
@@ -841,7 +1274,8 @@ static gint procheader_scan_date_string(const gchar *str,
 		}
 	}
 
-	return -1;
+	return procheader_scan_date_other(str, weekday, day, month, year,
+					  hh, mm, ss, zone);
 }
 
 /*
@@ -900,6 +1334,27 @@ gboolean procheader_date_parse_to_tm(const gchar *src, struct tm *t, char *zone)
 	return TRUE;
 }
 
+/* same as remote_tzoffset_sec(), with "+hhmm" handled without sscanf() */
+static time_t procheader_zone_offset(const gchar *zone)
+{
+	const gchar *p;
+	gint offset = 0;
+	time_t remoteoffset;
+
+	if (zone[0] != '+' && zone[0] != '-')
+		return remote_tzoffset_sec(zone);
+	for (p = zone + 1; g_ascii_isdigit(*p); p++)
+		offset = offset * 10 + (*p - '0');
+	if (p == zone + 1 || *p != '\0')
+		return remote_tzoffset_sec(zone);
+
+	remoteoffset = ((offset / 100) * 60 + (offset % 100)) * 60;
+	if (zone[0] == '-')
+		remoteoffset = -remoteoffset;
+
+	return remoteoffset;
+}
+
 time_t procheader_date_parse(gchar *dest, const gchar *src, gint len)
 {
 	gchar weekday[11];
@@ -948,7 +1403,7 @@ time_t procheader_date_parse(gchar *dest, const gchar *src, gint len)
 	t.tm_isdst = -1;
 
 	timer = mktime(&t);
-	tz_offset = remote_tzoffset_sec(zone);
+	tz_offset = procheader_zone_offset(zone);
 	if (tz_offset != -1)
 		timer += tzoffset_sec(&timer) - tz_offset;
 
@@ -1303,8 +1303,145 @@ MsgInfo *procmsg_msginfo_get_full_info(MsgInfo *msginfo)
 	return full_msginfo;
 }
 
+/* Address-like header fields repeat a lot across messages and folders
+ * (mailing lists, our own addresses), so they are shared through one
+ * string table. */
+static StringTable *msginfo_string_table = NULL;
+G_LOCK_DEFINE_STATIC(msginfo_string_table);
+
+StringTable *procmsg_get_string_table(void)
+{
+	G_LOCK(msginfo_string_table);
+	if (msginfo_string_table == NULL)
+		msginfo_string_table = string_table_new();
+	G_UNLOCK(msginfo_string_table);
+
+	return msginfo_string_table;
+}
+
+static gchar *procmsg_msginfo_intern_str(MsgInfo *msginfo,
+					 StringTable *table, gchar *str)
+{
+	gchar *interned;
+
+	if (str == NULL)
+		return NULL;
+	if (msginfo->cache_map && msgcache_map_owns(msginfo->cache_map, str))
+		return str;
+
+	interned = string_table_insert_string(table, str);
+	if (interned != str)
+		g_free(str);
+	else	/* already interned, drop the extra reference */
+		string_table_free_string(table, str);
+
+	return interned;
+}
+
+/* Replaces the address-like fields of a freshly parsed or read msginfo
+ * with shared copies. They must not be modified in place afterwards,
+ * see procmsg_msginfo_set_str(). */
+void procmsg_msginfo_intern_strings(MsgInfo *msginfo)
+{
+	StringTable *table;
+
+	cm_return_if_fail(msginfo != NULL);
+
+	table = procmsg_get_string_table();
+	msginfo->fromname = procmsg_msginfo_intern_str(msginfo, table, msginfo->fromname);
+	msginfo->from = procmsg_msginfo_intern_str(msginfo, table, msginfo->from);
+	msginfo->to = procmsg_msginfo_intern_str(msginfo, table, msginfo->to);
+	msginfo->cc = procmsg_msginfo_intern_str(msginfo, table, msginfo->cc);
+	msginfo->newsgroups = procmsg_msginfo_intern_str(msginfo, table, msginfo->newsgroups);
+}
+
+/* Strings read from a mapped cache file belong to the mapping */
+static void procmsg_msginfo_free_str(MsgInfo *msginfo, gchar *str)
+{
+	if (msginfo->cache_map && msgcache_map_owns(msginfo->cache_map, str))
+		return;
+	g_free(str);
+}
+
+static void procmsg_msginfo_free_addr(MsgInfo *msginfo, gchar *str)
+{
+	if (str != NULL && msginfo_string_table != NULL &&
+	    string_table_free_string(msginfo_string_table, str))
+		return;
+	procmsg_msginfo_free_str(msginfo, str);
+}
+
+/**
+ * procmsg_msginfo_set_str:
+ * @msginfo: the message
+ * @field: the address of one of its string fields
+ * @str: the new value, copied, or NULL
+ *
+ * Sets a string field of a msginfo which may already hold strings from
+ * a mapped cache file or from the string table. Those are shared and
+ * must be neither freed nor modified: the old value is released as its
+ * owner wants, and the field gets a copy of its own.
+ */
+void procmsg_msginfo_set_str(MsgInfo *msginfo, gchar **field,
+			     const gchar *str)
+{
+	gchar *old;
+
+	cm_return_if_fail(msginfo != NULL);
+	cm_return_if_fail(field != NULL);
+
+	old = *field;
+	*field = g_strdup(str);
+	procmsg_msginfo_free_addr(msginfo, old);
+}
+
+/**
+ * procmsg_msginfo_get_writable_str:
+ * @msginfo: the message
+ * @field: the address of one of its string fields
+ *
+ * Returns the string at @field, after giving the field a copy of its
+ * own the first time a shared string is to be modified in place.
+ */
+gchar *procmsg_msginfo_get_writable_str(MsgInfo *msginfo, gchar **field)
+{
+	cm_return_val_if_fail(msginfo != NULL, NULL);
+	cm_return_val_if_fail(field != NULL, NULL);
+
+	if (*field == NULL)
+		return NULL;
+
+	if ((msginfo->cache_map &&
+	     msgcache_map_owns(msginfo->cache_map, *field)) ||
+	    (msginfo_string_table != NULL &&
+	     string_table_owns_string(msginfo_string_table, *field)))
+		procmsg_msginfo_set_str(msginfo, field, *field);
+
+	return *field;
+}
+
+static guint procmsg_msginfo_str_memusage(MsgInfo *msginfo, const gchar *str)
+{
+	if (str == NULL)
+		return 0;
+	if (msginfo->cache_map && msgcache_map_owns(msginfo->cache_map, str))
+		return 0;
+	return strlen(str) + 1;
+}
+
+/* Shared strings are accounted for once by the string table */
+static guint procmsg_msginfo_addr_memusage(MsgInfo *msginfo, const gchar *str)
+{
+	if (str != NULL && msginfo_string_table != NULL &&
+	    string_table_owns_string(msginfo_string_table, str))
+		return 0;
+	return procmsg_msginfo_str_memusage(msginfo, str);
+}
+
 void procmsg_msginfo_free(MsgInfo *msginfo)
 {
+	GSList *cur;
+
 	if (msginfo == NULL) return;
 
 	msginfo->refcnt--;
@@ -1318,17 +1455,17 @@ void procmsg_msginfo_free(MsgInfo *msginfo)
 
 	g_free(msginfo->fromspace);
 
-	g_free(msginfo->fromname);
+	procmsg_msginfo_free_addr(msginfo, msginfo->fromname);
 
-	g_free(msginfo->date);
-	g_free(msginfo->from);
-	g_free(msginfo->to);
-	g_free(msginfo->cc);
-	g_free(msginfo->newsgroups);
-	g_free(msginfo->subject);
-	g_free(msginfo->msgid);
-	g_free(msginfo->inreplyto);
-	g_free(msginfo->xref);
+	procmsg_msginfo_free_str(msginfo, msginfo->date);
+	procmsg_msginfo_free_addr(msginfo, msginfo->from);
+	procmsg_msginfo_free_addr(msginfo, msginfo->to);
+	procmsg_msginfo_free_addr(msginfo, msginfo->cc);
+	procmsg_msginfo_free_addr(msginfo, msginfo->newsgroups);
+	procmsg_msginfo_free_str(msginfo, msginfo->subject);
+	procmsg_msginfo_free_str(msginfo, msginfo->msgid);
+	procmsg_msginfo_free_str(msginfo, msginfo->inreplyto);
+	procmsg_msginfo_free_str(msginfo, msginfo->xref);
 
 	if (msginfo->extradata) {
 		g_free(msginfo->extradata->returnreceiptto);
@@ -1346,46 +1483,105 @@ void procmsg_msginfo_free(MsgInfo *msginfo)
 		g_free(msginfo->extradata->account_login);
 		g_free(msginfo->extradata);
 	}
-	slist_free_strings(msginfo->references);
+	for (cur = msginfo->references; cur != NULL; cur = cur->next)
+		procmsg_msginfo_free_str(msginfo, (gchar *)cur->data);
 	g_slist_free(msginfo->references);
 	g_slist_free(msginfo->tags);
 
 	g_free(msginfo->plaintext_file);
 
+	msgcache_map_unref(msginfo->cache_map);
+
 	g_free(msginfo);
 }
 
+#define MSGINFO_N_ADDRS	5
+
+static void procmsg_msginfo_get_addrs(MsgInfo *msginfo, gchar ***addrs)
+{
+	addrs[0] = &msginfo->fromname;
+	addrs[1] = &msginfo->from;
+	addrs[2] = &msginfo->to;
+	addrs[3] = &msginfo->cc;
+	addrs[4] = &msginfo->newsgroups;
+}
+
+/* Same as procmsg_msginfo_free() on each of msginfos, but the addresses
+ * shared by the messages freed go back to the string table together,
+ * taking its lock once instead of up to five times a message. The array
+ * itself is left to the caller. */
+void procmsg_msginfo_free_array(GPtrArray *msginfos)
+{
+	GPtrArray *dead, *strs;
+	gchar **addrs[MSGINFO_N_ADDRS];
+	MsgInfo *msginfo;
+	guint i, j, k;
+
+	cm_return_if_fail(msginfos != NULL);
+
+	dead = g_ptr_array_sized_new(msginfos->len);
+	strs = g_ptr_array_sized_new(msginfos->len * MSGINFO_N_ADDRS);
+	for (i = 0; i < msginfos->len; i++) {
+		msginfo = g_ptr_array_index(msginfos, i);
+		if (msginfo == NULL)
+			continue;
+		if (msginfo->refcnt > 1) {
+			msginfo->refcnt--;
+			continue;
+		}
+		g_ptr_array_add(dead, msginfo);
+		procmsg_msginfo_get_addrs(msginfo, addrs);
+		for (j = 0; j < MSGINFO_N_ADDRS; j++)
+			if (*addrs[j] != NULL)
+				g_ptr_array_add(strs, *addrs[j]);
+	}
+
+	if (strs->len > 0 && msginfo_string_table != NULL)
+		string_table_free_strings(msginfo_string_table,
+					  (gchar **)strs->pdata, strs->len);
+
+	/* strs holds the addresses in the order they were gathered, those
+	 * the table released now NULL */
+	for (i = 0, k = 0; i < dead->len; i++) {
+		msginfo = g_ptr_array_index(dead, i);
+		procmsg_msginfo_get_addrs(msginfo, addrs);
+		for (j = 0; j < MSGINFO_N_ADDRS; j++) {
+			if (*addrs[j] == NULL)
+				continue;
+			procmsg_msginfo_free_str(msginfo,
+						 g_ptr_array_index(strs, k++));
+			*addrs[j] = NULL;
+		}
+		procmsg_msginfo_free(msginfo);
+	}
+
+	g_ptr_array_free(strs, TRUE);
+	g_ptr_array_free(dead, TRUE);
+}
+
 guint procmsg_msginfo_memusage(MsgInfo *msginfo)
 {
 	guint memusage = 0;
 	GSList *tmp;
 	
 	memusage += sizeof(MsgInfo);
-	if (msginfo->fromname)
-		memusage += strlen(msginfo->fromname);
-	if (msginfo->date)
-		memusage += strlen(msginfo->date);
-	if (msginfo->from)
-		memusage += strlen(msginfo->from);
-	if (msginfo->to)
-		memusage += strlen(msginfo->to);
-	if (msginfo->cc)
-		memusage += strlen(msginfo->cc);
-	if (msginfo->newsgroups)
-		memusage += strlen(msginfo->newsgroups);
-	if (msginfo->subject)
-		memusage += strlen(msginfo->subject);
-	if (msginfo->msgid)
-		memusage += strlen(msginfo->msgid);
-	if (msginfo->inreplyto)
-		memusage += strlen(msginfo->inreplyto);
+	memusage += procmsg_msginfo_addr_memusage(msginfo, msginfo->fromname);
+	memusage += procmsg_msginfo_str_memusage(msginfo, msginfo->date);
+	memusage += procmsg_msginfo_addr_memusage(msginfo, msginfo->from);
+	memusage += procmsg_msginfo_addr_memusage(msginfo, msginfo->to);
+	memusage += procmsg_msginfo_addr_memusage(msginfo, msginfo->cc);
+	memusage += procmsg_msginfo_addr_memusage(msginfo, msginfo->newsgroups);
+	memusage += procmsg_msginfo_str_memusage(msginfo, msginfo->subject);
+	memusage += procmsg_msginfo_str_memusage(msginfo, msginfo->msgid);
+	memusage += procmsg_msginfo_str_memusage(msginfo, msginfo->inreplyto);
+	memusage += procmsg_msginfo_str_memusage(msginfo, msginfo->xref);
 
 	for (tmp = msginfo->references; tmp; tmp=tmp->next) {
 		gchar *r = (gchar *)tmp->data;
-		memusage += r?strlen(r):0 + sizeof(GSList);
+		memusage += procmsg_msginfo_str_memusage(msginfo, r) + sizeof(GSList);
 	}
 	if (msginfo->fromspace)
-		memusage += strlen(msginfo->fromspace);
+		memusage += strlen(msginfo->fromspace) + 1;
 
 	for (tmp = msginfo->tags; tmp; tmp=tmp->next) {
 		memusage += sizeof(GSList);
@@ -1393,33 +1589,33 @@ guint procmsg_msginfo_memusage(MsgInfo *msginfo)
 	if (msginfo->extradata) {
 		memusage += sizeof(MsgInfoExtraData);
 		if (msginfo->extradata->xface)
-			memusage += strlen(msginfo->extradata->xface);
+			memusage += strlen(msginfo->extradata->xface) + 1;
 		if (msginfo->extradata->face)
-			memusage += strlen(msginfo->extradata->face);
+			memusage += strlen(msginfo->extradata->face) + 1;
 		if (msginfo->extradata->dispositionnotificationto)
-			memusage += strlen(msginfo->extradata->dispositionnotificationto);
+			memusage += strlen(msginfo->extradata->dispositionnotificationto) + 1;
 		if (msginfo->extradata->returnreceiptto)
-			memusage += strlen(msginfo->extradata->returnreceiptto);
+			memusage += strlen(msginfo->extradata->returnreceiptto) + 1;
 
 		if (msginfo->extradata->partial_recv)
-			memusage += strlen(msginfo->extradata->partial_recv);
+			memusage += strlen(msginfo->extradata->partial_recv) + 1;
 		if (msginfo->extradata->account_server)
-			memusage += strlen(msginfo->extradata->account_server);
+			memusage += strlen(msginfo->extradata->account_server) + 1;
 		if (msginfo->extradata->account_login)
-			memusage += strlen(msginfo->extradata->account_login);
+			memusage += strlen(msginfo->extradata->account_login) + 1;
 
 		if (msginfo->extradata->list_post)
-			memusage += strlen(msginfo->extradata->list_post);
+			memusage += strlen(msginfo->extradata->list_post) + 1;
 		if (msginfo->extradata->list_subscribe)
-			memusage += strlen(msginfo->extradata->list_subscribe);
+			memusage += strlen(msginfo->extradata->list_subscribe) + 1;
 		if (msginfo->extradata->list_unsubscribe)
-			memusage += strlen(msginfo->extradata->list_unsubscribe);
+			memusage += strlen(msginfo->extradata->list_unsubscribe) + 1;
 		if (msginfo->extradata->list_help)
-			memusage += strlen(msginfo->extradata->list_help);
+			memusage += strlen(msginfo->extradata->list_help) + 1;
 		if (msginfo->extradata->list_archive)
-			memusage += strlen(msginfo->extradata->list_archive);
+			memusage += strlen(msginfo->extradata->list_archive) + 1;
 		if (msginfo->extradata->list_owner)
-			memusage += strlen(msginfo->extradata->list_owner);
+			memusage += strlen(msginfo->extradata->list_owner) + 1;
 	}
 	return memusage;
 }
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <string.h>
 #include "utils.h"
+#include "stringtable.h"
 
 typedef struct _MsgInfo			MsgInfo;
 typedef struct _MsgFlags		MsgFlags;
@@ -248,6 +249,11 @@ struct _MsgInfo
 	GSList *tags;
 
 	MsgInfoExtraData *extradata;
+
+	/* set when string fields point into a mapped cache file */
+	struct _MsgCacheMap *cache_map;
+	/* bytes charged to the cache holding this msginfo */
+	guint cache_memusage;
 };
 
 struct _MsgInfoExtraData
@@ -342,7 +348,16 @@ MsgInfo *procmsg_msginfo_get_full_info_from_file
 					(MsgInfo *msginfo, 
 					const gchar *file);
 void	 procmsg_msginfo_free		(MsgInfo	*msginfo);
+void	 procmsg_msginfo_free_array	(GPtrArray	*msginfos);
 guint	 procmsg_msginfo_memusage	(MsgInfo	*msginfo);
+void	 procmsg_msginfo_intern_strings	(MsgInfo	*msginfo);
+void	 procmsg_msginfo_set_str	(MsgInfo	*msginfo,
+					 gchar		**field,
+					 const gchar	*str);
+gchar	*procmsg_msginfo_get_writable_str
+					(MsgInfo	*msginfo,
+					 gchar		**field);
+StringTable *procmsg_get_string_table	(void);
 
 gint procmsg_send_message_queue		(const gchar *file,
 					 gchar **errstr,
@@ -0,0 +1,324 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times writing and reading synthetic message cache records as
+ * src/msgcache.c lays them out, plain and in zlib blocks, and prints the
+ * size of both files.
+ *
+ * Build:
+ *	gcc -O2 -o cache_bench cache_bench.c \
+ *		`pkg-config --cflags --libs glib-2.0` -lz
+ * Run, writing its files in a directory:
+ *	./cache_bench [-n records] [-z level] /tmp
+ *
+ * Files are read back from the page cache. The record layout and the
+ * block size must be kept in step with msgcache.c.
+ */
+
+#include <glib.h>
+#include <zlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CACHE_BLOCK_SIZE	(64 * 1024)
+
+static void append_int(GByteArray *buf, guint32 n)
+{
+	n = GUINT32_SWAP_LE_BE(n);
+	g_byte_array_append(buf, (guint8 *)&n, sizeof(n));
+}
+
+static void append_str(GByteArray *buf, const gchar *str)
+{
+	gsize len = strlen(str);
+
+	append_int(buf, len);
+	g_byte_array_append(buf, (const guint8 *)str, len + 1);
+}
+
+static const gchar *names[] = {
+	"Alice Martin", "Bob Dupont", "Claws Mail Team", "Dmitri Ivanov",
+	"Eva Schmidt", "Fran\xc3\xa7ois Leclerc", "Giulia Rossi", "Hiro Tanaka"
+};
+static const gchar *domains[] = {
+	"example.org", "lists.example.com", "mail.example.net", "example.de"
+};
+static const gchar *subjects[] = {
+	"Re: [users] Filtering rules on IMAP folders",
+	"Meeting notes", "Re: Re: build failure on 64-bit",
+	"[announce] release", "Invoice", "Fwd: holiday pictures",
+	"Re: patch: faster folder scan", "Weekly report"
+};
+
+/* one record of msgcache_encode_cache() with made up, mail like data */
+static void encode_record(GRand *rand, guint num, GByteArray *buf)
+{
+	const gchar *name = names[g_rand_int_range(rand, 0, G_N_ELEMENTS(names))];
+	const gchar *domain = domains[g_rand_int_range(rand, 0, G_N_ELEMENTS(domains))];
+	gchar *from, *to, *msgid, *inreplyto, *date;
+	guint32 n_refs, i;
+
+	from = g_strdup_printf("%s <user%u@%s>", name,
+			       g_rand_int_range(rand, 0, 500), domain);
+	to = g_strdup_printf("list%u@%s", g_rand_int_range(rand, 0, 20),
+			     domain);
+	msgid = g_strdup_printf("%08x.%u@%s", g_rand_int(rand), num, domain);
+	inreplyto = g_strdup_printf("%08x.%u@%s", g_rand_int(rand),
+				    g_rand_int_range(rand, 1, num + 1), domain);
+	date = g_strdup_printf("Mon, %u Mar 2009 %02u:%02u:%02u +0100",
+			       g_rand_int_range(rand, 1, 29),
+			       g_rand_int_range(rand, 0, 24),
+			       g_rand_int_range(rand, 0, 60),
+			       g_rand_int_range(rand, 0, 60));
+
+	append_int(buf, num);
+	append_int(buf, g_rand_int_range(rand, 1000, 200000));
+	append_int(buf, 1236000000 + num * 60);
+	append_int(buf, 1236000000 + num * 60);
+	append_int(buf, 0);
+	append_str(buf, name);
+	append_str(buf, date);
+	append_str(buf, from);
+	append_str(buf, to);
+	append_str(buf, "");
+	append_str(buf, "");
+	append_str(buf, subjects[g_rand_int_range(rand, 0, G_N_ELEMENTS(subjects))]);
+	append_str(buf, msgid);
+	append_str(buf, inreplyto);
+	append_str(buf, "");
+	append_int(buf, 0);
+	append_int(buf, 0);
+	n_refs = g_rand_int_range(rand, 0, 5);
+	append_int(buf, n_refs);
+	for (i = 0; i < n_refs; i++)
+		append_str(buf, inreplyto);
+
+	g_free(from);
+	g_free(to);
+	g_free(msgid);
+	g_free(inreplyto);
+	g_free(date);
+}
+
+static gboolean write_block(FILE *fp, GByteArray *block, gint level)
+{
+	uLongf comp_len = compressBound(block->len);
+	Bytef *comp = g_malloc(comp_len);
+	guint32 hdr[2];
+	gboolean ok;
+
+	ok = compress2(comp, &comp_len, block->data, block->len, level) == Z_OK;
+	hdr[0] = GUINT32_SWAP_LE_BE(block->len);
+	hdr[1] = GUINT32_SWAP_LE_BE(block->len > 0 ? comp_len : 0);
+	ok = ok && fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+	     (block->len == 0 || fwrite(comp, 1, comp_len, fp) == comp_len);
+	g_free(comp);
+	g_byte_array_set_size(block, 0);
+
+	return ok;
+}
+
+static gboolean write_file(const gchar *file, GPtrArray *records,
+			   gboolean compressed, gint level)
+{
+	GByteArray *block = g_byte_array_sized_new(CACHE_BLOCK_SIZE * 2);
+	GByteArray *record;
+	gboolean ok = TRUE;
+	FILE *fp;
+	guint i;
+
+	if ((fp = fopen(file, "wb")) == NULL)
+		return FALSE;
+	for (i = 0; ok && i < records->len; i++) {
+		record = g_ptr_array_index(records, i);
+		if (!compressed) {
+			ok = fwrite(record->data, 1, record->len, fp) == record->len;
+			continue;
+		}
+		g_byte_array_append(block, record->data, record->len);
+		if (block->len >= CACHE_BLOCK_SIZE)
+			ok = write_block(fp, block, level);
+	}
+	/* last records, then the empty block ending them */
+	if (ok && compressed && block->len > 0)
+		ok = write_block(fp, block, level);
+	if (ok && compressed)
+		ok = write_block(fp, block, level);
+	g_byte_array_free(block, TRUE);
+	if (fclose(fp) != 0)
+		ok = FALSE;
+
+	return ok;
+}
+
+static guint32 get_int(const guint8 *p)
+{
+	guint32 n;
+
+	memcpy(&n, p, sizeof(n));
+
+	return GUINT32_SWAP_LE_BE(n);
+}
+
+/* walks the records as msgcache_decode_record() does, without making
+ * MsgInfos of them */
+static guint walk_records(const guint8 *p, gsize len)
+{
+	const guint8 *end = p + len;
+	guint n = 0, i, refs;
+
+	while (p + 20 <= end) {
+		p += 20;
+		for (i = 0; i < 10 && p + 4 <= end; i++)
+			p += 4 + get_int(p) + 1;
+		if (p + 12 > end)
+			break;
+		refs = get_int(p + 8);
+		p += 12;
+		for (i = 0; i < refs && p + 4 <= end; i++)
+			p += 4 + get_int(p) + 1;
+		n++;
+	}
+
+	return n;
+}
+
+static guint read_file(const gchar *file, gboolean compressed)
+{
+	guint8 *contents, *p, *end, *raw;
+	guint32 raw_len, comp_len;
+	uLongf out_len;
+	gsize len;
+	guint n = 0;
+
+	if (!g_file_get_contents(file, (gchar **)&contents, &len, NULL))
+		return 0;
+	if (!compressed) {
+		n = walk_records(contents, len);
+		g_free(contents);
+		return n;
+	}
+
+	raw = g_malloc(CACHE_BLOCK_SIZE * 2);
+	for (p = contents, end = contents + len; p + 8 <= end;
+	     p += 8 + comp_len) {
+		raw_len = get_int(p);
+		comp_len = get_int(p + 4);
+		if (raw_len == 0 || raw_len > CACHE_BLOCK_SIZE * 2 ||
+		    p + 8 + comp_len > end)
+			break;
+		out_len = raw_len;
+		if (uncompress(raw, &out_len, p + 8, comp_len) != Z_OK)
+			break;
+		n += walk_records(raw, out_len);
+	}
+	g_free(raw);
+	g_free(contents);
+
+	return n;
+}
+
+static void bench(const gchar *what, const gchar *file, GPtrArray *records,
+		  gsize raw_size, gboolean compressed, gint level)
+{
+	GTimer *timer = g_timer_new();
+	gdouble write_secs, read_secs;
+	struct stat s;
+	gsize len = 0;
+	guint n;
+
+	if (!write_file(file, records, compressed, level)) {
+		g_printerr("can't write %s\n", file);
+		g_timer_destroy(timer);
+		return;
+	}
+	write_secs = g_timer_elapsed(timer, NULL);
+	if (stat(file, &s) == 0)
+		len = s.st_size;
+
+	g_timer_start(timer);
+	n = read_file(file, compressed);
+	read_secs = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	printf("%-12s %7.1fMB (%3.0f%%)  write %7.1fMB/s  read %7.1fMB/s  "
+	       "%u records\n", what, len / 1e6, 100.0 * len / raw_size,
+	       raw_size / 1e6 / write_secs, raw_size / 1e6 / read_secs, n);
+	unlink(file);
+}
+
+int main(int argc, char *argv[])
+{
+	GPtrArray *records;
+	GByteArray *record;
+	GRand *rand;
+	gchar *file, *what;
+	gint n = 500000, level = Z_BEST_SPEED, opt, i;
+	gsize raw_size = 0;
+
+	while ((opt = getopt(argc, argv, "n:z:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = MAX(atoi(optarg), 1);
+			break;
+		case 'z':
+			level = CLAMP(atoi(optarg), 0, 9);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind + 1 != argc) {
+		g_printerr("usage: %s [-n records] [-z level] directory\n",
+			   argv[0]);
+		return 1;
+	}
+
+	rand = g_rand_new_with_seed(1);
+	records = g_ptr_array_sized_new(n);
+	for (i = 0; i < n; i++) {
+		record = g_byte_array_new();
+		encode_record(rand, i + 1, record);
+		raw_size += record->len;
+		g_ptr_array_add(records, record);
+	}
+	g_rand_free(rand);
+
+	file = g_build_filename(argv[optind], "cache_bench.tmp", NULL);
+	bench("plain", file, records, raw_size, FALSE, 0);
+	what = g_strdup_printf("zlib -%d", level);
+	bench(what, file, records, raw_size, TRUE, level);
+	g_free(what);
+	if (level != 6)
+		bench("zlib default", file, records, raw_size, TRUE,
+		      Z_DEFAULT_COMPRESSION);
+	g_free(file);
+
+	for (i = 0; i < n; i++)
+		g_byte_array_free(g_ptr_array_index(records, i), TRUE);
+	g_ptr_array_free(records, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,592 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares the date parsing of src/procheader.c with the sscanf()
+ * patterns it used to be made of alone, on generated and mutated date
+ * strings:
+ * - procheader_scan_date_fast() must only accept what the patterns
+ *   accept, and read the same fields;
+ * - procheader_scan_date_string(), procheader_date_parse() and
+ *   procheader_date_parse_to_tm() must give the same results as before
+ *   on every string the patterns accept;
+ * - what only the new code accepts must be read by
+ *   procheader_scan_date_other(): asctime() and RFC 850 dates, which
+ *   used to parse to 0. Those must give the same time as the RFC 2822
+ *   date with the same fields.
+ *
+ * procheader.c is included, so that its static functions can be called.
+ * Build in the tools directory of a built source tree:
+ *	gcc -O2 -DHAVE_CONFIG_H -I.. -I../src -I../src/common -I../src/gtk \
+ *		`pkg-config --cflags gtk+-2.0` -o date_fuzz date_fuzz.c \
+ *		../src/codeconv.o ../src/common/.libs/libclawscommon.a \
+ *		`pkg-config --libs gtk+-2.0 gthread-2.0`
+ * Run it in several time zones:
+ *	for tz in UTC Europe/Berlin America/New_York Australia/Lord_Howe; do
+ *		TZ=$tz ./date_fuzz -n 500000
+ *	done
+ */
+
+#include "procheader.c"
+
+/* the rest of Claws Mail is not linked in */
+PrefsCommon prefs_common;
+
+MsgInfo *procmsg_msginfo_new(void)
+{
+	MsgInfo *msginfo = g_new0(MsgInfo, 1);
+
+	msginfo->refcnt = 1;
+
+	return msginfo;
+}
+
+void procmsg_msginfo_intern_strings(MsgInfo *msginfo)
+{
+}
+
+gchar *procmsg_get_message_file_path(MsgInfo *msginfo)
+{
+	return NULL;
+}
+
+typedef struct _DateFields {
+	gchar	weekday[11];
+	gint	day;
+	gchar	month[10];
+	gint	year;
+	gint	hh, mm, ss;
+	gchar	zone[6];
+} DateFields;
+
+/* procheader_scan_date_string() before the single pass scanners */
+static gint ref_scan_date_string(const gchar *str,
+				 gchar *weekday, gint *day,
+				 gchar *month, gint *year,
+				 gint *hh, gint *mm, gint *ss,
+				 gchar *zone)
+{
+	gint result;
+	gint month_n;
+	gchar zone1[3];
+	gchar zone2[3];
+
+	if (str == NULL)
+		return -1;
+
+	result = sscanf(str, "%10s %d %9s %d %2d:%2d:%2d %5s",
+			weekday, day, month, year, hh, mm, ss, zone);
+	if (result == 8) return 0;
+
+	/* RFC2822 */
+	result = sscanf(str, "%3s,%d %9s %d %2d:%2d:%2d %5s",
+			weekday, day, month, year, hh, mm, ss, zone);
+	if (result == 8) return 0;
+
+	result = sscanf(str, "%d %9s %d %2d:%2d:%2d %5s",
+			day, month, year, hh, mm, ss, zone);
+	if (result == 7) return 0;
+
+	*zone = '\0';
+	result = sscanf(str, "%10s %d %9s %d %2d:%2d:%2d",
+			weekday, day, month, year, hh, mm, ss);
+	if (result == 7) return 0;
+
+	result = sscanf(str, "%d %9s %d %2d:%2d:%2d",
+			day, month, year, hh, mm, ss);
+	if (result == 6) return 0;
+
+	*ss = 0;
+	result = sscanf(str, "%10s %d %9s %d %2d:%2d %5s",
+			weekday, day, month, year, hh, mm, zone);
+	if (result == 7) return 0;
+
+	result = sscanf(str, "%d %9s %d %2d:%2d %5s",
+			day, month, year, hh, mm, zone);
+	if (result == 6) return 0;
+
+	*zone = '\0';
+	result = sscanf(str, "%10s %d %9s %d %2d:%2d",
+			weekday, day, month, year, hh, mm);
+	if (result == 6) return 0;
+
+	result = sscanf(str, "%d %9s %d %2d:%2d",
+			day, month, year, hh, mm);
+	if (result == 5) return 0;
+
+	/* RFC3339 subset */
+	*weekday = '\0';
+	result = sscanf(str, "%4d-%2d-%2d %2d:%2d:%2d+%2s:%2s",
+			year, &month_n, day, hh, mm, ss, zone1, zone2);
+	if (result == 8) {
+		if (1 <= month_n && month_n <= 12) {
+			strncpy2(month, monthstr+((month_n-1)*3), 4);
+			*zone = '+';
+			strncpy2(zone+1, zone1, 3);
+			strncpy2(zone+3, zone2, 3);
+			return 0;
+		}
+	}
+
+	/* RFC3339 subset */
+	*zone = '\0';
+	*weekday = '\0';
+	result = sscanf(str, "%4d-%2d-%2d %2d:%2d:%2d",
+			year, &month_n, day, hh, mm, ss);
+	if (result == 6) {
+		if (1 <= month_n && month_n <= 12) {
+			strncpy2(month, monthstr+((month_n-1)*3), 4);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* procheader_date_parse_to_tm() before */
+static gboolean ref_date_parse_to_tm(const gchar *src, struct tm *t,
+				     char *zone)
+{
+	gchar weekday[11];
+	gint day;
+	gchar month[10];
+	gint year;
+	gint hh, mm, ss;
+	GDateMonth dmonth;
+	gchar *p;
+
+	memset(t, 0, sizeof *t);
+
+	if (ref_scan_date_string(src, weekday, &day, month, &year,
+				 &hh, &mm, &ss, zone) < 0)
+		return FALSE;
+
+	if (year < 100) {
+		if (year < 70)
+			year += 2000;
+		else
+			year += 1900;
+	}
+
+	month[3] = '\0';
+	if ((p = strstr(monthstr, month)) != NULL)
+		dmonth = (gint)(p - monthstr) / 3 + 1;
+	else
+		dmonth = G_DATE_BAD_MONTH;
+
+	t->tm_sec = ss;
+	t->tm_min = mm;
+	t->tm_hour = hh;
+	t->tm_mday = day;
+	t->tm_mon = dmonth - 1;
+	t->tm_year = year - 1900;
+	t->tm_wday = 0;
+	t->tm_yday = 0;
+	t->tm_isdst = -1;
+
+	mktime(t);
+
+	return TRUE;
+}
+
+/* procheader_date_parse() before, without dest */
+static time_t ref_date_parse(const gchar *src)
+{
+	gchar weekday[11];
+	gint day;
+	gchar month[10];
+	gint year;
+	gint hh, mm, ss;
+	gchar zone[6];
+	GDateMonth dmonth = G_DATE_BAD_MONTH;
+	struct tm t;
+	gchar *p;
+	time_t timer;
+	time_t tz_offset;
+
+	if (ref_scan_date_string(src, weekday, &day, month, &year,
+				 &hh, &mm, &ss, zone) < 0)
+		return 0;
+
+	if (year < 1000) {
+		if (year < 50)
+			year += 2000;
+		else
+			year += 1900;
+	}
+
+	month[3] = '\0';
+	for (p = monthstr; *p != '\0'; p += 3) {
+		if (!g_ascii_strncasecmp(p, month, 3)) {
+			dmonth = (gint)(p - monthstr) / 3 + 1;
+			break;
+		}
+	}
+
+	t.tm_sec = ss;
+	t.tm_min = mm;
+	t.tm_hour = hh;
+	t.tm_mday = day;
+	t.tm_mon = dmonth - 1;
+	t.tm_year = year - 1900;
+	t.tm_wday = 0;
+	t.tm_yday = 0;
+	t.tm_isdst = -1;
+
+	timer = mktime(&t);
+	tz_offset = remote_tzoffset_sec(zone);
+	if (tz_offset != -1)
+		timer += tzoffset_sec(&timer) - tz_offset;
+
+	return timer;
+}
+
+/* the weekday is not compared: the patterns without one leave what
+ * an earlier pattern read there, and it is not used */
+static gboolean fields_equal(const DateFields *a, const DateFields *b)
+{
+	return a->day == b->day && strcmp(a->month, b->month) == 0 &&
+	       a->year == b->year && a->hh == b->hh && a->mm == b->mm &&
+	       a->ss == b->ss && strcmp(a->zone, b->zone) == 0;
+}
+
+static gboolean tm_equal(const struct tm *a, const struct tm *b)
+{
+	return a->tm_sec == b->tm_sec && a->tm_min == b->tm_min &&
+	       a->tm_hour == b->tm_hour && a->tm_mday == b->tm_mday &&
+	       a->tm_mon == b->tm_mon && a->tm_year == b->tm_year &&
+	       a->tm_wday == b->tm_wday && a->tm_yday == b->tm_yday &&
+	       a->tm_isdst == b->tm_isdst;
+}
+
+#define SCAN_ARGS(f) \
+	(f).weekday, &(f).day, (f).month, &(f).year, \
+	&(f).hh, &(f).mm, &(f).ss, (f).zone
+
+static const gchar *wdays[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+	"Sunday", "Wednesday", "mon", "Xyz", "Thursdays,"
+};
+static const gchar *wdays_long[] = {
+	"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+	"Saturday"
+};
+static const gchar *months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+	"jan", "DEC", "January", "September", "Sept", "Foo"
+};
+static const gchar *zones[] = {
+	"+0000", "-0500", "+0530", "+1345", "GMT", "UT", "EST", "PDT",
+	"CEST", "Z", "+01:00", "(CET)", "+00000", "-", "Europe/Berlin"
+};
+static const gchar *alpha_zones[] = { "GMT", "UT", "EST", "PDT" };
+static const gchar *spaces[] = { " ", " ", " ", "  ", "\t", " \t " };
+static const gchar mutations[] = " \t:,-+0123456789AZaz()\x80\xe9";
+
+#define PICK(rand, array) \
+	((array)[g_rand_int_range((rand), 0, G_N_ELEMENTS(array))])
+
+#define MUTATION(rand) \
+	(mutations[g_rand_int_range((rand), 0, sizeof(mutations) - 1)])
+
+typedef enum {
+	GEN_RFC2822,
+	GEN_ASCTIME,
+	GEN_RFC850,
+	GEN_RFC3339
+} GenKind;
+
+typedef struct _Generated {
+	GenKind	 kind;
+	gchar	*str;
+	gchar	*rfc2822;	/* the same fields, for asctime and RFC 850 */
+} Generated;
+
+static void gen_number(GRand *rand, GString *str, gint min, gint max)
+{
+	gint n = g_rand_int_range(rand, min, max + 1);
+
+	switch (g_rand_int_range(rand, 0, 12)) {
+	case 0:
+		g_string_append_printf(str, "%+d", n);
+		break;
+	case 1:
+		g_string_append_printf(str, "%d%d", n, g_rand_int_range(rand, 0, 100));
+		break;
+	case 2:
+	case 3:
+		g_string_append_printf(str, "%02d", n);
+		break;
+	default:
+		g_string_append_printf(str, "%d", n);
+		break;
+	}
+}
+
+static void gen_time(GRand *rand, GString *str, gboolean seconds)
+{
+	gen_number(rand, str, 0, 25);
+	g_string_append_c(str, ':');
+	gen_number(rand, str, 0, 61);
+	if (seconds) {
+		g_string_append_c(str, ':');
+		gen_number(rand, str, 0, 61);
+	}
+}
+
+static void gen_date(GRand *rand, Generated *gen)
+{
+	GString *str = g_string_new(NULL);
+	gint day, year, hh, mm, ss;
+	const gchar *month, *zone;
+
+	gen->kind = g_rand_int_range(rand, 0, 8);
+	if (gen->kind > GEN_RFC3339)
+		gen->kind = GEN_RFC2822;
+	gen->rfc2822 = NULL;
+
+	switch (gen->kind) {
+	case GEN_RFC2822:
+		if (g_rand_boolean(rand)) {
+			g_string_append(str, PICK(rand, wdays));
+			if (g_rand_boolean(rand))
+				g_string_append_c(str, ',');
+			g_string_append(str, PICK(rand, spaces));
+		}
+		gen_number(rand, str, 0, 32);
+		g_string_append(str, PICK(rand, spaces));
+		g_string_append(str, PICK(rand, months));
+		g_string_append(str, PICK(rand, spaces));
+		if (g_rand_boolean(rand))
+			gen_number(rand, str, 1900, 2099);
+		else
+			gen_number(rand, str, 0, 999);
+		g_string_append(str, PICK(rand, spaces));
+		gen_time(rand, str, g_rand_int_range(rand, 0, 4) != 0);
+		if (g_rand_int_range(rand, 0, 4) != 0) {
+			g_string_append(str, PICK(rand, spaces));
+			g_string_append(str, PICK(rand, zones));
+		}
+		if (g_rand_int_range(rand, 0, 8) == 0)
+			g_string_append(str, " (CET)");
+		break;
+	case GEN_ASCTIME:
+	case GEN_RFC850:
+		/* valid dates only, compared with their RFC 2822 form */
+		day = g_rand_int_range(rand, 1, 29);
+		month = months[g_rand_int_range(rand, 0, 12)];
+		hh = g_rand_int_range(rand, 0, 24);
+		mm = g_rand_int_range(rand, 0, 60);
+		ss = g_rand_int_range(rand, 0, 60);
+		zone = zones[g_rand_int_range(rand, 0, 8)];
+		if (gen->kind == GEN_ASCTIME) {
+			/* date(1) puts a zone before the year */
+			year = g_rand_int_range(rand, 1970, 2038);
+			zone = g_rand_boolean(rand) ? PICK(rand, alpha_zones) : NULL;
+			g_string_append_printf(str, "%s %s %2d %02d:%02d:%02d ",
+					       wdays[day % 7], month, day,
+					       hh, mm, ss);
+			if (zone != NULL)
+				g_string_append_printf(str, "%s ", zone);
+			g_string_append_printf(str, "%d", year);
+		} else {
+			year = g_rand_int_range(rand, 70, 138) % 100;
+			g_string_append_printf(str,
+				"%s, %02d-%s-%02d %02d:%02d:%02d %s",
+				wdays_long[day % 7], day, month, year,
+				hh, mm, ss, zone);
+		}
+		gen->rfc2822 = g_strdup_printf("%d %s %d %02d:%02d:%02d%s%s",
+					       day, month, year, hh, mm, ss,
+					       zone ? " " : "", zone ? zone : "");
+		break;
+	case GEN_RFC3339:
+		gen_number(rand, str, 1970, 2037);
+		g_string_append_c(str, '-');
+		gen_number(rand, str, 0, 13);
+		g_string_append_c(str, '-');
+		gen_number(rand, str, 1, 31);
+		g_string_append(str, PICK(rand, spaces));
+		gen_time(rand, str, TRUE);
+		if (g_rand_boolean(rand))
+			g_string_append(str, "+01:00");
+		break;
+	}
+
+	gen->str = g_string_free(str, FALSE);
+}
+
+/* deletes, inserts, replaces bytes or cuts the string short */
+static gchar *mutate(GRand *rand, const gchar *src)
+{
+	GString *str = g_string_new(src);
+	gint n = g_rand_int_range(rand, 1, 4), pos;
+
+	while (n-- > 0 && str->len > 0) {
+		pos = g_rand_int_range(rand, 0, str->len);
+		switch (g_rand_int_range(rand, 0, 4)) {
+		case 0:
+			g_string_erase(str, pos, 1);
+			break;
+		case 1:
+			g_string_insert_c(str, pos, MUTATION(rand));
+			break;
+		case 2:
+			str->str[pos] = MUTATION(rand);
+			break;
+		case 3:
+			g_string_truncate(str, pos);
+			break;
+		}
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+typedef struct _FuzzStats {
+	guint	tested;
+	guint	old_accepted;
+	guint	fast_accepted;
+	guint	new_only;
+	guint	was_zero;
+	guint	mismatches;
+} FuzzStats;
+
+static void fuzz_mismatch(FuzzStats *stats, const gchar *what,
+			  const gchar *str)
+{
+	if (stats->mismatches++ < 20)
+		printf("%s: \"%s\"\n", what, str);
+}
+
+static void fuzz_one(FuzzStats *stats, const gchar *str)
+{
+	DateFields ref, fast, new, other;
+	struct tm ref_tm, new_tm;
+	gchar ref_zone[6], new_zone[6];
+	gboolean ref_ok, fast_ok, new_ok;
+
+	stats->tested++;
+	memset(&ref, 0, sizeof(ref));
+	memset(&fast, 0, sizeof(fast));
+	memset(&new, 0, sizeof(new));
+	memset(&other, 0, sizeof(other));
+
+	ref_ok = ref_scan_date_string(str, SCAN_ARGS(ref)) == 0;
+	fast_ok = procheader_scan_date_fast(str, SCAN_ARGS(fast)) == 0;
+	new_ok = procheader_scan_date_string(str, SCAN_ARGS(new)) == 0;
+
+	if (ref_ok)
+		stats->old_accepted++;
+	if (fast_ok) {
+		stats->fast_accepted++;
+		if (!ref_ok)
+			fuzz_mismatch(stats, "fast scanner accepts", str);
+		else if (!fields_equal(&ref, &fast))
+			fuzz_mismatch(stats, "fast scanner fields differ", str);
+	}
+
+	if (!ref_ok) {
+		if (new_ok && !fast_ok) {
+			stats->new_only++;
+			if (procheader_scan_date_other(str, SCAN_ARGS(other)) != 0 ||
+			    !fields_equal(&new, &other))
+				fuzz_mismatch(stats, "not read by the last scanner", str);
+		}
+		return;
+	}
+
+	if (!new_ok || !fields_equal(&ref, &new))
+		fuzz_mismatch(stats, "fields differ", str);
+	if (ref_date_parse(str) != procheader_date_parse(NULL, str, 0))
+		fuzz_mismatch(stats, "time differs", str);
+	if (ref_date_parse_to_tm(str, &ref_tm, ref_zone) !=
+	    procheader_date_parse_to_tm(str, &new_tm, new_zone) ||
+	    !tm_equal(&ref_tm, &new_tm) || strcmp(ref_zone, new_zone) != 0)
+		fuzz_mismatch(stats, "struct tm differs", str);
+}
+
+static void fuzz_other(FuzzStats *stats, const Generated *gen)
+{
+	if (ref_date_parse(gen->str) == 0)
+		stats->was_zero++;
+	if (procheader_date_parse(NULL, gen->str, 0) !=
+	    ref_date_parse(gen->rfc2822))
+		fuzz_mismatch(stats, "not the time of its RFC 2822 form",
+			      gen->str);
+}
+
+static void quiet_log(const gchar *domain, GLogLevelFlags level,
+		      const gchar *message, gpointer data)
+{
+}
+
+int main(int argc, char *argv[])
+{
+	FuzzStats stats;
+	Generated gen;
+	GRand *rand;
+	gchar *mutated;
+	guint32 seed = 1;
+	gint n = 1000000, i, opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = MAX(atoi(optarg), 1);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			g_printerr("usage: %s [-n strings] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	tzset();
+	/* invalid dates and months are warned about */
+	g_log_set_handler(NULL, G_LOG_LEVEL_WARNING, quiet_log, NULL);
+
+	memset(&stats, 0, sizeof(stats));
+	rand = g_rand_new_with_seed(seed);
+	for (i = 0; i < n; i += 2) {
+		gen_date(rand, &gen);
+		fuzz_one(&stats, gen.str);
+		if (gen.rfc2822 != NULL)
+			fuzz_other(&stats, &gen);
+		mutated = mutate(rand, gen.str);
+		fuzz_one(&stats, mutated);
+		g_free(mutated);
+		g_free(gen.str);
+		g_free(gen.rfc2822);
+	}
+	g_rand_free(rand);
+
+	printf("TZ=%s seed %u: %u strings, %u accepted by the sscanf() "
+	       "patterns, %u by the fast scanner\n",
+	       g_getenv("TZ") ? g_getenv("TZ") : "", seed, stats.tested,
+	       stats.old_accepted, stats.fast_accepted);
+	printf("%u only accepted now (asctime, RFC 850), %u generated ones "
+	       "used to parse to 0\n", stats.new_only, stats.was_zero);
+	printf("%u mismatches\n", stats.mismatches);
+
+	return stats.mismatches > 0 ? 1 : 0;
+}
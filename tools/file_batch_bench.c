@@ -0,0 +1,226 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the ways src/file_batch.c can stat and read the files of a
+ * folder without io_uring: one after the other, or spread over threads,
+ * and prefetching the files on threads before reading them in order as
+ * mh_get_msginfos() does.
+ *
+ * Build:
+ *	gcc -O2 -o file_batch_bench file_batch_bench.c \
+ *		`pkg-config --cflags --libs gthread-2.0`
+ * Run on a folder, dropping the page cache before each test for cold
+ * numbers (as root: echo 3 > /proc/sys/vm/drop_caches):
+ *	./file_batch_bench [-t threads] [-l bytes] [-c command] ~/Mail/inbox
+ *
+ * -c runs the given shell command before each test, for instance
+ * "sync; echo 3 > /proc/sys/vm/drop_caches".
+ */
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+	BENCH_STAT,
+	BENCH_READ,
+	BENCH_PREFETCH
+} BenchOp;
+
+typedef struct _Bench {
+	const gchar	*dir;
+	gsize		 len;
+	BenchOp		 op;
+	gint		 errors;
+} Bench;
+
+G_LOCK_DEFINE_STATIC(bench);
+
+static void bench_error(Bench *bench)
+{
+	G_LOCK(bench);
+	bench->errors++;
+	G_UNLOCK(bench);
+}
+
+static void bench_file(gpointer data, gpointer user_data)
+{
+	Bench *bench = (Bench *)user_data;
+	gchar *path, *buf;
+	struct stat s;
+	gint fd;
+
+	path = g_build_filename(bench->dir, (const gchar *)data, NULL);
+	switch (bench->op) {
+	case BENCH_STAT:
+		if (stat(path, &s) < 0)
+			bench_error(bench);
+		break;
+	case BENCH_READ:
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			bench_error(bench);
+			break;
+		}
+		buf = g_malloc(bench->len);
+		if (read(fd, buf, bench->len) < 0)
+			bench_error(bench);
+		g_free(buf);
+		close(fd);
+		break;
+	case BENCH_PREFETCH:
+		/* as file_batch_readahead() */
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			bench_error(bench);
+			break;
+		}
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, bench->len, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+		break;
+	}
+	g_free(path);
+}
+
+static void bench_run(Bench *bench, GPtrArray *files, gint n_threads)
+{
+	GThreadPool *pool;
+	guint i;
+
+	if (n_threads <= 1) {
+		for (i = 0; i < files->len; i++)
+			bench_file(g_ptr_array_index(files, i), bench);
+		return;
+	}
+
+	pool = g_thread_pool_new(bench_file, bench, n_threads, TRUE, NULL);
+	for (i = 0; i < files->len; i++)
+		g_thread_pool_push(pool, g_ptr_array_index(files, i), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+static void bench_prepare(const gchar *command)
+{
+	if (command != NULL && system(command) != 0)
+		g_printerr("%s failed\n", command);
+}
+
+static gdouble bench_time(Bench *bench, GPtrArray *files, BenchOp op,
+			  gint n_threads, const gchar *command)
+{
+	GTimer *timer;
+	gdouble elapsed;
+
+	bench_prepare(command);
+	bench->op = op;
+	timer = g_timer_new();
+	bench_run(bench, files, n_threads);
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	Bench bench;
+	GPtrArray *files;
+	GDir *dir;
+	const gchar *name, *command = NULL;
+	gint n_threads = 8, opt;
+	gdouble prefetch_secs, read_secs;
+	GTimer *timer;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.len = 16384;
+
+	while ((opt = getopt(argc, argv, "t:l:c:")) != -1) {
+		switch (opt) {
+		case 't':
+			n_threads = MAX(atoi(optarg), 1);
+			break;
+		case 'l':
+			bench.len = MAX(atoi(optarg), 1);
+			break;
+		case 'c':
+			command = optarg;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind + 1 != argc) {
+		g_printerr("usage: %s [-t threads] [-l bytes] [-c command] "
+			   "directory\n", argv[0]);
+		return 1;
+	}
+	bench.dir = argv[optind];
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if ((dir = g_dir_open(bench.dir, 0, NULL)) == NULL) {
+		g_printerr("can't open %s\n", bench.dir);
+		return 1;
+	}
+	files = g_ptr_array_new();
+	while ((name = g_dir_read_name(dir)) != NULL)
+		if (name[0] != '.')
+			g_ptr_array_add(files, g_strdup(name));
+	g_dir_close(dir);
+
+	printf("%u files, %d threads, %lu bytes read of each\n",
+	       files->len, n_threads, (gulong)bench.len);
+	printf("stat                 serial %7.3fs   threads %7.3fs\n",
+	       bench_time(&bench, files, BENCH_STAT, 1, command),
+	       bench_time(&bench, files, BENCH_STAT, n_threads, command));
+	printf("read                 serial %7.3fs   threads %7.3fs\n",
+	       bench_time(&bench, files, BENCH_READ, 1, command),
+	       bench_time(&bench, files, BENCH_READ, n_threads, command));
+
+	/* prefetching is only worth it if it and the reads in order that
+	 * follow beat reading in order alone */
+	bench_prepare(command);
+	timer = g_timer_new();
+	bench.op = BENCH_PREFETCH;
+	bench_run(&bench, files, n_threads);
+	prefetch_secs = g_timer_elapsed(timer, NULL);
+	bench.op = BENCH_READ;
+	bench_run(&bench, files, 1);
+	read_secs = g_timer_elapsed(timer, NULL) - prefetch_secs;
+	g_timer_destroy(timer);
+	printf("prefetch, then read  %7.3fs + %7.3fs = %7.3fs\n",
+	       prefetch_secs, read_secs, prefetch_secs + read_secs);
+
+	if (bench.errors > 0)
+		printf("%d files could not be read\n", bench.errors);
+
+	g_ptr_array_foreach(files, (GFunc)g_free, NULL);
+	g_ptr_array_free(files, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Times the header parsing of src/procheader.c on real messages:
+ * - the fields read by the line reader parse_stream() used before,
+ *   procheader_get_one_field() over stdio with a linear scan of the
+ *   header names;
+ * - the same fields read by the block reader with the hashed name
+ *   lookup, which must give the same fields, unfolded the same way,
+ *   filling its block through stdio and with plain read()s;
+ * - procheader_parse_file() as a whole, as folders call it, and as it
+ *   was before it read() the file: stat() and fopen() of the path.
+ *
+ * procheader.c is included, so that its static functions can be called.
+ * Build in the tools directory of a built source tree:
+ *	gcc -O2 -DHAVE_CONFIG_H -I.. -I../src -I../src/common -I../src/gtk \
+ *		`pkg-config --cflags gtk+-2.0` -o header_bench header_bench.c \
+ *		../src/codeconv.o ../src/common/.libs/libclawscommon.a \
+ *		`pkg-config --libs gtk+-2.0 gthread-2.0`
+ * Run on message files, for instance an MH folder:
+ *	./header_bench [-n rounds] ~/Mail/inbox/[0-9]*
+ * The files are read again on every round, from the page cache after
+ * the first one.
+ */
+
+#include "procheader.c"
+
+/* the rest of Claws Mail is not linked in */
+PrefsCommon prefs_common;
+
+MsgInfo *procmsg_msginfo_new(void)
+{
+	MsgInfo *msginfo = g_new0(MsgInfo, 1);
+
+	msginfo->refcnt = 1;
+
+	return msginfo;
+}
+
+void procmsg_msginfo_intern_strings(MsgInfo *msginfo)
+{
+}
+
+gchar *procmsg_get_message_file_path(MsgInfo *msginfo)
+{
+	return NULL;
+}
+
+/* frees what parse_stream() sets */
+static void bench_msginfo_free(MsgInfo *msginfo)
+{
+	GSList *cur;
+
+	g_free(msginfo->fromname);
+	g_free(msginfo->date);
+	g_free(msginfo->from);
+	g_free(msginfo->to);
+	g_free(msginfo->cc);
+	g_free(msginfo->newsgroups);
+	g_free(msginfo->subject);
+	g_free(msginfo->msgid);
+	g_free(msginfo->inreplyto);
+	g_free(msginfo->fromspace);
+	for (cur = msginfo->references; cur != NULL; cur = cur->next)
+		g_free(cur->data);
+	g_slist_free(msginfo->references);
+	if (msginfo->extradata != NULL) {
+		g_free(msginfo->extradata->face);
+		g_free(msginfo->extradata->xface);
+		g_free(msginfo->extradata->dispositionnotificationto);
+		g_free(msginfo->extradata->returnreceiptto);
+		g_free(msginfo->extradata->partial_recv);
+		g_free(msginfo->extradata->account_server);
+		g_free(msginfo->extradata->account_login);
+		g_free(msginfo->extradata->list_post);
+		g_free(msginfo->extradata->list_subscribe);
+		g_free(msginfo->extradata->list_unsubscribe);
+		g_free(msginfo->extradata->list_help);
+		g_free(msginfo->extradata->list_archive);
+		g_free(msginfo->extradata->list_owner);
+		g_free(msginfo->extradata);
+	}
+	g_free(msginfo);
+}
+
+/* the header number and the unfolded field */
+typedef struct _BenchField {
+	gint	 hnum;
+	gchar	*field;
+} BenchField;
+
+static gint n_entries(void)
+{
+	gint n;
+
+	for (n = 0; hentry_full[n].name != NULL; n++)
+		;
+
+	return n;
+}
+
+static void add_field(GArray *fields, gint hnum, const gchar *buf)
+{
+	BenchField field;
+
+	if (fields == NULL)
+		return;
+	field.hnum = hnum;
+	field.field = g_strdup(buf);
+	g_array_append_val(fields, field);
+}
+
+static void free_fields(GArray *fields)
+{
+	guint i;
+
+	for (i = 0; i < fields->len; i++)
+		g_free(g_array_index(fields, BenchField, i).field);
+	g_array_free(fields, TRUE);
+}
+
+/* as parse_stream() read the headers before the block reader */
+static gboolean read_lines(const gchar *file, GArray *fields)
+{
+	gchar buf[BUFFSIZE];
+	FILE *fp;
+	gint hnum;
+
+	if ((fp = g_fopen(file, "rb")) == NULL)
+		return FALSE;
+	while ((hnum = procheader_get_one_field(buf, sizeof(buf), fp,
+						hentry_full)) != -1)
+		add_field(fields, hnum, buf);
+	fclose(fp);
+
+	return TRUE;
+}
+
+static gboolean read_block_stdio(const gchar *file, GArray *fields)
+{
+	HeaderReader reader;
+	gchar buf[BUFFSIZE];
+	gint hnum, nentries = n_entries();
+	FILE *fp;
+
+	if ((fp = g_fopen(file, "rb")) == NULL)
+		return FALSE;
+	header_reader_init(&reader, fp, -1, NULL);
+	while ((hnum = header_reader_get_field(&reader, buf, sizeof(buf),
+					       nentries)) != -1)
+		add_field(fields, hnum, buf);
+	fclose(fp);
+
+	return TRUE;
+}
+
+static gboolean read_block(const gchar *file, GArray *fields)
+{
+	HeaderReader reader;
+	gchar buf[BUFFSIZE];
+	gint fd, hnum, nentries = n_entries();
+
+	if ((fd = g_open(file, O_RDONLY, 0)) < 0)
+		return FALSE;
+	header_reader_init(&reader, NULL, fd, NULL);
+	while ((hnum = header_reader_get_field(&reader, buf, sizeof(buf),
+					       nentries)) != -1)
+		add_field(fields, hnum, buf);
+	close(fd);
+
+	return TRUE;
+}
+
+static gboolean parse_file(const gchar *file, GArray *fields)
+{
+	MsgFlags flags = { 0, 0 };
+	MsgInfo *msginfo;
+
+	if ((msginfo = procheader_parse_file(file, flags, TRUE, FALSE)) == NULL)
+		return FALSE;
+	bench_msginfo_free(msginfo);
+
+	return TRUE;
+}
+
+/* as procheader_parse_file() opened messages before */
+static gboolean parse_file_stdio(const gchar *file, GArray *fields)
+{
+	MsgFlags flags = { 0, 0 };
+	MsgInfo *msginfo;
+	struct stat s;
+	FILE *fp;
+
+	if (g_stat(file, &s) < 0 || !S_ISREG(s.st_mode))
+		return FALSE;
+	if ((fp = g_fopen(file, "rb")) == NULL)
+		return FALSE;
+	msginfo = parse_stream(fp, -1, NULL, flags, TRUE, FALSE);
+	fclose(fp);
+	if (msginfo == NULL)
+		return FALSE;
+	msginfo->size = s.st_size;
+	msginfo->mtime = s.st_mtime;
+	bench_msginfo_free(msginfo);
+
+	return TRUE;
+}
+
+static gboolean fields_equal(GArray *a, GArray *b)
+{
+	guint i;
+
+	if (a->len != b->len)
+		return FALSE;
+	for (i = 0; i < a->len; i++) {
+		BenchField *fa = &g_array_index(a, BenchField, i);
+		BenchField *fb = &g_array_index(b, BenchField, i);
+
+		if (fa->hnum != fb->hnum || strcmp(fa->field, fb->field) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gdouble bench_time(gboolean (*read_func)(const gchar *, GArray *),
+			  GPtrArray *files, gint rounds)
+{
+	GTimer *timer;
+	gdouble elapsed;
+	gint r;
+	guint i;
+
+	timer = g_timer_new();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < files->len; i++)
+			read_func(g_ptr_array_index(files, i), NULL);
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+static void bench_print(const gchar *what, gdouble secs, guint n)
+{
+	printf("%-26s %8.3fs, %7.2f us/message\n", what, secs,
+	       secs * 1e6 / n);
+}
+
+int main(int argc, char *argv[])
+{
+	GPtrArray *files;
+	GArray *line_fields, *block_fields, *stdio_fields;
+	gint rounds = 10, i, opt, mismatches = 0;
+	guint n_fields = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = MAX(atoi(optarg), 1);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind >= argc) {
+		g_printerr("usage: %s [-n rounds] message-file...\n", argv[0]);
+		return 1;
+	}
+
+	/* checks both readers give the same fields on every message */
+	files = g_ptr_array_new();
+	for (i = optind; i < argc; i++) {
+		line_fields = g_array_new(FALSE, FALSE, sizeof(BenchField));
+		block_fields = g_array_new(FALSE, FALSE, sizeof(BenchField));
+		stdio_fields = g_array_new(FALSE, FALSE, sizeof(BenchField));
+		if (read_lines(argv[i], line_fields) &&
+		    read_block(argv[i], block_fields) &&
+		    read_block_stdio(argv[i], stdio_fields)) {
+			g_ptr_array_add(files, argv[i]);
+			n_fields += line_fields->len;
+			if ((!fields_equal(line_fields, block_fields) ||
+			     !fields_equal(line_fields, stdio_fields)) &&
+			    mismatches++ < 10)
+				g_printerr("fields differ in %s\n", argv[i]);
+		} else {
+			g_printerr("can't read %s\n", argv[i]);
+		}
+		free_fields(line_fields);
+		free_fields(block_fields);
+		free_fields(stdio_fields);
+	}
+	if (files->len == 0) {
+		g_printerr("no message could be read\n");
+		return 1;
+	}
+
+	printf("%u messages, %u fields looked up, %d rounds\n",
+	       files->len, n_fields, rounds);
+	bench_print("line reader, linear names",
+		    bench_time(read_lines, files, rounds), files->len * rounds);
+	bench_print("block reader, stdio",
+		    bench_time(read_block_stdio, files, rounds),
+		    files->len * rounds);
+	bench_print("block reader, read()",
+		    bench_time(read_block, files, rounds), files->len * rounds);
+	bench_print("parse_file, stat+fopen",
+		    bench_time(parse_file_stdio, files, rounds),
+		    files->len * rounds);
+	bench_print("procheader_parse_file()",
+		    bench_time(parse_file, files, rounds), files->len * rounds);
+	if (mismatches > 0)
+		printf("%d messages read differently\n", mismatches);
+
+	g_ptr_array_free(files, TRUE);
+
+	return mismatches > 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Prints how many bytes a cycle the scans of src/common/textscan.c go
+ * through, next to the byte by byte loops they replace and to
+ * g_utf8_validate(), on ASCII strings of a header line, a body line and
+ * a whole body. Cycles are read from the time stamp counter on x86;
+ * elsewhere, or with -g, bytes a nanosecond are printed instead.
+ *
+ * textscan.c is included, so that the scans are built as Claws Mail
+ * builds them. Build in the tools directory of a configured source tree:
+ *	gcc -O2 -DHAVE_CONFIG_H -I.. -I../src/common -o textscan_bench \
+ *		textscan_bench.c `pkg-config --cflags --libs glib-2.0`
+ * Run:
+ *	./textscan_bench [-n megabytes] [-g]
+ * The time stamp counter ticks at the nominal frequency of the CPU,
+ * turbo or not: pin the frequency for numbers to compare.
+ */
+
+#include "textscan.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define BENCH_HAVE_TSC
+#endif
+
+/* the scans as they were written before textscan.c */
+static gsize ref_ascii_span(const gchar *str, gssize len)
+{
+	const guchar *p = (const guchar *)str;
+
+	while ((len < 0 || p < (const guchar *)str + len) &&
+	       *p != '\0' && *p < 0x80)
+		p++;
+
+	return p - (const guchar *)str;
+}
+
+static gsize ref_text_span(const gchar *str, gssize len)
+{
+	const guchar *p = (const guchar *)str;
+
+	while ((len < 0 || p < (const guchar *)str + len) &&
+	       ((*p >= 32 && *p < 127) || *p == '\t' || *p == '\r' ||
+		*p == '\n'))
+		p++;
+
+	return p - (const guchar *)str;
+}
+
+static gsize glib_utf8_validate(const gchar *str, gssize len)
+{
+	const gchar *end;
+
+	g_utf8_validate(str, len, &end);
+
+	return end - str;
+}
+
+static gsize textscan_utf8_validate(const gchar *str, gssize len)
+{
+	const gchar *end;
+
+	scan_utf8_validate(str, len, &end);
+
+	return end - str;
+}
+
+typedef struct _BenchFunc {
+	const gchar	*name;
+	gsize		(*func)(const gchar *str, gssize len);
+} BenchFunc;
+
+static const BenchFunc bench_funcs[] = {
+	{ "ascii, bytewise",	ref_ascii_span },
+	{ "scan_ascii_span",	scan_ascii_span },
+	{ "text, bytewise",	ref_text_span },
+	{ "scan_text_span",	scan_text_span },
+	{ "g_utf8_validate",	glib_utf8_validate },
+	{ "scan_utf8_validate",	textscan_utf8_validate }
+};
+
+static const gint bench_lens[] = { 40, 200, 16384 };
+
+static const gchar bench_text[] =
+	"Received: from mail.example.org by mx.example.net\t";
+
+static GTimer *timer = NULL;
+
+/* cycles, or nanoseconds without a timer */
+static guint64 bench_ticks(void)
+{
+#ifdef BENCH_HAVE_TSC
+	if (timer == NULL)
+		return __rdtsc();
+#endif
+	return (guint64)(g_timer_elapsed(timer, NULL) * 1e9);
+}
+
+/* the scans go to the end of the string, so len bytes are looked at */
+static gdouble bench_run(const BenchFunc *bf, const gchar *str, gint len,
+			 gsize total, gboolean terminated)
+{
+	guint64 start, ticks;
+	gsize n, sum = 0, i;
+
+	n = MAX(total / len, 1);
+	start = bench_ticks();
+	for (i = 0; i < n; i++)
+		sum += bf->func(str, terminated ? -1 : len);
+	ticks = bench_ticks() - start;
+
+	if (sum != n * len)
+		g_printerr("%s stopped early\n", bf->name);
+
+	return (gdouble)n * len / MAX(ticks, 1);
+}
+
+int main(int argc, char *argv[])
+{
+	gchar *str;
+	gsize total = 256 << 20;
+	gboolean use_time = FALSE;
+	gint opt, l, i, j, k;
+
+	while ((opt = getopt(argc, argv, "n:g")) != -1) {
+		switch (opt) {
+		case 'n':
+			total = (gsize)MAX(atoi(optarg), 1) << 20;
+			break;
+		case 'g':
+			use_time = TRUE;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc) {
+		g_printerr("usage: %s [-n megabytes] [-g]\n", argv[0]);
+		return 1;
+	}
+#ifndef BENCH_HAVE_TSC
+	use_time = TRUE;
+#endif
+	if (use_time)
+		timer = g_timer_new();
+
+	printf("%s, %lu MB scanned by each, NUL-terminated then counted "
+	       "strings\n", use_time ? "bytes/ns" : "bytes/cycle",
+	       (gulong)(total >> 20));
+	printf("%-20s", "length");
+	for (j = 0; j < 2; j++)
+		for (l = 0; l < (gint)G_N_ELEMENTS(bench_lens); l++)
+			printf("%9d", bench_lens[l]);
+	printf("\n");
+
+	for (i = 0; i < (gint)G_N_ELEMENTS(bench_funcs); i++) {
+		printf("%-20s", bench_funcs[i].name);
+		for (j = 0; j < 2; j++) {
+			for (l = 0; l < (gint)G_N_ELEMENTS(bench_lens); l++) {
+				/* header text, from a fresh buffer of its
+				 * length as the strings of a message are */
+				str = g_malloc(bench_lens[l] + 1);
+				for (k = 0; k < bench_lens[l]; k++)
+					str[k] = bench_text[k % (sizeof(bench_text) - 1)];
+				str[bench_lens[l]] = '\0';
+				printf("%9.2f", bench_run(&bench_funcs[i], str,
+							  bench_lens[l], total,
+							  j == 0));
+				g_free(str);
+			}
+		}
+		printf("\n");
+	}
+	if (timer != NULL)
+		g_timer_destroy(timer);
+
+	return 0;
+}
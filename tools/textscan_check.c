@@ -0,0 +1,182 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2009 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the scans of src/common/textscan.c on strings laid against
+ * PROT_NONE pages: a scan reading one byte past what it may read, the
+ * NUL of a NUL-terminated string or the last byte of a counted one,
+ * crashes. Every length up to -l bytes is tried at every alignment, with
+ * a byte that ends the span put at random, and the results are compared
+ * with byte by byte scans and with g_utf8_validate().
+ *
+ * textscan.c is included, so that the scans are built as Claws Mail
+ * builds them. Build in the tools directory of a configured source tree:
+ *	gcc -O2 -DHAVE_CONFIG_H -I.. -I../src/common -o textscan_check \
+ *		textscan_check.c `pkg-config --cflags --libs glib-2.0`
+ * Run:
+ *	./textscan_check [-n rounds] [-l max length] [-s seed]
+ * It exits with 1, printing the failing case, on the first crash or wrong
+ * result.
+ */
+
+#include "textscan.c"
+
+#include <sys/mman.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* the case being checked, printed if it crashes */
+static const gchar *check_func = "";
+static gint check_len, check_align, check_terminated;
+
+static void check_print(const gchar *what)
+{
+	fprintf(stderr, "%s: %s, length %d, %s, %d bytes past a 32 byte "
+		"boundary\n", what, check_func, check_len,
+		check_terminated ? "NUL-terminated" : "counted", check_align);
+}
+
+static void check_segv(int sig)
+{
+	check_print("read past the string");
+	_exit(1);
+}
+
+static gsize ref_span(const guchar *str, gssize len, gint kind)
+{
+	gssize n;
+
+	for (n = 0; len < 0 || n < len; n++)
+		if (!scan_byte_ok(str[n], kind))
+			break;
+
+	return n;
+}
+
+/* printable ASCII mostly, now and then a byte ending one span or both */
+static guchar check_byte(GRand *rand)
+{
+	static const guchar rare[] = {
+		0x80, 0xc3, 0xa9, 0xff, 0x01, 0x7f, 0x1b, '\t', '\r', '\n'
+	};
+
+	if (g_rand_int_range(rand, 0, 8) != 0)
+		return g_rand_int_range(rand, 32, 127);
+
+	return rare[g_rand_int_range(rand, 0, sizeof(rare))];
+}
+
+static gboolean check_string(const gchar *str, gssize len)
+{
+	const gchar *end, *ref_end;
+	gboolean valid, ref_valid;
+
+	check_func = "scan_ascii_span()";
+	if (scan_ascii_span(str, len) !=
+	    ref_span((const guchar *)str, len, SCAN_ASCII))
+		return FALSE;
+	check_func = "scan_text_span()";
+	if (scan_text_span(str, len) !=
+	    ref_span((const guchar *)str, len, SCAN_TEXT))
+		return FALSE;
+	check_func = "scan_utf8_validate()";
+	valid = scan_utf8_validate(str, len, &end);
+	ref_valid = g_utf8_validate(str, len, &ref_end);
+
+	return valid == ref_valid && end == ref_end;
+}
+
+int main(int argc, char *argv[])
+{
+	GRand *rand;
+	gchar *map, *guard, *str;
+	gsize page;
+	gint rounds = 20, max_len = 300, opt, r, len, i;
+	guint32 seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = MAX(atoi(optarg), 1);
+			break;
+		case 'l':
+			max_len = MAX(atoi(optarg), 1);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc) {
+		g_printerr("usage: %s [-n rounds] [-l max length] [-s seed]\n",
+			   argv[0]);
+		return 1;
+	}
+
+	/* a readable page, then one that is not */
+	page = sysconf(_SC_PAGESIZE);
+	max_len = MIN(max_len, (gint)page - 64);
+	map = mmap(NULL, page * 2, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	guard = map + page;
+	if (mprotect(guard, page, PROT_NONE) < 0) {
+		perror("mprotect");
+		return 1;
+	}
+	signal(SIGSEGV, check_segv);
+	signal(SIGBUS, check_segv);
+
+	rand = g_rand_new_with_seed(seed);
+	for (r = 0; r < rounds; r++) {
+		for (len = 0; len <= max_len; len++) {
+			/* the string ends against the guard page, where an
+			 * aligned or unaligned block past it would fault */
+			for (check_terminated = 0; check_terminated < 2;
+			     check_terminated++) {
+				str = guard - len - check_terminated;
+				for (i = 0; i < len; i++)
+					str[i] = check_byte(rand);
+				if (check_terminated)
+					str[len] = '\0';
+				check_len = len;
+				check_align = (gsize)str & 31;
+				if (!check_string(str, check_terminated ?
+						  -1 : len)) {
+					check_print("wrong result");
+					return 1;
+				}
+			}
+		}
+	}
+	g_rand_free(rand);
+	munmap(map, page * 2);
+
+	printf("%d rounds of lengths 0 to %d checked\n", rounds, max_len);
+
+	return 0;
+}